@@ -29,6 +29,20 @@
 
 #include "cutils.h"
 
+/* vectorized string scanning: SSE2 and AVX2 (selected at run time) on
+   x86-64, NEON on AArch64 */
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define CONFIG_SIMD_SSE2
+#if defined(__GNUC__) && !defined(_WIN32)
+#include <immintrin.h>
+#define CONFIG_SIMD_AVX2
+#endif
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define CONFIG_SIMD_NEON
+#endif
+
 void pstrcpy(char *buf, int buf_size, const char *str)
 {
     int c;
@@ -313,6 +327,97 @@ int unicode_from_utf8(const uint8_t *p, int max_len, const uint8_t **pp)
     return c;
 }
 
+/* return the length of the ASCII prefix of 'buf' */
+size_t count_ascii(const uint8_t *buf, size_t len)
+{
+    const uint8_t *p, *p_end;
+    p = buf;
+    p_end = buf + len;
+#if defined(CONFIG_SIMD_SSE2)
+    while (p_end - p >= 16) {
+        int m = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p));
+        if (m != 0)
+            return p - buf + ctz32(m);
+        p += 16;
+    }
+#elif defined(CONFIG_SIMD_NEON)
+    while (p_end - p >= 16 && vmaxvq_u8(vld1q_u8(p)) < 0x80)
+        p += 16;
+#endif
+    while (p < p_end && *p < 128)
+        p++;
+    return p - buf;
+}
+
+#ifdef CONFIG_SIMD_AVX2
+/* return the index of the first 'c' in tab[*pi..len) or -1. *pi is
+   updated with the index of the remaining characters. */
+static __attribute__((target("avx2"))) int
+u16_indexof_avx2(const uint16_t *tab, int c, int *pi, int len)
+{
+    __m256i vc = _mm256_set1_epi16(c);
+    int i, m;
+
+    for(i = *pi; i + 16 <= len; i += 16) {
+        m = _mm256_movemask_epi8(_mm256_cmpeq_epi16(
+            _mm256_loadu_si256((const __m256i *)(tab + i)), vc));
+        if (m != 0)
+            return i + (ctz32(m) >> 1);
+    }
+    *pi = i;
+    return -1;
+}
+
+static BOOL cpu_has_avx2(void)
+{
+    static int has_avx2 = -1;
+    if (unlikely(has_avx2 < 0))
+        has_avx2 = __builtin_cpu_supports("avx2") != 0;
+    return has_avx2;
+}
+#endif
+
+/* return the index of the first 'c' in tab[from..len) or -1 */
+int u16_indexof(const uint16_t *tab, int c, int from, int len)
+{
+    int i = from;
+#if defined(CONFIG_SIMD_SSE2)
+    __m128i vc;
+    int m;
+
+#ifdef CONFIG_SIMD_AVX2
+    if (len - i >= 32 && cpu_has_avx2()) {
+        m = u16_indexof_avx2(tab, c, &i, len);
+        if (m >= 0)
+            return m;
+    }
+#endif
+    vc = _mm_set1_epi16(c);
+    for(; i + 8 <= len; i += 8) {
+        m = _mm_movemask_epi8(_mm_cmpeq_epi16(
+            _mm_loadu_si128((const __m128i *)(tab + i)), vc));
+        if (m != 0)
+            return i + (ctz32(m) >> 1);
+    }
+#elif defined(CONFIG_SIMD_NEON)
+    uint16x8_t vc = vdupq_n_u16(c);
+    uint64_t m;
+
+    for(; i + 8 <= len; i += 8) {
+        /* one byte per 16 bit lane */
+        m = vget_lane_u64(vreinterpret_u64_u8(
+            vshrn_n_u16(vceqq_u16(vld1q_u16(tab + i), vc), 4)), 0);
+        if (m != 0)
+            return i + (ctz64(m) >> 3);
+    }
+#endif
+    for(; i < len; i++) {
+        if (tab[i] == c)
+            return i;
+    }
+    return -1;
+}
+
 #if 0
 
 #if defined(EMSCRIPTEN) || defined(__ANDROID__)
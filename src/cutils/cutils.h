@@ -331,6 +331,8 @@ static inline void dbuf_set_error(DynBuf *s)
 
 int unicode_to_utf8(uint8_t *buf, unsigned int c);
 int unicode_from_utf8(const uint8_t *p, int max_len, const uint8_t **pp);
+size_t count_ascii(const uint8_t *buf, size_t len);
+int u16_indexof(const uint16_t *tab, int c, int from, int len);
 
 static inline BOOL is_surrogate(uint32_t c)
 {
@@ -69,5 +69,7 @@ DEF(negative_lookahead, 5) /* must come after */
 DEF(set_char_pos, 2) /* store the character position to a register */
 DEF(check_advance, 2) /* check that the register is different from the character position */
 DEF(prev, 1) /* go to the previous char */
+DEF(class_loop, 5) /* greedy loop of the character opcode at pc + 5 without backtracking, then goto */
+DEF(class_loop_back, 5) /* same with the character opcode at the goto target, then next opcode */
 
 #endif /* DEF */
@@ -61,6 +61,16 @@ typedef enum {
 /* must be large enough to have a negligible runtime cost and small
    enough to call the interrupt callback often. */
 #define INTERRUPT_COUNTER_INIT 10000
+/* maximum number of registers (zero advance checks) supported by the
+   linear matcher */
+#define RE_LINEAR_REGISTER_MAX 4
+/* maximum size in bytes of a quantifier expanded into copies of its
+   atom instead of using a counter (see re_expand_quantifier()) */
+#define RE_QUANT_EXPAND_MAX 1024
+/* when the linear matcher can be used, the backtracking matcher gives
+   up after RE_BACKTRACK_BUDGET(n) backtracks, n being the number of
+   characters after the start position */
+#define RE_BACKTRACK_BUDGET(n) (1024 + 16 * (int64_t)(n))
 
 /* unicode code points */
 #define CP_LS   0x2028
@@ -112,8 +122,17 @@ static const REOpCode reopcode_info[REOP_COUNT] = {
 #define RE_HEADER_CAPTURE_COUNT  2
 #define RE_HEADER_REGISTER_COUNT 3
 #define RE_HEADER_BYTECODE_LEN   4
+#define RE_HEADER_THREAD_COUNT   8 /* != 0 if the linear matcher can be used */
+#define RE_HEADER_PREFIX_LEN    10 /* number of chars in the literal prefix */
+#define RE_HEADER_PREFIX        11 /* literal prefix (16 bit chars) */
 
-#define RE_HEADER_LEN 8
+#define RE_PREFIX_LEN_MAX 8
+
+#define RE_HEADER_LEN (RE_HEADER_PREFIX + 2 * RE_PREFIX_LEN_MAX)
+
+/* size of the loop iterating thru all the start positions in non
+   sticky regexps */
+#define RE_SEARCH_LOOP_LEN (5 + 1 + 5)
 
 static inline int is_digit(int c) {
     return c >= '0' && c <= '9';
@@ -471,8 +490,15 @@ static __maybe_unused void lre_dump_bytecode(const uint8_t *buf,
     re_flags = lre_get_flags(buf);
     bc_len = get_u32(buf + RE_HEADER_BYTECODE_LEN);
     assert(bc_len + RE_HEADER_LEN <= buf_len);
-    printf("flags: 0x%x capture_count=%d reg_count=%d\n",
-           re_flags, buf[RE_HEADER_CAPTURE_COUNT], buf[RE_HEADER_REGISTER_COUNT]);
+    printf("flags: 0x%x capture_count=%d reg_count=%d thread_count=%d\n",
+           re_flags, buf[RE_HEADER_CAPTURE_COUNT], buf[RE_HEADER_REGISTER_COUNT],
+           get_u16(buf + RE_HEADER_THREAD_COUNT));
+    if (buf[RE_HEADER_PREFIX_LEN] != 0) {
+        printf("prefix:");
+        for(i = 0; i < buf[RE_HEADER_PREFIX_LEN]; i++)
+            printf(" 0x%04x", get_u16(buf + RE_HEADER_PREFIX + 2 * i));
+        printf("\n");
+    }
     if (re_flags & LRE_FLAG_NAMED_GROUPS) {
         const char *p;
         p = (char *)buf + RE_HEADER_LEN + bc_len;
@@ -523,6 +549,8 @@ static __maybe_unused void lre_dump_bytecode(const uint8_t *buf,
         case REOP_goto:
         case REOP_split_goto_first:
         case REOP_split_next_first:
+        case REOP_class_loop:
+        case REOP_class_loop_back:
         case REOP_lookahead:
         case REOP_negative_lookahead:
             val = get_u32(buf + pos + 1);
@@ -1842,6 +1870,59 @@ static BOOL update_modifier(BOOL val, int add_mask, int remove_mask,
     return val;
 }
 
+/* Replace the atom X at 'last_atom_start' by X{quant_min,quant_max}
+   made of quant_min copies of X followed by X* or by quant_max -
+   quant_min nested optional copies of X. Unlike the counted loops, it
+   can be run by the linear matcher. Return 1 if the quantifier was
+   expanded, 0 if it is too large or -1 if memory error. */
+static int re_expand_quantifier(REParseState *s, int last_atom_start, int len,
+                                int quant_min, int quant_max, BOOL greedy,
+                                BOOL add_zero_advance_check)
+{
+    int64_t size;
+    int i, n, opt_size, check_size, pos = 0;
+    uint8_t *atom;
+
+    check_size = add_zero_advance_check * 2;
+    opt_size = 5 + check_size + len + check_size;
+    if (quant_max == INT32_MAX)
+        size = (int64_t)quant_min * len + opt_size + 5;
+    else
+        size = (int64_t)quant_min * len + (int64_t)(quant_max - quant_min) * opt_size;
+    if (len == 0 || size > RE_QUANT_EXPAND_MAX)
+        return 0;
+    atom = lre_realloc(s->opaque, NULL, len);
+    if (!atom)
+        return re_parse_out_of_memory(s);
+    memcpy(atom, s->byte_code.buf + last_atom_start, len);
+    s->byte_code.size = last_atom_start;
+    for(i = 0; i < quant_min; i++)
+        dbuf_put(&s->byte_code, atom, len);
+    if (quant_max == INT32_MAX) {
+        pos = s->byte_code.size;
+        re_emit_op_u32(s, REOP_split_goto_first + greedy, opt_size);
+    }
+    n = quant_max == INT32_MAX ? 1 : quant_max - quant_min;
+    for(i = 0; i < n; i++) {
+        /* the optional copies are nested: skipping one skips the
+           following ones */
+        if (quant_max != INT32_MAX)
+            re_emit_op_u32(s, REOP_split_goto_first + greedy,
+                           (n - i) * opt_size - 5);
+        if (add_zero_advance_check)
+            re_emit_op_u8(s, REOP_set_char_pos, 0);
+        dbuf_put(&s->byte_code, atom, len);
+        if (add_zero_advance_check)
+            re_emit_op_u8(s, REOP_check_advance, 0);
+    }
+    if (quant_max == INT32_MAX)
+        re_emit_goto(s, REOP_goto, pos);
+    lre_realloc(s->opaque, atom, 0);
+    if (dbuf_error(&s->byte_code))
+        return re_parse_out_of_memory(s);
+    return 1;
+}
+
 static int re_parse_term(REParseState *s, BOOL is_backward_dir)
 {
     const uint8_t *p;
@@ -2256,7 +2337,7 @@ static int re_parse_term(REParseState *s, BOOL is_backward_dir)
             }
             {
                 BOOL need_capture_init, add_zero_advance_check;
-                int len, pos;
+                int len, pos, ret;
                 
                 /* the spec tells that if there is no advance when
                    running the atom after the first quant_min times,
@@ -2311,6 +2392,13 @@ static int re_parse_term(REParseState *s, BOOL is_backward_dir)
                         if (has_goto)
                             re_emit_goto(s, REOP_goto, last_atom_start);
                     } else {
+                        ret = re_expand_quantifier(s, last_atom_start, len,
+                                                   quant_min, quant_max, greedy,
+                                                   add_zero_advance_check);
+                        if (ret < 0)
+                            return -1;
+                        if (ret > 0)
+                            goto quant_done;
                         if (dbuf_insert(&s->byte_code, last_atom_start, 11 + add_zero_advance_check * 2))
                             goto out_of_memory;
                         pos = last_atom_start;
@@ -2336,6 +2424,13 @@ static int re_parse_term(REParseState *s, BOOL is_backward_dir)
                 } else {
                     if (quant_min == quant_max)
                         add_zero_advance_check = FALSE;
+                    ret = re_expand_quantifier(s, last_atom_start, len,
+                                               quant_min, quant_max, greedy,
+                                               add_zero_advance_check);
+                    if (ret < 0)
+                        return -1;
+                    if (ret > 0)
+                        goto quant_done;
                     if (dbuf_insert(&s->byte_code, last_atom_start, 6 + add_zero_advance_check * 2))
                         goto out_of_memory;
                     /* Note: we assume the string length is < INT32_MAX */
@@ -2356,6 +2451,7 @@ static int re_parse_term(REParseState *s, BOOL is_backward_dir)
                         re_emit_goto_u8_u32(s, (add_zero_advance_check ? REOP_loop_check_adv_split_next_first : REOP_loop_split_next_first) - greedy, 0, quant_max - quant_min, last_atom_start);
                     }
                 }
+            quant_done:
                 last_atom_start = -1;
             }
             break;
@@ -2504,6 +2600,454 @@ static int compute_register_count(uint8_t *bc_buf, int bc_buf_len)
     return stack_size_max;
 }
 
+static BOOL is_line_terminator(uint32_t c)
+{
+    return (c == '\n' || c == '\r' || c == CP_LS || c == CP_PS);
+}
+
+/* 'pc' points to the range count followed by the 16 bit ranges */
+static BOOL lre_range_match(const uint8_t *pc, uint32_t c)
+{
+    int n;
+    uint32_t low, high, idx_min, idx_max, idx;
+
+    n = get_u16(pc); /* n must be >= 1 */
+    pc += 2;
+    idx_min = 0;
+    low = get_u16(pc + 0 * 4);
+    if (c < low)
+        return FALSE;
+    idx_max = n - 1;
+    high = get_u16(pc + idx_max * 4 + 2);
+    /* 0xffff in for last value means +infinity */
+    if (unlikely(c >= 0xffff) && high == 0xffff)
+        return TRUE;
+    if (c > high)
+        return FALSE;
+    while (idx_min <= idx_max) {
+        idx = (idx_min + idx_max) / 2;
+        low = get_u16(pc + idx * 4);
+        high = get_u16(pc + idx * 4 + 2);
+        if (c < low)
+            idx_max = idx - 1;
+        else if (c > high)
+            idx_min = idx + 1;
+        else
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* 'pc' points to the range count followed by the 32 bit ranges */
+static BOOL lre_range32_match(const uint8_t *pc, uint32_t c)
+{
+    int n;
+    uint32_t low, high, idx_min, idx_max, idx;
+
+    n = get_u16(pc); /* n must be >= 1 */
+    pc += 2;
+    idx_min = 0;
+    low = get_u32(pc + 0 * 8);
+    if (c < low)
+        return FALSE;
+    idx_max = n - 1;
+    high = get_u32(pc + idx_max * 8 + 4);
+    if (c > high)
+        return FALSE;
+    while (idx_min <= idx_max) {
+        idx = (idx_min + idx_max) / 2;
+        low = get_u32(pc + idx * 8);
+        high = get_u32(pc + idx * 8 + 4);
+        if (c < low)
+            idx_max = idx - 1;
+        else if (c > high)
+            idx_min = idx + 1;
+        else
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* Return the length of the opcode at 'pc' if it matches a single
+   character, 0 otherwise. */
+static int re_get_class_len(const uint8_t *pc)
+{
+    switch(pc[0]) {
+    case REOP_char:
+    case REOP_char_i:
+    case REOP_char32:
+    case REOP_char32_i:
+    case REOP_dot:
+    case REOP_any:
+    case REOP_space:
+    case REOP_not_space:
+        return reopcode_info[pc[0]].size;
+    case REOP_range:
+    case REOP_range_i:
+        return 3 + get_u16(pc + 1) * 4;
+    case REOP_range32:
+    case REOP_range32_i:
+        return 3 + get_u16(pc + 1) * 8;
+    default:
+        return 0;
+    }
+}
+
+/* Return TRUE if the single character opcode at 'pc' accepts 'c'. 'c'
+   must be canonicalized for the case insensitive opcodes. */
+static BOOL re_class_has_char(const uint8_t *pc, uint32_t c)
+{
+    switch(pc[0]) {
+    case REOP_char:
+    case REOP_char_i:
+        return c == get_u16(pc + 1);
+    case REOP_char32:
+    case REOP_char32_i:
+        return c == get_u32(pc + 1);
+    case REOP_dot:
+        return !is_line_terminator(c);
+    case REOP_any:
+        return TRUE;
+    case REOP_space:
+        return lre_is_space(c);
+    case REOP_not_space:
+        return !lre_is_space(c);
+    case REOP_range:
+    case REOP_range_i:
+        return lre_range_match(pc + 1, c);
+    case REOP_range32:
+    case REOP_range32_i:
+        return lre_range32_match(pc + 1, c);
+    default:
+        abort();
+    }
+}
+
+/* 0 if the set of accepted characters is closed under case folding,
+   1 if the opcode is case sensitive, 2 if it is case insensitive */
+static int re_get_class_case(int opcode)
+{
+    switch(opcode) {
+    case REOP_char_i:
+    case REOP_char32_i:
+    case REOP_range_i:
+    case REOP_range32_i:
+        return 2;
+    case REOP_char:
+    case REOP_char32:
+    case REOP_range:
+    case REOP_range32:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* return the size of the range bounds or 0 if not a range opcode */
+static int re_get_range_elt_size(int opcode)
+{
+    switch(opcode) {
+    case REOP_range:
+    case REOP_range_i:
+        return 2;
+    case REOP_range32:
+    case REOP_range32_i:
+        return 4;
+    default:
+        return 0;
+    }
+}
+
+/* return the single character of the opcode or -1 if none */
+static int re_get_class_char(const uint8_t *pc)
+{
+    switch(pc[0]) {
+    case REOP_char:
+    case REOP_char_i:
+        return get_u16(pc + 1);
+    case REOP_char32:
+    case REOP_char32_i:
+        return get_u32(pc + 1);
+    default:
+        return -1;
+    }
+}
+
+/* return TRUE if all the characters accepted by the opcode are ASCII */
+static BOOL re_class_is_ascii(const uint8_t *pc)
+{
+    int n;
+
+    switch(pc[0]) {
+    case REOP_char:
+    case REOP_char_i:
+    case REOP_char32:
+    case REOP_char32_i:
+        return re_get_class_char(pc) < 0x80;
+    case REOP_range:
+    case REOP_range_i:
+        n = get_u16(pc + 1);
+        return get_u16(pc + 3 + (n - 1) * 4 + 2) < 0x80;
+    case REOP_range32:
+    case REOP_range32_i:
+        n = get_u16(pc + 1);
+        return get_u32(pc + 3 + (n - 1) * 8 + 4) < 0x80;
+    default:
+        return FALSE;
+    }
+}
+
+/* Return TRUE if the single character opcodes at 'pc1' and 'pc2' may
+   accept the same character. */
+static BOOL re_class_intersect(const uint8_t *pc1, const uint8_t *pc2)
+{
+    int k1, k2, c, n1, n2, i1, i2, elt_size;
+    uint32_t low1, high1, low2, high2;
+
+    k1 = re_get_class_case(pc1[0]);
+    k2 = re_get_class_case(pc2[0]);
+    if (k1 != 0 && k2 != 0 && k1 != k2)
+        return TRUE;
+    /* the case insensitive opcodes accept the characters whose
+       canonical value is in their set, so it is enough to test the
+       intersection of the sets */
+    c = re_get_class_char(pc2);
+    if (c >= 0)
+        return re_class_has_char(pc1, c);
+    c = re_get_class_char(pc1);
+    if (c >= 0)
+        return re_class_has_char(pc2, c);
+    elt_size = re_get_range_elt_size(pc1[0]);
+    if (elt_size != 0 && elt_size == re_get_range_elt_size(pc2[0])) {
+        /* both ranges are sorted */
+        n1 = get_u16(pc1 + 1);
+        n2 = get_u16(pc2 + 1);
+        pc1 += 3;
+        pc2 += 3;
+        i1 = 0;
+        i2 = 0;
+        while (i1 < n1 && i2 < n2) {
+            if (elt_size == 2) {
+                low1 = get_u16(pc1 + i1 * 4);
+                high1 = get_u16(pc1 + i1 * 4 + 2);
+                low2 = get_u16(pc2 + i2 * 4);
+                high2 = get_u16(pc2 + i2 * 4 + 2);
+            } else {
+                low1 = get_u32(pc1 + i1 * 8);
+                high1 = get_u32(pc1 + i1 * 8 + 4);
+                low2 = get_u32(pc2 + i2 * 8);
+                high2 = get_u32(pc2 + i2 * 8 + 4);
+            }
+            if (high1 < low2)
+                i1++;
+            else if (high2 < low1)
+                i2++;
+            else
+                return TRUE;
+        }
+        return FALSE;
+    }
+    if (re_class_is_ascii(pc1) || re_class_is_ascii(pc2)) {
+        for(c = 0; c < 0x80; c++) {
+            if (re_class_has_char(pc1, c) && re_class_has_char(pc2, c))
+                return TRUE;
+        }
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* Return TRUE if the code at 'pos' cannot match after a greedy loop of
+   the single character opcode at 'class_pc' gave back characters:
+   the next character is then accepted by the loop. */
+static BOOL re_is_class_loop_end(const uint8_t *bc_buf, int pos,
+                                 const uint8_t *class_pc)
+{
+    int len, target;
+
+    for(;;) {
+        switch(bc_buf[pos]) {
+        case REOP_save_start:
+        case REOP_save_end:
+        case REOP_save_reset:
+            pos += reopcode_info[bc_buf[pos]].size;
+            break;
+        case REOP_goto:
+            target = pos + 5 + (int)get_u32(bc_buf + pos + 1);
+            if (target <= pos)
+                return FALSE;
+            pos = target;
+            break;
+        case REOP_match:
+            /* the first try succeeds */
+        case REOP_line_end:
+            return TRUE;
+        case REOP_line_end_m:
+            return !re_class_has_char(class_pc, '\n') &&
+                !re_class_has_char(class_pc, '\r') &&
+                !re_class_has_char(class_pc, CP_LS) &&
+                !re_class_has_char(class_pc, CP_PS);
+        default:
+            len = re_get_class_len(bc_buf + pos);
+            if (len == 0)
+                return FALSE;
+            return !re_class_intersect(class_pc, bc_buf + pos);
+        }
+    }
+}
+
+/* Replace the greedy loops of a single character opcode by
+   REOP_class_loop or REOP_class_loop_back when giving back characters
+   cannot lead to a match, so that the loop does not save a state for
+   each character. Both opcodes have the size of the split opcode they
+   replace. */
+static void re_optimize_class_loops(uint8_t *bc_buf, int bc_buf_len)
+{
+    int pos, prev_pos, len, class_len, goto_pos, target;
+
+    prev_pos = -1;
+    pos = RE_HEADER_LEN;
+    while (pos < bc_buf_len) {
+        len = reopcode_info[bc_buf[pos]].size;
+        switch(bc_buf[pos]) {
+        case REOP_range:
+        case REOP_range_i:
+        case REOP_range32:
+        case REOP_range32_i:
+            len = re_get_class_len(bc_buf + pos);
+            break;
+        case REOP_back_reference:
+        case REOP_back_reference_i:
+        case REOP_backward_back_reference:
+        case REOP_backward_back_reference_i:
+            len += bc_buf[pos + 1];
+            break;
+        case REOP_split_next_first:
+            /* split_next_first L1; class; goto pos; L1: */
+            target = pos + 5 + (int)get_u32(bc_buf + pos + 1);
+            class_len = re_get_class_len(bc_buf + pos + 5);
+            goto_pos = pos + 5 + class_len;
+            if (class_len != 0 && goto_pos + 5 == target &&
+                bc_buf[goto_pos] == REOP_goto &&
+                goto_pos + 5 + (int)get_u32(bc_buf + goto_pos + 1) == pos &&
+                re_is_class_loop_end(bc_buf, target, bc_buf + pos + 5)) {
+                bc_buf[pos] = REOP_class_loop;
+            }
+            break;
+        case REOP_split_goto_first:
+            /* L1: class; split_goto_first L1 */
+            target = pos + 5 + (int)get_u32(bc_buf + pos + 1);
+            if (prev_pos >= 0 && target == prev_pos &&
+                re_get_class_len(bc_buf + prev_pos) == pos - prev_pos &&
+                re_is_class_loop_end(bc_buf, pos + 5, bc_buf + prev_pos)) {
+                bc_buf[pos] = REOP_class_loop_back;
+            }
+            break;
+        }
+        prev_pos = pos;
+        pos += len;
+    }
+}
+
+/* Return the maximum number of threads of the linear matcher, i.e. the
+   number of opcodes consuming a character plus the final match. Return
+   0 if the bytecode needs the backtracking matcher because it uses
+   back references, lookarounds, counted loops or too many registers. */
+static int compute_thread_count(const uint8_t *bc_buf, int bc_buf_len)
+{
+    int pos, opcode, len, count;
+
+    count = 0;
+    pos = RE_HEADER_LEN;
+    while (pos < bc_buf_len) {
+        opcode = bc_buf[pos];
+        len = reopcode_info[opcode].size;
+        switch(opcode) {
+        case REOP_range:
+        case REOP_range_i:
+            len += get_u16(bc_buf + pos + 1) * 4;
+            count++;
+            break;
+        case REOP_range32:
+        case REOP_range32_i:
+            len += get_u16(bc_buf + pos + 1) * 8;
+            count++;
+            break;
+        case REOP_char:
+        case REOP_char_i:
+        case REOP_char32:
+        case REOP_char32_i:
+        case REOP_dot:
+        case REOP_any:
+        case REOP_space:
+        case REOP_not_space:
+        case REOP_match:
+            count++;
+            break;
+        case REOP_line_start:
+        case REOP_line_start_m:
+        case REOP_line_end:
+        case REOP_line_end_m:
+        case REOP_goto:
+        case REOP_split_goto_first:
+        case REOP_split_next_first:
+        case REOP_class_loop:
+        case REOP_class_loop_back:
+        case REOP_save_start:
+        case REOP_save_end:
+        case REOP_save_reset:
+        case REOP_word_boundary:
+        case REOP_word_boundary_i:
+        case REOP_not_word_boundary:
+        case REOP_not_word_boundary_i:
+        case REOP_set_char_pos:
+        case REOP_check_advance:
+            break;
+        default:
+            return 0;
+        }
+        pos += len;
+    }
+    if (count > 0xffff ||
+        bc_buf[RE_HEADER_REGISTER_COUNT] > RE_LINEAR_REGISTER_MAX)
+        return 0;
+    return count;
+}
+
+/* Store in the header the literal characters which must be at the
+   start position of any match, so that lre_exec() can look for them
+   instead of trying every position. */
+static void compute_prefix(uint8_t *bc_buf, int bc_buf_len)
+{
+    int pos, n, c;
+
+    n = 0;
+    pos = RE_HEADER_LEN + RE_SEARCH_LOOP_LEN;
+    while (pos < bc_buf_len && n < RE_PREFIX_LEN_MAX) {
+        switch(bc_buf[pos]) {
+        case REOP_save_start:
+        case REOP_save_end:
+        case REOP_save_reset:
+            /* always succeed without consuming characters */
+            break;
+        case REOP_char:
+            c = get_u16(bc_buf + pos + 1);
+            /* a surrogate could be the second half of a pair
+               skipped by the search loop in unicode mode */
+            if (is_surrogate(c))
+                goto done;
+            put_u16(bc_buf + RE_HEADER_PREFIX + 2 * n, c);
+            n++;
+            break;
+        default:
+            goto done;
+        }
+        pos += reopcode_info[bc_buf[pos]].size;
+    }
+ done:
+    bc_buf[RE_HEADER_PREFIX_LEN] = n;
+}
+
 static void *lre_bytecode_realloc(void *opaque, void *ptr, size_t size)
 {
     if (size > (INT32_MAX / 2)) {
@@ -2524,7 +3068,7 @@ uint8_t *lre_compile(int *plen, char *error_msg, int error_msg_size,
                      void *opaque)
 {
     REParseState s_s, *s = &s_s;
-    int register_count;
+    int register_count, i;
     BOOL is_sticky;
 
     memset(s, 0, sizeof(*s));
@@ -2550,6 +3094,10 @@ uint8_t *lre_compile(int *plen, char *error_msg, int error_msg_size,
     dbuf_putc(&s->byte_code, 0); /* second element is the number of captures */
     dbuf_putc(&s->byte_code, 0); /* stack size */
     dbuf_put_u32(&s->byte_code, 0); /* bytecode length */
+    dbuf_put_u16(&s->byte_code, 0); /* thread count */
+    dbuf_putc(&s->byte_code, 0); /* literal prefix length */
+    for(i = 0; i < RE_PREFIX_LEN_MAX; i++)
+        dbuf_put_u16(&s->byte_code, 0); /* literal prefix */
 
     if (!is_sticky) {
         /* iterate thru all positions (about the same as .*?( ... ) )
@@ -2585,6 +3133,8 @@ uint8_t *lre_compile(int *plen, char *error_msg, int error_msg_size,
         goto error;
     }
 
+    re_optimize_class_loops(s->byte_code.buf, s->byte_code.size);
+
     register_count = compute_register_count(s->byte_code.buf, s->byte_code.size);
     if (register_count < 0) {
         re_parse_error(s, "too many imbricated quantifiers");
@@ -2595,6 +3145,10 @@ uint8_t *lre_compile(int *plen, char *error_msg, int error_msg_size,
     s->byte_code.buf[RE_HEADER_REGISTER_COUNT] = register_count;
     put_u32(s->byte_code.buf + RE_HEADER_BYTECODE_LEN,
             s->byte_code.size - RE_HEADER_LEN);
+    put_u16(s->byte_code.buf + RE_HEADER_THREAD_COUNT,
+            compute_thread_count(s->byte_code.buf, s->byte_code.size));
+    if (!is_sticky)
+        compute_prefix(s->byte_code.buf, s->byte_code.size);
 
     /* add the named groups if needed */
     if (s->group_names.size > (s->capture_count - 1) * LRE_GROUP_NAME_TRAILER_LEN) {
@@ -2613,11 +3167,6 @@ uint8_t *lre_compile(int *plen, char *error_msg, int error_msg_size,
     return s->byte_code.buf;
 }
 
-static BOOL is_line_terminator(uint32_t c)
-{
-    return (c == '\n' || c == '\r' || c == CP_LS || c == CP_PS);
-}
-
 #define GET_CHAR(c, cptr, cbuf_end, cbuf_type)                          \
     do {                                                                \
         if (cbuf_type == 0) {                                           \
@@ -2730,6 +3279,7 @@ typedef struct {
     int capture_count;
     BOOL is_unicode;
     int interrupt_counter;
+    int64_t backtrack_budget; /* see RE_BACKTRACK_BUDGET() */
     void *opaque; /* used for stack overflow check */
 
     StackElem *stack_buf;
@@ -2737,6 +3287,9 @@ typedef struct {
     StackElem static_stack_buf[32]; /* static stack to avoid allocation in most cases */
 } REExecContext;
 
+/* internal: the backtracking matcher exceeded its budget */
+#define LRE_RET_BACKTRACK_LIMIT (-3)
+
 static int lre_poll_timeout(REExecContext *s)
 {
     if (unlikely(--s->interrupt_counter <= 0)) {
@@ -2770,7 +3323,137 @@ static no_inline int stack_realloc(REExecContext *s, size_t n)
     return 0;
 }
 
+static BOOL lre_is_word_char(uint32_t c, BOOL ignore_case)
+{
+    if (c < 256)
+        return lre_is_word_byte(c) != 0;
+    else
+        return ignore_case && (c == 0x017f || c == 0x212a);
+}
+
+/* line and word boundary assertions at 'cptr' */
+static BOOL lre_check_assertion(REExecContext *s, int opcode,
+                                const uint8_t *cptr)
+{
+    int cbuf_type = s->cbuf_type;
+    uint32_t c;
+
+    switch(opcode) {
+    case REOP_line_start:
+    case REOP_line_start_m:
+        if (cptr == s->cbuf)
+            return TRUE;
+        if (opcode == REOP_line_start)
+            return FALSE;
+        PEEK_PREV_CHAR(c, cptr, s->cbuf, cbuf_type);
+        return is_line_terminator(c);
+    case REOP_line_end:
+    case REOP_line_end_m:
+        if (cptr == s->cbuf_end)
+            return TRUE;
+        if (opcode == REOP_line_end)
+            return FALSE;
+        PEEK_CHAR(c, cptr, s->cbuf_end, cbuf_type);
+        return is_line_terminator(c);
+    default:
+        {
+            BOOL v1, v2;
+            int ignore_case = (opcode == REOP_word_boundary_i || opcode == REOP_not_word_boundary_i);
+            BOOL is_boundary = (opcode == REOP_word_boundary || opcode == REOP_word_boundary_i);
+            /* char before */
+            if (cptr == s->cbuf) {
+                v1 = FALSE;
+            } else {
+                PEEK_PREV_CHAR(c, cptr, s->cbuf, cbuf_type);
+                v1 = lre_is_word_char(c, ignore_case);
+            }
+            /* current char */
+            if (cptr >= s->cbuf_end) {
+                v2 = FALSE;
+            } else {
+                PEEK_CHAR(c, cptr, s->cbuf_end, cbuf_type);
+                v2 = lre_is_word_char(c, ignore_case);
+            }
+            return !(v1 ^ v2 ^ is_boundary);
+        }
+    }
+}
+
 /* return 1 if match, 0 if not match or < 0 if error. */
+/* Return the opcode following the consuming opcode at 'pc' if it
+   accepts the character 'c', otherwise NULL. */
+static const uint8_t *lre_match_char(REExecContext *s, const uint8_t *pc,
+                                     uint32_t c)
+{
+    int len;
+
+    len = re_get_class_len(pc);
+    if (len == 0) /* REOP_match */
+        return NULL;
+    if (re_get_class_case(pc[0]) == 2)
+        c = lre_canonicalize(c, s->is_unicode);
+    if (!re_class_has_char(pc, c))
+        return NULL;
+    return pc + len;
+}
+
+/* Return the end of the longest run of characters accepted by the
+   single character opcode at 'pc' starting at 'cptr'. */
+static const uint8_t *lre_skip_class(REExecContext *s, const uint8_t *pc,
+                                     const uint8_t *cptr)
+{
+    const uint8_t *cbuf_end = s->cbuf_end, *cptr1;
+    int cbuf_type = s->cbuf_type;
+    uint32_t c, i, low, high, bitmap[256 / 32];
+
+    if (pc[0] == REOP_any && cbuf_type != 2)
+        return cbuf_end;
+    if (pc[0] == REOP_range && cbuf_type != 2) {
+        /* the first characters are tested with the ranges. For long
+           runs, a bitmap of the Latin-1 characters is built. */
+        for(i = 0; i < 16; i++) {
+            if (cptr >= cbuf_end)
+                return cptr;
+            c = cbuf_type == 0 ? *cptr : *(const uint16_t *)cptr;
+            if (!lre_range_match(pc + 1, c))
+                return cptr;
+            cptr += 1 << cbuf_type;
+        }
+        memset(bitmap, 0, sizeof(bitmap));
+        for(i = 0; i < get_u16(pc + 1); i++) {
+            low = get_u16(pc + 3 + i * 4);
+            high = min_uint32(get_u16(pc + 3 + i * 4 + 2), 255);
+            for(c = low; c <= high; c++)
+                bitmap[c >> 5] |= 1U << (c & 31);
+        }
+        if (cbuf_type == 0) {
+            while (cptr < cbuf_end &&
+                   ((bitmap[*cptr >> 5] >> (*cptr & 31)) & 1))
+                cptr++;
+        } else {
+            for(; cptr < cbuf_end; cptr += 2) {
+                c = *(const uint16_t *)cptr;
+                if (c < 256) {
+                    if (!((bitmap[c >> 5] >> (c & 31)) & 1))
+                        break;
+                } else {
+                    if (!lre_range_match(pc + 1, c))
+                        break;
+                }
+            }
+        }
+        return cptr;
+    }
+    while (cptr < cbuf_end) {
+        cptr1 = cptr;
+        GET_CHAR(c, cptr1, cbuf_end, cbuf_type);
+        if (!lre_match_char(s, pc, c))
+            break;
+        cptr = cptr1;
+    }
+    return cptr;
+}
+
 static intptr_t lre_exec_backtrack(REExecContext *s, uint8_t **capture,
                                    const uint8_t *pc, const uint8_t *cptr)
 {
@@ -2870,6 +3553,8 @@ static intptr_t lre_exec_backtrack(REExecContext *s, uint8_t **capture,
             }
             if (lre_poll_timeout(s))
                 return LRE_RET_TIMEOUT;
+            if (unlikely(--s->backtrack_budget < 0))
+                return LRE_RET_BACKTRACK_LIMIT;
             break;
         case REOP_lookahead_match:
             /* pop all the saved states until reaching the start of
@@ -2964,6 +3649,22 @@ static intptr_t lre_exec_backtrack(REExecContext *s, uint8_t **capture,
                 bp = sp;
             }
             break;
+        case REOP_class_loop:
+        case REOP_class_loop_back:
+            {
+                const uint8_t *pc1;
+
+                val = get_u32(pc);
+                pc += 4;
+                if (opcode == REOP_class_loop) {
+                    pc1 = pc;
+                    pc += (int)val;
+                } else {
+                    pc1 = pc + (int)val;
+                }
+                cptr = lre_skip_class(s, pc1, cptr);
+            }
+            break;
         case REOP_lookahead:
         case REOP_negative_lookahead:
             val = get_u32(pc);
@@ -2984,22 +3685,13 @@ static intptr_t lre_exec_backtrack(REExecContext *s, uint8_t **capture,
             break;
         case REOP_line_start:
         case REOP_line_start_m:
-            if (cptr == s->cbuf)
-                break;
-            if (opcode == REOP_line_start)
-                goto no_match;
-            PEEK_PREV_CHAR(c, cptr, s->cbuf, cbuf_type);
-            if (!is_line_terminator(c))
-                goto no_match;
-            break;
         case REOP_line_end:
         case REOP_line_end_m:
-            if (cptr == cbuf_end)
-                break;
-            if (opcode == REOP_line_end)
-                goto no_match;
-            PEEK_CHAR(c, cptr, cbuf_end, cbuf_type);
-            if (!is_line_terminator(c))
+        case REOP_word_boundary:
+        case REOP_word_boundary_i:
+        case REOP_not_word_boundary:
+        case REOP_not_word_boundary_i:
+            if (!lre_check_assertion(s, opcode, cptr))
                 goto no_match;
             break;
         case REOP_dot:
@@ -3135,40 +3827,6 @@ static intptr_t lre_exec_backtrack(REExecContext *s, uint8_t **capture,
             if (capture[idx] == cptr)
                 goto no_match;
             break;
-        case REOP_word_boundary:
-        case REOP_word_boundary_i:
-        case REOP_not_word_boundary:
-        case REOP_not_word_boundary_i:
-            {
-                BOOL v1, v2;
-                int ignore_case = (opcode == REOP_word_boundary_i || opcode == REOP_not_word_boundary_i);
-                BOOL is_boundary = (opcode == REOP_word_boundary || opcode == REOP_word_boundary_i);
-                /* char before */
-                if (cptr == s->cbuf) {
-                    v1 = FALSE;
-                } else {
-                    PEEK_PREV_CHAR(c, cptr, s->cbuf, cbuf_type);
-                    if (c < 256) {
-                        v1 = (lre_is_word_byte(c) != 0);
-                    } else {
-                        v1 = ignore_case && (c == 0x017f || c == 0x212a);
-                    }
-                }
-                /* current char */
-                if (cptr >= cbuf_end) {
-                    v2 = FALSE;
-                } else {
-                    PEEK_CHAR(c, cptr, cbuf_end, cbuf_type);
-                    if (c < 256) {
-                        v2 = (lre_is_word_byte(c) != 0);
-                    } else {
-                        v2 = ignore_case && (c == 0x017f || c == 0x212a);
-                    }
-                }
-                if (v1 ^ v2 ^ is_boundary)
-                    goto no_match;
-            }
-            break;
         case REOP_back_reference:
         case REOP_back_reference_i:
         case REOP_backward_back_reference:
@@ -3228,82 +3886,27 @@ static intptr_t lre_exec_backtrack(REExecContext *s, uint8_t **capture,
             break;
         case REOP_range:
         case REOP_range_i:
-            {
-                int n;
-                uint32_t low, high, idx_min, idx_max, idx;
-
-                n = get_u16(pc); /* n must be >= 1 */
-                pc += 2;
-                if (cptr >= cbuf_end)
-                    goto no_match;
-                GET_CHAR(c, cptr, cbuf_end, cbuf_type);
-                if (opcode == REOP_range_i) {
-                    c = lre_canonicalize(c, s->is_unicode);
-                }
-                idx_min = 0;
-                low = get_u16(pc + 0 * 4);
-                if (c < low)
-                    goto no_match;
-                idx_max = n - 1;
-                high = get_u16(pc + idx_max * 4 + 2);
-                /* 0xffff in for last value means +infinity */
-                if (unlikely(c >= 0xffff) && high == 0xffff)
-                    goto range_match;
-                if (c > high)
-                    goto no_match;
-                while (idx_min <= idx_max) {
-                    idx = (idx_min + idx_max) / 2;
-                    low = get_u16(pc + idx * 4);
-                    high = get_u16(pc + idx * 4 + 2);
-                    if (c < low)
-                        idx_max = idx - 1;
-                    else if (c > high)
-                        idx_min = idx + 1;
-                    else
-                        goto range_match;
-                }
+            if (cptr >= cbuf_end)
                 goto no_match;
-            range_match:
-                pc += 4 * n;
+            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+            if (opcode == REOP_range_i) {
+                c = lre_canonicalize(c, s->is_unicode);
             }
+            if (!lre_range_match(pc, c))
+                goto no_match;
+            pc += 2 + 4 * get_u16(pc);
             break;
         case REOP_range32:
         case REOP_range32_i:
-            {
-                int n;
-                uint32_t low, high, idx_min, idx_max, idx;
-
-                n = get_u16(pc); /* n must be >= 1 */
-                pc += 2;
-                if (cptr >= cbuf_end)
-                    goto no_match;
-                GET_CHAR(c, cptr, cbuf_end, cbuf_type);
-                if (opcode == REOP_range32_i) {
-                    c = lre_canonicalize(c, s->is_unicode);
-                }
-                idx_min = 0;
-                low = get_u32(pc + 0 * 8);
-                if (c < low)
-                    goto no_match;
-                idx_max = n - 1;
-                high = get_u32(pc + idx_max * 8 + 4);
-                if (c > high)
-                    goto no_match;
-                while (idx_min <= idx_max) {
-                    idx = (idx_min + idx_max) / 2;
-                    low = get_u32(pc + idx * 8);
-                    high = get_u32(pc + idx * 8 + 4);
-                    if (c < low)
-                        idx_max = idx - 1;
-                    else if (c > high)
-                        idx_min = idx + 1;
-                    else
-                        goto range32_match;
-                }
+            if (cptr >= cbuf_end)
                 goto no_match;
-            range32_match:
-                pc += 8 * n;
+            GET_CHAR(c, cptr, cbuf_end, cbuf_type);
+            if (opcode == REOP_range32_i) {
+                c = lre_canonicalize(c, s->is_unicode);
             }
+            if (!lre_range32_match(pc, c))
+                goto no_match;
+            pc += 2 + 8 * get_u16(pc);
             break;
         case REOP_prev:
             /* go to the previous char */
@@ -3320,6 +3923,347 @@ static intptr_t lre_exec_backtrack(REExecContext *s, uint8_t **capture,
     }
 }
 
+/* Return the index of the next occurrence of the literal prefix at or
+   after 'pos' or -1 if none. memchr() and u16_indexof() find the
+   candidates for the first character. */
+static int lre_find_prefix(REExecContext *s, const uint8_t *bc_buf, int pos)
+{
+    int prefix_len, i, c, len;
+    union {
+        uint8_t str8[RE_PREFIX_LEN_MAX];
+        uint16_t str16[RE_PREFIX_LEN_MAX];
+    } prefix;
+
+    prefix_len = bc_buf[RE_HEADER_PREFIX_LEN];
+    for(i = 0; i < prefix_len; i++) {
+        c = get_u16(bc_buf + RE_HEADER_PREFIX + 2 * i);
+        if (s->cbuf_type == 0) {
+            if (c > 0xff)
+                return -1;
+            prefix.str8[i] = c;
+        } else {
+            prefix.str16[i] = c;
+        }
+    }
+    len = (s->cbuf_end - s->cbuf) >> (s->cbuf_type != 0);
+    if (s->cbuf_type == 0) {
+        const uint8_t *p;
+        for(;;) {
+            if (len - pos < prefix_len)
+                return -1;
+            /* memchr is vectorized by the C library */
+            p = memchr(s->cbuf + pos, prefix.str8[0],
+                       len - pos - prefix_len + 1);
+            if (!p)
+                return -1;
+            pos = p - s->cbuf;
+            if (!memcmp(p + 1, prefix.str8 + 1, prefix_len - 1))
+                return pos;
+            pos++;
+        }
+    } else {
+        const uint16_t *tab = (const uint16_t *)s->cbuf;
+        for(;;) {
+            pos = u16_indexof(tab, prefix.str16[0], pos,
+                              len - prefix_len + 1);
+            if (pos < 0)
+                return -1;
+            if (!memcmp(tab + pos + 1, prefix.str16 + 1,
+                        (prefix_len - 1) * 2))
+                return pos;
+            pos++;
+        }
+    }
+}
+
+/* Non sticky regexp with a literal prefix: look for the prefix instead
+   of running the search loop of the bytecode at every position. */
+static intptr_t lre_exec_prefix(REExecContext *s, uint8_t **capture,
+                                const uint8_t *bc_buf, const uint8_t *cptr)
+{
+    const uint8_t *pc;
+    int i, pos;
+    intptr_t ret;
+
+    /* skip the search loop */
+    pc = bc_buf + RE_HEADER_LEN + RE_SEARCH_LOOP_LEN;
+    pos = (cptr - s->cbuf) >> (s->cbuf_type != 0);
+    for(;;) {
+        pos = lre_find_prefix(s, bc_buf, pos);
+        if (pos < 0)
+            return 0;
+        for(i = 0; i < s->capture_count * 2; i++)
+            capture[i] = NULL;
+        ret = lre_exec_backtrack(s, capture, pc,
+                                 s->cbuf + (pos << (s->cbuf_type != 0)));
+        if (ret != 0)
+            return ret;
+        if (lre_poll_timeout(s))
+            return LRE_RET_TIMEOUT;
+        pos++;
+    }
+}
+
+/* Linear time matcher (Pike VM), used when compute_thread_count() is
+   not zero and the backtracking matcher exceeded its budget. The
+   threads run in lock step over the input. They are kept in priority
+   order, and a thread is dropped when a thread of higher priority
+   already reached the same opcode at the same position. Since there
+   are no back references, both threads would have the same future, so
+   the captures are the same as the ones of the backtracking matcher.
+
+   The registers only hold the positions of the zero advance checks.
+   They are all before the current position once a character is
+   consumed, so a thread only needs to know which registers were set
+   at the current position: it is the bit mask 'mask' of
+   lre_add_thread(), which is part of the key of the visited
+   opcodes. */
+
+typedef struct {
+    int count;
+    const uint8_t **pc; /* consuming opcode or REOP_match */
+    uint8_t **capture; /* capture_count * 2 entries per thread */
+} REThreadList;
+
+/* Add to 'l' the threads reachable from 'pc' without consuming a
+   character, in priority order. 'capture' holds the captures of the
+   thread. It is modified during the traversal and restored on
+   return. 'visited' contains the generation 'gen' for the keys already
+   reached at this position. */
+static int lre_add_thread(REExecContext *s, REThreadList *l,
+                          uint32_t *visited, uint32_t gen, int reg_count,
+                          const uint8_t *bc, const uint8_t *pc,
+                          const uint8_t *cptr, uint8_t **capture)
+{
+    StackElem *sp, *stack_end;
+    int opcode, ncap = s->capture_count * 2;
+    uint32_t val, val2, idx, key, mask;
+
+    sp = s->stack_buf;
+    stack_end = s->stack_buf + s->stack_size;
+    mask = 0;
+
+    /* a pending job is either an opcode to visit (idx = -1), a
+       register mask to restore (idx = -2) or a capture to restore */
+#define PUSH_JOB(idx, p)                                        \
+    {                                                           \
+        if (unlikely(stack_end - sp < 2)) {                     \
+            size_t saved_sp = sp - s->stack_buf;                \
+            if (stack_realloc(s, saved_sp + 2))                 \
+                return -1;                                      \
+            stack_end = s->stack_buf + s->stack_size;           \
+            sp = s->stack_buf + saved_sp;                       \
+        }                                                       \
+        sp[0].val = (idx);                                      \
+        sp[1].ptr = (uint8_t *)(p);                             \
+        sp += 2;                                                \
+    }
+
+    for(;;) {
+        key = ((pc - bc) << reg_count) | mask;
+        if (visited[key] == gen)
+            goto next;
+        visited[key] = gen;
+        opcode = pc[0];
+        switch(opcode) {
+        case REOP_goto:
+            pc += 5 + (int)get_u32(pc + 1);
+            break;
+        case REOP_split_goto_first:
+        case REOP_class_loop_back:
+            PUSH_JOB(-1, pc + 5);
+            pc += 5 + (int)get_u32(pc + 1);
+            break;
+        case REOP_split_next_first:
+        case REOP_class_loop:
+            PUSH_JOB(-1, pc + 5 + (int)get_u32(pc + 1));
+            pc += 5;
+            break;
+        case REOP_save_start:
+        case REOP_save_end:
+            idx = 2 * pc[1] + opcode - REOP_save_start;
+            PUSH_JOB(idx, capture[idx]);
+            capture[idx] = (uint8_t *)cptr;
+            pc += 2;
+            break;
+        case REOP_save_reset:
+            for(val = pc[1], val2 = pc[2]; val <= val2; val++) {
+                PUSH_JOB(2 * val, capture[2 * val]);
+                PUSH_JOB(2 * val + 1, capture[2 * val + 1]);
+                capture[2 * val] = NULL;
+                capture[2 * val + 1] = NULL;
+            }
+            pc += 3;
+            break;
+        case REOP_set_char_pos:
+            PUSH_JOB(-2, (uintptr_t)mask);
+            mask |= 1 << pc[1];
+            pc += 2;
+            break;
+        case REOP_check_advance:
+            if (mask & (1 << pc[1]))
+                goto next;
+            pc += 2;
+            break;
+        case REOP_line_start:
+        case REOP_line_start_m:
+        case REOP_line_end:
+        case REOP_line_end_m:
+        case REOP_word_boundary:
+        case REOP_word_boundary_i:
+        case REOP_not_word_boundary:
+        case REOP_not_word_boundary_i:
+            if (!lre_check_assertion(s, opcode, cptr))
+                goto next;
+            pc++;
+            break;
+        default:
+            /* consuming opcode or match: new thread. The registers
+               are no longer tested after it, so the mask is ignored. */
+            if (mask != 0) {
+                key = (pc - bc) << reg_count;
+                if (visited[key] == gen)
+                    goto next;
+                visited[key] = gen;
+            }
+            l->pc[l->count] = pc;
+            memcpy(l->capture + l->count * ncap, capture,
+                   sizeof(capture[0]) * ncap);
+            l->count++;
+        next:
+            for(;;) {
+                if (sp == s->stack_buf)
+                    return 0;
+                sp -= 2;
+                if (sp[0].val == -1) {
+                    pc = sp[1].ptr;
+                    break;
+                } else if (sp[0].val == -2) {
+                    mask = (uintptr_t)sp[1].ptr;
+                } else {
+                    capture[sp[0].val] = sp[1].ptr;
+                }
+            }
+            break;
+        }
+    }
+#undef PUSH_JOB
+}
+
+static intptr_t lre_exec_linear(REExecContext *s, uint8_t **capture,
+                                const uint8_t *bc_buf, const uint8_t *cptr)
+{
+    const uint8_t *bc, *pc, *cptr_next, *cbuf_end = s->cbuf_end;
+    int cbuf_type = s->cbuf_type;
+    int thread_count, bc_len, reg_count, ncap, i, pos;
+    BOOL has_prefix;
+    REThreadList lists[2], *clist, *nlist, *tmp;
+    uint8_t **work, **mem;
+    uint32_t *visited, gen, c;
+    size_t visited_len;
+    intptr_t ret;
+
+    bc = bc_buf + RE_HEADER_LEN;
+    bc_len = get_u32(bc_buf + RE_HEADER_BYTECODE_LEN);
+    thread_count = get_u16(bc_buf + RE_HEADER_THREAD_COUNT);
+    reg_count = bc_buf[RE_HEADER_REGISTER_COUNT];
+    has_prefix = (bc_buf[RE_HEADER_PREFIX_LEN] != 0);
+    ncap = s->capture_count * 2;
+    for(i = 0; i < ncap; i++)
+        capture[i] = NULL;
+
+    if (has_prefix) {
+        /* no match can start before the first occurrence of the
+           prefix */
+        pos = lre_find_prefix(s, bc_buf, (cptr - s->cbuf) >> (cbuf_type != 0));
+        if (pos < 0)
+            return 0;
+        cptr = s->cbuf + (pos << (cbuf_type != 0));
+    }
+
+    visited_len = (size_t)bc_len << reg_count;
+    mem = lre_realloc(s->opaque, NULL,
+                      sizeof(mem[0]) * (ncap + 2 * thread_count * (1 + ncap)) +
+                      sizeof(visited[0]) * visited_len);
+    if (!mem)
+        return LRE_RET_MEMORY_ERROR;
+    work = mem;
+    for(i = 0; i < 2; i++) {
+        lists[i].count = 0;
+        lists[i].pc = (const uint8_t **)mem + ncap + i * thread_count;
+        lists[i].capture = mem + ncap + 2 * thread_count +
+            i * thread_count * ncap;
+    }
+    visited = (uint32_t *)(mem + ncap + 2 * thread_count * (1 + ncap));
+    memset(visited, 0, sizeof(visited[0]) * visited_len);
+    for(i = 0; i < ncap; i++)
+        work[i] = NULL;
+    clist = &lists[0];
+    nlist = &lists[1];
+
+    gen = 1;
+    ret = 0;
+    if (lre_add_thread(s, clist, visited, gen, reg_count, bc, bc, cptr, work))
+        goto fail;
+    while (clist->count != 0) {
+        cptr_next = cptr;
+        c = 0;
+        if (cptr < cbuf_end)
+            GET_CHAR(c, cptr_next, cbuf_end, cbuf_type);
+        gen++;
+        nlist->count = 0;
+        for(i = 0; i < clist->count; i++) {
+            pc = clist->pc[i];
+            if (pc[0] == REOP_match) {
+                /* the threads of lower priority are dropped */
+                memcpy(capture, clist->capture + i * ncap,
+                       sizeof(capture[0]) * ncap);
+                ret = 1;
+                break;
+            }
+            if (cptr >= cbuf_end)
+                continue;
+            if (has_prefix && pc == bc + 5 && nlist->count == 0) {
+                /* only the search loop is running: skip to the next
+                   occurrence of the prefix. It is the last thread. */
+                pos = lre_find_prefix(s, bc_buf,
+                                      (cptr_next - s->cbuf) >> (cbuf_type != 0));
+                if (pos < 0)
+                    break;
+                cptr_next = s->cbuf + (pos << (cbuf_type != 0));
+                if (lre_add_thread(s, nlist, visited, gen, reg_count, bc, bc,
+                                   cptr_next, work))
+                    goto fail;
+                break;
+            }
+            pc = lre_match_char(s, pc, c);
+            if (pc) {
+                memcpy(work, clist->capture + i * ncap,
+                       sizeof(work[0]) * ncap);
+                if (lre_add_thread(s, nlist, visited, gen, reg_count, bc, pc,
+                                   cptr_next, work))
+                    goto fail;
+            }
+        }
+        if (cptr >= cbuf_end)
+            break;
+        tmp = clist;
+        clist = nlist;
+        nlist = tmp;
+        cptr = cptr_next;
+        if (lre_poll_timeout(s)) {
+            ret = LRE_RET_TIMEOUT;
+            break;
+        }
+    }
+ done:
+    lre_realloc(s->opaque, mem, 0);
+    return ret;
+ fail:
+    ret = LRE_RET_MEMORY_ERROR;
+    goto done;
+}
+
 /* Return 1 if match, 0 if not match or < 0 if error (see LRE_RET_x). cindex is the
    starting position of the match and must be such as 0 <= cindex <=
    clen. */
@@ -3356,7 +4300,18 @@ int lre_exec(uint8_t **capture,
         }
     }
 
-    ret = lre_exec_backtrack(s, capture, bc_buf + RE_HEADER_LEN, cptr);
+    /* the backtracking matcher is usually faster, but the linear
+       matcher bounds the matching time when it is available */
+    if (get_u16(bc_buf + RE_HEADER_THREAD_COUNT) != 0)
+        s->backtrack_budget = RE_BACKTRACK_BUDGET(clen - cindex);
+    else
+        s->backtrack_budget = INT64_MAX;
+    if (bc_buf[RE_HEADER_PREFIX_LEN] != 0)
+        ret = lre_exec_prefix(s, capture, bc_buf, cptr);
+    else
+        ret = lre_exec_backtrack(s, capture, bc_buf + RE_HEADER_LEN, cptr);
+    if (ret == LRE_RET_BACKTRACK_LIMIT)
+        ret = lre_exec_linear(s, capture, bc_buf, cptr);
 
     if (s->stack_buf != s->static_stack_buf)
         lre_realloc(s->opaque, s->stack_buf, 0);
@@ -304,6 +304,9 @@ void help(void)
            "-d  --dump         dump the memory usage stats\n"
            "    --memory-limit n  limit the memory usage to 'n' bytes (SI suffixes allowed)\n"
            "    --stack-size n    limit the stack size to 'n' bytes (SI suffixes allowed)\n"
+           "    --gc-generational  only scan the young objects in most automatic GCs\n"
+           "    --no-tail-calls    keep a stack frame for the calls in tail position\n"
+           "    --pools        allocate the small blocks in memory pools\n"
            "    --no-unhandled-rejection  ignore unhandled promise rejections\n"
            "-s                    strip all the debug info\n"
            "    --strip-source    strip the source code\n"
@@ -327,6 +330,9 @@ int main(int argc, char **argv)
     int load_std = 0;
     int dump_unhandled_promise_rejection = 1;
     size_t memory_limit = 0;
+    int gc_generational = 0;
+    int no_tail_calls = 0;
+    int use_pools = 0;
     char *include_list[32];
     int i, include_count = 0;
     int strip_flags = 0;
@@ -433,6 +439,18 @@ int main(int argc, char **argv)
                 stack_size = get_suffixed_size(argv[optind++]);
                 continue;
             }
+            if (!strcmp(longopt, "gc-generational")) {
+                gc_generational = 1;
+                continue;
+            }
+            if (!strcmp(longopt, "no-tail-calls")) {
+                no_tail_calls = 1;
+                continue;
+            }
+            if (!strcmp(longopt, "pools")) {
+                use_pools = 1;
+                continue;
+            }
             if (opt == 's') {
                 strip_flags = JS_STRIP_DEBUG;
                 continue;
@@ -452,9 +470,15 @@ int main(int argc, char **argv)
 
     if (trace_memory) {
         js_trace_malloc_init(&trace_data);
-        rt = JS_NewRuntime2(&trace_mf, &trace_data);
+        if (use_pools)
+            rt = JS_NewRuntimeWithPools(&trace_mf, &trace_data);
+        else
+            rt = JS_NewRuntime2(&trace_mf, &trace_data);
     } else {
-        rt = JS_NewRuntime();
+        if (use_pools)
+            rt = JS_NewRuntimeWithPools(NULL, NULL);
+        else
+            rt = JS_NewRuntime();
     }
     if (!rt) {
         fprintf(stderr, "qjs: cannot allocate JS runtime\n");
@@ -464,6 +488,10 @@ int main(int argc, char **argv)
         JS_SetMemoryLimit(rt, memory_limit);
     if (stack_size != 0)
         JS_SetMaxStackSize(rt, stack_size);
+    if (gc_generational)
+        JS_SetGCMode(rt, JS_GC_MODE_GENERATIONAL);
+    if (no_tail_calls)
+        JS_SetTailCalls(rt, FALSE);
     JS_SetStripInfo(rt, strip_flags);
     js_std_set_worker_new_context_func(JS_NewCustomContext);
     js_std_init_handlers(rt);
@@ -850,6 +850,36 @@ static JSValue js_std_gc(JSContext *ctx, JSValueConst this_val,
     return JS_UNDEFINED;
 }
 
+static JSValue js_std_memoryUsage(JSContext *ctx, JSValueConst this_val,
+                                  int argc, JSValueConst *argv)
+{
+    JSMemoryUsage stats;
+    JSValue obj;
+
+    JS_ComputeMemoryUsage(JS_GetRuntime(ctx), &stats);
+    obj = JS_NewObject(ctx);
+    if (JS_IsException(obj))
+        return obj;
+#define DEF(name) \
+    JS_DefinePropertyValueStr(ctx, obj, #name, JS_NewInt64(ctx, stats.name), JS_PROP_C_W_E)
+    DEF(malloc_size);
+    DEF(memory_used_size);
+    DEF(memory_used_count);
+    DEF(str_count);
+    DEF(str_size);
+    DEF(obj_count);
+    DEF(obj_size);
+    DEF(prop_count);
+    DEF(prop_size);
+    DEF(shape_count);
+    DEF(shape_size);
+    DEF(array_count);
+    DEF(fast_array_count);
+    DEF(fast_array_elements);
+#undef DEF
+    return obj;
+}
+
 static int interrupt_handler(JSRuntime *rt, void *opaque)
 {
     return (os_pending_signals >> SIGINT) & 1;
@@ -1141,13 +1171,17 @@ static FILE *js_std_file_get(JSContext *ctx, JSValueConst obj)
     return s->f;
 }
 
+static void js_print_value_write(void *opaque, const char *buf, size_t len)
+{
+    FILE *fo = opaque;
+    fwrite(buf, 1, len, fo);
+}
+
 static JSValue js_std_file_puts(JSContext *ctx, JSValueConst this_val,
                                 int argc, JSValueConst *argv, int magic)
 {
     FILE *f;
     int i;
-    const char *str;
-    size_t len;
 
     if (magic == 0) {
         f = stdout;
@@ -1158,11 +1192,8 @@ static JSValue js_std_file_puts(JSContext *ctx, JSValueConst this_val,
     }
 
     for(i = 0; i < argc; i++) {
-        str = JS_ToCStringLen(ctx, &len, argv[i]);
-        if (!str)
+        if (JS_WriteStringUTF8(ctx, js_print_value_write, f, argv[i]))
             return JS_EXCEPTION;
-        fwrite(str, 1, len, f);
-        JS_FreeCString(ctx, str);
     }
     return JS_UNDEFINED;
 }
@@ -1193,12 +1224,6 @@ static JSValue js_std_file_printf(JSContext *ctx, JSValueConst this_val,
     return js_printf_internal(ctx, argc, argv, f);
 }
 
-static void js_print_value_write(void *opaque, const char *buf, size_t len)
-{
-    FILE *fo = opaque;
-    fwrite(buf, 1, len, fo);
-}
-
 static JSValue js_std_file_printObject(JSContext *ctx, JSValueConst this_val,
                                        int argc, JSValueConst *argv)
 {
@@ -1640,6 +1665,7 @@ static const JSCFunctionListEntry js_std_error_props[] = {
 static const JSCFunctionListEntry js_std_funcs[] = {
     JS_CFUNC_DEF("exit", 1, js_std_exit ),
     JS_CFUNC_DEF("gc", 0, js_std_gc ),
+    JS_CFUNC_DEF("memoryUsage", 0, js_std_memoryUsage ),
     JS_CFUNC_DEF("evalScript", 1, js_evalScript ),
     JS_CFUNC_DEF("loadScript", 1, js_loadScript ),
     JS_CFUNC_DEF("getenv", 1, js_std_getenv ),
@@ -4034,13 +4060,8 @@ static JSValue js_print(JSContext *ctx, JSValueConst this_val,
             putchar(' ');
         v = argv[i];
         if (JS_IsString(v)) {
-            const char *str;
-            size_t len;
-            str = JS_ToCStringLen(ctx, &len, v);
-            if (!str)
+            if (JS_WriteStringUTF8(ctx, js_print_value_write, stdout, v))
                 return JS_EXCEPTION;
-            fwrite(str, 1, len, stdout);
-            JS_FreeCString(ctx, str);
         } else {
             JS_PrintValue(ctx, js_print_value_write, stdout, v, NULL);
         }
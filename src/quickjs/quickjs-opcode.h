@@ -134,6 +134,9 @@ DEF(  put_ref_value, 1, 3, 0, none)
 DEF(      get_field, 5, 1, 1, atom)
 DEF(     get_field2, 5, 1, 2, atom)
 DEF(      put_field, 5, 2, 0, atom)
+DEF(   get_field_ic, 7, 1, 1, atom_u16) /* atom, inline cache index. Must be in the same order as get_field */
+DEF(  get_field2_ic, 7, 1, 2, atom_u16)
+DEF(   put_field_ic, 7, 2, 0, atom_u16)
 DEF( get_private_field, 1, 2, 1, none) /* obj prop -> value */
 DEF( put_private_field, 1, 3, 0, none) /* obj value prop -> */
 DEF(define_private_field, 1, 3, 1, none) /* obj prop value -> obj */
@@ -256,6 +259,16 @@ DEF(             or, 1, 2, 1, none)
 DEF(is_undefined_or_null, 1, 1, 1, none)
 DEF(     private_in, 1, 2, 1, none)
 DEF(push_bigint_i32, 5, 0, 1, i32)
+/* quickened opcodes: the interpreter rewrites the generic opcode of the
+   same size in place after observing int32 operands and reverts it when
+   the operand types differ. They are never serialized. */
+DEF(      add_int32, 1, 2, 1, none)
+DEF(      sub_int32, 1, 2, 1, none)
+DEF(       lt_int32, 1, 2, 1, none) /* must be in the same order as lt */
+DEF(      lte_int32, 1, 2, 1, none)
+DEF(       gt_int32, 1, 2, 1, none)
+DEF(      gte_int32, 1, 2, 1, none)
+DEF(get_array_el_fast_int, 1, 2, 1, none)
 /* must be the last non short and non temporary opcode */
 DEF(            nop, 1, 0, 0, none)
 
@@ -77,6 +77,13 @@
 #define CONFIG_STACK_CHECK
 #endif
 
+/* the baseline JIT (CONFIG_JIT) only supports x86-64 with the
+   default JSValue representation */
+#if defined(CONFIG_JIT) && (!defined(__x86_64__) || defined(_WIN32) || \
+                            defined(JS_NAN_BOXING) || defined(CONFIG_CHECK_JSVALUE))
+#undef CONFIG_JIT
+#endif
+
 
 /* dump object free */
 //#define DUMP_FREE
@@ -117,6 +124,11 @@
 #include <errno.h>
 #endif
 
+#ifdef CONFIG_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 enum {
     /* classid tag        */    /* union usage   | properties */
     JS_CLASS_OBJECT = 1,        /* must be first */
@@ -215,12 +227,26 @@ typedef enum JSErrorEnum {
 #define JS_STRING_ROPE_SHORT2_LEN 8192
 /* rope depth at which we rebalance */
 #define JS_STRING_ROPE_MAX_DEPTH 60
+/* substrings >= this length reference the characters of their parent
+   string instead of copying them... */
+#define JS_STRING_SLICE_MIN_LEN 512
+/* ...unless they are smaller than 1/JS_STRING_SLICE_MAX_RATIO of the
+   parent, which would keep too much unused memory alive */
+#define JS_STRING_SLICE_MAX_RATIO 8
 
 #define __exception __attribute__((warn_unused_result))
 
 typedef struct JSShape JSShape;
 typedef struct JSString JSString;
 typedef struct JSString JSAtomStruct;
+
+/* entry of the atom hash table (open addressing with linear
+   probing). The hash is copied so that probing does not need to
+   access the atom strings. */
+typedef struct JSAtomHashEntry {
+    uint32_t hash;
+    JSAtom atom; /* JS_ATOM_NULL if empty */
+} JSAtomHashEntry;
 typedef struct JSObject JSObject;
 
 #define JS_VALUE_GET_OBJ(v) ((JSObject *)JS_VALUE_GET_PTR(v))
@@ -235,16 +261,19 @@ typedef enum {
 
 typedef enum OPCodeEnum OPCodeEnum;
 
+typedef struct JSPool JSPool;
+
 struct JSRuntime {
     JSMallocFunctions mf;
     JSMallocState malloc_state;
+    JSPool *pool; /* NULL if the memory pools are not used */
     const char *rt_info;
 
     int atom_hash_size; /* power of two */
     int atom_count;
     int atom_size;
     int atom_count_resize; /* resize hash table at this count */
-    uint32_t *atom_hash;
+    JSAtomHashEntry *atom_hash;
     JSAtomStruct **atom_array;
     int atom_free_index; /* 0 = none */
 
@@ -259,7 +288,9 @@ struct JSRuntime {
     struct list_head gc_zero_ref_count_list;
     struct list_head tmp_obj_list; /* used during GC */
     JSGCPhaseEnum gc_phase : 8;
+    JSGCModeEnum gc_mode : 8;
     size_t malloc_gc_threshold;
+    size_t gc_full_threshold; /* JS_GC_MODE_GENERATIONAL only */
     struct list_head weakref_list; /* list of JSWeakRefHeader.link */
 #ifdef DUMP_LEAKS
     struct list_head string_list; /* list of JSString.link */
@@ -297,6 +328,7 @@ struct JSRuntime {
     int64_t module_async_evaluation_next_timestamp;
 
     BOOL can_block : 8; /* TRUE if Atomics.wait can block */
+    BOOL tail_calls : 8; /* see JS_SetTailCalls() */
     /* used to allocate, free and clone SharedArrayBuffers */
     JSSharedArrayBufferFunctions sab_funcs;
     /* see JS_SetStripInfo() */
@@ -307,6 +339,26 @@ struct JSRuntime {
     int shape_hash_size;
     int shape_hash_count; /* number of hashed shapes */
     JSShape **shape_hash;
+    uint32_t shape_id_counter; /* last allocated JSShape.id */
+
+    /* last leaf found by string_rope_find_leaf(). Reset when the rope
+       is freed or linearized. */
+    struct JSStringRope *rope_cache;
+    JSString *rope_cache_leaf;
+    uint32_t rope_cache_start;
+
+    /* shared one character Latin-1 strings, allocated on demand */
+    JSString *char_strings[256];
+
+    /* LRU cache of the compiled regexps, see JS_SetRegExpCacheSize() */
+    int regexp_cache_size; /* maximum number of entries, 0 if disabled */
+    int regexp_cache_count;
+    int regexp_cache_hash_size; /* power of two, 0 if not allocated */
+    struct JSRegExpCacheEntry **regexp_cache_hash;
+    struct list_head regexp_cache_list; /* most recently used first */
+    int64_t regexp_cache_hits;
+    int64_t regexp_cache_misses;
+
     void *user_opaque;
 };
 
@@ -356,7 +408,8 @@ struct JSGCObjectHeader {
     int ref_count; /* must come first, 32-bit */
     JSGCObjectTypeEnum gc_obj_type : 4;
     uint8_t mark : 1; /* used by the GC */
-    uint8_t dummy0: 3;
+    uint8_t young : 1; /* allocated since the previous GC */
+    uint8_t dummy0: 2;
     uint8_t dummy1; /* not used by the GC */
     uint16_t dummy2; /* not used by the GC */
     struct list_head link;
@@ -515,14 +568,17 @@ typedef enum {
 
 struct JSString {
     JSRefCountHeader header; /* must come first, 32-bit */
-    uint32_t len : 31;
+    uint32_t len : 30;
+    uint8_t is_ref : 1; /* 1 = the characters are not stored in the
+                           structure (JSStringRef) */
     uint8_t is_wide_char : 1; /* 0 = 8 bits, 1 = 16 bits characters */
     /* for JS_ATOM_TYPE_SYMBOL: hash = weakref_count, atom_type = 3,
        for JS_ATOM_TYPE_PRIVATE: hash = JS_ATOM_HASH_PRIVATE, atom_type = 3
-       XXX: could change encoding to have one more bit in hash */
+       XXX: could change encoding to have one more bit in hash
+       for non atom strings: hash = cached js_string_hash() if hash_next != 0 */
     uint32_t hash : 30;
     uint8_t atom_type : 2; /* != 0 if atom, JS_ATOM_TYPE_x */
-    uint32_t hash_next; /* atom_index for JS_ATOM_TYPE_SYMBOL */
+    uint32_t hash_next; /* atom_index for atoms */
 #ifdef DUMP_LEAKS
     struct list_head link; /* string list */
 #endif
@@ -532,6 +588,19 @@ struct JSString {
     } u;
 };
 
+/* String referencing characters stored elsewhere: either a slice of
+   a parent string or the host memory given to
+   JS_NewExternalString(). It is never an atom and its 8 bit
+   characters are not null terminated. */
+typedef struct JSStringRef {
+    JSString str; /* is_ref = 1 */
+    const void *ptr; /* first character */
+    JSString *parent; /* string holding the characters or NULL. It is
+                         never a slice. */
+    JSFreeExternalStringFunc *free_func; /* used if parent = NULL */
+    void *opaque;
+} JSStringRef;
+
 typedef struct JSStringRope {
     JSRefCountHeader header; /* must come first, 32-bit */
     uint32_t len;
@@ -617,6 +686,28 @@ typedef enum JSFunctionKindEnum {
     JS_FUNC_ASYNC_GENERATOR = (JS_FUNC_GENERATOR | JS_FUNC_ASYNC),
 } JSFunctionKindEnum;
 
+/* Inline caches for the get_field_ic, get_field2_ic and put_field_ic
+   opcodes. An entry matches when the receiver has the same shape
+   pointer and the same shape id (JSShape.id is renewed each time the
+   shape content is modified, so an id check also covers in place
+   modifications and reuse of a freed shape address). */
+#define JS_IC_WAYS      4 /* number of shapes cached per site */
+#define JS_IC_MAX_COUNT 0xffff /* maximum number of sites per function */
+
+typedef struct JSInlineCacheEntry {
+    JSShape *shape; /* receiver shape, NULL if free entry. Never dereferenced */
+    uint32_t shape_id;
+    /* 0 if the property is an own property of the receiver. Otherwise
+       the property is in the prototype of the receiver and
+       'proto_shape_id' is the shape id of this prototype. */
+    uint32_t proto_shape_id;
+    uint32_t prop_idx; /* index in JSObject.prop of the holder */
+} JSInlineCacheEntry;
+
+typedef struct JSInlineCache {
+    JSInlineCacheEntry entries[JS_IC_WAYS]; /* most recent first */
+} JSInlineCache;
+
 typedef struct JSFunctionBytecode {
     JSGCObjectHeader header; /* must come first */
     uint8_t js_mode;
@@ -648,6 +739,12 @@ typedef struct JSFunctionBytecode {
     JSValue *cpool; /* constant pool (self pointer) */
     int cpool_count;
     int closure_var_count;
+    int ic_count; /* number of inline cache sites in the byte code */
+    JSInlineCache *ic; /* allocated on the first cache miss, NULL if none */
+#ifdef CONFIG_JIT
+    uint16_t jit_counter; /* number of calls and backward branches */
+    struct JSJitCode *jit_code; /* native code, NULL if none */
+#endif
     struct {
         /* debug info, move to separate structure to save memory? */
         JSAtom filename;
@@ -685,6 +782,15 @@ typedef struct JSRegExp {
     JSString *bytecode; /* also contains the flags */
 } JSRegExp;
 
+typedef struct JSRegExpCacheEntry {
+    struct list_head link; /* rt->regexp_cache_list */
+    struct JSRegExpCacheEntry *hash_next;
+    uint32_t hash;
+    int re_flags;
+    JSString *pattern;
+    JSString *bytecode;
+} JSRegExpCacheEntry;
+
 typedef struct JSProxyData {
     JSValue target;
     JSValue handler;
@@ -918,6 +1024,7 @@ struct JSShape {
     int prop_size; /* allocated properties */
     int prop_count; /* include deleted properties */
     int deleted_prop_count;
+    uint32_t id; /* renewed when the shape is modified (see JSInlineCache) */
     JSShape *shape_hash_next; /* in JSRuntime.shape_hash[h] list */
     JSObject *proto;
     JSShapeProperty prop[0]; /* prop_size elements */
@@ -1018,24 +1125,38 @@ struct JSObject {
     } u;
 };
 
+/* Map/Set records are stored in insertion order in a dense array. The
+   hash table chains the records by index. */
 typedef struct JSMapRecord {
-    int ref_count; /* used during enumeration to avoid freeing the record */
-    BOOL empty : 8; /* TRUE if the record is deleted */
-    struct list_head link;
-    struct JSMapRecord *hash_next;
-    JSValue key;
+    JSValue key; /* JS_UNINITIALIZED if the record is deleted */
     JSValue value;
+    uint32_t hash_next; /* index of the next record in the hash chain */
 } JSMapRecord;
 
+#define MAP_RECORD_NONE ((uint32_t)-1)
+
+static inline BOOL map_record_is_deleted(const JSMapRecord *mr)
+{
+    return JS_VALUE_GET_TAG(mr->key) == JS_TAG_UNINITIALIZED;
+}
+
+/* enumeration position in a Map/Set. It is updated when the deleted
+   records are removed from the record array. */
+typedef struct JSMapIterPos {
+    struct list_head link; /* JSMapState.iterators list */
+    uint32_t index; /* index of the next record to enumerate */
+} JSMapIterPos;
+
 typedef struct JSMapState {
     BOOL is_weak; /* TRUE if WeakSet/WeakMap */
-    struct list_head records; /* list of JSMapRecord.link */
-    uint32_t record_count;
-    JSMapRecord **hash_table;
+    uint32_t record_count; /* number of live records */
+    JSMapRecord *records; /* may contain deleted records */
+    uint32_t records_len; /* number of used entries in records[] */
+    uint32_t records_size; /* allocated size of records[] */
+    uint32_t *hash_table; /* NULL if records_size = 0 */
     int hash_bits;
     uint32_t hash_size; /* = 2 ^ hash_bits */
-    uint32_t record_count_threshold; /* count at which a hash table
-                                        resize is needed */
+    struct list_head iterators; /* list of JSMapIterPos.link */
     JSWeakRefHeader weakref_header; /* only used if is_weak = TRUE */
 } JSMapState;
 
@@ -1197,7 +1318,7 @@ static JSValue js_new_string8_len(JSContext *ctx, const char *buf, int len);
 static JSValue js_compile_regexp(JSContext *ctx, JSValueConst pattern,
                                  JSValueConst flags);
 static JSValue JS_NewRegexp(JSContext *ctx, JSValue pattern, JSValue bc);
-static void gc_decref(JSRuntime *rt);
+static void gc_decref(JSRuntime *rt, struct list_head *start, BOOL young_only);
 static int JS_NewClass1(JSRuntime *rt, JSClassID class_id,
                         const JSClassDef *class_def, JSAtom name);
 
@@ -1301,6 +1422,7 @@ static void js_free_shape_null(JSRuntime *rt, JSShape *sh);
 static int js_shape_prepare_update(JSContext *ctx, JSObject *p,
                                    JSShapeProperty **pprs);
 static int init_shape_hash(JSRuntime *rt);
+static void regexp_cache_clear(JSRuntime *rt);
 static __exception int js_get_length32(JSContext *ctx, uint32_t *pres,
                                        JSValueConst obj);
 static __exception int js_get_length64(JSContext *ctx, int64_t *pres,
@@ -1332,7 +1454,8 @@ static JSValue js_object_groupBy(JSContext *ctx, JSValueConst this_val,
 static void map_delete_weakrefs(JSRuntime *rt, JSWeakRefHeader *wh);
 static void weakref_delete_weakref(JSRuntime *rt, JSWeakRefHeader *wh);
 static void finrec_delete_weakref(JSRuntime *rt, JSWeakRefHeader *wh);
-static void JS_RunGCInternal(JSRuntime *rt, BOOL remove_weak_objects);
+static void JS_RunGCInternal(JSRuntime *rt, BOOL remove_weak_objects,
+                             BOOL young_only);
 static JSValue js_array_from_iterator(JSContext *ctx, uint32_t *plen,
                                       JSValueConst obj, JSValueConst method);
 static int js_string_find_invalid_codepoint(JSString *p);
@@ -1351,6 +1474,10 @@ static const JSClassExoticMethods js_proxy_exotic_methods;
 static const JSClassExoticMethods js_module_ns_exotic_methods;
 static JSClassID js_class_id_alloc = JS_CLASS_INIT_COUNT;
 
+/* allocation size between two GCs of the young objects */
+#define JS_GC_YOUNG_SIZE_MIN (256 * 1024)
+#define JS_GC_YOUNG_SIZE_MAX (4 * 1024 * 1024)
+
 static void js_trigger_gc(JSRuntime *rt, size_t size)
 {
     BOOL force_gc;
@@ -1365,9 +1492,27 @@ static void js_trigger_gc(JSRuntime *rt, size_t size)
         printf("GC: size=%" PRIu64 "\n",
                (uint64_t)rt->malloc_state.malloc_size);
 #endif
-        JS_RunGC(rt);
-        rt->malloc_gc_threshold = rt->malloc_state.malloc_size +
-            (rt->malloc_state.malloc_size >> 1);
+        if (rt->gc_mode == JS_GC_MODE_GENERATIONAL &&
+            (rt->malloc_state.malloc_size + size) <= rt->gc_full_threshold) {
+            /* only collect the cycles of young objects */
+            JS_RunGCInternal(rt, TRUE, TRUE);
+        } else {
+            JS_RunGC(rt);
+            rt->gc_full_threshold = rt->malloc_state.malloc_size +
+                (rt->malloc_state.malloc_size >> 1);
+        }
+        if (rt->gc_mode == JS_GC_MODE_GENERATIONAL) {
+            size_t young_size;
+            young_size = rt->malloc_state.malloc_size >> 2;
+            if (young_size < JS_GC_YOUNG_SIZE_MIN)
+                young_size = JS_GC_YOUNG_SIZE_MIN;
+            else if (young_size > JS_GC_YOUNG_SIZE_MAX)
+                young_size = JS_GC_YOUNG_SIZE_MAX;
+            rt->malloc_gc_threshold = rt->malloc_state.malloc_size + young_size;
+        } else {
+            rt->malloc_gc_threshold = rt->malloc_state.malloc_size +
+                (rt->malloc_state.malloc_size >> 1);
+        }
     }
 }
 
@@ -1376,23 +1521,442 @@ static size_t js_malloc_usable_size_unknown(const void *ptr)
     return 0;
 }
 
+/* Memory pools (JS_NewRuntimeWithPools()): the small blocks (objects,
+   shapes, strings, closure variables, map records...) are allocated
+   in chunks of JS_POOL_CHUNK_SIZE bytes containing blocks of a single
+   size class. It avoids the malloc() header and the usable size
+   computation of each block. The chunks are allocated with rt->mf so
+   that the memory accounting and limit still apply. The chunk of a
+   block is found with a hash table indexed by the block address
+   divided by JS_POOL_CHUNK_SIZE. */
+
+#define JS_POOL_CHUNK_BITS 16
+#define JS_POOL_CHUNK_SIZE (1 << JS_POOL_CHUNK_BITS)
+#define JS_POOL_ALIGN_BITS 4
+#define JS_POOL_MAX_SIZE 256 /* larger blocks are allocated with rt->mf */
+#define JS_POOL_CLASS_COUNT (JS_POOL_MAX_SIZE >> JS_POOL_ALIGN_BITS)
+
+typedef struct JSPoolFreeBlock {
+    struct JSPoolFreeBlock *next;
+} JSPoolFreeBlock;
+
+typedef struct JSPoolChunk {
+    /* in JSPool.partial_list[] if the chunk is not full, otherwise
+       link.next = NULL */
+    struct list_head link;
+    JSPoolFreeBlock *free_list;
+    uint8_t *bump; /* first block which was never allocated */
+    uint8_t *start;
+    uint8_t *end;
+    uint32_t block_size;
+    uint32_t used_count;
+} JSPoolChunk;
+
+typedef struct JSPoolPage {
+    uintptr_t page; /* address >> JS_POOL_CHUNK_BITS, 0 = free entry */
+    JSPoolChunk *chunks[2]; /* a page overlaps at most two chunks */
+} JSPoolPage;
+
+struct JSPool {
+    struct list_head partial_list[JS_POOL_CLASS_COUNT];
+    JSPoolPage *page_hash;
+    int page_hash_bits;
+    int page_count;
+};
+
+/* With JS_NAN_BOXING64, the pointers stored in a JSValue must fit in
+   48 bits. The allocations returning other pointers fail. */
+static inline BOOL js_ptr_fits_value(const void *ptr)
+{
+#ifdef JS_NAN_BOXING64
+    return ((uintptr_t)ptr >> 48) == 0;
+#else
+    return TRUE;
+#endif
+}
+
+static inline uint32_t js_pool_page_hash(uintptr_t page, int bits)
+{
+    return ((uint64_t)page * 0x9e3779b97f4a7c15) >> (64 - bits);
+}
+
+static inline JSPoolPage *js_pool_find_page(JSPool *pool, uintptr_t page)
+{
+    uint32_t h, mask;
+    JSPoolPage *e;
+
+    mask = (1 << pool->page_hash_bits) - 1;
+    h = js_pool_page_hash(page, pool->page_hash_bits);
+    for(;;) {
+        e = &pool->page_hash[h];
+        if (e->page == page)
+            return e;
+        if (e->page == 0)
+            return NULL;
+        h = (h + 1) & mask;
+    }
+}
+
+static inline JSPoolChunk *js_pool_find_chunk(JSPool *pool, const void *ptr)
+{
+    JSPoolPage *e;
+    JSPoolChunk *c;
+
+    e = js_pool_find_page(pool, (uintptr_t)ptr >> JS_POOL_CHUNK_BITS);
+    if (!e)
+        return NULL;
+    c = e->chunks[0];
+    if (c && (uint8_t *)ptr >= c->start && (uint8_t *)ptr < c->end)
+        return c;
+    c = e->chunks[1];
+    if (c && (uint8_t *)ptr >= c->start && (uint8_t *)ptr < c->end)
+        return c;
+    return NULL;
+}
+
+static JSPoolPage *js_pool_insert_page(JSPool *pool, JSPoolPage *tab,
+                                       int bits, uintptr_t page)
+{
+    uint32_t h, mask;
+
+    mask = (1 << bits) - 1;
+    h = js_pool_page_hash(page, bits);
+    while (tab[h].page != 0)
+        h = (h + 1) & mask;
+    tab[h].page = page;
+    return &tab[h];
+}
+
+static int js_pool_add_page(JSRuntime *rt, JSPool *pool, uintptr_t page,
+                            JSPoolChunk *c)
+{
+    JSPoolPage *e, *new_tab;
+    int i, new_bits;
+
+    e = js_pool_find_page(pool, page);
+    if (!e) {
+        if (2 * (pool->page_count + 1) > (1 << pool->page_hash_bits)) {
+            new_bits = pool->page_hash_bits + 1;
+            new_tab = rt->mf.js_malloc(&rt->malloc_state,
+                                       sizeof(new_tab[0]) << new_bits);
+            if (!new_tab)
+                return -1;
+            memset(new_tab, 0, sizeof(new_tab[0]) << new_bits);
+            for(i = 0; i < (1 << pool->page_hash_bits); i++) {
+                if (pool->page_hash[i].page != 0) {
+                    *js_pool_insert_page(pool, new_tab, new_bits,
+                                         pool->page_hash[i].page) =
+                        pool->page_hash[i];
+                }
+            }
+            rt->mf.js_free(&rt->malloc_state, pool->page_hash);
+            pool->page_hash = new_tab;
+            pool->page_hash_bits = new_bits;
+        }
+        e = js_pool_insert_page(pool, pool->page_hash, pool->page_hash_bits,
+                                page);
+        e->chunks[0] = NULL;
+        e->chunks[1] = NULL;
+        pool->page_count++;
+    }
+    if (!e->chunks[0]) {
+        e->chunks[0] = c;
+    } else {
+        assert(!e->chunks[1]);
+        e->chunks[1] = c;
+    }
+    return 0;
+}
+
+static void js_pool_remove_page(JSPool *pool, uintptr_t page, JSPoolChunk *c)
+{
+    JSPoolPage *tab = pool->page_hash;
+    JSPoolPage *e;
+    uint32_t i, j, k, mask;
+
+    e = js_pool_find_page(pool, page);
+    assert(e != NULL);
+    if (e->chunks[0] == c)
+        e->chunks[0] = e->chunks[1];
+    e->chunks[1] = NULL;
+    if (e->chunks[0])
+        return;
+    /* delete the entry by moving back the next entries of the
+       collision chain (linear probing) */
+    pool->page_count--;
+    mask = (1 << pool->page_hash_bits) - 1;
+    i = j = e - tab;
+    for(;;) {
+        tab[i].page = 0;
+        for(;;) {
+            j = (j + 1) & mask;
+            if (tab[j].page == 0)
+                return;
+            k = js_pool_page_hash(tab[j].page, pool->page_hash_bits);
+            /* the entry can be moved if its home slot is not in ]i, j] */
+            if (i <= j ? (k <= i || k > j) : (k <= i && k > j))
+                break;
+        }
+        tab[i] = tab[j];
+        i = j;
+    }
+}
+
+static JSPoolChunk *js_pool_new_chunk(JSRuntime *rt, JSPool *pool, int cl)
+{
+    JSPoolChunk *c;
+    uintptr_t page0, page1;
+    uint32_t block_size, hdr_size;
+
+    c = rt->mf.js_malloc(&rt->malloc_state, JS_POOL_CHUNK_SIZE);
+    if (!c)
+        return NULL;
+    if (unlikely(!js_ptr_fits_value(c)))
+        goto fail;
+    page0 = (uintptr_t)c >> JS_POOL_CHUNK_BITS;
+    page1 = ((uintptr_t)c + JS_POOL_CHUNK_SIZE - 1) >> JS_POOL_CHUNK_BITS;
+    if (js_pool_add_page(rt, pool, page0, c))
+        goto fail;
+    if (page1 != page0 && js_pool_add_page(rt, pool, page1, c)) {
+        js_pool_remove_page(pool, page0, c);
+        goto fail;
+    }
+    block_size = (cl + 1) << JS_POOL_ALIGN_BITS;
+    hdr_size = (sizeof(JSPoolChunk) + (1 << JS_POOL_ALIGN_BITS) - 1) &
+        ~((1 << JS_POOL_ALIGN_BITS) - 1);
+    c->free_list = NULL;
+    c->start = (uint8_t *)c + hdr_size;
+    c->bump = c->start;
+    c->end = c->start +
+        ((JS_POOL_CHUNK_SIZE - hdr_size) / block_size) * block_size;
+    c->block_size = block_size;
+    c->used_count = 0;
+    list_add(&c->link, &pool->partial_list[cl]);
+    return c;
+ fail:
+    rt->mf.js_free(&rt->malloc_state, c);
+    return NULL;
+}
+
+static void js_pool_free_chunk(JSRuntime *rt, JSPool *pool, JSPoolChunk *c)
+{
+    uintptr_t page0, page1;
+
+    page0 = (uintptr_t)c >> JS_POOL_CHUNK_BITS;
+    page1 = ((uintptr_t)c + JS_POOL_CHUNK_SIZE - 1) >> JS_POOL_CHUNK_BITS;
+    js_pool_remove_page(pool, page0, c);
+    if (page1 != page0)
+        js_pool_remove_page(pool, page1, c);
+    rt->mf.js_free(&rt->malloc_state, c);
+}
+
+/* 1 <= size <= JS_POOL_MAX_SIZE */
+static void *js_pool_malloc(JSRuntime *rt, size_t size)
+{
+    JSPool *pool = rt->pool;
+    struct list_head *head;
+    JSPoolChunk *c;
+    JSPoolFreeBlock *b;
+    int cl;
+
+    cl = (size - 1) >> JS_POOL_ALIGN_BITS;
+    head = &pool->partial_list[cl];
+    if (unlikely(list_empty(head))) {
+        c = js_pool_new_chunk(rt, pool, cl);
+        if (!c)
+            return NULL;
+    } else {
+        c = list_entry(head->next, JSPoolChunk, link);
+    }
+    b = c->free_list;
+    if (b) {
+        c->free_list = b->next;
+    } else {
+        b = (JSPoolFreeBlock *)c->bump;
+        c->bump += c->block_size;
+    }
+    c->used_count++;
+    if (!c->free_list && c->bump >= c->end) {
+        /* the chunk is full */
+        list_del(&c->link);
+        c->link.next = NULL;
+    }
+    return b;
+}
+
+static void js_pool_free(JSRuntime *rt, JSPoolChunk *c, void *ptr)
+{
+    JSPool *pool = rt->pool;
+    JSPoolFreeBlock *b = ptr;
+    struct list_head *head;
+
+    head = &pool->partial_list[(c->block_size >> JS_POOL_ALIGN_BITS) - 1];
+    b->next = c->free_list;
+    c->free_list = b;
+    if (!c->link.next)
+        list_add(&c->link, head);
+    if (--c->used_count == 0) {
+        if (head->next != &c->link || c->link.next != head) {
+            /* another chunk has free blocks: release this one */
+            list_del(&c->link);
+            js_pool_free_chunk(rt, pool, c);
+        } else {
+            c->free_list = NULL;
+            c->bump = c->start;
+        }
+    }
+}
+
+static void *js_pool_realloc(JSRuntime *rt, JSPoolChunk *c, void *ptr,
+                             size_t size)
+{
+    void *new_ptr;
+
+    if (size == 0) {
+        js_pool_free(rt, c, ptr);
+        return NULL;
+    }
+    if (size <= c->block_size &&
+        size > c->block_size - (1 << JS_POOL_ALIGN_BITS))
+        return ptr;
+    new_ptr = js_malloc_rt(rt, size);
+    if (!new_ptr)
+        return NULL;
+    memcpy(new_ptr, ptr, min_uint32(size, c->block_size));
+    js_pool_free(rt, c, ptr);
+    return new_ptr;
+}
+
+static int js_pool_init(JSRuntime *rt)
+{
+    JSPool *pool;
+    int i;
+
+    pool = rt->mf.js_malloc(&rt->malloc_state, sizeof(*pool));
+    if (!pool)
+        return -1;
+    for(i = 0; i < JS_POOL_CLASS_COUNT; i++)
+        init_list_head(&pool->partial_list[i]);
+    pool->page_hash_bits = 6;
+    pool->page_count = 0;
+    pool->page_hash = rt->mf.js_malloc(&rt->malloc_state,
+                                       sizeof(pool->page_hash[0]) << pool->page_hash_bits);
+    if (!pool->page_hash) {
+        rt->mf.js_free(&rt->malloc_state, pool);
+        return -1;
+    }
+    memset(pool->page_hash, 0,
+           sizeof(pool->page_hash[0]) << pool->page_hash_bits);
+    rt->pool = pool;
+    return 0;
+}
+
+/* free all the chunks, even if some blocks are still allocated */
+static void js_pool_free_all(JSRuntime *rt)
+{
+    JSPool *pool = rt->pool;
+    JSPoolPage *e;
+    JSPoolChunk *c;
+    int i, j;
+
+    if (!pool)
+        return;
+    for(i = 0; i < (1 << pool->page_hash_bits); i++) {
+        e = &pool->page_hash[i];
+        if (e->page == 0)
+            continue;
+        for(j = 0; j < 2; j++) {
+            c = e->chunks[j];
+            /* a chunk is freed with its first page */
+            if (c && ((uintptr_t)c >> JS_POOL_CHUNK_BITS) == e->page)
+                rt->mf.js_free(&rt->malloc_state, c);
+        }
+    }
+    rt->mf.js_free(&rt->malloc_state, pool->page_hash);
+    rt->mf.js_free(&rt->malloc_state, pool);
+    rt->pool = NULL;
+}
+
 void *js_malloc_rt(JSRuntime *rt, size_t size)
 {
-    return rt->mf.js_malloc(&rt->malloc_state, size);
+    void *ptr;
+    if (rt->pool && (size - 1) < JS_POOL_MAX_SIZE)
+        return js_pool_malloc(rt, size);
+    ptr = rt->mf.js_malloc(&rt->malloc_state, size);
+    if (unlikely(!js_ptr_fits_value(ptr))) {
+        rt->mf.js_free(&rt->malloc_state, ptr);
+        return NULL;
+    }
+    return ptr;
 }
 
 void js_free_rt(JSRuntime *rt, void *ptr)
 {
+    JSPoolChunk *c;
+    if (rt->pool && ptr) {
+        c = js_pool_find_chunk(rt->pool, ptr);
+        if (c) {
+            js_pool_free(rt, c, ptr);
+            return;
+        }
+    }
     rt->mf.js_free(&rt->malloc_state, ptr);
 }
 
 void *js_realloc_rt(JSRuntime *rt, void *ptr, size_t size)
 {
-    return rt->mf.js_realloc(&rt->malloc_state, ptr, size);
+    JSPoolChunk *c;
+    if (rt->pool) {
+        if (!ptr) {
+            if (size == 0)
+                return NULL;
+            return js_malloc_rt(rt, size);
+        }
+        c = js_pool_find_chunk(rt->pool, ptr);
+        if (c)
+            return js_pool_realloc(rt, c, ptr, size);
+    }
+#ifdef JS_NAN_BOXING64
+    if (ptr && size != 0) {
+        size_t old_size;
+        void *new_ptr;
+        /* realloc() could move the block out of reach after freeing
+           it, so the block is moved with the checked allocation path
+           when its size is known */
+        old_size = rt->mf.js_malloc_usable_size(ptr);
+        if (old_size != 0) {
+            if (size <= old_size && size >= old_size / 2)
+                return ptr;
+            new_ptr = js_malloc_rt(rt, size);
+            if (!new_ptr)
+                return NULL;
+            memcpy(new_ptr, ptr, size < old_size ? size : old_size);
+            rt->mf.js_free(&rt->malloc_state, ptr);
+            return new_ptr;
+        }
+    }
+#endif
+    ptr = rt->mf.js_realloc(&rt->malloc_state, ptr, size);
+    if (unlikely(!js_ptr_fits_value(ptr))) {
+        void *new_ptr;
+        /* unknown block size: copy the moved block if possible */
+        new_ptr = js_malloc_rt(rt, size);
+        if (new_ptr)
+            memcpy(new_ptr, ptr, size);
+        rt->mf.js_free(&rt->malloc_state, ptr);
+        ptr = new_ptr;
+    }
+    return ptr;
 }
 
 size_t js_malloc_usable_size_rt(JSRuntime *rt, const void *ptr)
 {
+    JSPoolChunk *c;
+    if (rt->pool) {
+        c = js_pool_find_chunk(rt->pool, ptr);
+        if (c)
+            return c->block_size;
+    }
     return rt->mf.js_malloc_usable_size(ptr);
 }
 
@@ -1524,7 +2088,7 @@ static void *js_realloc_bytecode_rt(void *opaque, void *ptr, size_t size)
            avoid some overflows. */
         return NULL;
     } else {
-        return rt->mf.js_realloc(&rt->malloc_state, ptr, size);
+        return js_realloc_rt(rt, ptr, size);
     }
 }
 
@@ -1537,8 +2101,20 @@ static inline int is_digit(int c) {
     return c >= '0' && c <= '9';
 }
 
+static inline const uint8_t *string_ptr8(const JSString *p) {
+    if (unlikely(p->is_ref))
+        return ((const JSStringRef *)p)->ptr;
+    return p->u.str8;
+}
+
+static inline const uint16_t *string_ptr16(const JSString *p) {
+    if (unlikely(p->is_ref))
+        return ((const JSStringRef *)p)->ptr;
+    return p->u.str16;
+}
+
 static inline int string_get(const JSString *p, int idx) {
-    return p->is_wide_char ? p->u.str16[idx] : p->u.str8[idx];
+    return p->is_wide_char ? string_ptr16(p)[idx] : string_ptr8(p)[idx];
 }
 
 typedef struct JSClassShortDef {
@@ -1673,6 +2249,8 @@ JSRuntime *JS_NewRuntime2(const JSMallocFunctions *mf, void *opaque)
     init_list_head(&rt->string_list);
 #endif
     init_list_head(&rt->job_list);
+    init_list_head(&rt->regexp_cache_list);
+    rt->regexp_cache_size = JS_DEFAULT_REGEXP_CACHE_SIZE;
 
     if (JS_InitAtoms(rt))
         goto fail;
@@ -1697,6 +2275,7 @@ JSRuntime *JS_NewRuntime2(const JSMallocFunctions *mf, void *opaque)
     JS_UpdateStackTop(rt);
 
     rt->current_exception = JS_UNINITIALIZED;
+    rt->tail_calls = TRUE;
 
     return rt;
  fail:
@@ -1799,6 +2378,21 @@ JSRuntime *JS_NewRuntime(void)
     return JS_NewRuntime2(&def_malloc_funcs, NULL);
 }
 
+/* 'mf' = NULL selects the default allocator */
+JSRuntime *JS_NewRuntimeWithPools(const JSMallocFunctions *mf, void *opaque)
+{
+    JSRuntime *rt;
+
+    rt = JS_NewRuntime2(mf ? mf : &def_malloc_funcs, opaque);
+    if (!rt)
+        return NULL;
+    if (js_pool_init(rt)) {
+        JS_FreeRuntime(rt);
+        return NULL;
+    }
+    return rt;
+}
+
 void JS_SetMemoryLimit(JSRuntime *rt, size_t limit)
 {
     rt->malloc_state.malloc_limit = limit;
@@ -1810,6 +2404,17 @@ void JS_SetGCThreshold(JSRuntime *rt, size_t gc_threshold)
     rt->malloc_gc_threshold = gc_threshold;
 }
 
+void JS_SetGCMode(JSRuntime *rt, JSGCModeEnum mode)
+{
+    rt->gc_mode = mode;
+}
+
+void JS_SetRegExpCacheSize(JSRuntime *rt, int size)
+{
+    regexp_cache_clear(rt);
+    rt->regexp_cache_size = max_int(size, 0);
+}
+
 #define malloc(s) malloc_is_forbidden(s)
 #define free(p) free_is_forbidden(p)
 #define realloc(p,s) realloc_is_forbidden(p,s)
@@ -1825,6 +2430,11 @@ void JS_SetCanBlock(JSRuntime *rt, BOOL can_block)
     rt->can_block = can_block;
 }
 
+void JS_SetTailCalls(JSRuntime *rt, BOOL enable)
+{
+    rt->tail_calls = enable;
+}
+
 void JS_SetSharedArrayBufferFunctions(JSRuntime *rt,
                                       const JSSharedArrayBufferFunctions *sf)
 {
@@ -1932,6 +2542,7 @@ static JSString *js_alloc_string_rt(JSRuntime *rt, int max_len, int is_wide_char
         return NULL;
     str->header.ref_count = 1;
     str->is_wide_char = is_wide_char;
+    str->is_ref = 0;
     str->len = max_len;
     str->atom_type = 0;
     str->hash = 0;          /* optional but costless */
@@ -1953,6 +2564,8 @@ static JSString *js_alloc_string(JSContext *ctx, int max_len, int is_wide_char)
     return p;
 }
 
+static void js_free_string_ref(JSRuntime *rt, JSStringRef *r);
+
 /* same as JS_FreeValueRT() but faster */
 static inline void js_free_string(JSRuntime *rt, JSString *str)
 {
@@ -1963,11 +2576,46 @@ static inline void js_free_string(JSRuntime *rt, JSString *str)
 #ifdef DUMP_LEAKS
             list_del(&str->link);
 #endif
+            if (unlikely(str->is_ref))
+                js_free_string_ref(rt, (JSStringRef *)str);
             js_free_rt(rt, str);
         }
     }
 }
 
+/* release the characters referenced by 'r' */
+static void js_free_string_ref(JSRuntime *rt, JSStringRef *r)
+{
+    if (r->parent)
+        js_free_string(rt, r->parent);
+    else if (r->free_func)
+        r->free_func(rt, r->opaque, (void *)r->ptr);
+}
+
+static JSStringRef *js_alloc_string_ref(JSContext *ctx, const void *ptr,
+                                        int len, int is_wide_char)
+{
+    JSStringRef *r;
+    r = js_malloc(ctx, sizeof(JSStringRef));
+    if (unlikely(!r))
+        return NULL;
+    r->str.header.ref_count = 1;
+    r->str.is_wide_char = is_wide_char;
+    r->str.is_ref = 1;
+    r->str.len = len;
+    r->str.atom_type = 0;
+    r->str.hash = 0;
+    r->str.hash_next = 0;
+#ifdef DUMP_LEAKS
+    list_add_tail(&r->str.link, &ctx->rt->string_list);
+#endif
+    r->ptr = ptr;
+    r->parent = NULL;
+    r->free_func = NULL;
+    r->opaque = NULL;
+    return r;
+}
+
 void JS_SetRuntimeInfo(JSRuntime *rt, const char *s)
 {
     if (rt)
@@ -1981,6 +2629,12 @@ void JS_FreeRuntime(JSRuntime *rt)
 
     JS_FreeValueRT(rt, rt->current_exception);
 
+    for(i = 0; i < countof(rt->char_strings); i++) {
+        if (rt->char_strings[i])
+            JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_STRING, rt->char_strings[i]));
+    }
+    regexp_cache_clear(rt);
+
     list_for_each_safe(el, el1, &rt->job_list) {
         JSJobEntry *e = list_entry(el, JSJobEntry, link);
         for(i = 0; i < e->argc; i++)
@@ -1992,7 +2646,7 @@ void JS_FreeRuntime(JSRuntime *rt)
 
     /* don't remove the weak objects to avoid create new jobs with
        FinalizationRegistry */
-    JS_RunGCInternal(rt, FALSE);
+    JS_RunGCInternal(rt, FALSE, FALSE);
 
 #ifdef DUMP_LEAKS
     /* leaking objects */
@@ -2007,7 +2661,7 @@ void JS_FreeRuntime(JSRuntime *rt)
             p = list_entry(el, JSGCObjectHeader, link);
             p->mark = 0;
         }
-        gc_decref(rt);
+        gc_decref(rt, &rt->gc_obj_list, FALSE);
 
         header_done = FALSE;
         list_for_each(el, &rt->gc_obj_list) {
@@ -2144,6 +2798,11 @@ void JS_FreeRuntime(JSRuntime *rt)
         if (rt->rt_info)
             printf("\n");
     }
+#endif
+
+    js_pool_free_all(rt);
+
+#ifdef DUMP_LEAKS
     {
         JSMallocState *s = &rt->malloc_state;
         if (s->malloc_count > 1) {
@@ -2162,7 +2821,8 @@ void JS_FreeRuntime(JSRuntime *rt)
     }
 }
 
-JSContext *JS_NewContextRaw(JSRuntime *rt)
+/* context without any object */
+static JSContext *JS_NewContext0(JSRuntime *rt)
 {
     JSContext *ctx;
     int i;
@@ -2188,7 +2848,16 @@ JSContext *JS_NewContextRaw(JSRuntime *rt)
     ctx->regexp_ctor = JS_NULL;
     ctx->promise_ctor = JS_NULL;
     init_list_head(&ctx->loaded_modules);
+    return ctx;
+}
+
+JSContext *JS_NewContextRaw(JSRuntime *rt)
+{
+    JSContext *ctx;
 
+    ctx = JS_NewContext0(rt);
+    if (!ctx)
+        return NULL;
     if (JS_AddIntrinsicBasicObjects(ctx)) {
         JS_FreeContext(ctx);
         return NULL;
@@ -2444,7 +3113,7 @@ static inline BOOL is_strict_mode(JSContext *ctx)
 #define JS_ATOM_MAX     ((1U << 30) - 1)
 
 /* return the max count from the hash size */
-#define JS_ATOM_COUNT_RESIZE(n) ((n) * 2)
+#define JS_ATOM_COUNT_RESIZE(n) ((n) / 4 * 3)
 
 static inline BOOL __JS_AtomIsConst(JSAtom v)
 {
@@ -2510,12 +3179,23 @@ static inline BOOL is_num_string(uint32_t *pval, const JSString *p)
     }
 }
 
-/* XXX: could use faster version ? */
+/* The characters are combined 4 at a time so that the multiplications
+   do not depend on each other. The result is the same as 'h = h * 263 +
+   c' for each character, so 8 bit and 16 bit strings with the same
+   content have the same hash. */
+#define HASH_K2 (263u * 263u)
+#define HASH_K3 (HASH_K2 * 263u)
+#define HASH_K4 (HASH_K3 * 263u)
+
 static inline uint32_t hash_string8(const uint8_t *str, size_t len, uint32_t h)
 {
     size_t i;
 
-    for(i = 0; i < len; i++)
+    for(i = 0; i + 4 <= len; i += 4) {
+        h = h * HASH_K4 + str[i] * HASH_K3 + str[i + 1] * HASH_K2 +
+            str[i + 2] * 263u + str[i + 3];
+    }
+    for(; i < len; i++)
         h = h * 263 + str[i];
     return h;
 }
@@ -2525,7 +3205,11 @@ static inline uint32_t hash_string16(const uint16_t *str,
 {
     size_t i;
 
-    for(i = 0; i < len; i++)
+    for(i = 0; i + 4 <= len; i += 4) {
+        h = h * HASH_K4 + str[i] * HASH_K3 + str[i + 1] * HASH_K2 +
+            str[i + 2] * 263u + str[i + 3];
+    }
+    for(; i < len; i++)
         h = h * 263 + str[i];
     return h;
 }
@@ -2533,9 +3217,32 @@ static inline uint32_t hash_string16(const uint16_t *str,
 static uint32_t hash_string(const JSString *str, uint32_t h)
 {
     if (str->is_wide_char)
-        h = hash_string16(str->u.str16, str->len, h);
+        h = hash_string16(string_ptr16(str), str->len, h);
     else
-        h = hash_string8(str->u.str8, str->len, h);
+        h = hash_string8(string_ptr8(str), str->len, h);
+    return h;
+}
+
+static inline BOOL js_string_has_hash(const JSString *p)
+{
+    return p->atom_type == JS_ATOM_TYPE_STRING ||
+        (p->atom_type == 0 && p->hash_next != 0);
+}
+
+/* return the hash of the string content, as used for the string
+   atoms. It is cached in 'hash' for non atom strings, 'hash_next != 0'
+   indicating that it is valid. */
+static uint32_t js_string_hash(JSString *p)
+{
+    uint32_t h;
+
+    if (js_string_has_hash(p))
+        return p->hash;
+    h = hash_string(p, JS_ATOM_TYPE_STRING) & JS_ATOM_HASH_MASK;
+    if (p->atom_type == 0) {
+        p->hash = h;
+        p->hash_next = 1;
+    }
     return h;
 }
 
@@ -2591,15 +3298,11 @@ static __maybe_unused void JS_DumpAtoms(JSRuntime *rt)
            rt->atom_count, rt->atom_size, rt->atom_hash_size);
     printf("JSAtom hash table: {\n");
     for(i = 0; i < rt->atom_hash_size; i++) {
-        h = rt->atom_hash[i];
+        h = rt->atom_hash[i].atom;
         if (h) {
-            printf("  %d:", i);
-            while (h) {
-                p = rt->atom_array[h];
-                printf(" ");
-                JS_DumpString(rt, p);
-                h = p->hash_next;
-            }
+            p = rt->atom_array[h];
+            printf("  %d: %d ", i, rt->atom_hash[i].hash & (rt->atom_hash_size - 1));
+            JS_DumpString(rt, p);
             printf("\n");
         }
     }
@@ -2619,8 +3322,8 @@ static __maybe_unused void JS_DumpAtoms(JSRuntime *rt)
 
 static int JS_ResizeAtomHash(JSRuntime *rt, int new_hash_size)
 {
-    JSAtomStruct *p;
-    uint32_t new_hash_mask, h, i, hash_next1, j, *new_hash;
+    JSAtomHashEntry *e, *new_hash;
+    uint32_t new_hash_mask, i, j;
 
     assert((new_hash_size & (new_hash_size - 1)) == 0); /* power of two */
     new_hash_mask = new_hash_size - 1;
@@ -2628,15 +3331,13 @@ static int JS_ResizeAtomHash(JSRuntime *rt, int new_hash_size)
     if (!new_hash)
         return -1;
     for(i = 0; i < rt->atom_hash_size; i++) {
-        h = rt->atom_hash[i];
-        while (h != 0) {
-            p = rt->atom_array[h];
-            hash_next1 = p->hash_next;
+        e = &rt->atom_hash[i];
+        if (e->atom != JS_ATOM_NULL) {
             /* add in new hash table */
-            j = p->hash & new_hash_mask;
-            p->hash_next = new_hash[j];
-            new_hash[j] = h;
-            h = hash_next1;
+            j = e->hash & new_hash_mask;
+            while (new_hash[j].atom != JS_ATOM_NULL)
+                j = (j + 1) & new_hash_mask;
+            new_hash[j] = *e;
         }
     }
     js_free_rt(rt, rt->atom_hash);
@@ -2657,7 +3358,7 @@ static int JS_InitAtoms(JSRuntime *rt)
     rt->atom_count = 0;
     rt->atom_size = 0;
     rt->atom_free_index = 0;
-    if (JS_ResizeAtomHash(rt, 512))     /* there are at least 504 predefined atoms */
+    if (JS_ResizeAtomHash(rt, 1024))     /* there are at least 504 predefined atoms */
         return -1;
 
     p = js_atom_init;
@@ -2731,19 +3432,7 @@ static BOOL JS_AtomIsString(JSContext *ctx, JSAtom v)
 
 static JSAtom js_get_atom_index(JSRuntime *rt, JSAtomStruct *p)
 {
-    uint32_t i = p->hash_next;  /* atom_index */
-    if (p->atom_type != JS_ATOM_TYPE_SYMBOL) {
-        JSAtomStruct *p1;
-
-        i = rt->atom_hash[p->hash & (rt->atom_hash_size - 1)];
-        p1 = rt->atom_array[i];
-        while (p1 != p) {
-            assert(i != 0);
-            i = p1->hash_next;
-            p1 = rt->atom_array[i];
-        }
-    }
-    return i;
+    return p->hash_next;  /* atom_index */
 }
 
 /* string case (internal). Return JS_ATOM_NULL if error. 'str' is
@@ -2752,6 +3441,7 @@ static JSAtom __JS_NewAtom(JSRuntime *rt, JSString *str, int atom_type)
 {
     uint32_t h, h1, i;
     JSAtomStruct *p;
+    JSAtomHashEntry *e;
     int len;
 
 #if 0
@@ -2767,24 +3457,39 @@ static JSAtom __JS_NewAtom(JSRuntime *rt, JSString *str, int atom_type)
                 str->header.ref_count--;
             return i;
         }
+        if (unlikely(rt->atom_count >= rt->atom_count_resize)) {
+            /* at least one entry must stay empty to end the probing */
+            if (JS_ResizeAtomHash(rt, rt->atom_hash_size * 2) &&
+                rt->atom_count + 1 >= rt->atom_hash_size)
+                goto fail;
+        }
         /* try and locate an already registered atom */
         len = str->len;
-        h = hash_string(str, atom_type);
-        h &= JS_ATOM_HASH_MASK;
+        if (atom_type == JS_ATOM_TYPE_STRING) {
+            h = js_string_hash(str);
+        } else {
+            h = hash_string(str, atom_type);
+            h &= JS_ATOM_HASH_MASK;
+        }
         h1 = h & (rt->atom_hash_size - 1);
-        i = rt->atom_hash[h1];
-        while (i != 0) {
-            p = rt->atom_array[i];
-            if (p->hash == h &&
-                p->atom_type == atom_type &&
-                p->len == len &&
-                js_string_memcmp(p, 0, str, 0, len) == 0) {
-                if (!__JS_AtomIsConst(i))
-                    p->header.ref_count++;
-                goto done;
+        for(;;) {
+            e = &rt->atom_hash[h1];
+            i = e->atom;
+            if (i == JS_ATOM_NULL)
+                break;
+            if (e->hash == h) {
+                p = rt->atom_array[i];
+                if (p->atom_type == atom_type &&
+                    p->len == len &&
+                    js_string_memcmp(p, 0, str, 0, len) == 0) {
+                    if (!__JS_AtomIsConst(i))
+                        p->header.ref_count++;
+                    goto done;
+                }
             }
-            i = p->hash_next;
+            h1 = (h1 + 1) & (rt->atom_hash_size - 1);
         }
+        /* h1 is the free entry where the atom can be inserted */
     } else {
         h1 = 0; /* avoid warning */
         if (atom_type == JS_ATOM_TYPE_SYMBOL) {
@@ -2843,10 +3548,11 @@ static JSAtom __JS_NewAtom(JSRuntime *rt, JSString *str, int atom_type)
     }
 
     if (str) {
-        if (str->atom_type == 0) {
+        if (str->atom_type == 0 && !str->is_ref) {
             p = str;
             p->atom_type = atom_type;
         } else {
+            /* atoms always hold their characters */
             p = js_malloc_rt(rt, sizeof(JSString) +
                              (str->len << str->is_wide_char) +
                              1 - str->is_wide_char);
@@ -2854,12 +3560,14 @@ static JSAtom __JS_NewAtom(JSRuntime *rt, JSString *str, int atom_type)
                 goto fail;
             p->header.ref_count = 1;
             p->is_wide_char = str->is_wide_char;
+            p->is_ref = 0;
             p->len = str->len;
 #ifdef DUMP_LEAKS
             list_add_tail(&p->link, &rt->string_list);
 #endif
-            memcpy(p->u.str8, str->u.str8, (str->len << str->is_wide_char) +
-                   1 - str->is_wide_char);
+            memcpy(p->u.str8, string_ptr8(str), str->len << str->is_wide_char);
+            if (!str->is_wide_char)
+                p->u.str8[str->len] = '\0';
             js_free_string(rt, str);
         }
     } else {
@@ -2868,6 +3576,7 @@ static JSAtom __JS_NewAtom(JSRuntime *rt, JSString *str, int atom_type)
             return JS_ATOM_NULL;
         p->header.ref_count = 1;
         p->is_wide_char = 1;    /* Hack to represent NULL as a JSString */
+        p->is_ref = 0;
         p->len = 0;
 #ifdef DUMP_LEAKS
         list_add_tail(&p->link, &rt->string_list);
@@ -2886,10 +3595,9 @@ static JSAtom __JS_NewAtom(JSRuntime *rt, JSString *str, int atom_type)
     rt->atom_count++;
 
     if (atom_type != JS_ATOM_TYPE_SYMBOL) {
-        p->hash_next = rt->atom_hash[h1];
-        rt->atom_hash[h1] = i;
-        if (unlikely(rt->atom_count >= rt->atom_count_resize))
-            JS_ResizeAtomHash(rt, rt->atom_hash_size * 2);
+        e = &rt->atom_hash[h1];
+        e->hash = h;
+        e->atom = i;
     }
 
     //    JS_DumpAtoms(rt);
@@ -2922,23 +3630,28 @@ static JSAtom __JS_FindAtom(JSRuntime *rt, const char *str, size_t len,
 {
     uint32_t h, h1, i;
     JSAtomStruct *p;
+    JSAtomHashEntry *e;
 
     h = hash_string8((const uint8_t *)str, len, JS_ATOM_TYPE_STRING);
     h &= JS_ATOM_HASH_MASK;
     h1 = h & (rt->atom_hash_size - 1);
-    i = rt->atom_hash[h1];
-    while (i != 0) {
-        p = rt->atom_array[i];
-        if (p->hash == h &&
-            p->atom_type == JS_ATOM_TYPE_STRING &&
-            p->len == len &&
-            p->is_wide_char == 0 &&
-            memcmp(p->u.str8, str, len) == 0) {
-            if (!__JS_AtomIsConst(i))
-                p->header.ref_count++;
-            return i;
+    for(;;) {
+        e = &rt->atom_hash[h1];
+        i = e->atom;
+        if (i == JS_ATOM_NULL)
+            break;
+        if (e->hash == h) {
+            p = rt->atom_array[i];
+            if (p->atom_type == JS_ATOM_TYPE_STRING &&
+                p->len == len &&
+                p->is_wide_char == 0 &&
+                memcmp(p->u.str8, str, len) == 0) {
+                if (!__JS_AtomIsConst(i))
+                    p->header.ref_count++;
+                return i;
+            }
         }
-        i = p->hash_next;
+        h1 = (h1 + 1) & (rt->atom_hash_size - 1);
     }
     return JS_ATOM_NULL;
 }
@@ -2953,26 +3666,30 @@ static void JS_FreeAtomStruct(JSRuntime *rt, JSAtomStruct *p)
 #endif
     uint32_t i = p->hash_next;  /* atom_index */
     if (p->atom_type != JS_ATOM_TYPE_SYMBOL) {
-        JSAtomStruct *p0, *p1;
-        uint32_t h0;
-
-        h0 = p->hash & (rt->atom_hash_size - 1);
-        i = rt->atom_hash[h0];
-        p1 = rt->atom_array[i];
-        if (p1 == p) {
-            rt->atom_hash[h0] = p1->hash_next;
-        } else {
-            for(;;) {
-                assert(i != 0);
-                p0 = p1;
-                i = p1->hash_next;
-                p1 = rt->atom_array[i];
-                if (p1 == p) {
-                    p0->hash_next = p1->hash_next;
-                    break;
-                }
+        JSAtomHashEntry *tab = rt->atom_hash;
+        uint32_t mask, h0, h1, k;
+
+        mask = rt->atom_hash_size - 1;
+        h0 = p->hash & mask;
+        while (tab[h0].atom != i) {
+            assert(tab[h0].atom != JS_ATOM_NULL);
+            h0 = (h0 + 1) & mask;
+        }
+        /* move back the following entries of the probe sequence so
+           that no empty entry is left in it */
+        h1 = h0;
+        for(;;) {
+            h1 = (h1 + 1) & mask;
+            if (tab[h1].atom == JS_ATOM_NULL)
+                break;
+            k = tab[h1].hash & mask;
+            /* the entry stays if its home position is in ]h0, h1] */
+            if (((h1 - k) & mask) >= ((h1 - h0) & mask)) {
+                tab[h0] = tab[h1];
+                h0 = h1;
             }
         }
+        tab[h0].atom = JS_ATOM_NULL;
     }
     /* insert in free atom list */
     rt->atom_array[i] = atom_set_free(rt->atom_free_index);
@@ -3017,17 +3734,6 @@ static JSAtom JS_NewAtomStr(JSContext *ctx, JSString *p)
     return __JS_NewAtom(rt, p, JS_ATOM_TYPE_STRING);
 }
 
-/* XXX: optimize */
-static size_t count_ascii(const uint8_t *buf, size_t len)
-{
-    const uint8_t *p, *p_end;
-    p = buf;
-    p_end = buf + len;
-    while (p < p_end && *p < 128)
-        p++;
-    return p - buf;
-}
-
 /* str is UTF-8 encoded */
 JSAtom JS_NewAtomLen(JSContext *ctx, const char *str, size_t len)
 {
@@ -3492,6 +4198,26 @@ int JS_NewClass(JSRuntime *rt, JSClassID class_id, const JSClassDef *class_def)
     return ret;
 }
 
+/* return the string made of the Latin-1 character 'c'. These strings
+   are shared so that character level code does not allocate. */
+static JSValue js_new_string_char8(JSContext *ctx, uint8_t c)
+{
+    JSRuntime *rt = ctx->rt;
+    JSString *str;
+
+    str = rt->char_strings[c];
+    if (unlikely(!str)) {
+        str = js_alloc_string(ctx, 1, 0);
+        if (!str)
+            return JS_EXCEPTION;
+        str->u.str8[0] = c;
+        str->u.str8[1] = '\0';
+        rt->char_strings[c] = str;
+    }
+    str->header.ref_count++;
+    return JS_MKPTR(JS_TAG_STRING, str);
+}
+
 static JSValue js_new_string8_len(JSContext *ctx, const char *buf, int len)
 {
     JSString *str;
@@ -3499,6 +4225,8 @@ static JSValue js_new_string8_len(JSContext *ctx, const char *buf, int len)
     if (len <= 0) {
         return JS_AtomToString(ctx, JS_ATOM_empty_string);
     }
+    if (len == 1)
+        return js_new_string_char8(ctx, buf[0]);
     str = js_alloc_string(ctx, len, 0);
     if (!str)
         return JS_EXCEPTION;
@@ -3525,43 +4253,79 @@ static JSValue js_new_string16_len(JSContext *ctx, const uint16_t *buf, int len)
 static JSValue js_new_string_char(JSContext *ctx, uint16_t c)
 {
     if (c < 0x100) {
-        uint8_t ch8 = c;
-        return js_new_string8_len(ctx, (const char *)&ch8, 1);
+        return js_new_string_char8(ctx, c);
     } else {
         uint16_t ch16 = c;
         return js_new_string16_len(ctx, &ch16, 1);
     }
 }
 
+/* return a string referencing the characters of 'p' from 'start' or
+   JS_UNDEFINED if they should be copied */
+static JSValue js_new_string_slice(JSContext *ctx, JSString *p, int start,
+                                   int len)
+{
+    JSStringRef *r;
+    JSString *parent;
+
+    parent = p;
+    if (p->is_ref && ((JSStringRef *)p)->parent)
+        parent = ((JSStringRef *)p)->parent;
+    if (len < JS_STRING_SLICE_MIN_LEN ||
+        len < parent->len / JS_STRING_SLICE_MAX_RATIO)
+        return JS_UNDEFINED;
+    r = js_alloc_string_ref(ctx, string_ptr8(p) + (start << p->is_wide_char),
+                            len, p->is_wide_char);
+    if (!r)
+        return JS_EXCEPTION;
+    parent->header.ref_count++;
+    r->parent = parent;
+    return JS_MKPTR(JS_TAG_STRING, &r->str);
+}
+
 static JSValue js_sub_string(JSContext *ctx, JSString *p, int start, int end)
 {
     int len = end - start;
+    JSValue ret;
+
     if (start == 0 && end == p->len) {
         return JS_DupValue(ctx, JS_MKPTR(JS_TAG_STRING, p));
     }
     if (p->is_wide_char && len > 0) {
         JSString *str;
+        const uint16_t *src = string_ptr16(p);
         int i;
         uint16_t c = 0;
         for (i = start; i < end; i++) {
-            c |= p->u.str16[i];
+            c |= src[i];
         }
-        if (c > 0xFF)
-            return js_new_string16_len(ctx, p->u.str16 + start, len);
+        if (c > 0xFF) {
+            ret = js_new_string_slice(ctx, p, start, len);
+            if (!JS_IsUndefined(ret))
+                return ret;
+            return js_new_string16_len(ctx, src + start, len);
+        }
+        if (len == 1)
+            return js_new_string_char8(ctx, c);
 
         str = js_alloc_string(ctx, len, 0);
         if (!str)
             return JS_EXCEPTION;
         for (i = 0; i < len; i++) {
-            str->u.str8[i] = p->u.str16[start + i];
+            str->u.str8[i] = src[start + i];
         }
         str->u.str8[len] = '\0';
         return JS_MKPTR(JS_TAG_STRING, str);
     } else {
-        return js_new_string8_len(ctx, (const char *)(p->u.str8 + start), len);
+        ret = js_new_string_slice(ctx, p, start, len);
+        if (!JS_IsUndefined(ret))
+            return ret;
+        return js_new_string8_len(ctx, (const char *)(string_ptr8(p) + start), len);
     }
 }
 
+typedef struct UTF8Writer UTF8Writer;
+
 typedef struct StringBuffer {
     JSContext *ctx;
     JSString *str;
@@ -3569,8 +4333,13 @@ typedef struct StringBuffer {
     int size;
     int is_wide_char;
     int error_status;
+    /* if not NULL, the content is output to it when the buffer is
+       full instead of growing the buffer */
+    UTF8Writer *writer;
 } StringBuffer;
 
+static void utf8_writer_string(UTF8Writer *w, const JSString *p);
+
 /* It is valid to call string_buffer_end() and all string_buffer functions even
    if string_buffer_init() or another string_buffer function returns an error.
    If the error_status is set, string_buffer_end() returns JS_EXCEPTION.
@@ -3583,6 +4352,7 @@ static int string_buffer_init2(JSContext *ctx, StringBuffer *s, int size,
     s->len = 0;
     s->is_wide_char = is_wide;
     s->error_status = 0;
+    s->writer = NULL;
     s->str = js_alloc_string(ctx, size, is_wide);
     if (unlikely(!s->str)) {
         s->size = 0;
@@ -3637,6 +4407,16 @@ static no_inline int string_buffer_widen(StringBuffer *s, int size)
     return 0;
 }
 
+/* output the content of the buffer to its writer and empty it. The
+   buffer must not be in the error state (s->str is NULL). */
+static void string_buffer_flush(StringBuffer *s)
+{
+    s->str->len = s->len;
+    s->str->is_wide_char = s->is_wide_char;
+    utf8_writer_string(s->writer, s->str);
+    s->len = 0;
+}
+
 static no_inline int string_buffer_realloc(StringBuffer *s, int new_len, int c)
 {
     JSString *new_str;
@@ -3646,6 +4426,14 @@ static no_inline int string_buffer_realloc(StringBuffer *s, int new_len, int c)
     if (s->error_status)
         return -1;
 
+    /* error_status is checked above */
+    if (s->writer) {
+        new_len -= s->len;
+        string_buffer_flush(s);
+        if (new_len <= s->size && (s->is_wide_char || c < 0x100))
+            return 0;
+    }
+
     if (new_len > JS_STRING_LEN_MAX) {
         JS_ThrowInternalError(s->ctx, "string too long");
         return string_buffer_set_error(s);
@@ -3749,16 +4537,16 @@ static int string_getc(const JSString *p, int *pidx)
     int idx, c, c1;
     idx = *pidx;
     if (p->is_wide_char) {
-        c = p->u.str16[idx++];
+        c = string_ptr16(p)[idx++];
         if (is_hi_surrogate(c) && idx < p->len) {
-            c1 = p->u.str16[idx];
+            c1 = string_ptr16(p)[idx];
             if (is_lo_surrogate(c1)) {
                 c = from_surrogate(c, c1);
                 idx++;
             }
         }
     } else {
-        c = p->u.str8[idx++];
+        c = string_ptr8(p)[idx++];
     }
     *pidx = idx;
     return c;
@@ -3822,9 +4610,9 @@ static int string_buffer_concat(StringBuffer *s, const JSString *p,
     if (to <= from)
         return 0;
     if (p->is_wide_char)
-        return string_buffer_write16(s, p->u.str16 + from, to - from);
+        return string_buffer_write16(s, string_ptr16(p) + from, to - from);
     else
-        return string_buffer_write8(s, p->u.str8 + from, to - from);
+        return string_buffer_write8(s, string_ptr8(p) + from, to - from);
 }
 
 static int string_buffer_concat_value(StringBuffer *s, JSValueConst v)
@@ -3858,6 +4646,33 @@ static int string_buffer_concat_value(StringBuffer *s, JSValueConst v)
     return string_buffer_concat(s, p, 0, p->len);
 }
 
+/* append the characters [start, end) of the string or rope 'v' */
+static int string_buffer_concat_rope_range(StringBuffer *s, JSValueConst v,
+                                           uint32_t start, uint32_t end)
+{
+    JSStringRope *r;
+    uint32_t len;
+
+    if (JS_VALUE_GET_TAG(v) == JS_TAG_STRING)
+        return string_buffer_concat(s, JS_VALUE_GET_STRING(v), start, end);
+    r = JS_VALUE_GET_STRING_ROPE(v);
+    if (JS_VALUE_GET_TAG(r->left) == JS_TAG_STRING)
+        len = JS_VALUE_GET_STRING(r->left)->len;
+    else
+        len = JS_VALUE_GET_STRING_ROPE(r->left)->len;
+    /* recursion is acceptable because the rope depth is bounded */
+    if (start < len) {
+        if (string_buffer_concat_rope_range(s, r->left, start, min_uint32(end, len)))
+            return -1;
+    }
+    if (end > len) {
+        return string_buffer_concat_rope_range(s, r->right,
+                                               max_uint32(start, len) - len,
+                                               end - len);
+    }
+    return 0;
+}
+
 static int string_buffer_concat_value_free(StringBuffer *s, JSValue v)
 {
     JSString *p;
@@ -3904,6 +4719,12 @@ static JSValue string_buffer_end(StringBuffer *s)
         s->str = NULL;
         return JS_AtomToString(s->ctx, JS_ATOM_empty_string);
     }
+    if (s->len == 1 && !s->is_wide_char) {
+        uint8_t c = str->u.str8[0];
+        js_free(s->ctx, str);
+        s->str = NULL;
+        return js_new_string_char8(s->ctx, c);
+    }
     if (s->len < s->size) {
         /* smaller size so js_realloc should not fail, but OK if it does */
         /* XXX: should add some slack to avoid unnecessary calls */
@@ -3926,12 +4747,64 @@ static JSValue string_buffer_end(StringBuffer *s)
 }
 
 /* create a string from a UTF-8 buffer */
+/* decode the valid UTF-8 string 'buf' of 'len' characters, 'is_wide'
+   is FALSE if they are all Latin-1 characters */
+static JSValue js_new_string_utf8(JSContext *ctx, const uint8_t *buf,
+                                  size_t buf_len, size_t len, BOOL is_wide)
+{
+    const uint8_t *p, *p_end, *p_next;
+    JSString *str;
+    size_t n, i;
+    uint32_t c;
+
+    str = js_alloc_string(ctx, len, is_wide);
+    if (!str)
+        return JS_EXCEPTION;
+    p = buf;
+    p_end = buf + buf_len;
+    if (!is_wide) {
+        uint8_t *q = str->u.str8;
+        while (p < p_end) {
+            n = count_ascii(p, p_end - p);
+            memcpy(q, p, n);
+            q += n;
+            p += n;
+            /* only 2 byte sequences for Latin-1 characters */
+            while (p < p_end && *p >= 0x80) {
+                *q++ = ((p[0] & 0x1f) << 6) | (p[1] & 0x3f);
+                p += 2;
+            }
+        }
+        *q = '\0';
+    } else {
+        uint16_t *q = str->u.str16;
+        while (p < p_end) {
+            n = count_ascii(p, p_end - p);
+            for(i = 0; i < n; i++)
+                q[i] = p[i];
+            q += n;
+            p += n;
+            while (p < p_end && *p >= 0x80) {
+                c = unicode_from_utf8(p, p_end - p, &p_next);
+                p = p_next;
+                if (c >= 0x10000) {
+                    *q++ = get_hi_surrogate(c);
+                    c = get_lo_surrogate(c);
+                }
+                *q++ = c;
+            }
+        }
+    }
+    return JS_MKPTR(JS_TAG_STRING, str);
+}
+
 JSValue JS_NewStringLen(JSContext *ctx, const char *buf, size_t buf_len)
 {
     const uint8_t *p, *p_end, *p_start, *p_next;
     uint32_t c;
     StringBuffer b_s, *b = &b_s;
-    size_t len1;
+    size_t len1, len;
+    BOOL is_wide;
 
     p_start = (const uint8_t *)buf;
     p_end = p_start + buf_len;
@@ -3943,6 +4816,38 @@ JSValue JS_NewStringLen(JSContext *ctx, const char *buf, size_t buf_len)
         /* ASCII string */
         return js_new_string8_len(ctx, buf, buf_len);
     } else {
+        /* compute the length and the width of the result so that it
+           can be decoded without reallocation. Invalid UTF-8 sequences
+           are handled by the generic loop below. */
+        len = len1;
+        is_wide = FALSE;
+        while (p < p_end) {
+            if (*p < 0x80) {
+                len1 = count_ascii(p, p_end - p);
+                p += len1;
+                len += len1;
+            } else {
+                c = unicode_from_utf8(p, p_end - p, &p_next);
+                if (c > 0x10FFFF)
+                    break;
+                p = p_next;
+                len += 1 + (c >= 0x10000);
+                is_wide |= (c >= 0x100);
+            }
+        }
+        if (p == p_end) {
+            if (len > JS_STRING_LEN_MAX)
+                return JS_ThrowInternalError(ctx, "string too long");
+            if (len == 1 && !is_wide) {
+                /* single 2 byte sequence */
+                return js_new_string_char8(ctx, ((p_start[0] & 0x1f) << 6) |
+                                           (p_start[1] & 0x3f));
+            }
+            return js_new_string_utf8(ctx, p_start, buf_len, len, is_wide);
+        }
+
+        len1 = count_ascii(p_start, buf_len);
+        p = p_start + len1;
         if (string_buffer_init(ctx, b, buf_len))
             goto fail;
         string_buffer_write8(b, p_start, len1);
@@ -3983,6 +4888,38 @@ JSValue JS_NewStringLen(JSContext *ctx, const char *buf, size_t buf_len)
     return JS_EXCEPTION;
 }
 
+/* The string references the characters of 'ptr' unless they must be
+   converted from UTF-8. */
+JSValue JS_NewExternalString(JSContext *ctx, const char *ptr, size_t len,
+                             BOOL is_latin1,
+                             JSFreeExternalStringFunc *free_func,
+                             void *opaque)
+{
+    JSStringRef *r;
+    JSValue val;
+
+    if (!is_latin1 && count_ascii((const uint8_t *)ptr, len) != len) {
+        val = JS_NewStringLen(ctx, ptr, len);
+        goto done;
+    }
+    if (len > JS_STRING_LEN_MAX) {
+        val = JS_ThrowInternalError(ctx, "string too long");
+        goto done;
+    }
+    r = js_alloc_string_ref(ctx, ptr, len, 0);
+    if (!r) {
+        val = JS_EXCEPTION;
+        goto done;
+    }
+    r->free_func = free_func;
+    r->opaque = opaque;
+    return JS_MKPTR(JS_TAG_STRING, &r->str);
+ done:
+    if (free_func)
+        free_func(ctx->rt, opaque, (void *)ptr);
+    return val;
+}
+
 static JSValue JS_ConcatString3(JSContext *ctx, const char *str1,
                                 JSValue str2, const char *str3)
 {
@@ -4027,6 +4964,214 @@ JSValue JS_NewAtomString(JSContext *ctx, const char *str)
 /* return (NULL, 0) if exception. */
 /* return pointer into a JSString with a live ref_count */
 /* cesu8 determines if non-BMP1 codepoints are encoded as 1 or 2 utf-8 sequences */
+typedef struct {
+    JSValueConst stack[JS_STRING_ROPE_MAX_DEPTH];
+    int stack_len;
+} JSStringRopeIter;
+
+static void string_rope_iter_init(JSStringRopeIter *s, JSValueConst val)
+{
+    s->stack_len = 0;
+    s->stack[s->stack_len++] = val;
+}
+
+/* iterate thru a rope and return the strings in order */
+static JSString *string_rope_iter_next(JSStringRopeIter *s)
+{
+    JSValueConst val;
+    JSStringRope *r;
+
+    if (s->stack_len == 0)
+        return NULL;
+    val = s->stack[--s->stack_len];
+    for(;;) {
+        if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
+            return JS_VALUE_GET_STRING(val);
+        r = JS_VALUE_GET_STRING_ROPE(val);
+        assert(s->stack_len < JS_STRING_ROPE_MAX_DEPTH);
+        s->stack[s->stack_len++] = r->right;
+        val = r->left;
+    }
+}
+
+#define UTF8_WRITER_BUF_SIZE 1024
+
+/* UTF-8 output of a sequence of strings, such as the leaves of a
+   rope */
+struct UTF8Writer {
+    JSPrintValueWrite *write_func;
+    void *write_opaque;
+    BOOL cesu8;
+    int hi; /* pending high surrogate or 0 */
+    int len;
+    uint8_t buf[UTF8_WRITER_BUF_SIZE];
+};
+
+static void utf8_writer_init(UTF8Writer *w, JSPrintValueWrite *write_func,
+                             void *write_opaque, BOOL cesu8)
+{
+    w->write_func = write_func;
+    w->write_opaque = write_opaque;
+    w->cesu8 = cesu8;
+    w->hi = 0;
+    w->len = 0;
+}
+
+static void utf8_writer_flush(UTF8Writer *w)
+{
+    if (w->len != 0) {
+        w->write_func(w->write_opaque, (const char *)w->buf, w->len);
+        w->len = 0;
+    }
+}
+
+static void utf8_writer_string(UTF8Writer *w, const JSString *p)
+{
+    int i, j, c;
+
+    if (!p->is_wide_char) {
+        const uint8_t *src = string_ptr8(p);
+        if (w->hi) {
+            w->len += unicode_to_utf8(w->buf + w->len, w->hi);
+            w->hi = 0;
+        }
+        for(i = 0; i < p->len;) {
+            /* ASCII characters are copied as is */
+            for(j = i; j < p->len && src[j] < 0x80; j++)
+                continue;
+            if (j - i > UTF8_WRITER_BUF_SIZE - w->len) {
+                utf8_writer_flush(w);
+                w->write_func(w->write_opaque, (const char *)src + i, j - i);
+            } else {
+                memcpy(w->buf + w->len, src + i, j - i);
+                w->len += j - i;
+            }
+            for(i = j; i < p->len && src[i] >= 0x80; i++) {
+                if (w->len > UTF8_WRITER_BUF_SIZE - 2)
+                    utf8_writer_flush(w);
+                w->buf[w->len++] = (src[i] >> 6) | 0xc0;
+                w->buf[w->len++] = (src[i] & 0x3f) | 0x80;
+            }
+        }
+    } else {
+        const uint16_t *src = string_ptr16(p);
+        for(i = 0; i < p->len; i++) {
+            if (w->len > UTF8_WRITER_BUF_SIZE - 2 * UTF8_CHAR_LEN_MAX)
+                utf8_writer_flush(w);
+            c = src[i];
+            if (w->hi) {
+                if (is_lo_surrogate(c)) {
+                    c = from_surrogate(w->hi, c);
+                    w->hi = 0;
+                    w->len += unicode_to_utf8(w->buf + w->len, c);
+                    continue;
+                }
+                /* Keep unmatched surrogate code points */
+                w->len += unicode_to_utf8(w->buf + w->len, w->hi);
+                w->hi = 0;
+            }
+            if (c < 0x80) {
+                w->buf[w->len++] = c;
+            } else if (is_hi_surrogate(c) && !w->cesu8) {
+                w->hi = c;
+            } else {
+                w->len += unicode_to_utf8(w->buf + w->len, c);
+            }
+        }
+    }
+}
+
+static void utf8_writer_end(UTF8Writer *w)
+{
+    if (w->hi) {
+        w->len += unicode_to_utf8(w->buf + w->len, w->hi);
+        w->hi = 0;
+    }
+    utf8_writer_flush(w);
+}
+
+static void utf8_write_to_buf(void *opaque, const char *buf, size_t len)
+{
+    uint8_t **pq = opaque;
+    memcpy(*pq, buf, len);
+    *pq += len;
+}
+
+/* convert a rope to UTF-8 without linearizing it */
+static const char *js_string_rope_to_cstring(JSContext *ctx, size_t *plen,
+                                             JSValueConst rope, BOOL cesu8)
+{
+    JSStringRopeIter it;
+    JSString *p, *str_new;
+    UTF8Writer w_s, *w = &w_s;
+    int64_t size;
+    uint8_t *q;
+    int i;
+
+    /* upper bound of the UTF-8 length */
+    size = 0;
+    string_rope_iter_init(&it, rope);
+    while ((p = string_rope_iter_next(&it)) != NULL) {
+        if (p->is_wide_char) {
+            size += (int64_t)p->len * 3;
+        } else {
+            const uint8_t *src = string_ptr8(p);
+            size += p->len;
+            for(i = 0; i < p->len; i++)
+                size += src[i] >> 7;
+        }
+    }
+    if (size > JS_STRING_LEN_MAX) {
+        JS_ThrowInternalError(ctx, "string too long");
+        goto fail;
+    }
+    str_new = js_alloc_string(ctx, size, 0);
+    if (!str_new)
+        goto fail;
+    q = str_new->u.str8;
+    utf8_writer_init(w, utf8_write_to_buf, &q, cesu8);
+    string_rope_iter_init(&it, rope);
+    while ((p = string_rope_iter_next(&it)) != NULL)
+        utf8_writer_string(w, p);
+    utf8_writer_end(w);
+    *q = '\0';
+    str_new->len = q - str_new->u.str8;
+    if (plen)
+        *plen = str_new->len;
+    return (const char *)str_new->u.str8;
+ fail:
+    if (plen)
+        *plen = 0;
+    return NULL;
+}
+
+/* Write the UTF-8 encoding of 'val' converted to a string. Contrary to
+   JS_ToCStringLen(), no copy of the string is done if it is a rope. */
+int JS_WriteStringUTF8(JSContext *ctx, JSPrintValueWrite *write_func,
+                       void *write_opaque, JSValueConst val1)
+{
+    JSValue val;
+    JSStringRopeIter it;
+    JSString *p;
+    UTF8Writer w_s, *w = &w_s;
+
+    if (JS_VALUE_GET_TAG(val1) == JS_TAG_STRING ||
+        JS_VALUE_GET_TAG(val1) == JS_TAG_STRING_ROPE) {
+        val = JS_DupValue(ctx, val1);
+    } else {
+        val = JS_ToString(ctx, val1);
+        if (JS_IsException(val))
+            return -1;
+    }
+    utf8_writer_init(w, write_func, write_opaque, FALSE);
+    string_rope_iter_init(&it, val);
+    while ((p = string_rope_iter_next(&it)) != NULL)
+        utf8_writer_string(w, p);
+    utf8_writer_end(w);
+    JS_FreeValue(ctx, val);
+    return 0;
+}
+
 const char *JS_ToCStringLen2(JSContext *ctx, size_t *plen, JSValueConst val1, BOOL cesu8)
 {
     JSValue val;
@@ -4034,6 +5179,8 @@ const char *JS_ToCStringLen2(JSContext *ctx, size_t *plen, JSValueConst val1, BO
     int pos, len, c, c1;
     uint8_t *q;
 
+    if (JS_VALUE_GET_TAG(val1) == JS_TAG_STRING_ROPE)
+        return js_string_rope_to_cstring(ctx, plen, val1, cesu8);
     if (JS_VALUE_GET_TAG(val1) != JS_TAG_STRING) {
         val = JS_ToString(ctx, val1);
         if (JS_IsException(val))
@@ -4045,7 +5192,7 @@ const char *JS_ToCStringLen2(JSContext *ctx, size_t *plen, JSValueConst val1, BO
     str = JS_VALUE_GET_STRING(val);
     len = str->len;
     if (!str->is_wide_char) {
-        const uint8_t *src = str->u.str8;
+        const uint8_t *src = string_ptr8(str);
         int count;
 
         /* count the number of non-ASCII characters */
@@ -4058,7 +5205,9 @@ const char *JS_ToCStringLen2(JSContext *ctx, size_t *plen, JSValueConst val1, BO
         for (pos = 0; pos < len; pos++) {
             count += src[pos] >> 7;
         }
-        if (count == 0) {
+        /* the string is returned as is if it holds its characters,
+           which are null terminated */
+        if (count == 0 && !str->is_ref) {
             if (plen)
                 *plen = len;
             return (const char *)src;
@@ -4077,7 +5226,7 @@ const char *JS_ToCStringLen2(JSContext *ctx, size_t *plen, JSValueConst val1, BO
             }
         }
     } else {
-        const uint16_t *src = str->u.str16;
+        const uint16_t *src = string_ptr16(str);
         /* Allocate 3 bytes per 16 bit code point. Surrogate pairs may
            produce 4 bytes but use 2 code points.
          */
@@ -4162,14 +5311,14 @@ static int js_string_memcmp(const JSString *p1, int pos1, const JSString *p2,
 
     if (likely(!p1->is_wide_char)) {
         if (likely(!p2->is_wide_char))
-            res = memcmp(p1->u.str8 + pos1, p2->u.str8 + pos2, len);
+            res = memcmp(string_ptr8(p1) + pos1, string_ptr8(p2) + pos2, len);
         else
-            res = -memcmp16_8(p2->u.str16 + pos2, p1->u.str8 + pos1, len);
+            res = -memcmp16_8(string_ptr16(p2) + pos2, string_ptr8(p1) + pos1, len);
     } else {
         if (!p2->is_wide_char)
-            res = memcmp16_8(p1->u.str16 + pos1, p2->u.str8 + pos2, len);
+            res = memcmp16_8(string_ptr16(p1) + pos1, string_ptr8(p2) + pos2, len);
         else
-            res = memcmp16(p1->u.str16 + pos1, p2->u.str16 + pos2, len);
+            res = memcmp16(string_ptr16(p1) + pos1, string_ptr16(p2) + pos2, len);
     }
     return res;
 }
@@ -4181,6 +5330,9 @@ static BOOL js_string_eq(JSContext *ctx,
         return FALSE;
     if (p1 == p2)
         return TRUE;
+    if (js_string_has_hash(p1) && js_string_has_hash(p2) &&
+        p1->hash != p2->hash)
+        return FALSE;
     return js_string_memcmp(p1, 0, p2, 0, p1->len) == 0;
 }
 
@@ -4205,9 +5357,9 @@ static int js_string_compare(JSContext *ctx,
 static void copy_str16(uint16_t *dst, const JSString *p, int offset, int len)
 {
     if (p->is_wide_char) {
-        memcpy(dst, p->u.str16 + offset, len * 2);
+        memcpy(dst, string_ptr16(p) + offset, len * 2);
     } else {
-        const uint8_t *src1 = p->u.str8 + offset;
+        const uint8_t *src1 = string_ptr8(p) + offset;
         int i;
 
         for(i = 0; i < len; i++)
@@ -4230,8 +5382,8 @@ static JSValue JS_ConcatString1(JSContext *ctx,
     if (!p)
         return JS_EXCEPTION;
     if (!is_wide_char) {
-        memcpy(p->u.str8, p1->u.str8, p1->len);
-        memcpy(p->u.str8 + p1->len, p2->u.str8, p2->len);
+        memcpy(p->u.str8, string_ptr8(p1), p1->len);
+        memcpy(p->u.str8 + p1->len, string_ptr8(p2), p2->len);
         p->u.str8[len] = '\0';
     } else {
         copy_str16(p->u.str16, p1, 0, p1->len);
@@ -4247,26 +5399,28 @@ static BOOL JS_ConcatStringInPlace(JSContext *ctx, JSString *p1, JSValueConst op
 
         if (p2->len == 0)
             return TRUE;
-        if (p1->header.ref_count != 1)
+        if (p1->header.ref_count != 1 || p1->atom_type != 0 || p1->is_ref)
             return FALSE;
+        p1->hash_next = 0; /* the cached hash is no longer valid */
         size1 = js_malloc_usable_size(ctx, p1);
         if (p1->is_wide_char) {
             if (size1 >= sizeof(*p1) + ((p1->len + p2->len) << 1)) {
                 if (p2->is_wide_char) {
-                    memcpy(p1->u.str16 + p1->len, p2->u.str16, p2->len << 1);
+                    memcpy(p1->u.str16 + p1->len, string_ptr16(p2), p2->len << 1);
                     p1->len += p2->len;
                     return TRUE;
                 } else {
+                    const uint8_t *src = string_ptr8(p2);
                     size_t i;
                     for (i = 0; i < p2->len; i++) {
-                        p1->u.str16[p1->len++] = p2->u.str8[i];
+                        p1->u.str16[p1->len++] = src[i];
                     }
                     return TRUE;
                 }
             }
         } else if (!p2->is_wide_char) {
             if (size1 >= sizeof(*p1) + p1->len + p2->len + 1) {
-                memcpy(p1->u.str8 + p1->len, p2->u.str8, p2->len);
+                memcpy(p1->u.str8 + p1->len, string_ptr8(p2), p2->len);
                 p1->len += p2->len;
                 p1->u.str8[p1->len] = '\0';
                 return TRUE;
@@ -4292,61 +5446,62 @@ static JSValue JS_ConcatString2(JSContext *ctx, JSValue op1, JSValue op2)
     return ret;
 }
 
-/* Return the character at position 'idx'. 'val' must be a string or rope */
-static int string_rope_get(JSValueConst val, uint32_t idx)
-{
-    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING) {
-        return string_get(JS_VALUE_GET_STRING(val), idx);
-    } else {
-        JSStringRope *r = JS_VALUE_GET_STRING_ROPE(val);
-        uint32_t len;
-        if (JS_VALUE_GET_TAG(r->left) == JS_TAG_STRING)
-            len = JS_VALUE_GET_STRING(r->left)->len;
-        else
-            len = JS_VALUE_GET_STRING_ROPE(r->left)->len;
-        if (idx < len)
-            return string_rope_get(r->left, idx);
-        else
-            return string_rope_get(r->right, idx - len);
-    }
-}
-
-typedef struct {
-    JSValueConst stack[JS_STRING_ROPE_MAX_DEPTH];
-    int stack_len;
-} JSStringRopeIter;
-
-static void string_rope_iter_init(JSStringRopeIter *s, JSValueConst val)
+static uint32_t string_rope_get_len(JSValueConst val)
 {
-    s->stack_len = 0;
-    s->stack[s->stack_len++] = val;
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
+        return JS_VALUE_GET_STRING(val)->len;
+    else
+        return JS_VALUE_GET_STRING_ROPE(val)->len;
 }
 
-/* iterate thru a rope and return the strings in order */
-static JSString *string_rope_iter_next(JSStringRopeIter *s)
+/* Return the leaf of the rope 'rope' containing the position 'idx'
+   (idx < length) and its position in the rope in '*pstart'. The last
+   leaf is cached so that sequential accesses are fast. */
+static JSString *string_rope_find_leaf(JSRuntime *rt, JSValueConst rope,
+                                       uint32_t idx, uint32_t *pstart)
 {
+    JSStringRope *r = JS_VALUE_GET_STRING_ROPE(rope);
     JSValueConst val;
-    JSStringRope *r;
+    JSString *p;
+    uint32_t start, len;
 
-    if (s->stack_len == 0)
-        return NULL;
-    val = s->stack[--s->stack_len];
+    if (rt->rope_cache == r &&
+        (idx - rt->rope_cache_start) < rt->rope_cache_leaf->len) {
+        *pstart = rt->rope_cache_start;
+        return rt->rope_cache_leaf;
+    }
+    val = rope;
+    start = 0;
     for(;;) {
         if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
-            return JS_VALUE_GET_STRING(val);
+            break;
         r = JS_VALUE_GET_STRING_ROPE(val);
-        assert(s->stack_len < JS_STRING_ROPE_MAX_DEPTH);
-        s->stack[s->stack_len++] = r->right;
-        val = r->left;
+        len = string_rope_get_len(r->left);
+        if (idx - start < len) {
+            val = r->left;
+        } else {
+            start += len;
+            val = r->right;
+        }
     }
+    p = JS_VALUE_GET_STRING(val);
+    rt->rope_cache = JS_VALUE_GET_STRING_ROPE(rope);
+    rt->rope_cache_leaf = p;
+    rt->rope_cache_start = start;
+    *pstart = start;
+    return p;
 }
 
-static uint32_t string_rope_get_len(JSValueConst val)
+/* Return the character at position 'idx'. 'val' must be a string or rope */
+static int string_rope_get(JSRuntime *rt, JSValueConst val, uint32_t idx)
 {
+    JSString *p;
+    uint32_t start;
+
     if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
-        return JS_VALUE_GET_STRING(val)->len;
-    else
-        return JS_VALUE_GET_STRING_ROPE(val)->len;
+        return string_get(JS_VALUE_GET_STRING(val), idx);
+    p = string_rope_find_leaf(rt, val, idx, &start);
+    return string_get(p, idx - start);
 }
 
 static int js_string_rope_compare(JSContext *ctx, JSValueConst op1,
@@ -4422,6 +5577,8 @@ static JSValue js_linearize_string_rope(JSContext *ctx, JSValue rope)
     ret = string_buffer_end(b);
     if (r->header.ref_count > 1) {
         /* update the rope so that it won't need to be linearized again */
+        if (ctx->rt->rope_cache == r)
+            ctx->rt->rope_cache = NULL;
         JS_FreeValue(ctx, r->left);
         JS_FreeValue(ctx, r->right);
         r->left = JS_DupValue(ctx, ret);
@@ -4501,6 +5658,46 @@ static JSValue js_new_string_rope(JSContext *ctx, JSValue op1, JSValue op2)
     return JS_EXCEPTION;
 }
 
+/* Return the substring [start, end) of the string or rope 'val'. The
+   rope is not linearized: the subtrees inside the range are shared
+   with it and only the characters of the partially covered leaves are
+   copied. */
+static JSValue js_sub_string_rope(JSContext *ctx, JSValueConst val,
+                                  uint32_t start, uint32_t end)
+{
+    JSStringRope *r;
+    JSValue left, right;
+    StringBuffer b_s, *b = &b_s;
+    uint32_t len;
+
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
+        return js_sub_string(ctx, JS_VALUE_GET_STRING(val), start, end);
+    r = JS_VALUE_GET_STRING_ROPE(val);
+    if (start == 0 && end == r->len)
+        return JS_DupValue(ctx, val);
+    if (end - start <= JS_STRING_ROPE_SHORT_LEN) {
+        if (start == end)
+            return JS_AtomToString(ctx, JS_ATOM_empty_string);
+        string_buffer_init(ctx, b, end - start);
+        string_buffer_concat_rope_range(b, val, start, end);
+        return string_buffer_end(b);
+    }
+    len = string_rope_get_len(r->left);
+    if (end <= len)
+        return js_sub_string_rope(ctx, r->left, start, end);
+    if (start >= len)
+        return js_sub_string_rope(ctx, r->right, start - len, end - len);
+    left = js_sub_string_rope(ctx, r->left, start, len);
+    if (JS_IsException(left))
+        return left;
+    right = js_sub_string_rope(ctx, r->right, 0, end - len);
+    if (JS_IsException(right)) {
+        JS_FreeValue(ctx, left);
+        return right;
+    }
+    return js_new_string_rope(ctx, left, right);
+}
+
 #define ROPE_N_BUCKETS 44
 
 /* Fibonacii numbers starting from F_2 */
@@ -4798,6 +5995,14 @@ static void js_shape_hash_unlink(JSRuntime *rt, JSShape *sh)
 }
 
 /* create a new empty shape with prototype 'proto'. It is not hashed */
+/* return a new shape id. The ids are never 0. */
+static inline uint32_t js_new_shape_id(JSRuntime *rt)
+{
+    if (unlikely(++rt->shape_id_counter == 0))
+        rt->shape_id_counter = 1;
+    return rt->shape_id_counter;
+}
+
 static inline JSShape *js_new_shape_nohash(JSContext *ctx, JSObject *proto,
                                            int hash_size, int prop_size)
 {
@@ -4820,6 +6025,7 @@ static inline JSShape *js_new_shape_nohash(JSContext *ctx, JSObject *proto,
     sh->prop_size = prop_size;
     sh->prop_count = 0;
     sh->deleted_prop_count = 0;
+    sh->id = js_new_shape_id(rt);
     sh->is_hashed = FALSE;
     return sh;
 }
@@ -4874,6 +6080,7 @@ static JSShape *js_clone_shape(JSContext *ctx, JSShape *sh1)
     sh->header.ref_count = 1;
     add_gc_object(ctx->rt, &sh->header, JS_GC_OBJ_TYPE_SHAPE);
     sh->is_hashed = FALSE;
+    sh->id = js_new_shape_id(ctx->rt);
     if (sh->proto) {
         JS_DupValue(ctx, JS_MKPTR(JS_TAG_OBJECT, sh->proto));
     }
@@ -4932,6 +6139,7 @@ static no_inline int resize_properties(JSContext *ctx, JSShape **psh,
     void *sh_alloc;
     intptr_t h;
     JSShape *old_sh;
+    struct list_head *el;
 
     sh = *psh;
     new_size = max_int(count, sh->prop_size * 3 / 2);
@@ -4954,11 +6162,14 @@ static no_inline int resize_properties(JSContext *ctx, JSShape **psh,
     if (!sh_alloc)
         return -1;
     sh = get_shape_from_alloc(sh_alloc, new_hash_size);
+    /* keep the position in gc_obj_list (the young objects must stay
+       at its end) */
+    el = old_sh->header.link.prev;
     list_del(&old_sh->header.link);
     /* copy all the shape properties */
     memcpy(sh, old_sh,
            sizeof(JSShape) + sizeof(sh->prop[0]) * old_sh->prop_count);
-    list_add_tail(&sh->header.link, &ctx->rt->gc_obj_list);
+    list_add(&sh->header.link, el);
 
     if (new_hash_size != (sh->prop_hash_mask + 1)) {
         /* resize the hash table and the properties */
@@ -4993,6 +6204,7 @@ static int compact_properties(JSContext *ctx, JSObject *p)
     uint32_t new_hash_size, i, j, new_hash_mask, new_size;
     JSShapeProperty *old_pr, *pr;
     JSProperty *prop, *new_prop;
+    struct list_head *el;
 
     sh = p->shape;
     assert(!sh->is_hashed);
@@ -5012,9 +6224,10 @@ static int compact_properties(JSContext *ctx, JSObject *p)
     if (!sh_alloc)
         return -1;
     sh = get_shape_from_alloc(sh_alloc, new_hash_size);
+    el = old_sh->header.link.prev;
     list_del(&old_sh->header.link);
     memcpy(sh, old_sh, sizeof(JSShape));
-    list_add_tail(&sh->header.link, &ctx->rt->gc_obj_list);
+    list_add(&sh->header.link, el);
 
     memset(prop_hash_end(sh) - new_hash_size, 0,
            sizeof(prop_hash_end(sh)[0]) * new_hash_size);
@@ -5041,6 +6254,7 @@ static int compact_properties(JSContext *ctx, JSObject *p)
     sh->prop_size = new_size;
     sh->deleted_prop_count = 0;
     sh->prop_count = j;
+    sh->id = js_new_shape_id(ctx->rt);
 
     p->shape = sh;
     js_free(ctx, get_alloc_from_shape(old_sh));
@@ -5087,6 +6301,7 @@ static int add_shape_property(JSContext *ctx, JSShape **psh,
     pr = &prop[sh->prop_count++];
     pr->atom = JS_DupAtom(ctx, atom);
     pr->flags = prop_flags;
+    sh->id = js_new_shape_id(rt);
     /* add in hash table */
     hash_mask = sh->prop_hash_mask;
     h = atom & hash_mask;
@@ -6012,6 +7227,17 @@ static void free_zero_refcount(JSRuntime *rt)
     rt->gc_phase = JS_GC_PHASE_NONE;
 }
 
+/* Called when the ref_count of a GC object which is not part of the
+   freed cycles reaches zero while the cycles are removed. It only
+   happens when the GC is limited to the young objects: the object is
+   then only referenced by young objects in the freed cycles. */
+static void gc_free_later(JSRuntime *rt, JSGCObjectHeader *p)
+{
+    list_del(&p->link);
+    list_add_tail(&p->link, &rt->tmp_obj_list);
+    p->mark = 1;
+}
+
 /* called with the ref_count of 'v' reaches zero. */
 void __JS_FreeValueRT(JSRuntime *rt, JSValue v)
 {
@@ -6039,6 +7265,8 @@ void __JS_FreeValueRT(JSRuntime *rt, JSValue v)
 #ifdef DUMP_LEAKS
                 list_del(&p->link);
 #endif
+                if (unlikely(p->is_ref))
+                    js_free_string_ref(rt, (JSStringRef *)p);
                 js_free_rt(rt, p);
             }
         }
@@ -6047,6 +7275,8 @@ void __JS_FreeValueRT(JSRuntime *rt, JSValue v)
         /* Note: recursion is acceptable because the rope depth is bounded */
         {
             JSStringRope *p = JS_VALUE_GET_STRING_ROPE(v);
+            if (rt->rope_cache == p)
+                rt->rope_cache = NULL;
             JS_FreeValueRT(rt, p->left);
             JS_FreeValueRT(rt, p->right);
             js_free_rt(rt, p);
@@ -6064,6 +7294,8 @@ void __JS_FreeValueRT(JSRuntime *rt, JSValue v)
                 if (rt->gc_phase == JS_GC_PHASE_NONE) {
                     free_zero_refcount(rt);
                 }
+            } else if (p->mark == 0) {
+                gc_free_later(rt, p);
             }
         }
         break;
@@ -6125,7 +7357,9 @@ static void add_gc_object(JSRuntime *rt, JSGCObjectHeader *h,
                           JSGCObjectTypeEnum type)
 {
     h->mark = 0;
+    h->young = 1;
     h->gc_obj_type = type;
+    /* the young objects are kept at the end of the list */
     list_add_tail(&h->link, &rt->gc_obj_list);
 }
 
@@ -6278,7 +7512,16 @@ static void gc_decref_child(JSRuntime *rt, JSGCObjectHeader *p)
     }
 }
 
-static void gc_decref(JSRuntime *rt)
+/* When only the young objects are scanned, the references from the
+   old objects are handled as external references. */
+static void gc_decref_child_young(JSRuntime *rt, JSGCObjectHeader *p)
+{
+    if (p->young)
+        gc_decref_child(rt, p);
+}
+
+/* scan the objects of gc_obj_list after 'start' */
+static void gc_decref(JSRuntime *rt, struct list_head *start, BOOL young_only)
 {
     struct list_head *el, *el1;
     JSGCObjectHeader *p;
@@ -6288,10 +7531,11 @@ static void gc_decref(JSRuntime *rt)
     /* decrement the refcount of all the children of all the GC
        objects and move the GC objects with zero refcount to
        tmp_obj_list */
-    list_for_each_safe(el, el1, &rt->gc_obj_list) {
+    for(el = start->next, el1 = el->next; el != &rt->gc_obj_list;
+        el = el1, el1 = el->next) {
         p = list_entry(el, JSGCObjectHeader, link);
         assert(p->mark == 0);
-        mark_children(rt, p, gc_decref_child);
+        mark_children(rt, p, young_only ? gc_decref_child_young : gc_decref_child);
         p->mark = 1;
         if (p->ref_count == 0) {
             list_del(&p->link);
@@ -6317,23 +7561,49 @@ static void gc_scan_incref_child2(JSRuntime *rt, JSGCObjectHeader *p)
     p->ref_count++;
 }
 
-static void gc_scan(JSRuntime *rt)
+static void gc_scan_incref_child_young(JSRuntime *rt, JSGCObjectHeader *p)
+{
+    if (p->young)
+        gc_scan_incref_child(rt, p);
+}
+
+static void gc_scan_incref_child2_young(JSRuntime *rt, JSGCObjectHeader *p)
+{
+    if (p->young)
+        p->ref_count++;
+}
+
+static void gc_scan(JSRuntime *rt, struct list_head *start, BOOL young_only)
 {
     struct list_head *el;
     JSGCObjectHeader *p;
 
     /* keep the objects with a refcount > 0 and their children. */
-    list_for_each(el, &rt->gc_obj_list) {
+    for(el = start->next; el != &rt->gc_obj_list; el = el->next) {
         p = list_entry(el, JSGCObjectHeader, link);
         assert(p->ref_count > 0);
         p->mark = 0; /* reset the mark for the next GC call */
-        mark_children(rt, p, gc_scan_incref_child);
+        if (young_only) {
+            mark_children(rt, p, gc_scan_incref_child_young);
+        } else {
+            p->young = 0;
+            mark_children(rt, p, gc_scan_incref_child);
+        }
     }
 
     /* restore the refcount of the objects to be deleted. */
     list_for_each(el, &rt->tmp_obj_list) {
         p = list_entry(el, JSGCObjectHeader, link);
-        mark_children(rt, p, gc_scan_incref_child2);
+        mark_children(rt, p, young_only ? gc_scan_incref_child2_young :
+                      gc_scan_incref_child2);
+    }
+
+    if (young_only) {
+        /* the remaining objects become old */
+        for(el = start->next; el != &rt->gc_obj_list; el = el->next) {
+            p = list_entry(el, JSGCObjectHeader, link);
+            p->young = 0;
+        }
     }
 }
 
@@ -6396,21 +7666,37 @@ static void gc_free_cycles(JSRuntime *rt)
     init_list_head(&rt->gc_zero_ref_count_list);
 }
 
-static void JS_RunGCInternal(JSRuntime *rt, BOOL remove_weak_objects)
+/* If 'young_only' is TRUE, only the objects allocated since the
+   previous GC are scanned, so only the cycles made of young objects
+   are freed. */
+static void JS_RunGCInternal(JSRuntime *rt, BOOL remove_weak_objects,
+                             BOOL young_only)
 {
+    struct list_head *start;
+
     if (remove_weak_objects) {
         /* free the weakly referenced object or symbol structures, delete
            the associated Map/Set entries and queue the finalization
            registry callbacks. */
         gc_remove_weak_objects(rt);
     }
-    
+
+    start = &rt->gc_obj_list;
+    if (young_only) {
+        /* the young objects are at the end of gc_obj_list */
+        start = rt->gc_obj_list.prev;
+        while (start != &rt->gc_obj_list &&
+               list_entry(start, JSGCObjectHeader, link)->young) {
+            start = start->prev;
+        }
+    }
+
     /* decrement the reference of the children of each object. mark =
        1 after this pass. */
-    gc_decref(rt);
+    gc_decref(rt, start, young_only);
 
     /* keep the GC objects with a non zero refcount and their childs */
-    gc_scan(rt);
+    gc_scan(rt, start, young_only);
 
     /* free the GC objects in a cycle */
     gc_free_cycles(rt);
@@ -6418,7 +7704,7 @@ static void JS_RunGCInternal(JSRuntime *rt, BOOL remove_weak_objects)
 
 void JS_RunGC(JSRuntime *rt)
 {
-    JS_RunGCInternal(rt, TRUE);
+    JS_RunGCInternal(rt, TRUE, FALSE);
 }
 
 /* Return false if not an object or if the object has already been
@@ -6453,8 +7739,13 @@ static void compute_jsstring_size(JSString *str, JSMemoryUsage_helper *hp)
     if (!str->atom_type) {  /* atoms are handled separately */
         double s_ref_count = str->header.ref_count;
         hp->str_count += 1 / s_ref_count;
-        hp->str_size += ((sizeof(*str) + (str->len << str->is_wide_char) +
-                          1 - str->is_wide_char) / s_ref_count);
+        if (str->is_ref) {
+            /* the characters are accounted with the parent string */
+            hp->str_size += sizeof(JSStringRef) / s_ref_count;
+        } else {
+            hp->str_size += ((sizeof(*str) + (str->len << str->is_wide_char) +
+                              1 - str->is_wide_char) / s_ref_count);
+        }
     }
 }
 
@@ -6480,6 +7771,10 @@ static void compute_bytecode_size(JSFunctionBytecode *b, JSMemoryUsage_helper *h
     if (!b->read_only_bytecode && b->byte_code_buf) {
         hp->js_func_code_size += b->byte_code_len;
     }
+    if (b->ic) {
+        memory_used_count++;
+        js_func_size += b->ic_count * sizeof(*b->ic);
+    }
     if (b->has_debug) {
         js_func_size += sizeof(*b) - offsetof(JSFunctionBytecode, debug);
         if (b->debug.source) {
@@ -6777,6 +8072,22 @@ void JS_ComputeMemoryUsage(JSRuntime *rt, JSMemoryUsage *s)
         }
     }
 
+    /* regexp cache */
+    if (rt->regexp_cache_hash) {
+        s->regexp_cache_count = rt->regexp_cache_count;
+        s->regexp_cache_size = sizeof(rt->regexp_cache_hash[0]) * rt->regexp_cache_hash_size +
+            sizeof(JSRegExpCacheEntry) * rt->regexp_cache_count;
+        s->memory_used_count += 1 + rt->regexp_cache_count;
+        s->memory_used_size += s->regexp_cache_size;
+        list_for_each(el, &rt->regexp_cache_list) {
+            JSRegExpCacheEntry *e = list_entry(el, JSRegExpCacheEntry, link);
+            compute_jsstring_size(e->pattern, hp);
+            compute_jsstring_size(e->bytecode, hp);
+        }
+    }
+    s->regexp_cache_hits = rt->regexp_cache_hits;
+    s->regexp_cache_misses = rt->regexp_cache_misses;
+
     /* atoms */
     s->memory_used_count += 2; /* rt->atom_array, rt->atom_hash */
     s->atom_count = rt->atom_count;
@@ -6928,6 +8239,11 @@ void JS_DumpMemoryUsage(FILE *fp, const JSMemoryUsage *s, JSRuntime *rt)
         fprintf(fp, "%-20s %8"PRId64" %8"PRId64"\n",
                 "binary objects", s->binary_object_count, s->binary_object_size);
     }
+    if (s->regexp_cache_hits || s->regexp_cache_misses) {
+        fprintf(fp, "%-20s %8"PRId64" %8"PRId64"  (%"PRId64" hits, %"PRId64" misses)\n",
+                "regexp cache", s->regexp_cache_count, s->regexp_cache_size,
+                s->regexp_cache_hits, s->regexp_cache_misses);
+    }
 }
 
 JSValue JS_GetGlobalObject(JSContext *ctx)
@@ -7830,7 +9146,7 @@ JSValue JS_GetPropertyInternal(JSContext *ctx, JSValueConst obj,
                     uint32_t idx;
                     idx = __JS_AtomToUInt32(prop);
                     if (idx < p1->len) {
-                        return js_new_string_char(ctx, string_rope_get(obj, idx));
+                        return js_new_string_char(ctx, string_rope_get(ctx->rt, obj, idx));
                     }
                 } else if (prop == JS_ATOM_length) {
                     return JS_NewInt32(ctx, p1->len);
@@ -9902,6 +11218,8 @@ static int js_shape_prepare_update(JSContext *ctx, JSObject *p,
             sh->is_hashed = FALSE;
         }
     }
+    /* the caller modifies the shape in place */
+    sh->id = js_new_shape_id(ctx->rt);
     return 0;
 }
 
@@ -13720,18 +15038,18 @@ static void js_print_object(JSPrintValueState *s, JSObject *p)
         comma_state = 2;
     } else if (p->class_id == JS_CLASS_MAP || p->class_id == JS_CLASS_SET) {
         JSMapState *ms = p->u.opaque;
-        struct list_head *el;
+        uint32_t j;
         
         if (!ms)
             goto default_obj;
         js_print_atom(s, rt->class_array[p->class_id].class_name);
         js_printf(s, "(%u) { ", ms->record_count);
         i = 0;
-        list_for_each(el, &ms->records) {
-            JSMapRecord *mr = list_entry(el, JSMapRecord, link);
-            js_print_comma(s, &comma_state);
-            if (mr->empty)
+        for(j = 0; j < ms->records_len; j++) {
+            JSMapRecord *mr = &ms->records[j];
+            if (map_record_is_deleted(mr))
                 continue;
+            js_print_comma(s, &comma_state);
             js_print_value(s, mr->key);
             if (p->class_id == JS_CLASS_MAP) {
                 js_printf(s, " => ");
@@ -16426,12 +17744,60 @@ static BOOL js_get_fast_array(JSContext *ctx, JSValueConst obj,
     return FALSE;
 }
 
+/* return TRUE if %ArrayIteratorPrototype%.next is the built-in
+   function (no side effect while getting it) */
+static BOOL js_array_iterator_next_is_builtin(JSContext *ctx)
+{
+    JSObject *p;
+    JSProperty *pr;
+    JSShapeProperty *prs;
+    JSCFunctionType ft;
+
+    p = JS_VALUE_GET_OBJ(ctx->class_proto[JS_CLASS_ARRAY_ITERATOR]);
+    prs = find_own_property(&pr, p, JS_ATOM_next);
+    if (!prs || (prs->flags & JS_PROP_TMASK) != JS_PROP_NORMAL)
+        return FALSE;
+    ft.iterator_next = js_array_iterator_next;
+    return JS_IsCFunction(ctx, pr->u.value, ft.generic, 0);
+}
+
+/* append the 'count' values of 'tab' at the position 'pos' of the
+   array 'obj' */
+static int js_append_values(JSContext *ctx, JSValueConst obj, uint32_t pos,
+                            const JSValue *tab, uint32_t count)
+{
+    JSObject *p = JS_VALUE_GET_OBJ(obj);
+    uint32_t i, new_len;
+
+    new_len = pos + count;
+    if (p->class_id == JS_CLASS_ARRAY && p->fast_array && p->extensible &&
+        pos == p->u.array.count && new_len >= pos && new_len <= INT32_MAX &&
+        JS_VALUE_GET_TAG(p->prop[0].u.value) == JS_TAG_INT &&
+        JS_VALUE_GET_INT(p->prop[0].u.value) == pos) {
+        if (new_len > p->u.array.u1.size) {
+            if (expand_fast_array(ctx, p, new_len))
+                return -1;
+        }
+        for(i = 0; i < count; i++)
+            p->u.array.u.values[pos + i] = JS_DupValue(ctx, tab[i]);
+        p->u.array.count = new_len;
+        p->prop[0].u.value = JS_NewInt32(ctx, new_len);
+    } else {
+        for(i = 0; i < count; i++) {
+            if (JS_DefinePropertyValueUint32(ctx, obj, pos + i,
+                                             JS_DupValue(ctx, tab[i]),
+                                             JS_PROP_C_W_E) < 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
 static __exception int js_append_enumerate(JSContext *ctx, JSValue *sp)
 {
     JSValue iterator, enumobj, method, value;
-    int is_array_iterator;
     JSValue *arrp;
-    uint32_t i, count32, pos;
+    uint32_t count32, pos, len;
     JSCFunctionType ft;
 
     if (JS_VALUE_GET_TAG(sp[-2]) != JS_TAG_INT) {
@@ -16443,19 +17809,39 @@ static __exception int js_append_enumerate(JSContext *ctx, JSValue *sp)
 
     /* XXX: further optimisations:
        - use ctx->array_proto_values?
-       - check if array_iterator_prototype next method is built-in and
-         avoid constructing actual iterator object?
        - build this into js_for_of_start and use in all `for (x of o)` loops
      */
     iterator = JS_GetProperty(ctx, sp[-1], JS_ATOM_Symbol_iterator);
     if (JS_IsException(iterator))
         return -1;
     ft.generic_magic = js_create_array_iterator;
-    is_array_iterator = JS_IsCFunction(ctx, iterator, ft.generic,
-                                       JS_ITERATOR_KIND_VALUE);
-    JS_FreeValue(ctx, iterator);
+    if (JS_IsCFunction(ctx, iterator, ft.generic, JS_ITERATOR_KIND_VALUE) &&
+        js_get_fast_array(ctx, sp[-1], &arrp, &count32) &&
+        js_array_iterator_next_is_builtin(ctx)) {
+        /* the iteration is not observable: the array iterator is not
+           created */
+        if (js_get_length32(ctx, &len, sp[-1])) {
+            JS_FreeValue(ctx, iterator);
+            return -1;
+        }
+        /* if len > count32, the elements >= count32 might be read in
+           the prototypes and might have side effects */
+        if (len == count32) {
+            JS_FreeValue(ctx, iterator);
+            if (js_append_values(ctx, sp[-3], pos, arrp, count32))
+                return -1;
+            pos += count32;
+            goto done;
+        }
+    }
 
-    enumobj = JS_GetIterator(ctx, sp[-1], FALSE);
+    if (!JS_IsFunction(ctx, iterator)) {
+        JS_FreeValue(ctx, iterator);
+        JS_ThrowTypeError(ctx, "value is not iterable");
+        return -1;
+    }
+    enumobj = JS_GetIterator2(ctx, sp[-1], iterator);
+    JS_FreeValue(ctx, iterator);
     if (JS_IsException(enumobj))
         return -1;
     method = JS_GetProperty(ctx, enumobj, JS_ATOM_next);
@@ -16463,46 +17849,26 @@ static __exception int js_append_enumerate(JSContext *ctx, JSValue *sp)
         JS_FreeValue(ctx, enumobj);
         return -1;
     }
-
-    ft.iterator_next = js_array_iterator_next;
-    if (is_array_iterator
-    &&  JS_IsCFunction(ctx, method, ft.generic, 0)
-    &&  js_get_fast_array(ctx, sp[-1], &arrp, &count32)) {
-        uint32_t len;
-        if (js_get_length32(ctx, &len, sp[-1]))
+    for (;;) {
+        BOOL done;
+        value = JS_IteratorNext(ctx, enumobj, method, 0, NULL, &done);
+        if (JS_IsException(value))
             goto exception;
-        /* if len > count32, the elements >= count32 might be read in
-           the prototypes and might have side effects */
-        if (len != count32)
-            goto general_case;
-        /* Handle fast arrays explicitly */
-        for (i = 0; i < count32; i++) {
-            if (JS_DefinePropertyValueUint32(ctx, sp[-3], pos++,
-                                             JS_DupValue(ctx, arrp[i]), JS_PROP_C_W_E) < 0)
-                goto exception;
-        }
-    } else {
-    general_case:
-        for (;;) {
-            BOOL done;
-            value = JS_IteratorNext(ctx, enumobj, method, 0, NULL, &done);
-            if (JS_IsException(value))
-                goto exception;
-            if (done) {
-                /* value is JS_UNDEFINED */
-                break;
-            }
-            if (JS_DefinePropertyValueUint32(ctx, sp[-3], pos++, value, JS_PROP_C_W_E) < 0)
-                goto exception;
+        if (done) {
+            /* value is JS_UNDEFINED */
+            break;
         }
+        if (JS_DefinePropertyValueUint32(ctx, sp[-3], pos++, value, JS_PROP_C_W_E) < 0)
+            goto exception;
     }
-    /* Note: could raise an error if too many elements */
-    sp[-2] = JS_NewInt32(ctx, pos);
     JS_FreeValue(ctx, enumobj);
     JS_FreeValue(ctx, method);
+ done:
+    /* Note: could raise an error if too many elements */
+    sp[-2] = JS_NewInt32(ctx, pos);
     return 0;
 
-exception:
+ exception:
     JS_IteratorClose(ctx, enumobj, TRUE);
     JS_FreeValue(ctx, enumobj);
     JS_FreeValue(ctx, method);
@@ -17352,6 +18718,258 @@ typedef enum {
 #define FUNC_RET_YIELD_STAR    2
 #define FUNC_RET_INITIAL_YIELD 3
 
+/* return the inline cache of the site 'ic_idx'. The cache table of
+   the function is allocated on the first use. Return NULL if memory
+   error (the property access is then just not cached) */
+static JSInlineCache *js_get_ic(JSRuntime *rt, JSFunctionBytecode *b,
+                                int ic_idx)
+{
+    if (!b->ic) {
+        b->ic = js_mallocz_rt(rt, sizeof(b->ic[0]) * b->ic_count);
+        if (!b->ic)
+            return NULL;
+    }
+    return &b->ic[ic_idx];
+}
+
+static void js_ic_add(JSInlineCache *ic, JSShape *sh,
+                      uint32_t proto_shape_id, uint32_t prop_idx)
+{
+    JSInlineCacheEntry *e;
+    int i;
+
+    /* replace an outdated entry for the same shape or evict the
+       oldest one */
+    for(i = 0; i < JS_IC_WAYS - 1; i++) {
+        if (ic->entries[i].shape == sh)
+            break;
+    }
+    memmove(ic->entries + 1, ic->entries, sizeof(ic->entries[0]) * i);
+    e = &ic->entries[0];
+    e->shape = sh;
+    e->shape_id = sh->id;
+    e->proto_shape_id = proto_shape_id;
+    e->prop_idx = prop_idx;
+}
+
+/* return TRUE if the lookup of 'atom' continues in the prototype of
+   'p' when 'atom' is not in the shape of 'p' */
+static inline BOOL js_ic_proto_lookup_ok(JSRuntime *rt, JSObject *p,
+                                         JSAtom atom)
+{
+    const JSClassExoticMethods *em;
+
+    if (likely(!p->is_exotic))
+        return TRUE;
+    if (p->fast_array) {
+        return !__JS_AtomIsTaggedInt(atom) &&
+            !(p->class_id >= JS_CLASS_UINT8C_ARRAY &&
+              p->class_id <= JS_CLASS_FLOAT64_ARRAY);
+    }
+    em = rt->class_array[p->class_id].exotic;
+    return !em || (!em->get_property && !em->get_own_property);
+}
+
+/* get_field_ic when the first cache entry does not match: try the
+   other entries, otherwise do the lookup and update the cache */
+static no_inline JSValue js_get_field_ic_slow(JSContext *ctx,
+                                              JSFunctionBytecode *b,
+                                              int ic_idx, JSValueConst obj,
+                                              JSAtom atom)
+{
+    JSObject *p, *p1;
+    JSShape *sh;
+    JSProperty *pr;
+    JSShapeProperty *prs;
+    JSInlineCache *ic;
+    JSInlineCacheEntry *e;
+
+    if (JS_VALUE_GET_TAG(obj) != JS_TAG_OBJECT)
+        goto slow_path;
+    p = JS_VALUE_GET_OBJ(obj);
+    sh = p->shape;
+    if (b->ic) {
+        for(e = b->ic[ic_idx].entries; e < b->ic[ic_idx].entries + JS_IC_WAYS; e++) {
+            if (e->shape == sh && e->shape_id == sh->id) {
+                if (e->proto_shape_id == 0)
+                    return JS_DupValue(ctx, p->prop[e->prop_idx].u.value);
+                p1 = sh->proto;
+                if (p1->shape->id == e->proto_shape_id &&
+                    js_ic_proto_lookup_ok(ctx->rt, p, atom))
+                    return JS_DupValue(ctx, p1->prop[e->prop_idx].u.value);
+                break;
+            }
+        }
+    }
+
+    p1 = p;
+    for(;;) {
+        prs = find_own_property(&pr, p1, atom);
+        if (prs) {
+            if (unlikely(prs->flags & JS_PROP_TMASK))
+                break;
+            /* only the own properties and the properties of the
+               direct prototype are cached */
+            if (p1 == p || p1 == sh->proto) {
+                ic = js_get_ic(ctx->rt, b, ic_idx);
+                if (ic) {
+                    js_ic_add(ic, sh, p1 == p ? 0 : p1->shape->id,
+                              prs - get_shape_prop(p1->shape));
+                }
+            }
+            return JS_DupValue(ctx, pr->u.value);
+        }
+        if (!js_ic_proto_lookup_ok(ctx->rt, p1, atom))
+            break;
+        p1 = p1->shape->proto;
+        if (!p1)
+            return JS_UNDEFINED;
+    }
+ slow_path:
+    return JS_GetPropertyInternal(ctx, obj, atom, obj, FALSE);
+}
+
+/* put_field_ic when the first cache entry does not match. Only
+   writable own properties are cached. 'val' is freed. */
+static no_inline int js_put_field_ic_slow(JSContext *ctx,
+                                          JSFunctionBytecode *b,
+                                          int ic_idx, JSValueConst obj,
+                                          JSAtom atom, JSValue val)
+{
+    JSObject *p;
+    JSShape *sh;
+    JSProperty *pr;
+    JSShapeProperty *prs;
+    JSInlineCache *ic;
+    JSInlineCacheEntry *e;
+
+    if (JS_VALUE_GET_TAG(obj) == JS_TAG_OBJECT) {
+        p = JS_VALUE_GET_OBJ(obj);
+        sh = p->shape;
+        if (b->ic) {
+            for(e = b->ic[ic_idx].entries; e < b->ic[ic_idx].entries + JS_IC_WAYS; e++) {
+                if (e->shape == sh && e->shape_id == sh->id) {
+                    set_value(ctx, &p->prop[e->prop_idx].u.value, val);
+                    return TRUE;
+                }
+            }
+        }
+        prs = find_own_property(&pr, p, atom);
+        if (prs && (prs->flags & (JS_PROP_TMASK | JS_PROP_WRITABLE |
+                                  JS_PROP_LENGTH)) == JS_PROP_WRITABLE) {
+            ic = js_get_ic(ctx->rt, b, ic_idx);
+            if (ic)
+                js_ic_add(ic, sh, 0, prs - get_shape_prop(sh));
+            set_value(ctx, &pr->u.value, val);
+            return TRUE;
+        }
+    }
+    return JS_SetPropertyInternal(ctx, obj, atom, val, obj,
+                                  JS_PROP_THROW_STRICT);
+}
+
+#ifdef CONFIG_JIT
+/* number of calls and backward branches before a function is compiled */
+#define JS_JIT_THRESHOLD 1000
+
+/* interpreter state seen by the native code */
+typedef struct JSJitFrame {
+    JSContext *ctx;
+    JSStackFrame *sf;
+    JSFunctionBytecode *b;
+    JSValue *var_buf;
+    JSValue *arg_buf;
+    JSValue *stack_buf;
+    JSVarRef **var_refs;
+    JSValueConst this_obj;
+    /* set when the native code returns */
+    const uint8_t *pc;
+    JSValue *sp;
+} JSJitFrame;
+
+typedef struct JSJitCode {
+    uint8_t *code; /* executable mapping */
+    size_t code_size;
+    /* offset in 'code' of each bytecode position, 0 if it is not an
+       entry point */
+    uint32_t pc_map[0];
+} JSJitCode;
+
+/* status = func(jf, entry): 0 = continue in the interpreter at
+   jf->pc, 1 = exception */
+typedef int JSJitFunc(JSJitFrame *jf, const uint8_t *entry);
+typedef JSValue *JSJitHelper(JSJitFrame *jf, JSValue *sp, const uint8_t *pc);
+
+static JSJitCode *js_jit_compile(JSContext *ctx, JSFunctionBytecode *b);
+static int js_jit_run(JSContext *ctx, JSStackFrame *sf, JSVarRef **var_refs,
+                      JSValueConst this_obj, const uint8_t *entry,
+                      const uint8_t **ppc, JSValue **psp);
+
+/* return the native code address of 'pc' or NULL if the function is
+   not compiled. */
+static inline const uint8_t *js_jit_get_entry(JSContext *ctx,
+                                              JSFunctionBytecode *b,
+                                              const uint8_t *pc)
+{
+    JSJitCode *jc = b->jit_code;
+    uint32_t ofs;
+
+    if (!jc) {
+        /* a failed compilation is not retried */
+        if (b->jit_counter >= JS_JIT_THRESHOLD ||
+            ++b->jit_counter < JS_JIT_THRESHOLD)
+            return NULL;
+        jc = js_jit_compile(ctx, b);
+        if (!jc)
+            return NULL;
+    }
+    ofs = jc->pc_map[pc - b->byte_code_buf];
+    if (ofs == 0)
+        return NULL;
+    return jc->code + ofs;
+}
+
+/* backward branch: poll the interrupts and try to continue in the
+   native code */
+#define JIT_LOOP_BRANCH(cond)                           \
+    do {                                                \
+        if (cond) {                                     \
+            if (unlikely(js_poll_interrupts(ctx)))      \
+                goto exception;                         \
+            goto jit_loop;                              \
+        }                                               \
+    } while (0)
+#else
+#define JIT_LOOP_BRANCH(cond) do { } while (0)
+#endif /* CONFIG_JIT */
+
+/* return TRUE if the tail call of 'func_obj' from the strict mode
+   function 'b' can reuse the stack frame of 'b'. 'stack_buf' to
+   'call_argv' are the stack values below the called function. */
+static BOOL js_can_reuse_frame(JSRuntime *rt, JSFunctionBytecode *b,
+                               JSValueConst func_obj, const JSValue *stack_buf,
+                               const JSValue *call_argv)
+{
+    JSObject *p;
+    const JSValue *pval;
+
+    if (!rt->tail_calls || !(b->js_mode & JS_MODE_STRICT) ||
+        b->func_kind != JS_FUNC_NORMAL)
+        return FALSE;
+    if (JS_VALUE_GET_TAG(func_obj) != JS_TAG_OBJECT)
+        return FALSE;
+    p = JS_VALUE_GET_OBJ(func_obj);
+    if (p->class_id != JS_CLASS_BYTECODE_FUNCTION ||
+        p->u.func.function_bytecode->func_kind != JS_FUNC_NORMAL)
+        return FALSE;
+    /* no exception handler must be active in the frame */
+    for(pval = stack_buf; pval < call_argv; pval++) {
+        if (JS_VALUE_GET_TAG(*pval) == JS_TAG_CATCH_OFFSET)
+            return FALSE;
+    }
+    return TRUE;
+}
+
 /* argv[] is modified if (flags & JS_CALL_FLAG_COPY_ARGV) = 0. */
 static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                                JSValueConst this_obj, JSValueConst new_target,
@@ -17366,7 +18984,10 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
     int opcode, arg_allocated_size, i;
     JSValue *local_buf, *stack_buf, *var_buf, *arg_buf, *sp, ret_val, *pval;
     JSVarRef **var_refs;
-    size_t alloca_size;
+    size_t alloca_size = 0; /* not set when resuming a generator */
+#ifdef CONFIG_JIT
+    const uint8_t *jit_entry;
+#endif
 
 #if !DIRECT_DISPATCH
 #define SWITCH(pc)      switch (opcode = *pc++)
@@ -17389,6 +19010,18 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
 #define DEFAULT         case_default
 #define BREAK           SWITCH(pc)
 #endif
+    /* rewrite the current one byte opcode with its quickened variant */
+#define QUICKEN(op)                                             \
+    do {                                                        \
+        if (!b->read_only_bytecode)                             \
+            ((uint8_t *)pc)[-1] = (op);                         \
+    } while (0)
+    /* revert a quickened opcode and execute the generic one */
+#define UNQUICKEN(op)                                           \
+    do {                                                        \
+        pc--;                                                   \
+        *(uint8_t *)pc = (op);                                  \
+    } while (0)
 
     if (js_poll_interrupts(caller_ctx))
         return JS_EXCEPTION;
@@ -17476,6 +19109,15 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
     rt->current_stack_frame = sf;
     ctx = b->realm; /* set the current realm */
 
+ tail_call_start:
+#ifdef CONFIG_JIT
+ jit_loop:
+    jit_entry = js_jit_get_entry(ctx, b, pc);
+    if (jit_entry) {
+        if (js_jit_run(ctx, sf, var_refs, this_obj, jit_entry, &pc, &sp))
+            goto exception;
+    }
+#endif
  restart:
     for(;;) {
         int call_argc;
@@ -17794,6 +19436,10 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             has_call_argc:
                 call_argv = sp - call_argc;
                 sf->cur_pc = pc;
+                if (opcode == OP_tail_call &&
+                    js_can_reuse_frame(rt, b, call_argv[-1], stack_buf,
+                                       call_argv - 1))
+                    goto tail_call;
                 ret_val = JS_CallInternal(ctx, call_argv[-1], JS_UNDEFINED,
                                           JS_UNDEFINED, call_argc, call_argv, 0);
                 if (unlikely(JS_IsException(ret_val)))
@@ -17830,6 +19476,10 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 pc += 2;
                 call_argv = sp - call_argc;
                 sf->cur_pc = pc;
+                if (opcode == OP_tail_call_method &&
+                    js_can_reuse_frame(rt, b, call_argv[-1], stack_buf,
+                                       call_argv - 2))
+                    goto tail_call;
                 ret_val = JS_CallInternal(ctx, call_argv[-1], call_argv[-2],
                                           JS_UNDEFINED, call_argc, call_argv, 0);
                 if (unlikely(JS_IsException(ret_val)))
@@ -17842,6 +19492,73 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 *sp++ = ret_val;
             }
             BREAK;
+        tail_call:
+            /* proper tail call: the stack frame is reused for the
+               called function. The frame then owns 'this', the function
+               and the arguments, stored at the start of local_buf. */
+            {
+                JSFunctionBytecode *b1;
+                JSValue *new_buf, *call_this;
+                size_t size;
+
+                if (unlikely(js_poll_interrupts(ctx)))
+                    goto exception;
+                call_this = call_argv - 1 - (opcode == OP_tail_call_method);
+                p = JS_VALUE_GET_OBJ(call_argv[-1]);
+                b1 = p->u.func.function_bytecode;
+                arg_allocated_size = 2 + max_int(call_argc, b1->arg_count);
+                size = sizeof(JSValue) * (arg_allocated_size + b1->var_count +
+                                          b1->stack_size) +
+                    sizeof(JSVarRef *) * b1->var_ref_count;
+                new_buf = local_buf;
+                if (size > alloca_size) {
+                    if (js_check_stack_overflow(rt, size)) {
+                        JS_ThrowStackOverflow(caller_ctx);
+                        goto exception;
+                    }
+                    new_buf = alloca(size);
+                    alloca_size = size;
+                }
+
+                /* free the current frame */
+                if (unlikely(b->var_ref_count != 0))
+                    close_var_refs(rt, b, sf);
+                for(pval = local_buf; pval < call_this; pval++)
+                    JS_FreeValue(ctx, *pval);
+                if (opcode == OP_tail_call_method) {
+                    memmove(new_buf, call_this, sizeof(JSValue) * (call_argc + 2));
+                } else {
+                    memmove(new_buf + 1, call_this,
+                            sizeof(JSValue) * (call_argc + 1));
+                    new_buf[0] = JS_UNDEFINED;
+                }
+
+                b = b1;
+                local_buf = new_buf;
+                this_obj = local_buf[0];
+                new_target = JS_UNDEFINED;
+                argc = call_argc;
+                argv = arg_buf = local_buf + 2;
+                for(i = argc; i < b->arg_count; i++)
+                    arg_buf[i] = JS_UNDEFINED;
+                sf->js_mode = b->js_mode;
+                sf->arg_count = arg_allocated_size - 2;
+                sf->cur_func = local_buf[1];
+                var_buf = local_buf + arg_allocated_size;
+                sf->var_buf = var_buf;
+                sf->arg_buf = arg_buf;
+                for(i = 0; i < b->var_count; i++)
+                    var_buf[i] = JS_UNDEFINED;
+                stack_buf = var_buf + b->var_count;
+                sf->var_refs = (JSVarRef **)(stack_buf + b->stack_size);
+                for(i = 0; i < b->var_ref_count; i++)
+                    sf->var_refs[i] = NULL;
+                sp = stack_buf;
+                pc = b->byte_code_buf;
+                var_refs = p->u.func.var_refs;
+                ctx = b->realm;
+                goto tail_call_start;
+            }
         CASE(OP_array_from):
             call_argc = get_u16(pc);
             pc += 2;
@@ -17859,7 +19576,31 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 pc += 2;
                 sf->cur_pc = pc;
 
-                ret_val = js_function_apply(ctx, sp[-3], 2, (JSValueConst *)&sp[-2], magic);
+                /* the argument array built by the spread operator is
+                   not visible to the program, so its storage is used
+                   directly as the argument list when it is fast */
+                p = JS_VALUE_GET_OBJ(sp[-1]);
+                if (JS_VALUE_GET_TAG(sp[-1]) == JS_TAG_OBJECT &&
+                    p->class_id == JS_CLASS_ARRAY && p->fast_array &&
+                    p->u.array.count <= JS_MAX_LOCAL_VARS &&
+                    JS_VALUE_GET_TAG(p->prop[0].u.value) == JS_TAG_INT &&
+                    JS_VALUE_GET_INT(p->prop[0].u.value) == p->u.array.count) {
+                    if (magic & 1) {
+                        if (!JS_IsFunction(ctx, sp[-3])) {
+                            JS_ThrowTypeError(ctx, "not a function");
+                            goto exception;
+                        }
+                        ret_val = JS_CallConstructorInternal(ctx, sp[-3], sp[-2],
+                                                             p->u.array.count,
+                                                             p->u.array.u.values, 0);
+                    } else {
+                        ret_val = JS_CallInternal(ctx, sp[-3], sp[-2],
+                                                  JS_UNDEFINED, p->u.array.count,
+                                                  p->u.array.u.values, 0);
+                    }
+                } else {
+                    ret_val = js_function_apply(ctx, sp[-3], 2, (JSValueConst *)&sp[-2], magic);
+                }
                 if (unlikely(JS_IsException(ret_val)))
                     goto exception;
                 JS_FreeValue(ctx, sp[-3]);
@@ -18426,18 +20167,30 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             BREAK;
 
         CASE(OP_goto):
-            pc += (int32_t)get_u32(pc);
+            {
+                int32_t diff = get_u32(pc);
+                pc += diff;
+                JIT_LOOP_BRANCH(diff < 0);
+            }
             if (unlikely(js_poll_interrupts(ctx)))
                 goto exception;
             BREAK;
 #if SHORT_OPCODES
         CASE(OP_goto16):
-            pc += (int16_t)get_u16(pc);
+            {
+                int diff = (int16_t)get_u16(pc);
+                pc += diff;
+                JIT_LOOP_BRANCH(diff < 0);
+            }
             if (unlikely(js_poll_interrupts(ctx)))
                 goto exception;
             BREAK;
         CASE(OP_goto8):
-            pc += (int8_t)pc[0];
+            {
+                int diff = (int8_t)pc[0];
+                pc += diff;
+                JIT_LOOP_BRANCH(diff < 0);
+            }
             if (unlikely(js_poll_interrupts(ctx)))
                 goto exception;
             BREAK;
@@ -18456,7 +20209,9 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 }
                 sp--;
                 if (res) {
-                    pc += (int32_t)get_u32(pc - 4) - 4;
+                    int32_t diff = (int32_t)get_u32(pc - 4) - 4;
+                    pc += diff;
+                    JIT_LOOP_BRANCH(diff < 0);
                 }
                 if (unlikely(js_poll_interrupts(ctx)))
                     goto exception;
@@ -18477,7 +20232,9 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 }
                 sp--;
                 if (!res) {
-                    pc += (int32_t)get_u32(pc - 4) - 4;
+                    int32_t diff = (int32_t)get_u32(pc - 4) - 4;
+                    pc += diff;
+                    JIT_LOOP_BRANCH(diff < 0);
                 }
                 if (unlikely(js_poll_interrupts(ctx)))
                     goto exception;
@@ -18498,7 +20255,9 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 }
                 sp--;
                 if (res) {
-                    pc += (int8_t)pc[-1] - 1;
+                    int diff = (int8_t)pc[-1] - 1;
+                    pc += diff;
+                    JIT_LOOP_BRANCH(diff < 0);
                 }
                 if (unlikely(js_poll_interrupts(ctx)))
                     goto exception;
@@ -18518,7 +20277,9 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 }
                 sp--;
                 if (!res) {
-                    pc += (int8_t)pc[-1] - 1;
+                    int diff = (int8_t)pc[-1] - 1;
+                    pc += diff;
+                    JIT_LOOP_BRANCH(diff < 0);
                 }
                 if (unlikely(js_poll_interrupts(ctx)))
                     goto exception;
@@ -18780,6 +20541,94 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             BREAK;
 #endif
             
+#define GET_FIELD_IC(name, keep)                                        \
+            {                                                           \
+                JSValue val, obj;                                       \
+                JSAtom atom;                                            \
+                JSObject *p, *p1;                                       \
+                JSShape *sh;                                            \
+                JSInlineCacheEntry *e;                                  \
+                int ic_idx;                                             \
+                                                                        \
+                atom = get_u32(pc);                                     \
+                ic_idx = get_u16(pc + 4);                               \
+                pc += 6;                                                \
+                                                                        \
+                obj = sp[-1];                                           \
+                if (likely(JS_VALUE_GET_TAG(obj) == JS_TAG_OBJECT && b->ic)) { \
+                    /* monomorphic case */                              \
+                    p = JS_VALUE_GET_OBJ(obj);                          \
+                    sh = p->shape;                                      \
+                    e = &b->ic[ic_idx].entries[0];                      \
+                    if (likely(e->shape == sh && e->shape_id == sh->id)) { \
+                        if (likely(e->proto_shape_id == 0)) {           \
+                            val = JS_DupValue(ctx, p->prop[e->prop_idx].u.value); \
+                            goto name ## _done;                         \
+                        }                                               \
+                        p1 = sh->proto;                                 \
+                        if (likely(p1->shape->id == e->proto_shape_id && \
+                                   js_ic_proto_lookup_ok(rt, p, atom))) { \
+                            val = JS_DupValue(ctx, p1->prop[e->prop_idx].u.value); \
+                            goto name ## _done;                         \
+                        }                                               \
+                    }                                                   \
+                }                                                       \
+                sf->cur_pc = pc;                                        \
+                val = js_get_field_ic_slow(ctx, b, ic_idx, obj, atom);  \
+                if (unlikely(JS_IsException(val)))                      \
+                    goto exception;                                     \
+            name ## _done:                                              \
+                if (keep) {                                             \
+                    *sp++ = val;                                        \
+                } else {                                                \
+                    JS_FreeValue(ctx, sp[-1]);                          \
+                    sp[-1] = val;                                       \
+                }                                                       \
+            }
+
+        CASE(OP_get_field_ic):
+            GET_FIELD_IC(get_field_ic, 0);
+            BREAK;
+
+        CASE(OP_get_field2_ic):
+            GET_FIELD_IC(get_field2_ic, 1);
+            BREAK;
+
+        CASE(OP_put_field_ic):
+            {
+                int ret, ic_idx;
+                JSValue obj;
+                JSAtom atom;
+                JSObject *p;
+                JSShape *sh;
+                JSInlineCacheEntry *e;
+
+                atom = get_u32(pc);
+                ic_idx = get_u16(pc + 4);
+                pc += 6;
+
+                obj = sp[-2];
+                if (likely(JS_VALUE_GET_TAG(obj) == JS_TAG_OBJECT && b->ic)) {
+                    /* monomorphic case */
+                    p = JS_VALUE_GET_OBJ(obj);
+                    sh = p->shape;
+                    e = &b->ic[ic_idx].entries[0];
+                    if (likely(e->shape == sh && e->shape_id == sh->id)) {
+                        set_value(ctx, &p->prop[e->prop_idx].u.value, sp[-1]);
+                        JS_FreeValue(ctx, obj);
+                        sp -= 2;
+                        BREAK;
+                    }
+                }
+                sf->cur_pc = pc;
+                ret = js_put_field_ic_slow(ctx, b, ic_idx, obj, atom, sp[-1]);
+                JS_FreeValue(ctx, obj);
+                sp -= 2;
+                if (unlikely(ret < 0))
+                    goto exception;
+            }
+            BREAK;
+
         CASE(OP_put_field):
             {
                 int ret;
@@ -19015,6 +20864,8 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                         goto name ## _slow_path;                        \
                     if (unlikely(idx >= p->u.array.count))              \
                         goto name ## _slow_path;                        \
+                    if (!keep)                                          \
+                        QUICKEN(OP_get_array_el_fast_int);              \
                     val = JS_DupValue(ctx, p->u.array.u.values[idx]);   \
                 } else {                                                \
                     name ## _slow_path:                                 \
@@ -19041,6 +20892,29 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             GET_ARRAY_EL_INLINE(get_array_el, 0);
             BREAK;
 
+        CASE(OP_get_array_el_fast_int):
+            {
+                JSValue val;
+                JSObject *p;
+                uint32_t idx;
+
+                if (likely(JS_VALUE_GET_TAG(sp[-2]) == JS_TAG_OBJECT &&
+                           JS_VALUE_GET_TAG(sp[-1]) == JS_TAG_INT)) {
+                    p = JS_VALUE_GET_OBJ(sp[-2]);
+                    idx = JS_VALUE_GET_INT(sp[-1]);
+                    if (likely(p->class_id == JS_CLASS_ARRAY &&
+                               idx < p->u.array.count)) {
+                        val = JS_DupValue(ctx, p->u.array.u.values[idx]);
+                        JS_FreeValue(ctx, sp[-2]);
+                        sp[-2] = val;
+                        sp--;
+                        BREAK;
+                    }
+                }
+                UNQUICKEN(OP_get_array_el);
+            }
+            BREAK;
+
         CASE(OP_get_array_el2):
             GET_ARRAY_EL_INLINE(get_array_el2, 1);
             BREAK;
@@ -19306,6 +21180,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 op2 = sp[-1];
                 if (likely(JS_VALUE_IS_BOTH_INT(op1, op2))) {
                     int64_t r;
+                    QUICKEN(OP_add_int32);
                     r = (int64_t)JS_VALUE_GET_INT(op1) + JS_VALUE_GET_INT(op2);
                     if (unlikely((int)r != r)) {
                         sp[-2] = __JS_NewFloat64(ctx, (double)r);
@@ -19386,6 +21261,7 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 op2 = sp[-1];
                 if (likely(JS_VALUE_IS_BOTH_INT(op1, op2))) {
                     int64_t r;
+                    QUICKEN(OP_sub_int32);
                     r = (int64_t)JS_VALUE_GET_INT(op1) - JS_VALUE_GET_INT(op2);
                     if (unlikely((int)r != r)) {
                         sp[-2] = __JS_NewFloat64(ctx, (double)r);
@@ -19472,6 +21348,30 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 }
             }
             BREAK;
+#define OP_ARITH_INT32(opcode, binary_op, generic_op)                   \
+        CASE(opcode):                                                   \
+            {                                                           \
+                JSValue op1, op2;                                       \
+                int64_t r;                                              \
+                op1 = sp[-2];                                           \
+                op2 = sp[-1];                                           \
+                if (unlikely(!JS_VALUE_IS_BOTH_INT(op1, op2))) {        \
+                    UNQUICKEN(generic_op);                              \
+                    BREAK;                                              \
+                }                                                       \
+                r = (int64_t)JS_VALUE_GET_INT(op1) binary_op JS_VALUE_GET_INT(op2); \
+                if (unlikely((int)r != r)) {                            \
+                    sp[-2] = __JS_NewFloat64(ctx, (double)r);           \
+                } else {                                                \
+                    sp[-2] = JS_NewInt32(ctx, r);                       \
+                }                                                       \
+                sp--;                                                   \
+            }                                                           \
+            BREAK
+
+            OP_ARITH_INT32(OP_add_int32, +, OP_add);
+            OP_ARITH_INT32(OP_sub_int32, -, OP_sub);
+
         CASE(OP_pow):
         binary_arith_slow:
             sf->cur_pc = pc;
@@ -19786,13 +21686,15 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
             BREAK;
 
 
-#define OP_CMP(opcode, binary_op, slow_call)              \
+#define OP_CMP(opcode, binary_op, slow_call, quick_op)    \
             CASE(opcode):                                 \
                 {                                         \
                 JSValue op1, op2;                         \
                 op1 = sp[-2];                             \
                 op2 = sp[-1];                                   \
                 if (likely(JS_VALUE_IS_BOTH_INT(op1, op2))) {           \
+                    if (quick_op)                                       \
+                        QUICKEN(quick_op);                              \
                     sp[-2] = JS_NewBool(ctx, JS_VALUE_GET_INT(op1) binary_op JS_VALUE_GET_INT(op2)); \
                     sp--;                                               \
                 } else {                                                \
@@ -19804,14 +21706,50 @@ static JSValue JS_CallInternal(JSContext *caller_ctx, JSValueConst func_obj,
                 }                                                       \
             BREAK
 
-            OP_CMP(OP_lt, <, js_relational_slow(ctx, sp, opcode));
-            OP_CMP(OP_lte, <=, js_relational_slow(ctx, sp, opcode));
-            OP_CMP(OP_gt, >, js_relational_slow(ctx, sp, opcode));
-            OP_CMP(OP_gte, >=, js_relational_slow(ctx, sp, opcode));
-            OP_CMP(OP_eq, ==, js_eq_slow(ctx, sp, 0));
-            OP_CMP(OP_neq, !=, js_eq_slow(ctx, sp, 1));
-            OP_CMP(OP_strict_eq, ==, js_strict_eq_slow(ctx, sp, 0));
-            OP_CMP(OP_strict_neq, !=, js_strict_eq_slow(ctx, sp, 1));
+            OP_CMP(OP_lt, <, js_relational_slow(ctx, sp, opcode), OP_lt_int32);
+            OP_CMP(OP_lte, <=, js_relational_slow(ctx, sp, opcode), OP_lte_int32);
+            OP_CMP(OP_gt, >, js_relational_slow(ctx, sp, opcode), OP_gt_int32);
+            OP_CMP(OP_gte, >=, js_relational_slow(ctx, sp, opcode), OP_gte_int32);
+            OP_CMP(OP_eq, ==, js_eq_slow(ctx, sp, 0), 0);
+            OP_CMP(OP_neq, !=, js_eq_slow(ctx, sp, 1), 0);
+            OP_CMP(OP_strict_eq, ==, js_strict_eq_slow(ctx, sp, 0), 0);
+            OP_CMP(OP_strict_neq, !=, js_strict_eq_slow(ctx, sp, 1), 0);
+
+            /* the int32 comparisons are fused with a following
+               if_false (loop condition) */
+#define OP_CMP_INT32(opcode, binary_op, generic_op)                     \
+            CASE(opcode):                                               \
+                {                                                       \
+                JSValue op1, op2;                                       \
+                int res, diff;                                          \
+                op1 = sp[-2];                                           \
+                op2 = sp[-1];                                           \
+                if (unlikely(!JS_VALUE_IS_BOTH_INT(op1, op2))) {        \
+                    UNQUICKEN(generic_op);                              \
+                    BREAK;                                              \
+                }                                                       \
+                res = JS_VALUE_GET_INT(op1) binary_op JS_VALUE_GET_INT(op2); \
+                if (*pc == OP_if_false8) {                              \
+                    diff = res ? 2 : (int8_t)pc[1] + 1;                 \
+                } else if (*pc == OP_if_false) {                        \
+                    diff = res ? 5 : (int32_t)get_u32(pc + 1) + 1;      \
+                } else {                                                \
+                    sp[-2] = JS_NewBool(ctx, res);                      \
+                    sp--;                                               \
+                    BREAK;                                              \
+                }                                                       \
+                sp -= 2;                                                \
+                pc += diff;                                             \
+                JIT_LOOP_BRANCH(diff < 0);                              \
+                if (unlikely(js_poll_interrupts(ctx)))                  \
+                    goto exception;                                     \
+                }                                                       \
+            BREAK
+
+            OP_CMP_INT32(OP_lt_int32, <, OP_lt);
+            OP_CMP_INT32(OP_lte_int32, <=, OP_lte);
+            OP_CMP_INT32(OP_gt_int32, >, OP_gt);
+            OP_CMP_INT32(OP_gte_int32, >=, OP_gte);
 
         CASE(OP_in):
             sf->cur_pc = pc;
@@ -20425,6 +22363,8 @@ static void async_func_free(JSRuntime *rt, JSAsyncFunctionState *s)
             if (rt->gc_phase == JS_GC_PHASE_NONE) {
                 free_zero_refcount(rt);
             }
+        } else if (s->header.mark == 0) {
+            gc_free_later(rt, &s->header);
         }
     }
 }
@@ -21500,6 +23440,8 @@ typedef struct JSFunctionDef {
     int jump_size;
     int jump_count;
 
+    int ic_count; /* number of inline cache sites (set in resolve_labels) */
+
     LineNumberSlot *line_number_slots;
     int line_number_size;
     int line_number_count;
@@ -21598,6 +23540,26 @@ static const JSOpCode opcode_info[OP_COUNT + (OP_TEMP_END - OP_TEMP_START)] = {
 #define short_opcode_info(op) opcode_info[op]
 #endif
 
+/* return the generic opcode of a quickened opcode */
+static inline int js_generic_opcode(int op)
+{
+    switch(op) {
+    case OP_add_int32:
+        return OP_add;
+    case OP_sub_int32:
+        return OP_sub;
+    case OP_lt_int32:
+    case OP_lte_int32:
+    case OP_gt_int32:
+    case OP_gte_int32:
+        return op - OP_lt_int32 + OP_lt;
+    case OP_get_array_el_fast_int:
+        return OP_get_array_el;
+    default:
+        return op;
+    }
+}
+
 static __exception int next_token(JSParseState *s);
 
 static void free_token(JSParseState *s, JSToken *token)
@@ -23409,6 +25371,260 @@ static __exception int emit_push_const(JSParseState *s, JSValueConst val,
     return 0;
 }
 
+/* Constant folding: the operands of an operator are folded if they
+   are single instructions pushing primitive constants. */
+
+/* If the instruction at 'pos' pushes a primitive constant, return its
+   length and the constant in '*pval'. Otherwise return 0. */
+static int js_get_const_push(JSParseState *s, int pos, JSValue *pval)
+{
+    JSFunctionDef *fd = s->cur_func;
+    const uint8_t *p;
+    JSValue val;
+    int op;
+
+    if (pos >= fd->byte_code.size || dbuf_error(&fd->byte_code))
+        return 0;
+    p = fd->byte_code.buf + pos;
+    op = p[0];
+    switch(op) {
+    case OP_push_i32:
+        val = JS_NewInt32(s->ctx, get_u32(p + 1));
+        break;
+    case OP_push_const:
+        val = fd->cpool[get_u32(p + 1)];
+        if (JS_VALUE_GET_TAG(val) != JS_TAG_STRING &&
+            JS_VALUE_GET_TAG(val) != JS_TAG_FLOAT64)
+            return 0;
+        val = JS_DupValue(s->ctx, val);
+        break;
+    case OP_push_atom_value:
+        val = JS_AtomToString(s->ctx, get_u32(p + 1));
+        if (JS_IsException(val))
+            return 0;
+        break;
+    case OP_undefined:
+        val = JS_UNDEFINED;
+        break;
+    case OP_null:
+        val = JS_NULL;
+        break;
+    case OP_push_false:
+    case OP_push_true:
+        val = JS_NewBool(s->ctx, op == OP_push_true);
+        break;
+    default:
+        return 0;
+    }
+    *pval = val;
+    return opcode_info[op].size;
+}
+
+/* remove the constant pushes from 'pos' to the end of the byte code */
+static void js_remove_const_pushes(JSParseState *s, int pos)
+{
+    JSFunctionDef *fd = s->cur_func;
+    const uint8_t *p;
+    int i, cpool_idx;
+
+    cpool_idx = fd->cpool_count;
+    for(i = pos; i < fd->byte_code.size; i += opcode_info[p[0]].size) {
+        p = fd->byte_code.buf + i;
+        switch(p[0]) {
+        case OP_push_atom_value:
+        case OP_get_field2:
+            JS_FreeAtom(s->ctx, get_u32(p + 1));
+            break;
+        case OP_push_const:
+            cpool_idx = min_int(cpool_idx, get_u32(p + 1));
+            break;
+        }
+    }
+    /* the constant pool entries added by these instructions are the
+       last ones */
+    while (fd->cpool_count > cpool_idx)
+        JS_FreeValue(s->ctx, fd->cpool[--fd->cpool_count]);
+    fd->byte_code.size = pos;
+    fd->last_opcode_pos = -1;
+}
+
+/* emit the push of the primitive constant 'val' and free it */
+static int emit_push_value(JSParseState *s, JSValue val)
+{
+    int ret;
+
+    switch(JS_VALUE_GET_TAG(val)) {
+    case JS_TAG_INT:
+        emit_op(s, OP_push_i32);
+        emit_u32(s, JS_VALUE_GET_INT(val));
+        return 0;
+    case JS_TAG_BOOL:
+        emit_op(s, JS_VALUE_GET_BOOL(val) ? OP_push_true : OP_push_false);
+        return 0;
+    case JS_TAG_NULL:
+        emit_op(s, OP_null);
+        return 0;
+    case JS_TAG_UNDEFINED:
+        emit_op(s, OP_undefined);
+        return 0;
+    case JS_TAG_STRING_ROPE:
+        val = JS_ToStringFree(s->ctx, val);
+        if (JS_IsException(val))
+            return -1;
+        /* fall thru */
+    default:
+        ret = emit_push_const(s, val, JS_VALUE_GET_TAG(val) == JS_TAG_STRING);
+        JS_FreeValue(s->ctx, val);
+        return ret;
+    }
+}
+
+/* Fold the unary operator 'op' if its operand, from 'pos' to the end of
+   the byte code, is a constant. Return TRUE if folded. */
+static BOOL js_fold_unary_op(JSParseState *s, int op, int pos)
+{
+    JSContext *ctx = s->ctx;
+    JSValue stack[1], *sp = stack + 1, val;
+    int len, ret;
+
+    len = js_get_const_push(s, pos, &stack[0]);
+    if (len == 0)
+        return FALSE;
+    if (pos + len != s->cur_func->byte_code.size) {
+        JS_FreeValue(ctx, stack[0]);
+        return FALSE;
+    }
+    switch(op) {
+    case OP_neg:
+    case OP_plus:
+        ret = js_unary_arith_slow(ctx, sp, op);
+        break;
+    case OP_not:
+        ret = js_not_slow(ctx, sp);
+        break;
+    case OP_lnot:
+        sp[-1] = JS_NewBool(ctx, !JS_ToBoolFree(ctx, sp[-1]));
+        ret = 0;
+        break;
+    case OP_typeof:
+        val = JS_AtomToString(ctx, js_operator_typeof(ctx, sp[-1]));
+        JS_FreeValue(ctx, sp[-1]);
+        sp[-1] = val;
+        ret = JS_IsException(val) ? -1 : 0;
+        break;
+    default:
+        abort();
+    }
+    if (ret) {
+        /* do not fold the operations raising an exception */
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return FALSE;
+    }
+    js_remove_const_pushes(s, pos);
+    emit_push_value(s, sp[-1]);
+    return TRUE;
+}
+
+/* Fold the binary operator 'op' if its operands, from 'pos' to the end
+   of the byte code, are constants. Return TRUE if folded. */
+static BOOL js_fold_binary_op(JSParseState *s, int op, int pos)
+{
+    JSContext *ctx = s->ctx;
+    JSValue stack[2], *sp = stack + 2;
+    int len1, len2, ret;
+
+    switch(op) {
+    case OP_add: case OP_sub: case OP_mul: case OP_div: case OP_mod:
+    case OP_pow: case OP_shl: case OP_sar: case OP_shr: case OP_and:
+    case OP_or: case OP_xor: case OP_lt: case OP_lte: case OP_gt:
+    case OP_gte: case OP_eq: case OP_neq: case OP_strict_eq:
+    case OP_strict_neq:
+        break;
+    default:
+        return FALSE;
+    }
+    len1 = js_get_const_push(s, pos, &stack[0]);
+    if (len1 == 0)
+        return FALSE;
+    len2 = js_get_const_push(s, pos + len1, &stack[1]);
+    if (len2 == 0) {
+        JS_FreeValue(ctx, stack[0]);
+        return FALSE;
+    }
+    if (pos + len1 + len2 != s->cur_func->byte_code.size) {
+        JS_FreeValue(ctx, stack[0]);
+        JS_FreeValue(ctx, stack[1]);
+        return FALSE;
+    }
+    switch(op) {
+    case OP_add:
+        ret = js_add_slow(ctx, sp);
+        break;
+    case OP_sub: case OP_mul: case OP_div: case OP_mod: case OP_pow:
+        ret = js_binary_arith_slow(ctx, sp, op);
+        break;
+    case OP_shr:
+        ret = js_shr_slow(ctx, sp);
+        break;
+    case OP_shl: case OP_sar: case OP_and: case OP_or: case OP_xor:
+        ret = js_binary_logic_slow(ctx, sp, op);
+        break;
+    case OP_eq: case OP_neq:
+        ret = js_eq_slow(ctx, sp, op == OP_neq);
+        break;
+    case OP_strict_eq: case OP_strict_neq:
+        ret = js_strict_eq_slow(ctx, sp, op == OP_strict_neq);
+        break;
+    default:
+        ret = js_relational_slow(ctx, sp, op);
+        break;
+    }
+    if (ret) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return FALSE;
+    }
+    js_remove_const_pushes(s, pos);
+    emit_push_value(s, sp[-2]);
+    return TRUE;
+}
+
+/* Fold a template literal whose substitutions are constants. The byte
+   code from 'pos' is the first string, get_field2 concat and the
+   'argc' arguments of concat(). Return TRUE if folded. */
+static BOOL js_fold_template(JSParseState *s, int pos, int argc)
+{
+    JSContext *ctx = s->ctx;
+    JSValue str, val;
+    int i, len, pos1;
+
+    len = js_get_const_push(s, pos, &str);
+    if (len == 0)
+        return FALSE;
+    pos1 = pos + len;
+    if (s->cur_func->byte_code.buf[pos1] != OP_get_field2)
+        goto fail;
+    pos1 += opcode_info[OP_get_field2].size;
+    for(i = 0; i < argc; i++) {
+        len = js_get_const_push(s, pos1, &val);
+        if (len == 0)
+            goto fail;
+        pos1 += len;
+        str = JS_ConcatString(ctx, str, val);
+        if (JS_IsException(str)) {
+            JS_FreeValue(ctx, JS_GetException(ctx));
+            return FALSE;
+        }
+    }
+    if (pos1 != s->cur_func->byte_code.size)
+        goto fail;
+    js_remove_const_pushes(s, pos);
+    emit_push_value(s, str);
+    return TRUE;
+ fail:
+    JS_FreeValue(ctx, str);
+    return FALSE;
+}
+
 /* return the variable index or -1 if not found,
    add ARGUMENT_VAR_OFFSET for argument variables */
 static int find_arg(JSContext *ctx, JSFunctionDef *fd, JSAtom name)
@@ -23906,7 +26122,7 @@ static __exception int js_parse_template(JSParseState *s, int call, int *argc)
     JSContext *ctx = s->ctx;
     JSValue raw_array, template_object;
     JSToken cooked;
-    int depth, ret;
+    int depth, ret, pos;
 
     raw_array = JS_UNDEFINED; /* avoid warning */
     template_object = JS_UNDEFINED; /* avoid warning */
@@ -23931,6 +26147,7 @@ static __exception int js_parse_template(JSParseState *s, int call, int *argc)
     }
 
     depth = 0;
+    pos = s->cur_func->byte_code.size;
     while (s->token.val == TOK_TEMPLATE) {
         const uint8_t *p = s->token.ptr + 1;
         cooked = s->token;
@@ -24003,7 +26220,7 @@ static __exception int js_parse_template(JSParseState *s, int call, int *argc)
         seal_template_obj(ctx, raw_array);
         seal_template_obj(ctx, template_object);
         *argc = depth + 1;
-    } else {
+    } else if (!js_fold_template(s, pos, depth - 1)) {
         emit_op(s, OP_call_method);
         emit_u16(s, depth - 1);
     }
@@ -27005,9 +29222,10 @@ static __exception int js_parse_delete(JSParseState *s)
 /* allowed parse_flags: PF_POW_ALLOWED, PF_POW_FORBIDDEN */
 static __exception int js_parse_unary(JSParseState *s, int parse_flags)
 {
-    int op;
+    int op, pos;
     const uint8_t *op_token_ptr;
 
+    pos = s->cur_func->byte_code.size;
     switch(s->token.val) {
     case '+':
     case '-':
@@ -27022,17 +29240,25 @@ static __exception int js_parse_unary(JSParseState *s, int parse_flags)
             return -1;
         switch(op) {
         case '-':
+            if (js_fold_unary_op(s, OP_neg, pos))
+                break;
             emit_source_pos(s, op_token_ptr);
             emit_op(s, OP_neg);
             break;
         case '+':
+            if (js_fold_unary_op(s, OP_plus, pos))
+                break;
             emit_source_pos(s, op_token_ptr);
             emit_op(s, OP_plus);
             break;
         case '!':
+            if (js_fold_unary_op(s, OP_lnot, pos))
+                break;
             emit_op(s, OP_lnot);
             break;
         case '~':
+            if (js_fold_unary_op(s, OP_not, pos))
+                break;
             emit_source_pos(s, op_token_ptr);
             emit_op(s, OP_not);
             break;
@@ -27077,7 +29303,8 @@ static __exception int js_parse_unary(JSParseState *s, int parse_flags)
             if (get_prev_opcode(fd) == OP_scope_get_var) {
                 fd->byte_code.buf[fd->last_opcode_pos] = OP_scope_get_var_undef;
             }
-            emit_op(s, OP_typeof);
+            if (!js_fold_unary_op(s, OP_typeof, pos))
+                emit_op(s, OP_typeof);
             parse_flags = 0;
         }
         break;
@@ -27135,8 +29362,10 @@ static __exception int js_parse_unary(JSParseState *s, int parse_flags)
                 return -1;
             if (js_parse_unary(s, PF_POW_ALLOWED))
                 return -1;
-            emit_source_pos(s, op_token_ptr);
-            emit_op(s, OP_pow);
+            if (!js_fold_binary_op(s, OP_pow, pos)) {
+                emit_source_pos(s, op_token_ptr);
+                emit_op(s, OP_pow);
+            }
         }
     }
     return 0;
@@ -27146,9 +29375,10 @@ static __exception int js_parse_unary(JSParseState *s, int parse_flags)
 static __exception int js_parse_expr_binary(JSParseState *s, int level,
                                             int parse_flags)
 {
-    int op, opcode;
+    int op, opcode, pos;
     const uint8_t *op_token_ptr;
     
+    pos = s->cur_func->byte_code.size;
     if (level == 0) {
         return js_parse_unary(s, PF_POW_ALLOWED);
     } else if (s->token.val == TOK_PRIVATE_NAME &&
@@ -27303,8 +29533,10 @@ static __exception int js_parse_expr_binary(JSParseState *s, int level,
             return -1;
         if (js_parse_expr_binary(s, level - 1, parse_flags))
             return -1;
-        emit_source_pos(s, op_token_ptr);
-        emit_op(s, opcode);
+        if (!js_fold_binary_op(s, opcode, pos)) {
+            emit_source_pos(s, op_token_ptr);
+            emit_op(s, opcode);
+        }
     }
     return 0;
 }
@@ -33942,6 +36174,214 @@ static __exception int resolve_variables(JSContext *ctx, JSFunctionDef *s)
     return -1;
 }
 
+/* recompute scope linkage */
+static void compute_scope_links(JSFunctionDef *fd)
+{
+    int scope, idx;
+
+    for (scope = 0; scope < fd->scope_count; scope++) {
+        fd->scopes[scope].first = -1;
+    }
+    if (fd->has_parameter_expressions) {
+        /* special end of variable list marker for the argument scope */
+        fd->scopes[ARG_SCOPE_INDEX].first = ARG_SCOPE_END;
+    }
+    for (idx = 0; idx < fd->var_count; idx++) {
+        JSVarDef *vd = &fd->vars[idx];
+        vd->scope_next = fd->scopes[vd->scope_level].first;
+        fd->scopes[vd->scope_level].first = idx;
+    }
+    for (scope = 2; scope < fd->scope_count; scope++) {
+        JSVarScope *sd = &fd->scopes[scope];
+        if (sd->first < 0)
+            sd->first = fd->scopes[sd->parent].first;
+    }
+    for (idx = 0; idx < fd->var_count; idx++) {
+        JSVarDef *vd = &fd->vars[idx];
+        if (vd->scope_next < 0 && vd->scope_level > 1) {
+            scope = fd->scopes[vd->scope_level].parent;
+            vd->scope_next = fd->scopes[scope].first;
+        }
+    }
+}
+
+static int var_scope_cmp(const void *p1, const void *p2, void *opaque)
+{
+    JSFunctionDef *s = opaque;
+    int idx1 = *(const int *)p1, idx2 = *(const int *)p2;
+    int scope1 = s->vars[idx1].scope_level, scope2 = s->vars[idx2].scope_level;
+
+    if (scope1 != scope2)
+        return (scope1 > scope2) - (scope1 < scope2);
+    return (idx1 > idx2) - (idx1 < idx2);
+}
+
+static inline void remap_var_idx(const int *var_map, int *pidx)
+{
+    if (*pidx >= 0)
+        *pidx = var_map[*pidx];
+}
+
+/* Share the slots of the local variables of disjoint block scopes.
+   The scopes are numbered in the preorder of the scope tree, so the
+   scopes nested in 'scope' are the interval [scope, scope_last[scope]].
+   Only the non captured variables of the scopes nested in the function
+   body are moved. It is only done when the debug information is
+   stripped: otherwise each variable keeps its name and its value stays
+   alive until the function returns. */
+static __exception int reuse_var_slots(JSContext *ctx, JSFunctionDef *s)
+{
+    int *scope_last, *var_map, *order, *slot_last, *slot_var;
+    uint8_t *has_check;
+    JSVarDef *vars;
+    int i, j, pos, op, len, scope, idx, order_count, slot_count, fixed_count;
+    int new_count;
+    uint8_t *bc_buf;
+    int ret = -1;
+
+    if (!s->strip_debug || s->has_eval_call || s->body_scope < 0 ||
+        s->var_count < 2)
+        return 0;
+    scope_last = js_malloc(ctx, sizeof(scope_last[0]) * s->scope_count);
+    var_map = js_malloc(ctx, (sizeof(var_map[0]) * 4 + 1) * s->var_count);
+    if (!scope_last || !var_map)
+        goto done;
+    order = var_map + s->var_count;
+    slot_last = order + s->var_count;
+    slot_var = slot_last + s->var_count;
+    has_check = (uint8_t *)(slot_var + s->var_count);
+
+    for(scope = 0; scope < s->scope_count; scope++)
+        scope_last[scope] = scope;
+    for(scope = s->scope_count - 1; scope > 0; scope--) {
+        j = s->scopes[scope].parent;
+        if (j < 0 || j >= scope)
+            goto done_ok;
+        scope_last[j] = max_int(scope_last[j], scope_last[scope]);
+    }
+
+    bc_buf = s->byte_code.buf;
+    memset(has_check, 0, s->var_count);
+    for(pos = 0; pos < s->byte_code.size; pos += len) {
+        op = bc_buf[pos];
+        len = opcode_info[op].size;
+        switch(op) {
+        case OP_get_loc_check:
+        case OP_put_loc_check:
+        case OP_set_loc_check:
+        case OP_put_loc_check_init:
+        case OP_get_loc_checkthis:
+            has_check[get_u16(bc_buf + pos + 1)] = 1;
+            break;
+        }
+    }
+
+    /* the other variables keep their order */
+    fixed_count = 0;
+    order_count = 0;
+    for(i = 0; i < s->var_count; i++) {
+        JSVarDef *vd = &s->vars[i];
+        if (!vd->is_captured && vd->scope_level > s->body_scope &&
+            vd->scope_level <= scope_last[s->body_scope]) {
+            order[order_count++] = i;
+        } else {
+            var_map[i] = fixed_count++;
+        }
+    }
+    if (order_count < 2)
+        goto done_ok;
+    rqsort(order, order_count, sizeof(order[0]), var_scope_cmp, s);
+
+    /* first fit: a slot is free once the scopes of its variables are
+       left */
+    slot_count = 0;
+    for(i = 0; i < order_count; i++) {
+        JSVarDef *vd;
+        idx = order[i];
+        vd = &s->vars[idx];
+        scope = vd->scope_level;
+        for(j = 0; j < slot_count; j++) {
+            if (slot_last[j] < scope)
+                break;
+        }
+        if (j == slot_count) {
+            slot_count++;
+            slot_var[j] = idx;
+        } else if (has_check[idx] && !has_check[slot_var[j]]) {
+            slot_var[j] = idx;
+        }
+        slot_last[j] = scope_last[scope];
+        var_map[idx] = fixed_count + j;
+    }
+    new_count = fixed_count + slot_count;
+    if (new_count == s->var_count)
+        goto done_ok;
+    vars = js_malloc(ctx, sizeof(vars[0]) * new_count);
+    if (!vars)
+        goto done;
+
+    /* update the variable indexes in the byte code */
+    for(pos = 0; pos < s->byte_code.size; pos += len) {
+        op = bc_buf[pos];
+        len = opcode_info[op].size;
+        if (opcode_info[op].fmt == OP_FMT_loc) {
+            put_u16(bc_buf + pos + 1, var_map[get_u16(bc_buf + pos + 1)]);
+        } else if (op == OP_make_loc_ref) {
+            put_u16(bc_buf + pos + 5, var_map[get_u16(bc_buf + pos + 5)]);
+        }
+    }
+
+    /* update the closure variables of the child functions (they are
+       already created) */
+    for(i = 0; i < s->cpool_count; i++) {
+        JSFunctionBytecode *b1;
+        if (JS_VALUE_GET_TAG(s->cpool[i]) != JS_TAG_FUNCTION_BYTECODE)
+            continue;
+        b1 = JS_VALUE_GET_PTR(s->cpool[i]);
+        for(j = 0; j < b1->closure_var_count; j++) {
+            JSClosureVar *cv = &b1->closure_var[j];
+            if (cv->closure_type == JS_CLOSURE_LOCAL)
+                cv->var_idx = var_map[cv->var_idx];
+        }
+    }
+
+    remap_var_idx(var_map, &s->var_object_idx);
+    remap_var_idx(var_map, &s->arg_var_object_idx);
+    remap_var_idx(var_map, &s->arguments_var_idx);
+    remap_var_idx(var_map, &s->arguments_arg_idx);
+    remap_var_idx(var_map, &s->func_var_idx);
+    remap_var_idx(var_map, &s->eval_ret_idx);
+    remap_var_idx(var_map, &s->this_var_idx);
+    remap_var_idx(var_map, &s->new_target_var_idx);
+    remap_var_idx(var_map, &s->this_active_func_var_idx);
+    remap_var_idx(var_map, &s->home_object_var_idx);
+
+    /* a shared slot keeps the definition of one of its variables */
+    for(i = 0; i < s->var_count; i++) {
+        JSVarDef *vd = &s->vars[i];
+        idx = var_map[i];
+        if (idx >= fixed_count && slot_var[idx - fixed_count] != i) {
+            JS_FreeAtom(ctx, vd->var_name);
+            continue;
+        }
+        vars[idx] = *vd;
+    }
+    js_free(ctx, s->vars);
+    s->vars = vars;
+    s->var_count = new_count;
+    s->var_size = new_count;
+    /* the scope chains cannot be remapped: the variables merged in a
+       slot may belong to different scopes and only the definition of
+       one of them is kept */
+    compute_scope_links(s);
+ done_ok:
+    ret = 0;
+ done:
+    js_free(ctx, var_map);
+    js_free(ctx, scope_last);
+    return ret;
+}
+
 /* the pc2line table gives a source position for each PC value */
 static void add_pc2line_info(JSFunctionDef *s, uint32_t pc, uint32_t source_pos)
 {
@@ -34133,6 +36573,20 @@ static void push_short_int(DynBuf *bc_out, int val)
     dbuf_put_u32(bc_out, val);
 }
 
+/* emit get_field, get_field2 or put_field with an inline cache slot */
+static void put_field_ic_code(JSFunctionDef *s, DynBuf *bc_out, int op,
+                              JSAtom atom)
+{
+    if (s->ic_count < JS_IC_MAX_COUNT) {
+        dbuf_putc(bc_out, op + (OP_get_field_ic - OP_get_field));
+        dbuf_put_u32(bc_out, atom);
+        dbuf_put_u16(bc_out, s->ic_count++);
+    } else {
+        dbuf_putc(bc_out, op);
+        dbuf_put_u32(bc_out, atom);
+    }
+}
+
 static void put_short_code(DynBuf *bc_out, int op, int idx)
 {
 #if SHORT_OPCODES
@@ -34350,6 +36804,34 @@ static __exception int resolve_labels(JSContext *ctx, JSFunctionDef *s)
                     pos_next = skip_dead_code(s, bc_buf, bc_len, cc.pos, &line_num);
                     break;
                 }
+                if (OPTIMIZE) {
+                    /* call followed by labels and return (end of a
+                       conditional expression): the labels and the
+                       return are kept for the other branches */
+                    int pos1 = pos_next;
+                    while (pos1 < bc_len && (bc_buf[pos1] == OP_label ||
+                                             bc_buf[pos1] == OP_line_num))
+                        pos1 += opcode_info[bc_buf[pos1]].size;
+                    if (pos1 < bc_len && bc_buf[pos1] == OP_return) {
+                        add_pc2line_info(s, bc_out.size, line_num);
+                        put_short_code(&bc_out, op + 1, argc);
+                        break;
+                    }
+                }
+                if (OPTIMIZE && code_match(&cc, pos_next, OP_goto, -1)) {
+                    /* call followed by a jump to return */
+                    label = find_jump_target(s, cc.label, &op1, NULL);
+                    if (op1 == OP_return) {
+                        update_label(s, label, -1);
+                        add_pc2line_info(s, bc_out.size, line_num);
+                        put_short_code(&bc_out, op + 1, argc);
+                        pos_next = skip_dead_code(s, bc_buf, bc_len, cc.pos, &line_num);
+                        break;
+                    }
+                    /* the goto is optimized later */
+                    update_label(s, label, -1);
+                    update_label(s, cc.label, +1);
+                }
                 add_pc2line_info(s, bc_out.size, line_num);
                 put_short_code(&bc_out, op, argc);
                 break;
@@ -34660,18 +37142,23 @@ static __exception int resolve_labels(JSContext *ctx, JSFunctionDef *s)
             }
             goto no_change;
 
+#endif
         case OP_get_field:
-            if (OPTIMIZE) {
+        case OP_get_field2:
+        case OP_put_field:
+            {
                 JSAtom atom = get_u32(bc_buf + pos + 1);
-                if (atom == JS_ATOM_length) {
+                add_pc2line_info(s, bc_out.size, line_num);
+#if SHORT_OPCODES
+                if (OPTIMIZE && op == OP_get_field && atom == JS_ATOM_length) {
                     JS_FreeAtom(ctx, atom);
-                    add_pc2line_info(s, bc_out.size, line_num);
                     dbuf_putc(&bc_out, OP_get_length);
                     break;
                 }
-            }
-            goto no_change;
 #endif
+                put_field_ic_code(s, &bc_out, op, atom);
+            }
+            break;
         case OP_push_atom_value:
             if (OPTIMIZE) {
                 JSAtom atom = get_u32(bc_buf + pos + 1);
@@ -34756,8 +37243,7 @@ static __exception int resolve_labels(JSContext *ctx, JSFunctionDef *s)
                 if (code_match(&cc, pos_next, OP_put_field, OP_drop, -1)) {
                     if (cc.line_num >= 0) line_num = cc.line_num;
                     add_pc2line_info(s, bc_out.size, line_num);
-                    dbuf_putc(&bc_out, OP_put_field);
-                    dbuf_put_u32(&bc_out, cc.atom);
+                    put_field_ic_code(s, &bc_out, OP_put_field, cc.atom);
                     pos_next = cc.pos;
                     break;
                 }
@@ -34925,8 +37411,7 @@ static __exception int resolve_labels(JSContext *ctx, JSFunctionDef *s)
                     if (cc.line_num >= 0) line_num = cc.line_num;
                     add_pc2line_info(s, bc_out.size, line_num);
                     dbuf_putc(&bc_out, OP_dec + (op - OP_post_dec));
-                    dbuf_putc(&bc_out, OP_put_field);
-                    dbuf_put_u32(&bc_out, cc.atom);
+                    put_field_ic_code(s, &bc_out, OP_put_field, cc.atom);
                     pos_next = cc.pos;
                     break;
                 }
@@ -35425,36 +37910,12 @@ static JSValue js_create_function(JSContext *ctx, JSFunctionDef *fd)
     JSValue func_obj;
     JSFunctionBytecode *b;
     struct list_head *el, *el1;
-    int stack_size, scope, idx;
+    int stack_size;
     int function_size, byte_code_offset, cpool_offset;
     int closure_var_offset, vardefs_offset;
     BOOL strip_var_debug;
     
-    /* recompute scope linkage */
-    for (scope = 0; scope < fd->scope_count; scope++) {
-        fd->scopes[scope].first = -1;
-    }
-    if (fd->has_parameter_expressions) {
-        /* special end of variable list marker for the argument scope */
-        fd->scopes[ARG_SCOPE_INDEX].first = ARG_SCOPE_END;
-    }
-    for (idx = 0; idx < fd->var_count; idx++) {
-        JSVarDef *vd = &fd->vars[idx];
-        vd->scope_next = fd->scopes[vd->scope_level].first;
-        fd->scopes[vd->scope_level].first = idx;
-    }
-    for (scope = 2; scope < fd->scope_count; scope++) {
-        JSVarScope *sd = &fd->scopes[scope];
-        if (sd->first < 0)
-            sd->first = fd->scopes[sd->parent].first;
-    }
-    for (idx = 0; idx < fd->var_count; idx++) {
-        JSVarDef *vd = &fd->vars[idx];
-        if (vd->scope_next < 0 && vd->scope_level > 1) {
-            scope = fd->scopes[vd->scope_level].parent;
-            vd->scope_next = fd->scopes[scope].first;
-        }
-    }
+    compute_scope_links(fd);
 
     /* if the function contains an eval call, the closure variables
        are used to compile the eval and they must be ordered by scope,
@@ -35499,6 +37960,9 @@ static JSValue js_create_function(JSContext *ctx, JSFunctionDef *fd)
     if (resolve_variables(ctx, fd))
         goto fail;
 
+    if (reuse_var_slots(ctx, fd))
+        goto fail;
+
 #if defined(DUMP_BYTECODE) && (DUMP_BYTECODE & 2)
     if (!fd->strip_debug) {
         printf("pass 2\n");
@@ -35598,6 +38062,7 @@ static JSValue js_create_function(JSContext *ctx, JSFunctionDef *fd)
     fd->cpool = NULL;
 
     b->stack_size = stack_size;
+    b->ic_count = fd->ic_count;
 
     if (fd->strip_debug) {
         JS_FreeAtom(ctx, fd->filename);
@@ -35679,6 +38144,1862 @@ static JSValue js_create_function(JSContext *ctx, JSFunctionDef *fd)
     return JS_EXCEPTION;
 }
 
+#ifdef CONFIG_JIT
+/* Baseline JIT (x86-64).
+
+   A hot function is translated opcode by opcode into native code
+   which works directly on the interpreter frame (var_buf, arg_buf
+   and the value stack). The stack depth before each opcode is known
+   at compile time, so the native code never maintains 'sp': it only
+   materializes when the code exits. Fast paths (int32 arithmetic,
+   monomorphic inline caches, dense arrays) are inline, slow paths
+   call the same C functions as the interpreter. Unsupported opcodes
+   and rare cases exit to the interpreter at the start of the opcode;
+   the interpreter re-enters the native code at the next backward
+   branch.
+
+   Register usage: rbx = ctx, r12 = var_buf, r13 = arg_buf,
+   r14 = stack_buf, r15 = JSJitFrame. */
+
+/* Helpers called from the native code. A JSJitHelper executes the
+   opcode at 'pc' with the stack pointer 'sp' and returns the new stack
+   pointer, or NULL after setting jf->pc and jf->sp for the exception
+   handler. */
+
+static JSValue *js_jit_exception(JSJitFrame *jf, JSValue *sp,
+                                 const uint8_t *pc)
+{
+    jf->pc = pc;
+    jf->sp = sp;
+    return NULL;
+}
+
+static void js_jit_free_value(JSContext *ctx, void *ptr, int64_t tag)
+{
+    __JS_FreeValueRT(ctx->rt, JS_MKPTR(tag, ptr));
+}
+
+static int js_jit_to_bool(JSContext *ctx, void *ptr, int64_t tag)
+{
+    return JS_ToBoolFree(ctx, JS_MKPTR(tag, ptr));
+}
+
+static JSValue *js_jit_op_push(JSJitFrame *jf, JSValue *sp, const uint8_t *pc)
+{
+    JSContext *ctx = jf->ctx;
+    JSFunctionBytecode *b = jf->b;
+    const uint8_t *next_pc = pc + short_opcode_info(pc[0]).size;
+    JSValue val;
+
+    jf->sf->cur_pc = next_pc;
+    switch(pc[0]) {
+    case OP_push_atom_value:
+        val = JS_AtomToValue(ctx, get_u32(pc + 1));
+        break;
+    case OP_push_empty_string:
+        val = JS_AtomToString(ctx, JS_ATOM_empty_string);
+        break;
+    case OP_fclosure:
+        val = js_closure(ctx, JS_DupValue(ctx, b->cpool[get_u32(pc + 1)]),
+                         jf->var_refs, jf->sf, FALSE);
+        break;
+    case OP_fclosure8:
+        val = js_closure(ctx, JS_DupValue(ctx, b->cpool[pc[1]]),
+                         jf->var_refs, jf->sf, FALSE);
+        break;
+    case OP_object:
+        val = JS_NewObject(ctx);
+        break;
+    case OP_push_this:
+        if (!(b->js_mode & JS_MODE_STRICT) &&
+            JS_VALUE_GET_TAG(jf->this_obj) != JS_TAG_OBJECT) {
+            if (JS_IsNull(jf->this_obj) || JS_IsUndefined(jf->this_obj))
+                val = JS_DupValue(ctx, ctx->global_obj);
+            else
+                val = JS_ToObject(ctx, jf->this_obj);
+        } else {
+            val = JS_DupValue(ctx, jf->this_obj);
+        }
+        break;
+    default:
+        abort();
+    }
+    if (unlikely(JS_IsException(val)))
+        return js_jit_exception(jf, sp, next_pc);
+    *sp++ = val;
+    return sp;
+}
+
+static JSValue *js_jit_op_call(JSJitFrame *jf, JSValue *sp, const uint8_t *pc)
+{
+    JSContext *ctx = jf->ctx;
+    const uint8_t *next_pc = pc + short_opcode_info(pc[0]).size;
+    JSValue ret_val, *call_argv;
+    int call_argc, i, n;
+
+    if (pc[0] == OP_call || pc[0] == OP_call_method)
+        call_argc = get_u16(pc + 1);
+    else
+        call_argc = pc[0] - OP_call0;
+    call_argv = sp - call_argc;
+    jf->sf->cur_pc = next_pc;
+    if (pc[0] == OP_call_method) {
+        ret_val = JS_CallInternal(ctx, call_argv[-1], call_argv[-2],
+                                  JS_UNDEFINED, call_argc, call_argv, 0);
+        n = 2;
+    } else {
+        ret_val = JS_CallInternal(ctx, call_argv[-1], JS_UNDEFINED,
+                                  JS_UNDEFINED, call_argc, call_argv, 0);
+        n = 1;
+    }
+    if (unlikely(JS_IsException(ret_val)))
+        return js_jit_exception(jf, sp, next_pc);
+    for(i = -n; i < call_argc; i++)
+        JS_FreeValue(ctx, call_argv[i]);
+    sp -= call_argc + n;
+    *sp++ = ret_val;
+    return sp;
+}
+
+static JSValue *js_jit_op_get_field(JSJitFrame *jf, JSValue *sp,
+                                    const uint8_t *pc)
+{
+    JSContext *ctx = jf->ctx;
+    const uint8_t *next_pc = pc + short_opcode_info(pc[0]).size;
+    JSValue val, obj;
+
+    obj = sp[-1];
+    jf->sf->cur_pc = next_pc;
+    switch(pc[0]) {
+    case OP_get_field_ic:
+    case OP_get_field2_ic:
+        val = js_get_field_ic_slow(ctx, jf->b, get_u16(pc + 5), obj,
+                                   get_u32(pc + 1));
+        break;
+    case OP_get_length:
+        val = JS_GetPropertyInternal(ctx, obj, JS_ATOM_length, obj, 0);
+        break;
+    default:
+        val = JS_GetPropertyInternal(ctx, obj, get_u32(pc + 1), obj, 0);
+        break;
+    }
+    if (unlikely(JS_IsException(val)))
+        return js_jit_exception(jf, sp, next_pc);
+    if (pc[0] == OP_get_field2_ic || pc[0] == OP_get_field2) {
+        *sp++ = val;
+    } else {
+        JS_FreeValue(ctx, obj);
+        sp[-1] = val;
+    }
+    return sp;
+}
+
+static JSValue *js_jit_op_put_field(JSJitFrame *jf, JSValue *sp,
+                                    const uint8_t *pc)
+{
+    JSContext *ctx = jf->ctx;
+    const uint8_t *next_pc = pc + short_opcode_info(pc[0]).size;
+    int ret;
+
+    jf->sf->cur_pc = next_pc;
+    ret = js_put_field_ic_slow(ctx, jf->b, get_u16(pc + 5), sp[-2],
+                               get_u32(pc + 1), sp[-1]);
+    JS_FreeValue(ctx, sp[-2]);
+    sp -= 2;
+    if (unlikely(ret < 0))
+        return js_jit_exception(jf, sp, next_pc);
+    return sp;
+}
+
+static JSValue *js_jit_op_get_array_el(JSJitFrame *jf, JSValue *sp,
+                                       const uint8_t *pc)
+{
+    JSContext *ctx = jf->ctx;
+    JSValue val;
+
+    jf->sf->cur_pc = pc + 1;
+    val = JS_GetPropertyValue(ctx, sp[-2], sp[-1]);
+    sp--;
+    if (unlikely(JS_IsException(val)))
+        return js_jit_exception(jf, sp, pc + 1);
+    JS_FreeValue(ctx, sp[-1]);
+    sp[-1] = val;
+    return sp;
+}
+
+static JSValue *js_jit_op_put_array_el(JSJitFrame *jf, JSValue *sp,
+                                       const uint8_t *pc)
+{
+    JSContext *ctx = jf->ctx;
+    int ret;
+
+    jf->sf->cur_pc = pc + 1;
+    ret = JS_SetPropertyValue(ctx, sp[-3], sp[-2], sp[-1],
+                              JS_PROP_THROW_STRICT);
+    JS_FreeValue(ctx, sp[-3]);
+    sp -= 3;
+    if (unlikely(ret < 0))
+        return js_jit_exception(jf, sp, pc + 1);
+    return sp;
+}
+
+/* OP_add_loc when the operands are not both int32 */
+static JSValue *js_jit_op_add_loc(JSJitFrame *jf, JSValue *sp,
+                                  const uint8_t *pc)
+{
+    JSContext *ctx = jf->ctx;
+    JSValue op2, *pv;
+
+    op2 = sp[-1];
+    pv = &jf->var_buf[pc[1]];
+    pc += 2;
+    sp--;
+    jf->sf->cur_pc = pc;
+    if (JS_VALUE_IS_BOTH_INT(*pv, op2)) {
+        int64_t r;
+        r = (int64_t)JS_VALUE_GET_INT(*pv) + JS_VALUE_GET_INT(op2);
+        if (unlikely((int)r != r))
+            *pv = __JS_NewFloat64(ctx, (double)r);
+        else
+            *pv = JS_NewInt32(ctx, r);
+    } else if (JS_VALUE_IS_BOTH_FLOAT(*pv, op2)) {
+        *pv = __JS_NewFloat64(ctx, JS_VALUE_GET_FLOAT64(*pv) +
+                              JS_VALUE_GET_FLOAT64(op2));
+    } else if (JS_VALUE_GET_TAG(*pv) == JS_TAG_STRING &&
+               JS_VALUE_GET_TAG(op2) == JS_TAG_STRING) {
+        if (JS_ConcatStringInPlace(ctx, JS_VALUE_GET_STRING(*pv), op2)) {
+            JS_FreeValue(ctx, op2);
+        } else {
+            op2 = JS_ConcatString(ctx, JS_DupValue(ctx, *pv), op2);
+            if (JS_IsException(op2))
+                return js_jit_exception(jf, sp, pc);
+            set_value(ctx, pv, op2);
+        }
+    } else {
+        JSValue ops[2];
+        /* In case of exception, js_add_slow frees ops[0]
+           and ops[1], so we must duplicate *pv */
+        ops[0] = JS_DupValue(ctx, *pv);
+        ops[1] = op2;
+        if (js_add_slow(ctx, ops + 2))
+            return js_jit_exception(jf, sp, pc);
+        set_value(ctx, pv, ops[0]);
+    }
+    return sp;
+}
+
+enum {
+    JIT_RAX, JIT_RCX, JIT_RDX, JIT_RBX, JIT_RSP, JIT_RBP, JIT_RSI, JIT_RDI,
+    JIT_R8, JIT_R9, JIT_R10, JIT_R11, JIT_R12, JIT_R13, JIT_R14, JIT_R15,
+};
+
+enum {
+    JIT_CC_O = 0x0,
+    JIT_CC_B = 0x2,
+    JIT_CC_AE = 0x3,
+    JIT_CC_E = 0x4,
+    JIT_CC_NE = 0x5,
+    JIT_CC_A = 0x7,
+    JIT_CC_S = 0x8,
+    JIT_CC_L = 0xc,
+    JIT_CC_GE = 0xd,
+    JIT_CC_LE = 0xe,
+    JIT_CC_G = 0xf,
+};
+
+#define JIT_VALUE_SIZE ((int)sizeof(JSValue))
+#define JIT_TAG_OFFSET ((int)offsetof(JSValue, tag))
+#define JIT_COLD       (1U << 31) /* label or fixup in the cold code */
+#define JIT_UNBOUND    0xffffffff
+#define JIT_DEPTH_NONE 0xffff /* unreachable opcode */
+
+typedef struct JSJitFixup {
+    uint32_t pos; /* position of the rel32 field (| JIT_COLD) */
+    uint32_t target; /* label index or bytecode position */
+    BOOL is_pc;
+} JSJitFixup;
+
+typedef struct JSJitCompiler {
+    JSContext *ctx;
+    JSFunctionBytecode *b;
+    DynBuf code; /* main code */
+    DynBuf cold; /* slow paths and exits, appended to the main code */
+    DynBuf *out; /* current output */
+    BOOL error;
+    uint16_t *depth_tab; /* stack depth before each opcode */
+    uint8_t *target_tab; /* TRUE if the position is a branch target */
+    uint32_t *pc_map; /* native offset of each opcode */
+    uint32_t *labels;
+    int label_count;
+    int label_size;
+    JSJitFixup *fixups;
+    int fixup_count;
+    int fixup_size;
+    int epilogue; /* label */
+    int helper_exception; /* label: the helper already set pc and sp */
+    /* current opcode */
+    const uint8_t *pc;
+    const uint8_t *next_pc;
+    int sp; /* stack depth before the opcode */
+    int op_exit; /* label exiting to the interpreter at 'pc', or -1 */
+    int op_exception; /* label raising the exception with 'sp', or -1 */
+} JSJitCompiler;
+
+/* x86-64 encoding */
+
+static void jit_u8(JSJitCompiler *s, uint8_t v)
+{
+    dbuf_putc(s->out, v);
+}
+
+static void jit_u32(JSJitCompiler *s, uint32_t v)
+{
+    dbuf_put_u32(s->out, v);
+}
+
+static void jit_rex(JSJitCompiler *s, int w, int reg, int base)
+{
+    int rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | (base >> 3);
+    if (rex != 0x40)
+        jit_u8(s, rex);
+}
+
+static void jit_opcode(JSJitCompiler *s, int op)
+{
+    if (op > 0xff)
+        jit_u8(s, op >> 8);
+    jit_u8(s, op);
+}
+
+/* 'op reg, [base + disp]'. 'op' is a one or two byte (0x0f xx) opcode */
+static void jit_mem(JSJitCompiler *s, int w, int op, int reg, int base,
+                    int32_t disp)
+{
+    int mod;
+    jit_rex(s, w, reg, base);
+    jit_opcode(s, op);
+    if (disp == 0 && (base & 7) != JIT_RBP)
+        mod = 0;
+    else if (disp == (int8_t)disp)
+        mod = 1;
+    else
+        mod = 2;
+    jit_u8(s, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == JIT_RSP)
+        jit_u8(s, 0x24); /* SIB: no index */
+    if (mod == 1)
+        jit_u8(s, disp);
+    else if (mod == 2)
+        jit_u32(s, disp);
+}
+
+/* 'op reg, rm' */
+static void jit_rr(JSJitCompiler *s, int w, int op, int reg, int rm)
+{
+    jit_rex(s, w, reg, rm);
+    jit_opcode(s, op);
+    jit_u8(s, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void jit_load64(JSJitCompiler *s, int reg, int base, int32_t disp)
+{
+    jit_mem(s, 1, 0x8b, reg, base, disp);
+}
+
+static void jit_store64(JSJitCompiler *s, int reg, int base, int32_t disp)
+{
+    jit_mem(s, 1, 0x89, reg, base, disp);
+}
+
+static void jit_load32(JSJitCompiler *s, int reg, int base, int32_t disp)
+{
+    jit_mem(s, 0, 0x8b, reg, base, disp);
+}
+
+static void jit_store32(JSJitCompiler *s, int reg, int base, int32_t disp)
+{
+    jit_mem(s, 0, 0x89, reg, base, disp);
+}
+
+static void jit_mov_rr(JSJitCompiler *s, int dst, int src)
+{
+    jit_rr(s, 1, 0x89, src, dst);
+}
+
+static void jit_lea(JSJitCompiler *s, int reg, int base, int32_t disp)
+{
+    jit_mem(s, 1, 0x8d, reg, base, disp);
+}
+
+static void jit_mov_imm(JSJitCompiler *s, int reg, uint64_t v)
+{
+    if (v <= 0xffffffff) {
+        jit_rex(s, 0, 0, reg);
+        jit_u8(s, 0xb8 + (reg & 7));
+        jit_u32(s, v);
+    } else if ((int64_t)v == (int32_t)v) {
+        jit_rr(s, 1, 0xc7, 0, reg);
+        jit_u32(s, v);
+    } else {
+        jit_rex(s, 1, 0, reg);
+        jit_u8(s, 0xb8 + (reg & 7));
+        dbuf_put_u64(s->out, v);
+    }
+}
+
+/* 'mov [base + disp], imm' (sign extended if w = 1) */
+static void jit_store_imm(JSJitCompiler *s, int w, int base, int32_t disp,
+                          int32_t imm)
+{
+    jit_mem(s, w, 0xc7, 0, base, disp);
+    jit_u32(s, imm);
+}
+
+/* group 1 operation with an immediate: 0 = add, 1 = or, 4 = and,
+   5 = sub, 7 = cmp */
+static void jit_alu_imm(JSJitCompiler *s, int w, int ext, int reg, int32_t imm)
+{
+    if (imm == (int8_t)imm) {
+        jit_rr(s, w, 0x83, ext, reg);
+        jit_u8(s, imm);
+    } else {
+        jit_rr(s, w, 0x81, ext, reg);
+        jit_u32(s, imm);
+    }
+}
+
+static void jit_cmp_mem_imm(JSJitCompiler *s, int w, int base, int32_t disp,
+                            int32_t imm)
+{
+    if (imm == (int8_t)imm) {
+        jit_mem(s, w, 0x83, 7, base, disp);
+        jit_u8(s, imm);
+    } else {
+        jit_mem(s, w, 0x81, 7, base, disp);
+        jit_u32(s, imm);
+    }
+}
+
+static void jit_test_rr(JSJitCompiler *s, int w, int reg)
+{
+    jit_rr(s, w, 0x85, reg, reg);
+}
+
+static void jit_call(JSJitCompiler *s, void *func)
+{
+    jit_mov_imm(s, JIT_RAX, (uintptr_t)func);
+    jit_rr(s, 0, 0xff, 2, JIT_RAX);
+}
+
+/* labels */
+
+static int jit_new_label(JSJitCompiler *s)
+{
+    if (js_resize_array(s->ctx, (void **)&s->labels, sizeof(s->labels[0]),
+                        &s->label_size, s->label_count + 1)) {
+        s->error = TRUE;
+        return 0; /* label 0 is a placeholder */
+    }
+    s->labels[s->label_count] = JIT_UNBOUND;
+    return s->label_count++;
+}
+
+static uint32_t jit_pos(JSJitCompiler *s)
+{
+    return s->out->size | (s->out == &s->cold ? JIT_COLD : 0);
+}
+
+static void jit_bind(JSJitCompiler *s, int label)
+{
+    s->labels[label] = jit_pos(s);
+}
+
+static void jit_rel32(JSJitCompiler *s, uint32_t target, BOOL is_pc)
+{
+    JSJitFixup *f;
+    if (js_resize_array(s->ctx, (void **)&s->fixups, sizeof(s->fixups[0]),
+                        &s->fixup_size, s->fixup_count + 1)) {
+        s->error = TRUE;
+    } else {
+        f = &s->fixups[s->fixup_count++];
+        f->pos = jit_pos(s);
+        f->target = target;
+        f->is_pc = is_pc;
+    }
+    jit_u32(s, 0);
+}
+
+static void jit_jcc(JSJitCompiler *s, int cc, int label)
+{
+    jit_u8(s, 0x0f);
+    jit_u8(s, 0x80 | cc);
+    jit_rel32(s, label, FALSE);
+}
+
+static void jit_jmp(JSJitCompiler *s, int label)
+{
+    jit_u8(s, 0xe9);
+    jit_rel32(s, label, FALSE);
+}
+
+/* branch to the native code of the bytecode position 'pos' */
+static void jit_jcc_pc(JSJitCompiler *s, int cc, int pos)
+{
+    jit_u8(s, 0x0f);
+    jit_u8(s, 0x80 | cc);
+    jit_rel32(s, pos, TRUE);
+}
+
+static void jit_jmp_pc(JSJitCompiler *s, int pos)
+{
+    jit_u8(s, 0xe9);
+    jit_rel32(s, pos, TRUE);
+}
+
+/* values */
+
+static int jit_slot(int depth)
+{
+    return depth * JIT_VALUE_SIZE;
+}
+
+/* rax = value, rcx = tag */
+static void jit_load_value(JSJitCompiler *s, int base, int32_t disp)
+{
+    jit_load64(s, JIT_RAX, base, disp);
+    jit_load64(s, JIT_RCX, base, disp + JIT_TAG_OFFSET);
+}
+
+static void jit_store_value(JSJitCompiler *s, int base, int32_t disp)
+{
+    jit_store64(s, JIT_RAX, base, disp);
+    jit_store64(s, JIT_RCX, base, disp + JIT_TAG_OFFSET);
+}
+
+static void jit_store_const(JSJitCompiler *s, int base, int32_t disp,
+                            JSValue val)
+{
+    uint64_t u;
+    memcpy(&u, &val.u, sizeof(u));
+    if (JS_VALUE_GET_TAG(val) <= JS_TAG_EXCEPTION &&
+        JS_VALUE_GET_TAG(val) >= 0) {
+        jit_store_imm(s, 0, base, disp, JS_VALUE_GET_INT(val));
+    } else {
+        jit_mov_imm(s, JIT_RAX, u);
+        jit_store64(s, JIT_RAX, base, disp);
+    }
+    jit_store_imm(s, 1, base, disp + JIT_TAG_OFFSET, JS_VALUE_GET_TAG(val));
+}
+
+/* JS_DupValue() of rax/rcx */
+static void jit_dup_value(JSJitCompiler *s)
+{
+    jit_alu_imm(s, 0, 7, JIT_RCX, JS_TAG_FIRST);
+    jit_u8(s, 0x72); /* jb +2 */
+    jit_u8(s, 2);
+    jit_mem(s, 0, 0xff, 0, JIT_RAX, 0); /* inc dword [rax] */
+}
+
+/* JS_FreeValue() of rsi (value) / rdx (tag). Clobbers all the
+   caller saved registers if the value is freed. */
+static void jit_free_value(JSJitCompiler *s)
+{
+    DynBuf *out = s->out;
+    int l_free, l_done;
+
+    l_free = jit_new_label(s);
+    l_done = jit_new_label(s);
+    jit_alu_imm(s, 0, 7, JIT_RDX, JS_TAG_FIRST);
+    jit_jcc(s, JIT_CC_B, l_done);
+    jit_mem(s, 0, 0xff, 1, JIT_RSI, 0); /* dec dword [rsi] */
+    jit_jcc(s, JIT_CC_E, l_free);
+    jit_bind(s, l_done);
+
+    s->out = &s->cold;
+    jit_bind(s, l_free);
+    jit_mov_rr(s, JIT_RDI, JIT_RBX);
+    jit_call(s, js_jit_free_value);
+    jit_jmp(s, l_done);
+    s->out = out;
+}
+
+static void jit_free_mem(JSJitCompiler *s, int base, int32_t disp)
+{
+    jit_load64(s, JIT_RSI, base, disp);
+    jit_load64(s, JIT_RDX, base, disp + JIT_TAG_OFFSET);
+    jit_free_value(s);
+}
+
+/* set_value() of [base + disp] with rax/rcx */
+static void jit_set_value(JSJitCompiler *s, int base, int32_t disp)
+{
+    jit_load64(s, JIT_RSI, base, disp);
+    jit_load64(s, JIT_RDX, base, disp + JIT_TAG_OFFSET);
+    jit_store_value(s, base, disp);
+    jit_free_value(s);
+}
+
+/* r8 = var_refs[idx], then r8 = var_refs[idx]->pvalue if 'pvalue' */
+static void jit_load_var_ref(JSJitCompiler *s, int idx, BOOL pvalue)
+{
+    jit_load64(s, JIT_R8, JIT_R15, offsetof(JSJitFrame, var_refs));
+    jit_load64(s, JIT_R8, JIT_R8, idx * (int)sizeof(JSVarRef *));
+    if (pvalue)
+        jit_load64(s, JIT_R8, JIT_R8, offsetof(JSVarRef, pvalue));
+}
+
+/* exits */
+
+/* return to the interpreter with 'status' (0 = resume at 'pc', 1 =
+   raise the pending exception) and 'depth' values on the stack */
+static void jit_emit_exit(JSJitCompiler *s, const uint8_t *pc, int depth,
+                          int status)
+{
+    jit_lea(s, JIT_RAX, JIT_R14, jit_slot(depth));
+    jit_store64(s, JIT_RAX, JIT_R15, offsetof(JSJitFrame, sp));
+    jit_mov_imm(s, JIT_RAX, (uintptr_t)pc);
+    jit_store64(s, JIT_RAX, JIT_R15, offsetof(JSJitFrame, pc));
+    jit_mov_imm(s, JIT_RAX, status);
+    jit_jmp(s, s->epilogue);
+}
+
+/* exit to the interpreter before the current opcode. The exit code
+   is emitted after the opcode by jit_emit_op_exits(). */
+static int jit_op_exit(JSJitCompiler *s)
+{
+    if (s->op_exit < 0)
+        s->op_exit = jit_new_label(s);
+    return s->op_exit;
+}
+
+/* exception raised by a slow path which left the stack as it was
+   before the current opcode */
+static int jit_op_exception(JSJitCompiler *s)
+{
+    if (s->op_exception < 0)
+        s->op_exception = jit_new_label(s);
+    return s->op_exception;
+}
+
+static void jit_emit_op_exits(JSJitCompiler *s)
+{
+    DynBuf *out = s->out;
+    s->out = &s->cold;
+    if (s->op_exit >= 0) {
+        jit_bind(s, s->op_exit);
+        jit_emit_exit(s, s->pc, s->sp, 0);
+    }
+    if (s->op_exception >= 0) {
+        jit_bind(s, s->op_exception);
+        jit_emit_exit(s, s->next_pc, s->sp, 1);
+    }
+    s->out = out;
+}
+
+/* poll the interrupt counter before a backward branch */
+static void jit_poll_interrupts(JSJitCompiler *s)
+{
+    jit_mem(s, 0, 0xff, 1, JIT_RBX, offsetof(JSContext, interrupt_counter));
+    jit_jcc(s, JIT_CC_LE, jit_op_exit(s));
+}
+
+/* sf->cur_pc = next_pc, as the interpreter does before a slow path */
+static void jit_set_cur_pc(JSJitCompiler *s)
+{
+    jit_load64(s, JIT_RAX, JIT_R15, offsetof(JSJitFrame, sf));
+    jit_mov_imm(s, JIT_RCX, (uintptr_t)s->next_pc);
+    jit_store64(s, JIT_RCX, JIT_RAX, offsetof(JSStackFrame, cur_pc));
+}
+
+/* call 'func(ctx, sp[, arg])' which returns non zero on exception */
+static void jit_call_slow(JSJitCompiler *s, void *func, int arg)
+{
+    jit_set_cur_pc(s);
+    jit_mov_rr(s, JIT_RDI, JIT_RBX);
+    jit_lea(s, JIT_RSI, JIT_R14, jit_slot(s->sp));
+    jit_mov_imm(s, JIT_RDX, arg);
+    jit_call(s, func);
+    jit_test_rr(s, 0, JIT_RAX);
+    jit_jcc(s, JIT_CC_NE, jit_op_exception(s));
+}
+
+/* call 'func(jf, sp, pc)' (JSJitHelper) */
+static void jit_call_helper(JSJitCompiler *s, JSJitHelper *func)
+{
+    jit_mov_rr(s, JIT_RDI, JIT_R15);
+    jit_lea(s, JIT_RSI, JIT_R14, jit_slot(s->sp));
+    jit_mov_imm(s, JIT_RDX, (uintptr_t)s->pc);
+    jit_call(s, func);
+    jit_test_rr(s, 1, JIT_RAX);
+    jit_jcc(s, JIT_CC_E, s->helper_exception);
+}
+
+/* emit the cold code of 'slow' for the current opcode: it calls
+   'func' and continues at 'resume' */
+static void jit_cold_helper(JSJitCompiler *s, int slow, int resume,
+                            JSJitHelper *func)
+{
+    DynBuf *out = s->out;
+    s->out = &s->cold;
+    jit_bind(s, slow);
+    jit_call_helper(s, func);
+    jit_jmp(s, resume);
+    s->out = out;
+}
+
+static void jit_cold_slow(JSJitCompiler *s, int slow, int resume,
+                          void *func, int arg)
+{
+    DynBuf *out = s->out;
+    s->out = &s->cold;
+    jit_bind(s, slow);
+    jit_call_slow(s, func, arg);
+    jit_jmp(s, resume);
+    s->out = out;
+}
+
+/* permute the 'n' values at the top of the stack: the new value at
+   position i (from the bottom of the group) is the old value at
+   position perm[i] */
+static void jit_permute(JSJitCompiler *s, int n, const uint8_t *perm)
+{
+    int i, base = s->sp - n;
+    /* 64 bit accesses so that the loads are forwarded from the
+       previous stores */
+    for(i = 0; i < 2 * n; i++) {
+        jit_u8(s, 0xf3); /* movq xmm_i, [slot] */
+        jit_mem(s, 0, 0x0f7e, i, JIT_R14,
+                jit_slot(base + perm[i >> 1]) + (i & 1) * JIT_TAG_OFFSET);
+    }
+    for(i = 0; i < 2 * n; i++) {
+        jit_u8(s, 0x66); /* movq [slot], xmm_i */
+        jit_mem(s, 0, 0x0fd6, i, JIT_R14,
+                jit_slot(base + (i >> 1)) + (i & 1) * JIT_TAG_OFFSET);
+    }
+}
+
+/* move the stack value at depth 'src' to depth 'dst' */
+static void jit_move_value(JSJitCompiler *s, int src, int dst)
+{
+    jit_load_value(s, JIT_R14, jit_slot(src));
+    jit_store_value(s, JIT_R14, jit_slot(dst));
+}
+
+/* push a copy of the stack value at depth 'depth' */
+static void jit_push_dup(JSJitCompiler *s, int depth, int dst)
+{
+    jit_load_value(s, JIT_R14, jit_slot(depth));
+    jit_store_value(s, JIT_R14, jit_slot(dst));
+    jit_dup_value(s);
+}
+
+static void jit_get_value(JSJitCompiler *s, int base, int32_t disp)
+{
+    jit_load_value(s, base, disp);
+    jit_store_value(s, JIT_R14, jit_slot(s->sp));
+    jit_dup_value(s);
+}
+
+/* put_loc/put_arg/put_var_ref: 'dup' is TRUE for the set_x variants */
+static void jit_put_value(JSJitCompiler *s, int base, int32_t disp, BOOL dup)
+{
+    jit_load_value(s, JIT_R14, jit_slot(s->sp - 1));
+    if (dup)
+        jit_dup_value(s);
+    jit_set_value(s, base, disp);
+}
+
+/* exit if the value at [base + disp] is uninitialized */
+static void jit_check_initialized(JSJitCompiler *s, int base, int32_t disp)
+{
+    jit_cmp_mem_imm(s, 0, base, disp + JIT_TAG_OFFSET, JS_TAG_UNINITIALIZED);
+    jit_jcc(s, JIT_CC_E, jit_op_exit(s));
+}
+
+/* jump to 'slow' unless the two values at the top of the stack are int32 */
+static void jit_check_both_int(JSJitCompiler *s, int slow)
+{
+    jit_load32(s, JIT_RAX, JIT_R14, jit_slot(s->sp - 2) + JIT_TAG_OFFSET);
+    jit_mem(s, 0, 0x0b, JIT_RAX, JIT_R14,
+            jit_slot(s->sp - 1) + JIT_TAG_OFFSET); /* or */
+    jit_jcc(s, JIT_CC_NE, slow);
+}
+
+/* add, sub and mul: int32 fast path, float64 fast path in the cold
+   code, then the interpreter slow path */
+static void jit_arith(JSJitCompiler *s, int op)
+{
+    int a = jit_slot(s->sp - 2), b = jit_slot(s->sp - 1);
+    int l_float, l_slow, l_resume, l_store, sse_op;
+    DynBuf *out;
+
+    l_float = jit_new_label(s);
+    l_slow = jit_new_label(s);
+    l_resume = jit_new_label(s);
+    jit_check_both_int(s, l_float);
+    jit_load32(s, JIT_RAX, JIT_R14, a);
+    switch(op) {
+    case OP_add:
+        jit_mem(s, 0, 0x03, JIT_RAX, JIT_R14, b);
+        jit_jcc(s, JIT_CC_O, l_slow);
+        sse_op = 0x0f58;
+        break;
+    case OP_sub:
+        jit_mem(s, 0, 0x2b, JIT_RAX, JIT_R14, b);
+        jit_jcc(s, JIT_CC_O, l_slow);
+        sse_op = 0x0f5c;
+        break;
+    default: /* OP_mul */
+        l_store = jit_new_label(s);
+        jit_mem(s, 0, 0x0faf, JIT_RAX, JIT_R14, b); /* imul */
+        jit_jcc(s, JIT_CC_O, l_slow);
+        jit_test_rr(s, 0, JIT_RAX);
+        jit_jcc(s, JIT_CC_NE, l_store);
+        /* need to test zero case for -0 result */
+        jit_load32(s, JIT_RCX, JIT_R14, a);
+        jit_mem(s, 0, 0x0b, JIT_RCX, JIT_R14, b);
+        jit_jcc(s, JIT_CC_S, l_slow);
+        jit_bind(s, l_store);
+        sse_op = 0x0f59;
+        break;
+    }
+    jit_store32(s, JIT_RAX, JIT_R14, a);
+    jit_bind(s, l_resume);
+
+    out = s->out;
+    s->out = &s->cold;
+    jit_bind(s, l_float);
+    jit_cmp_mem_imm(s, 0, JIT_R14, a + JIT_TAG_OFFSET, JS_TAG_FLOAT64);
+    jit_jcc(s, JIT_CC_NE, l_slow);
+    jit_cmp_mem_imm(s, 0, JIT_R14, b + JIT_TAG_OFFSET, JS_TAG_FLOAT64);
+    jit_jcc(s, JIT_CC_NE, l_slow);
+    jit_u8(s, 0xf2);
+    jit_mem(s, 0, 0x0f10, 0, JIT_R14, a); /* movsd xmm0, a */
+    jit_u8(s, 0xf2);
+    jit_mem(s, 0, sse_op, 0, JIT_R14, b);
+    jit_u8(s, 0xf2);
+    jit_mem(s, 0, 0x0f11, 0, JIT_R14, a); /* movsd a, xmm0 */
+    jit_jmp(s, l_resume);
+    s->out = out;
+
+    if (op == OP_add)
+        jit_cold_slow(s, l_slow, l_resume, js_add_slow, 0);
+    else
+        jit_cold_slow(s, l_slow, l_resume, js_binary_arith_slow, op);
+}
+
+/* and, or, xor, shl, sar, shr */
+static void jit_logic(JSJitCompiler *s, int op)
+{
+    int a = jit_slot(s->sp - 2), b = jit_slot(s->sp - 1);
+    int l_slow, l_resume;
+
+    l_slow = jit_new_label(s);
+    l_resume = jit_new_label(s);
+    jit_check_both_int(s, l_slow);
+    jit_load32(s, JIT_RAX, JIT_R14, a);
+    switch(op) {
+    case OP_and:
+        jit_mem(s, 0, 0x23, JIT_RAX, JIT_R14, b);
+        break;
+    case OP_or:
+        jit_mem(s, 0, 0x0b, JIT_RAX, JIT_R14, b);
+        break;
+    case OP_xor:
+        jit_mem(s, 0, 0x33, JIT_RAX, JIT_R14, b);
+        break;
+    default:
+        /* the shift count is masked by the CPU as in JS */
+        jit_load32(s, JIT_RCX, JIT_R14, b);
+        jit_rr(s, 0, 0xd3, op == OP_shl ? 4 : op == OP_sar ? 7 : 5, JIT_RAX);
+        if (op == OP_shr) {
+            /* the result does not fit in an int32 */
+            jit_test_rr(s, 0, JIT_RAX);
+            jit_jcc(s, JIT_CC_S, l_slow);
+        }
+        break;
+    }
+    jit_store32(s, JIT_RAX, JIT_R14, a);
+    jit_bind(s, l_resume);
+    if (op == OP_shr)
+        jit_cold_slow(s, l_slow, l_resume, js_shr_slow, 0);
+    else
+        jit_cold_slow(s, l_slow, l_resume, js_binary_logic_slow, op);
+}
+
+static int jit_cmp_cc(int op)
+{
+    switch(op) {
+    case OP_lt:
+        return JIT_CC_L;
+    case OP_lte:
+        return JIT_CC_LE;
+    case OP_gt:
+        return JIT_CC_G;
+    case OP_gte:
+        return JIT_CC_GE;
+    case OP_eq:
+    case OP_strict_eq:
+        return JIT_CC_E;
+    default:
+        return JIT_CC_NE;
+    }
+}
+
+/* call the interpreter slow path of a comparison */
+static void jit_cmp_slow(JSJitCompiler *s, int op)
+{
+    switch(op) {
+    case OP_lt:
+    case OP_lte:
+    case OP_gt:
+    case OP_gte:
+        jit_call_slow(s, js_relational_slow, op);
+        break;
+    case OP_eq:
+    case OP_neq:
+        jit_call_slow(s, js_eq_slow, op == OP_neq);
+        break;
+    default:
+        jit_call_slow(s, js_strict_eq_slow, op == OP_strict_neq);
+        break;
+    }
+}
+
+/* comparison, fused with the following if_true/if_false if
+   'branch_op' is not zero */
+static void jit_compare(JSJitCompiler *s, int op, int branch_op, int target)
+{
+    int a = jit_slot(s->sp - 2), b = jit_slot(s->sp - 1);
+    int l_slow, l_resume, cc = jit_cmp_cc(op);
+    BOOL is_true = (branch_op == OP_if_true || branch_op == OP_if_true8);
+    DynBuf *out;
+
+    l_slow = jit_new_label(s);
+    l_resume = jit_new_label(s);
+    jit_check_both_int(s, l_slow);
+    jit_load32(s, JIT_RAX, JIT_R14, a);
+    jit_mem(s, 0, 0x3b, JIT_RAX, JIT_R14, b); /* cmp */
+    if (branch_op) {
+        jit_jcc_pc(s, is_true ? cc : cc ^ 1, target);
+    } else {
+        jit_rr(s, 0, 0x0f90 | cc, 0, JIT_RAX); /* setcc al */
+        jit_rr(s, 0, 0x0fb6, JIT_RAX, JIT_RAX); /* movzx eax, al */
+        jit_store32(s, JIT_RAX, JIT_R14, a);
+        jit_store_imm(s, 1, JIT_R14, a + JIT_TAG_OFFSET, JS_TAG_BOOL);
+    }
+    jit_bind(s, l_resume);
+
+    out = s->out;
+    s->out = &s->cold;
+    jit_bind(s, l_slow);
+    jit_cmp_slow(s, op);
+    if (branch_op) {
+        /* the slow path left a boolean */
+        jit_cmp_mem_imm(s, 0, JIT_R14, a, 0);
+        jit_jcc_pc(s, is_true ? JIT_CC_NE : JIT_CC_E, target);
+    }
+    jit_jmp(s, l_resume);
+    s->out = out;
+}
+
+/* if_true/if_false (not fused) */
+static void jit_branch(JSJitCompiler *s, BOOL is_true, int target)
+{
+    int v = jit_slot(s->sp - 1);
+    int l_slow, l_resume;
+    DynBuf *out;
+
+    l_slow = jit_new_label(s);
+    l_resume = jit_new_label(s);
+    /* quick and dirty test for JS_TAG_INT, JS_TAG_BOOL, JS_TAG_NULL and JS_TAG_UNDEFINED */
+    jit_cmp_mem_imm(s, 0, JIT_R14, v + JIT_TAG_OFFSET, JS_TAG_UNDEFINED);
+    jit_jcc(s, JIT_CC_A, l_slow);
+    jit_cmp_mem_imm(s, 0, JIT_R14, v, 0);
+    jit_jcc_pc(s, is_true ? JIT_CC_NE : JIT_CC_E, target);
+    jit_bind(s, l_resume);
+
+    out = s->out;
+    s->out = &s->cold;
+    jit_bind(s, l_slow);
+    jit_mov_rr(s, JIT_RDI, JIT_RBX);
+    jit_load64(s, JIT_RSI, JIT_R14, v);
+    jit_load64(s, JIT_RDX, JIT_R14, v + JIT_TAG_OFFSET);
+    jit_call(s, js_jit_to_bool);
+    jit_test_rr(s, 0, JIT_RAX);
+    jit_jcc_pc(s, is_true ? JIT_CC_NE : JIT_CC_E, target);
+    jit_jmp(s, l_resume);
+    s->out = out;
+}
+
+/* inc, dec, post_inc, post_dec */
+static void jit_inc(JSJitCompiler *s, int op)
+{
+    int v = jit_slot(s->sp - 1);
+    int l_slow, l_resume;
+    BOOL is_post = (op == OP_post_inc || op == OP_post_dec);
+    BOOL is_inc = (op == OP_inc || op == OP_post_inc);
+
+    l_slow = jit_new_label(s);
+    l_resume = jit_new_label(s);
+    jit_cmp_mem_imm(s, 0, JIT_R14, v + JIT_TAG_OFFSET, JS_TAG_INT);
+    jit_jcc(s, JIT_CC_NE, l_slow);
+    jit_load32(s, JIT_RAX, JIT_R14, v);
+    jit_alu_imm(s, 0, is_inc ? 0 : 5, JIT_RAX, 1);
+    jit_jcc(s, JIT_CC_O, l_slow);
+    if (is_post) {
+        jit_store32(s, JIT_RAX, JIT_R14, jit_slot(s->sp));
+        jit_store_imm(s, 1, JIT_R14, jit_slot(s->sp) + JIT_TAG_OFFSET,
+                      JS_TAG_INT);
+    } else {
+        jit_store32(s, JIT_RAX, JIT_R14, v);
+    }
+    jit_bind(s, l_resume);
+    jit_cold_slow(s, l_slow, l_resume,
+                  is_post ? (void *)js_post_inc_slow : (void *)js_unary_arith_slow,
+                  op);
+}
+
+/* get_field_ic, get_field2_ic and put_field_ic: monomorphic case */
+static void jit_field_ic(JSJitCompiler *s, int op)
+{
+    int obj = jit_slot(s->sp - (op == OP_put_field_ic ? 2 : 1));
+    int e = get_u16(s->pc + 5) * sizeof(JSInlineCache);
+    int l_slow, l_resume;
+
+    l_slow = jit_new_label(s);
+    l_resume = jit_new_label(s);
+    jit_cmp_mem_imm(s, 0, JIT_R14, obj + JIT_TAG_OFFSET, JS_TAG_OBJECT);
+    jit_jcc(s, JIT_CC_NE, l_slow);
+    jit_mov_imm(s, JIT_RAX, (uintptr_t)s->b);
+    jit_load64(s, JIT_RAX, JIT_RAX, offsetof(JSFunctionBytecode, ic));
+    jit_test_rr(s, 1, JIT_RAX);
+    jit_jcc(s, JIT_CC_E, l_slow);
+    jit_load64(s, JIT_RDX, JIT_R14, obj); /* p */
+    jit_load64(s, JIT_RCX, JIT_RDX, offsetof(JSObject, shape));
+    jit_mem(s, 1, 0x3b, JIT_RCX, JIT_RAX, e + offsetof(JSInlineCacheEntry, shape));
+    jit_jcc(s, JIT_CC_NE, l_slow);
+    jit_load32(s, JIT_RSI, JIT_RCX, offsetof(JSShape, id));
+    jit_mem(s, 0, 0x3b, JIT_RSI, JIT_RAX, e + offsetof(JSInlineCacheEntry, shape_id));
+    jit_jcc(s, JIT_CC_NE, l_slow);
+    if (op != OP_put_field_ic) {
+        jit_cmp_mem_imm(s, 0, JIT_RAX, e + offsetof(JSInlineCacheEntry, proto_shape_id), 0);
+        jit_jcc(s, JIT_CC_NE, l_slow);
+    }
+    /* r8 = &p->prop[e->prop_idx].u.value */
+    jit_load32(s, JIT_R8, JIT_RAX, e + offsetof(JSInlineCacheEntry, prop_idx));
+    jit_rr(s, 1, 0xc1, 4, JIT_R8); /* shl r8, 4 */
+    jit_u8(s, 4);
+    jit_mem(s, 1, 0x03, JIT_R8, JIT_RDX, offsetof(JSObject, prop));
+    if (op == OP_put_field_ic) {
+        jit_put_value(s, JIT_R8, 0, FALSE);
+        jit_free_mem(s, JIT_R14, obj);
+    } else {
+        jit_load_value(s, JIT_R8, 0);
+        jit_dup_value(s);
+        if (op == OP_get_field2_ic) {
+            jit_store_value(s, JIT_R14, jit_slot(s->sp));
+        } else {
+            jit_load64(s, JIT_RSI, JIT_R14, obj);
+            jit_load64(s, JIT_RDX, JIT_R14, obj + JIT_TAG_OFFSET);
+            jit_store_value(s, JIT_R14, obj);
+            jit_free_value(s);
+        }
+    }
+    jit_bind(s, l_resume);
+    jit_cold_helper(s, l_slow, l_resume,
+                    op == OP_put_field_ic ? js_jit_op_put_field : js_jit_op_get_field);
+}
+
+/* get_array_el and put_array_el: fast array with an index in range */
+static void jit_array_el(JSJitCompiler *s, int op)
+{
+    int n = (op == OP_put_array_el ? 3 : 2);
+    int obj = jit_slot(s->sp - n), prop = jit_slot(s->sp - n + 1);
+    int l_slow, l_resume;
+
+    l_slow = jit_new_label(s);
+    l_resume = jit_new_label(s);
+    jit_cmp_mem_imm(s, 0, JIT_R14, obj + JIT_TAG_OFFSET, JS_TAG_OBJECT);
+    jit_jcc(s, JIT_CC_NE, l_slow);
+    jit_cmp_mem_imm(s, 0, JIT_R14, prop + JIT_TAG_OFFSET, JS_TAG_INT);
+    jit_jcc(s, JIT_CC_NE, l_slow);
+    jit_load64(s, JIT_RDX, JIT_R14, obj);
+    jit_mem(s, 0, 0x0fb7, JIT_RAX, JIT_RDX, offsetof(JSObject, class_id)); /* movzx */
+    jit_alu_imm(s, 0, 7, JIT_RAX, JS_CLASS_ARRAY);
+    jit_jcc(s, JIT_CC_NE, l_slow);
+    jit_load32(s, JIT_R8, JIT_R14, prop);
+    jit_mem(s, 0, 0x3b, JIT_R8, JIT_RDX, offsetof(JSObject, u.array.count));
+    jit_jcc(s, JIT_CC_AE, l_slow);
+    /* r8 = &p->u.array.u.values[idx] */
+    jit_rr(s, 1, 0xc1, 4, JIT_R8); /* shl r8, 4 */
+    jit_u8(s, 4);
+    jit_mem(s, 1, 0x03, JIT_R8, JIT_RDX, offsetof(JSObject, u.array.u.values));
+    if (op == OP_put_array_el) {
+        jit_put_value(s, JIT_R8, 0, FALSE);
+        jit_free_mem(s, JIT_R14, obj);
+    } else {
+        /* the index is an int32 and does not need to be freed */
+        jit_load_value(s, JIT_R8, 0);
+        jit_dup_value(s);
+        jit_load64(s, JIT_RSI, JIT_R14, obj);
+        jit_load64(s, JIT_RDX, JIT_R14, obj + JIT_TAG_OFFSET);
+        jit_store_value(s, JIT_R14, obj);
+        jit_free_value(s);
+    }
+    jit_bind(s, l_resume);
+    jit_cold_helper(s, l_slow, l_resume,
+                    op == OP_put_array_el ? js_jit_op_put_array_el : js_jit_op_get_array_el);
+}
+
+static const uint8_t jit_perm_swap[] = { 1, 0 };
+static const uint8_t jit_perm3[] = { 1, 0, 2 };
+static const uint8_t jit_perm4[] = { 2, 0, 1, 3 };
+static const uint8_t jit_perm5[] = { 3, 0, 1, 2, 4 };
+static const uint8_t jit_perm_swap2[] = { 2, 3, 0, 1 };
+static const uint8_t jit_perm_rot3l[] = { 1, 2, 0 };
+static const uint8_t jit_perm_rot3r[] = { 2, 0, 1 };
+static const uint8_t jit_perm_rot4l[] = { 1, 2, 3, 0 };
+static const uint8_t jit_perm_rot5l[] = { 1, 2, 3, 4, 0 };
+static const uint8_t jit_perm_dup1[] = { 0, 2, 1 };
+
+/* return the bytecode position of the branch target */
+static int jit_branch_target(const uint8_t *bc_buf, int pos)
+{
+    int op = bc_buf[pos];
+    switch(op) {
+    case OP_goto8:
+    case OP_if_true8:
+    case OP_if_false8:
+        return pos + 1 + (int8_t)bc_buf[pos + 1];
+    case OP_goto16:
+        return pos + 1 + (int16_t)get_u16(bc_buf + pos + 1);
+    default:
+        return pos + 1 + (int32_t)get_u32(bc_buf + pos + 1);
+    }
+}
+
+static BOOL jit_is_if(int op)
+{
+    return op == OP_if_true || op == OP_if_false ||
+        op == OP_if_true8 || op == OP_if_false8;
+}
+
+/* emit the native code of the opcode at 'pos'. Return its size in
+   the bytecode (larger if the next opcode was fused). */
+static int jit_emit_op(JSJitCompiler *s, int pos)
+{
+    JSFunctionBytecode *b = s->b;
+    const uint8_t *bc_buf = b->byte_code_buf;
+    const uint8_t *pc = bc_buf + pos;
+    int op = js_generic_opcode(pc[0]), size, sp, idx, target;
+    JSValue val;
+
+    size = short_opcode_info(op).size;
+    s->pc = pc;
+    s->next_pc = pc + size;
+    s->sp = sp = s->depth_tab[pos];
+    s->op_exit = -1;
+    s->op_exception = -1;
+
+    switch(op) {
+        /* constants */
+    case OP_push_i32:
+        val = JS_NewInt32(s->ctx, get_u32(pc + 1));
+        goto push_const;
+    case OP_push_minus1:
+    case OP_push_0:
+    case OP_push_1:
+    case OP_push_2:
+    case OP_push_3:
+    case OP_push_4:
+    case OP_push_5:
+    case OP_push_6:
+    case OP_push_7:
+        val = JS_NewInt32(s->ctx, op - OP_push_0);
+        goto push_const;
+    case OP_push_i8:
+        val = JS_NewInt32(s->ctx, get_i8(pc + 1));
+        goto push_const;
+    case OP_push_i16:
+        val = JS_NewInt32(s->ctx, get_i16(pc + 1));
+        goto push_const;
+    case OP_undefined:
+        val = JS_UNDEFINED;
+        goto push_const;
+    case OP_null:
+        val = JS_NULL;
+        goto push_const;
+    case OP_push_false:
+        val = JS_FALSE;
+        goto push_const;
+    case OP_push_true:
+        val = JS_TRUE;
+        goto push_const;
+    case OP_push_const:
+        val = b->cpool[get_u32(pc + 1)];
+        goto push_const;
+    case OP_push_const8:
+        val = b->cpool[pc[1]];
+    push_const:
+        /* the constant pool lives as long as the native code */
+        jit_store_const(s, JIT_R14, jit_slot(sp), val);
+        if (JS_VALUE_HAS_REF_COUNT(val))
+            jit_mem(s, 0, 0xff, 0, JIT_RAX, 0); /* inc dword [rax] */
+        break;
+    case OP_push_atom_value:
+    case OP_push_empty_string:
+    case OP_push_this:
+    case OP_fclosure:
+    case OP_fclosure8:
+    case OP_object:
+        jit_call_helper(s, js_jit_op_push);
+        break;
+
+        /* local variables, arguments and closure variables */
+    case OP_get_loc:
+    case OP_get_loc8:
+    case OP_get_loc0:
+    case OP_get_loc1:
+    case OP_get_loc2:
+    case OP_get_loc3:
+    case OP_get_loc_check:
+    case OP_put_loc:
+    case OP_put_loc8:
+    case OP_put_loc0:
+    case OP_put_loc1:
+    case OP_put_loc2:
+    case OP_put_loc3:
+    case OP_put_loc_check:
+    case OP_set_loc:
+    case OP_set_loc8:
+    case OP_set_loc0:
+    case OP_set_loc1:
+    case OP_set_loc2:
+    case OP_set_loc3:
+    case OP_get_arg:
+    case OP_get_arg0:
+    case OP_get_arg1:
+    case OP_get_arg2:
+    case OP_get_arg3:
+    case OP_put_arg:
+    case OP_put_arg0:
+    case OP_put_arg1:
+    case OP_put_arg2:
+    case OP_put_arg3:
+    case OP_set_arg:
+    case OP_set_arg0:
+    case OP_set_arg1:
+    case OP_set_arg2:
+    case OP_set_arg3:
+        {
+            int base, kind;
+            switch(op) {
+            case OP_get_loc0: case OP_get_loc1: case OP_get_loc2: case OP_get_loc3:
+                idx = op - OP_get_loc0;
+                break;
+            case OP_put_loc0: case OP_put_loc1: case OP_put_loc2: case OP_put_loc3:
+                idx = op - OP_put_loc0;
+                break;
+            case OP_set_loc0: case OP_set_loc1: case OP_set_loc2: case OP_set_loc3:
+                idx = op - OP_set_loc0;
+                break;
+            case OP_get_arg0: case OP_get_arg1: case OP_get_arg2: case OP_get_arg3:
+                idx = op - OP_get_arg0;
+                break;
+            case OP_put_arg0: case OP_put_arg1: case OP_put_arg2: case OP_put_arg3:
+                idx = op - OP_put_arg0;
+                break;
+            case OP_set_arg0: case OP_set_arg1: case OP_set_arg2: case OP_set_arg3:
+                idx = op - OP_set_arg0;
+                break;
+            case OP_get_loc8: case OP_put_loc8: case OP_set_loc8:
+                idx = pc[1];
+                break;
+            default:
+                idx = get_u16(pc + 1);
+                break;
+            }
+            switch(op) {
+            case OP_get_loc: case OP_get_loc8: case OP_get_loc0: case OP_get_loc1:
+            case OP_get_loc2: case OP_get_loc3: case OP_get_loc_check:
+            case OP_get_arg: case OP_get_arg0: case OP_get_arg1:
+            case OP_get_arg2: case OP_get_arg3:
+                kind = 0;
+                break;
+            case OP_put_loc: case OP_put_loc8: case OP_put_loc0: case OP_put_loc1:
+            case OP_put_loc2: case OP_put_loc3: case OP_put_loc_check:
+            case OP_put_arg: case OP_put_arg0: case OP_put_arg1:
+            case OP_put_arg2: case OP_put_arg3:
+                kind = 1;
+                break;
+            default:
+                kind = 2;
+                break;
+            }
+            if (op >= OP_get_arg && op <= OP_set_arg)
+                base = JIT_R13;
+            else if (op >= OP_get_arg0 && op <= OP_set_arg3)
+                base = JIT_R13;
+            else
+                base = JIT_R12;
+            if (op == OP_get_loc_check || op == OP_put_loc_check)
+                jit_check_initialized(s, base, jit_slot(idx));
+            if (kind == 0)
+                jit_get_value(s, base, jit_slot(idx));
+            else
+                jit_put_value(s, base, jit_slot(idx), kind == 2);
+        }
+        break;
+    case OP_set_loc_uninitialized:
+        idx = get_u16(pc + 1);
+        jit_mov_imm(s, JIT_RAX, 0);
+        jit_mov_imm(s, JIT_RCX, JS_TAG_UNINITIALIZED);
+        jit_set_value(s, JIT_R12, jit_slot(idx));
+        break;
+    case OP_get_var_ref:
+    case OP_get_var_ref_check:
+    case OP_get_var_ref0:
+    case OP_get_var_ref1:
+    case OP_get_var_ref2:
+    case OP_get_var_ref3:
+    case OP_get_var:
+    case OP_get_var_undef:
+        if (op >= OP_get_var_ref0 && op <= OP_get_var_ref3)
+            idx = op - OP_get_var_ref0;
+        else
+            idx = get_u16(pc + 1);
+        jit_load_var_ref(s, idx, TRUE);
+        if (op == OP_get_var_ref_check || op == OP_get_var ||
+            op == OP_get_var_undef)
+            jit_check_initialized(s, JIT_R8, 0);
+        jit_get_value(s, JIT_R8, 0);
+        break;
+    case OP_put_var_ref:
+    case OP_put_var_ref_check:
+    case OP_put_var_ref0:
+    case OP_put_var_ref1:
+    case OP_put_var_ref2:
+    case OP_put_var_ref3:
+    case OP_set_var_ref:
+    case OP_set_var_ref0:
+    case OP_set_var_ref1:
+    case OP_set_var_ref2:
+    case OP_set_var_ref3:
+    case OP_put_var:
+        if (op >= OP_put_var_ref0 && op <= OP_put_var_ref3)
+            idx = op - OP_put_var_ref0;
+        else if (op >= OP_set_var_ref0 && op <= OP_set_var_ref3)
+            idx = op - OP_set_var_ref0;
+        else
+            idx = get_u16(pc + 1);
+        if (op == OP_put_var) {
+            /* constant global variable */
+            jit_load_var_ref(s, idx, FALSE);
+            jit_mem(s, 0, 0x80, 7, JIT_R8, offsetof(JSVarRef, is_const));
+            jit_u8(s, 0);
+            jit_jcc(s, JIT_CC_NE, jit_op_exit(s));
+            jit_load64(s, JIT_R8, JIT_R8, offsetof(JSVarRef, pvalue));
+        } else {
+            jit_load_var_ref(s, idx, TRUE);
+        }
+        if (op == OP_put_var_ref_check || op == OP_put_var)
+            jit_check_initialized(s, JIT_R8, 0);
+        jit_put_value(s, JIT_R8, 0,
+                      op == OP_set_var_ref || (op >= OP_set_var_ref0 && op <= OP_set_var_ref3));
+        break;
+
+        /* stack manipulation */
+    case OP_drop:
+        jit_free_mem(s, JIT_R14, jit_slot(sp - 1));
+        break;
+    case OP_nip:
+        jit_free_mem(s, JIT_R14, jit_slot(sp - 2));
+        jit_move_value(s, sp - 1, sp - 2);
+        break;
+    case OP_nip1:
+        jit_free_mem(s, JIT_R14, jit_slot(sp - 3));
+        jit_move_value(s, sp - 2, sp - 3);
+        jit_move_value(s, sp - 1, sp - 2);
+        break;
+    case OP_dup:
+        jit_push_dup(s, sp - 1, sp);
+        break;
+    case OP_dup1:
+        jit_push_dup(s, sp - 2, sp);
+        s->sp = sp + 1;
+        jit_permute(s, 3, jit_perm_dup1);
+        break;
+    case OP_dup2:
+        jit_push_dup(s, sp - 2, sp);
+        jit_push_dup(s, sp - 1, sp + 1);
+        break;
+    case OP_dup3:
+        jit_push_dup(s, sp - 3, sp);
+        jit_push_dup(s, sp - 2, sp + 1);
+        jit_push_dup(s, sp - 1, sp + 2);
+        break;
+    case OP_insert2:
+    case OP_insert3:
+    case OP_insert4:
+        jit_push_dup(s, sp - 1, sp);
+        s->sp = sp + 1;
+        if (op == OP_insert2)
+            jit_permute(s, 3, jit_perm3);
+        else if (op == OP_insert3)
+            jit_permute(s, 4, jit_perm4);
+        else
+            jit_permute(s, 5, jit_perm5);
+        break;
+    case OP_perm3:
+        jit_permute(s, 3, jit_perm3);
+        break;
+    case OP_perm4:
+        jit_permute(s, 4, jit_perm4);
+        break;
+    case OP_perm5:
+        jit_permute(s, 5, jit_perm5);
+        break;
+    case OP_swap:
+        jit_permute(s, 2, jit_perm_swap);
+        break;
+    case OP_swap2:
+        jit_permute(s, 4, jit_perm_swap2);
+        break;
+    case OP_rot3l:
+        jit_permute(s, 3, jit_perm_rot3l);
+        break;
+    case OP_rot3r:
+        jit_permute(s, 3, jit_perm_rot3r);
+        break;
+    case OP_rot4l:
+        jit_permute(s, 4, jit_perm_rot4l);
+        break;
+    case OP_rot5l:
+        jit_permute(s, 5, jit_perm_rot5l);
+        break;
+
+        /* arithmetic */
+    case OP_add:
+    case OP_sub:
+    case OP_mul:
+        jit_arith(s, op);
+        break;
+    case OP_div:
+    case OP_mod:
+    case OP_pow:
+        jit_call_slow(s, js_binary_arith_slow, op);
+        break;
+    case OP_and:
+    case OP_or:
+    case OP_xor:
+    case OP_shl:
+    case OP_sar:
+    case OP_shr:
+        jit_logic(s, op);
+        break;
+    case OP_inc:
+    case OP_dec:
+    case OP_post_inc:
+    case OP_post_dec:
+        jit_inc(s, op);
+        break;
+    case OP_inc_loc:
+    case OP_dec_loc:
+        idx = jit_slot(pc[1]);
+        jit_cmp_mem_imm(s, 0, JIT_R12, idx + JIT_TAG_OFFSET, JS_TAG_INT);
+        jit_jcc(s, JIT_CC_NE, jit_op_exit(s));
+        jit_load32(s, JIT_RAX, JIT_R12, idx);
+        jit_alu_imm(s, 0, op == OP_inc_loc ? 0 : 5, JIT_RAX, 1);
+        jit_jcc(s, JIT_CC_O, jit_op_exit(s));
+        jit_store32(s, JIT_RAX, JIT_R12, idx);
+        break;
+    case OP_add_loc:
+        {
+            int l_slow, l_resume, v = jit_slot(sp - 1);
+            idx = jit_slot(pc[1]);
+            l_slow = jit_new_label(s);
+            l_resume = jit_new_label(s);
+            jit_load32(s, JIT_RAX, JIT_R12, idx + JIT_TAG_OFFSET);
+            jit_mem(s, 0, 0x0b, JIT_RAX, JIT_R14, v + JIT_TAG_OFFSET);
+            jit_jcc(s, JIT_CC_NE, l_slow);
+            jit_load32(s, JIT_RAX, JIT_R12, idx);
+            jit_mem(s, 0, 0x03, JIT_RAX, JIT_R14, v);
+            jit_jcc(s, JIT_CC_O, l_slow);
+            jit_store32(s, JIT_RAX, JIT_R12, idx);
+            jit_bind(s, l_resume);
+            jit_cold_helper(s, l_slow, l_resume, js_jit_op_add_loc);
+        }
+        break;
+    case OP_not:
+        {
+            int l_slow, l_resume, v = jit_slot(sp - 1);
+            l_slow = jit_new_label(s);
+            l_resume = jit_new_label(s);
+            jit_cmp_mem_imm(s, 0, JIT_R14, v + JIT_TAG_OFFSET, JS_TAG_INT);
+            jit_jcc(s, JIT_CC_NE, l_slow);
+            jit_mem(s, 0, 0xf7, 2, JIT_R14, v); /* not dword [v] */
+            jit_bind(s, l_resume);
+            jit_cold_slow(s, l_slow, l_resume, js_not_slow, 0);
+        }
+        break;
+    case OP_lnot:
+        {
+            int l_slow, l_resume, v = jit_slot(sp - 1);
+            DynBuf *out;
+            l_slow = jit_new_label(s);
+            l_resume = jit_new_label(s);
+            jit_cmp_mem_imm(s, 0, JIT_R14, v + JIT_TAG_OFFSET, JS_TAG_UNDEFINED);
+            jit_jcc(s, JIT_CC_A, l_slow);
+            jit_cmp_mem_imm(s, 0, JIT_R14, v, 0);
+            jit_bind(s, l_resume);
+            jit_rr(s, 0, 0x0f90 | JIT_CC_E, 0, JIT_RAX); /* sete al */
+            jit_rr(s, 0, 0x0fb6, JIT_RAX, JIT_RAX); /* movzx eax, al */
+            jit_store32(s, JIT_RAX, JIT_R14, v);
+            jit_store_imm(s, 1, JIT_R14, v + JIT_TAG_OFFSET, JS_TAG_BOOL);
+
+            out = s->out;
+            s->out = &s->cold;
+            jit_bind(s, l_slow);
+            jit_mov_rr(s, JIT_RDI, JIT_RBX);
+            jit_load64(s, JIT_RSI, JIT_R14, v);
+            jit_load64(s, JIT_RDX, JIT_R14, v + JIT_TAG_OFFSET);
+            jit_call(s, js_jit_to_bool);
+            jit_test_rr(s, 0, JIT_RAX);
+            jit_jmp(s, l_resume);
+            s->out = out;
+        }
+        break;
+    case OP_lt:
+    case OP_lte:
+    case OP_gt:
+    case OP_gte:
+    case OP_eq:
+    case OP_neq:
+    case OP_strict_eq:
+    case OP_strict_neq:
+        /* fuse with a following forward conditional branch */
+        if (jit_is_if(pc[size]) && !s->target_tab[pos + size]) {
+            target = jit_branch_target(bc_buf, pos + size);
+            if (target > pos) {
+                jit_compare(s, op, pc[size], target);
+                s->pc_map[pos + size] = 0;
+                size += short_opcode_info(pc[size]).size;
+                break;
+            }
+        }
+        jit_compare(s, op, 0, 0);
+        break;
+
+        /* control flow */
+    case OP_goto:
+    case OP_goto16:
+    case OP_goto8:
+        target = jit_branch_target(bc_buf, pos);
+        if (target <= pos)
+            jit_poll_interrupts(s);
+        jit_jmp_pc(s, target);
+        break;
+    case OP_if_true:
+    case OP_if_false:
+    case OP_if_true8:
+    case OP_if_false8:
+        target = jit_branch_target(bc_buf, pos);
+        if (target <= pos)
+            jit_poll_interrupts(s);
+        jit_branch(s, op == OP_if_true || op == OP_if_true8, target);
+        break;
+
+        /* property access and calls */
+    case OP_get_field_ic:
+    case OP_get_field2_ic:
+    case OP_put_field_ic:
+        jit_field_ic(s, op);
+        break;
+    case OP_get_field:
+    case OP_get_field2:
+    case OP_get_length:
+        jit_call_helper(s, js_jit_op_get_field);
+        break;
+    case OP_get_array_el:
+    case OP_put_array_el:
+        jit_array_el(s, op);
+        break;
+    case OP_call:
+    case OP_call0:
+    case OP_call1:
+    case OP_call2:
+    case OP_call3:
+    case OP_call_method:
+        jit_call_helper(s, js_jit_op_call);
+        break;
+
+    default:
+        /* the interpreter executes the opcode (including return) */
+        jit_emit_exit(s, pc, sp, 0);
+        break;
+    }
+    s->sp = sp;
+    jit_emit_op_exits(s);
+    return size;
+}
+
+/* compute the stack depth before each reachable opcode */
+static int jit_analyze(JSJitCompiler *s)
+{
+    JSFunctionBytecode *b = s->b;
+    const uint8_t *bc_buf = b->byte_code_buf;
+    int bc_len = b->byte_code_len;
+    int *pc_stack, pc_stack_len, pos, pos_next, op, depth, n_pop, target;
+    const JSOpCode *oi;
+
+#define JIT_PUSH_PC(p, d)                                       \
+    do {                                                        \
+        if ((unsigned)(p) >= bc_len)                            \
+            goto fail;                                          \
+        if (s->depth_tab[p] == JIT_DEPTH_NONE) {                \
+            s->depth_tab[p] = (d);                              \
+            pc_stack[pc_stack_len++] = (p);                     \
+        }                                                       \
+    } while (0)
+
+    /* each position is pushed at most once */
+    pc_stack = js_malloc(s->ctx, sizeof(pc_stack[0]) * bc_len);
+    if (!pc_stack)
+        return -1;
+    pc_stack_len = 0;
+    JIT_PUSH_PC(0, 0);
+    while (pc_stack_len > 0) {
+        pos = pc_stack[--pc_stack_len];
+        depth = s->depth_tab[pos];
+        op = bc_buf[pos];
+        if (op == 0 || op >= OP_COUNT)
+            goto fail;
+        oi = &short_opcode_info(op);
+        pos_next = pos + oi->size;
+        n_pop = oi->n_pop;
+        if (oi->fmt == OP_FMT_npop || oi->fmt == OP_FMT_npop_u16)
+            n_pop += get_u16(bc_buf + pos + 1);
+        else if (oi->fmt == OP_FMT_npopx)
+            n_pop += op - OP_call0;
+        depth += oi->n_push - n_pop;
+        if (depth < 0 || depth > b->stack_size)
+            goto fail;
+        switch(op) {
+        case OP_tail_call:
+        case OP_tail_call_method:
+        case OP_return:
+        case OP_return_undef:
+        case OP_return_async:
+        case OP_throw:
+        case OP_throw_error:
+        case OP_ret:
+        case OP_nip_catch:
+            /* the code after nip_catch is only reached from the
+               interpreter */
+            continue;
+        case OP_goto:
+        case OP_goto16:
+        case OP_goto8:
+            target = jit_branch_target(bc_buf, pos);
+            s->target_tab[target] = TRUE;
+            JIT_PUSH_PC(target, depth);
+            continue;
+        case OP_if_true:
+        case OP_if_false:
+        case OP_if_true8:
+        case OP_if_false8:
+            target = jit_branch_target(bc_buf, pos);
+            s->target_tab[target] = TRUE;
+            JIT_PUSH_PC(target, depth);
+            break;
+        case OP_gosub:
+        case OP_catch:
+            target = pos + 1 + (int32_t)get_u32(bc_buf + pos + 1);
+            JIT_PUSH_PC(target, depth + (op == OP_gosub));
+            break;
+        case OP_with_get_var:
+        case OP_with_delete_var:
+        case OP_with_make_ref:
+        case OP_with_get_ref:
+        case OP_with_put_var:
+            target = pos + 5 + (int32_t)get_u32(bc_buf + pos + 5);
+            if (op == OP_with_make_ref || op == OP_with_get_ref)
+                JIT_PUSH_PC(target, depth + 2);
+            else if (op == OP_with_put_var)
+                JIT_PUSH_PC(target, depth - 1);
+            else
+                JIT_PUSH_PC(target, depth + 1);
+            break;
+        default:
+            break;
+        }
+        JIT_PUSH_PC(pos_next, depth);
+    }
+#undef JIT_PUSH_PC
+    js_free(s->ctx, pc_stack);
+    return 0;
+ fail:
+    js_free(s->ctx, pc_stack);
+    return -1;
+}
+
+static void jit_free_compiler(JSJitCompiler *s)
+{
+    dbuf_free(&s->code);
+    dbuf_free(&s->cold);
+    js_free(s->ctx, s->depth_tab);
+    js_free(s->ctx, s->target_tab);
+    js_free(s->ctx, s->labels);
+    js_free(s->ctx, s->fixups);
+}
+
+/* compile 'b' to native code. Return NULL if it is not possible. */
+static JSJitCode *js_jit_compile(JSContext *ctx, JSFunctionBytecode *b)
+{
+    JSJitCompiler s_s, *s = &s_s;
+    JSJitCode *jc = NULL;
+    static const uint8_t saved_regs[] = {
+        JIT_RBP, JIT_RBX, JIT_R12, JIT_R13, JIT_R14, JIT_R15,
+    };
+    int pos, i, bc_len = b->byte_code_len;
+    size_t code_size, page_size;
+    uint8_t *code;
+
+    if (b->func_kind != JS_FUNC_NORMAL)
+        return NULL;
+    memset(s, 0, sizeof(*s));
+    s->ctx = ctx;
+    s->b = b;
+    js_dbuf_init(ctx, &s->code);
+    js_dbuf_init(ctx, &s->cold);
+    s->out = &s->code;
+    jc = js_mallocz(ctx, sizeof(*jc) + sizeof(jc->pc_map[0]) * bc_len);
+    s->depth_tab = js_malloc(ctx, sizeof(s->depth_tab[0]) * bc_len);
+    s->target_tab = js_mallocz(ctx, bc_len);
+    if (!jc || !s->depth_tab || !s->target_tab)
+        goto fail;
+    s->pc_map = jc->pc_map;
+    for(pos = 0; pos < bc_len; pos++)
+        s->depth_tab[pos] = JIT_DEPTH_NONE;
+    if (jit_analyze(s))
+        goto fail;
+    jit_new_label(s); /* placeholder label 0 */
+    s->epilogue = jit_new_label(s);
+    s->helper_exception = jit_new_label(s);
+
+    /* prologue: int (*)(JSJitFrame *jf, const uint8_t *entry) */
+    for(i = 0; i < countof(saved_regs); i++) {
+        jit_rex(s, 0, 0, saved_regs[i]);
+        jit_u8(s, 0x50 + (saved_regs[i] & 7)); /* push */
+    }
+    jit_alu_imm(s, 1, 5, JIT_RSP, 8); /* keep the stack 16 byte aligned */
+    jit_mov_rr(s, JIT_R15, JIT_RDI);
+    jit_load64(s, JIT_RBX, JIT_R15, offsetof(JSJitFrame, ctx));
+    jit_load64(s, JIT_R12, JIT_R15, offsetof(JSJitFrame, var_buf));
+    jit_load64(s, JIT_R13, JIT_R15, offsetof(JSJitFrame, arg_buf));
+    jit_load64(s, JIT_R14, JIT_R15, offsetof(JSJitFrame, stack_buf));
+    jit_rr(s, 0, 0xff, 4, JIT_RSI); /* jmp rsi */
+    /* epilogue */
+    jit_bind(s, s->epilogue);
+    jit_alu_imm(s, 1, 0, JIT_RSP, 8);
+    for(i = countof(saved_regs) - 1; i >= 0; i--) {
+        jit_rex(s, 0, 0, saved_regs[i]);
+        jit_u8(s, 0x58 + (saved_regs[i] & 7)); /* pop */
+    }
+    jit_u8(s, 0xc3); /* ret */
+    jit_bind(s, s->helper_exception);
+    jit_mov_imm(s, JIT_RAX, 1);
+    jit_jmp(s, s->epilogue);
+
+    for(pos = 0; pos < bc_len;) {
+        if (s->depth_tab[pos] == JIT_DEPTH_NONE) {
+            pos += short_opcode_info(b->byte_code_buf[pos]).size;
+        } else {
+            s->pc_map[pos] = s->code.size;
+            pos += jit_emit_op(s, pos);
+        }
+    }
+    if (s->error || dbuf_error(&s->code) || dbuf_error(&s->cold))
+        goto fail;
+
+    /* link the main and cold code in an executable mapping */
+    page_size = sysconf(_SC_PAGESIZE);
+    code_size = (s->code.size + s->cold.size + page_size - 1) & ~(page_size - 1);
+    code = mmap(NULL, code_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        goto fail;
+    memcpy(code, s->code.buf, s->code.size);
+    memcpy(code + s->code.size, s->cold.buf, s->cold.size);
+    for(i = 0; i < s->fixup_count; i++) {
+        JSJitFixup *f = &s->fixups[i];
+        uint32_t pos1, target;
+        pos1 = (f->pos & ~JIT_COLD) + ((f->pos & JIT_COLD) ? s->code.size : 0);
+        if (f->is_pc) {
+            target = s->pc_map[f->target];
+        } else {
+            target = s->labels[f->target];
+            target = (target & ~JIT_COLD) + ((target & JIT_COLD) ? s->code.size : 0);
+        }
+        put_u32(code + pos1, target - (pos1 + 4));
+    }
+    if (mprotect(code, code_size, PROT_READ | PROT_EXEC)) {
+        munmap(code, code_size);
+        goto fail;
+    }
+    jc->code = code;
+    jc->code_size = code_size;
+    jit_free_compiler(s);
+    b->jit_code = jc;
+    return jc;
+ fail:
+    jit_free_compiler(s);
+    js_free(ctx, jc);
+    /* do not retry */
+    return NULL;
+}
+
+static void js_jit_free_code(JSRuntime *rt, JSFunctionBytecode *b)
+{
+    JSJitCode *jc = b->jit_code;
+    if (jc) {
+        munmap(jc->code, jc->code_size);
+        js_free_rt(rt, jc);
+        b->jit_code = NULL;
+    }
+}
+
+/* run the native code of the current function from 'entry' until it
+   exits. The interpreter continues at *ppc with the stack pointer
+   *psp. Return -1 if an exception was raised. */
+static int js_jit_run(JSContext *ctx, JSStackFrame *sf, JSVarRef **var_refs,
+                      JSValueConst this_obj, const uint8_t *entry,
+                      const uint8_t **ppc, JSValue **psp)
+{
+    JSFunctionBytecode *b;
+    JSJitFrame jf;
+    JSJitFunc *func;
+    int ret;
+
+    b = JS_VALUE_GET_OBJ(sf->cur_func)->u.func.function_bytecode;
+    jf.ctx = ctx;
+    jf.sf = sf;
+    jf.b = b;
+    jf.var_buf = sf->var_buf;
+    jf.arg_buf = sf->arg_buf;
+    jf.stack_buf = sf->var_buf + b->var_count;
+    jf.var_refs = var_refs;
+    jf.this_obj = this_obj;
+    func = (JSJitFunc *)(void *)b->jit_code->code;
+    ret = func(&jf, entry);
+    *ppc = jf.pc;
+    *psp = jf.sp;
+    return ret ? -1 : 0;
+}
+
+#endif /* CONFIG_JIT */
+
 static void free_function_bytecode(JSRuntime *rt, JSFunctionBytecode *b)
 {
     int i;
@@ -35707,6 +40028,10 @@ static void free_function_bytecode(JSRuntime *rt, JSFunctionBytecode *b)
     }
     if (b->realm)
         JS_FreeContext(b->realm);
+    js_free_rt(rt, b->ic);
+#ifdef CONFIG_JIT
+    js_jit_free_code(rt, b);
+#endif
 
     JS_FreeAtomRT(rt, b->func_name);
     if (b->has_debug) {
@@ -36902,7 +41227,7 @@ typedef enum BCTagEnum {
     BC_TAG_OBJECT_REFERENCE,
 } BCTagEnum;
 
-#define BC_VERSION 5
+#define BC_VERSION 10
 
 typedef struct BCWriterState {
     JSContext *ctx;
@@ -37129,7 +41454,9 @@ static int JS_WriteFunctionBytecode(BCWriterState *s,
 
     pos = 0;
     while (pos < bc_len) {
-        op = bc_buf[pos];
+        /* the quickened opcodes depend on the execution */
+        op = js_generic_opcode(bc_buf[pos]);
+        bc_buf[pos] = op;
         len = short_opcode_info(op).size;
         switch(short_opcode_info(op).fmt) {
         case OP_FMT_atom:
@@ -37166,9 +41493,9 @@ static void JS_WriteString(BCWriterState *s, JSString *p)
     bc_put_leb128(s, ((uint32_t)p->len << 1) | p->is_wide_char);
     if (p->is_wide_char) {
         for(i = 0; i < p->len; i++)
-            bc_put_u16(s, p->u.str16[i]);
+            bc_put_u16(s, string_ptr16(p)[i]);
     } else {
-        dbuf_put(&s->dbuf, p->u.str8, p->len);
+        dbuf_put(&s->dbuf, string_ptr8(p), p->len);
     }
 }
 
@@ -38062,6 +42389,9 @@ static int JS_ReadFunctionBytecode(BCReaderState *s, JSFunctionBytecode *b,
         default:
             break;
         }
+        if (op >= OP_get_field_ic && op <= OP_put_field_ic) {
+            b->ic_count = max_int(b->ic_count, get_u16(bc_buf + pos + 5) + 1);
+        }
         pos += len;
     }
     return 0;
@@ -40620,6 +44950,34 @@ static JSValue js_function_apply(JSContext *ctx, JSValueConst this_val,
          JS_VALUE_GET_TAG(array_arg) == JS_TAG_NULL) && magic != 2) {
         return JS_Call(ctx, this_val, this_arg, 0, NULL);
     }
+    if (JS_VALUE_GET_TAG(array_arg) == JS_TAG_OBJECT) {
+        JSObject *p = JS_VALUE_GET_OBJ(array_arg);
+        uint32_t i;
+        /* fast arrays are copied on the C stack. Their storage cannot
+           be used directly because the called function may modify
+           the array while it still reads its arguments. */
+        if (p->class_id == JS_CLASS_ARRAY && p->fast_array &&
+            p->u.array.count <= JS_MAX_LOCAL_VARS &&
+            JS_VALUE_GET_TAG(p->prop[0].u.value) == JS_TAG_INT &&
+            JS_VALUE_GET_INT(p->prop[0].u.value) == p->u.array.count) {
+            len = p->u.array.count;
+            if (js_check_stack_overflow(ctx->rt, sizeof(tab[0]) * len))
+                return JS_ThrowStackOverflow(ctx);
+            tab = alloca(sizeof(tab[0]) * max_uint32(1, len));
+            for(i = 0; i < len; i++)
+                tab[i] = JS_DupValue(ctx, p->u.array.u.values[i]);
+            if (magic & 1) {
+                ret = JS_CallConstructorInternal(ctx, this_val, this_arg,
+                                                 len, tab, 0);
+            } else {
+                ret = JS_CallInternal(ctx, this_val, this_arg, JS_UNDEFINED,
+                                      len, tab, 0);
+            }
+            for(i = 0; i < len; i++)
+                JS_FreeValue(ctx, tab[i]);
+            return ret;
+        }
+    }
     tab = build_arg_list(ctx, &len, array_arg);
     if (!tab)
         return JS_EXCEPTION;
@@ -42041,7 +46399,7 @@ static JSValue js_array_join(JSContext *ctx, JSValueConst this_val,
             goto exception;
         p = JS_VALUE_GET_STRING(sep);
         if (p->len == 1 && !p->is_wide_char)
-            c = p->u.str8[0];
+            c = string_ptr8(p)[0];
         else
             c = -1;
     }
@@ -44752,25 +49110,33 @@ static JSValue js_string___isSpace(JSContext *ctx, JSValueConst this_val,
 }
 #endif
 
+/* same as JS_ToStringCheckObject() but the ropes are not linearized */
+static JSValue js_to_string_or_rope_check_object(JSContext *ctx,
+                                                 JSValueConst val)
+{
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING_ROPE)
+        return JS_DupValue(ctx, val);
+    return JS_ToStringCheckObject(ctx, val);
+}
+
 static JSValue js_string_charCodeAt(JSContext *ctx, JSValueConst this_val,
                                      int argc, JSValueConst *argv)
 {
     JSValue val, ret;
-    JSString *p;
-    int idx, c;
+    int idx, c, len;
 
-    val = JS_ToStringCheckObject(ctx, this_val);
+    val = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(val))
         return val;
-    p = JS_VALUE_GET_STRING(val);
+    len = string_rope_get_len(val);
     if (JS_ToInt32Sat(ctx, &idx, argv[0])) {
         JS_FreeValue(ctx, val);
         return JS_EXCEPTION;
     }
-    if (idx < 0 || idx >= p->len) {
+    if (idx < 0 || idx >= len) {
         ret = JS_NAN;
     } else {
-        c = string_get(p, idx);
+        c = string_rope_get(ctx->rt, val, idx);
         ret = JS_NewInt32(ctx, c);
     }
     JS_FreeValue(ctx, val);
@@ -44781,26 +49147,25 @@ static JSValue js_string_charAt(JSContext *ctx, JSValueConst this_val,
                                 int argc, JSValueConst *argv, int is_at)
 {
     JSValue val, ret;
-    JSString *p;
-    int idx, c;
+    int idx, c, len;
 
-    val = JS_ToStringCheckObject(ctx, this_val);
+    val = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(val))
         return val;
-    p = JS_VALUE_GET_STRING(val);
+    len = string_rope_get_len(val);
     if (JS_ToInt32Sat(ctx, &idx, argv[0])) {
         JS_FreeValue(ctx, val);
         return JS_EXCEPTION;
     }
     if (idx < 0 && is_at)
-        idx += p->len;
-    if (idx < 0 || idx >= p->len) {
+        idx += len;
+    if (idx < 0 || idx >= len) {
         if (is_at)
             ret = JS_UNDEFINED;
         else
             ret = JS_AtomToString(ctx, JS_ATOM_empty_string);
     } else {
-        c = string_get(p, idx);
+        c = string_rope_get(ctx->rt, val, idx);
         ret = js_new_string_char(ctx, c);
     }
     JS_FreeValue(ctx, val);
@@ -44811,21 +49176,25 @@ static JSValue js_string_codePointAt(JSContext *ctx, JSValueConst this_val,
                                      int argc, JSValueConst *argv)
 {
     JSValue val, ret;
-    JSString *p;
-    int idx, c;
+    int idx, c, c1, len;
 
-    val = JS_ToStringCheckObject(ctx, this_val);
+    val = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(val))
         return val;
-    p = JS_VALUE_GET_STRING(val);
+    len = string_rope_get_len(val);
     if (JS_ToInt32Sat(ctx, &idx, argv[0])) {
         JS_FreeValue(ctx, val);
         return JS_EXCEPTION;
     }
-    if (idx < 0 || idx >= p->len) {
+    if (idx < 0 || idx >= len) {
         ret = JS_UNDEFINED;
     } else {
-        c = string_getc(p, &idx);
+        c = string_rope_get(ctx->rt, val, idx);
+        if (is_hi_surrogate(c) && idx + 1 < len) {
+            c1 = string_rope_get(ctx->rt, val, idx + 1);
+            if (is_lo_surrogate(c1))
+                c = from_surrogate(c, c1);
+        }
         ret = JS_NewInt32(ctx, c);
     }
     JS_FreeValue(ctx, val);
@@ -44863,18 +49232,57 @@ static int string_cmp(JSString *p1, JSString *p2, int x1, int x2, int len)
 static int string_indexof_char(JSString *p, int c, int from)
 {
     /* assuming 0 <= from <= p->len */
-    int i, len = p->len;
-    if (p->is_wide_char) {
-        for (i = from; i < len; i++) {
-            if (p->u.str16[i] == c)
+    const uint8_t *q;
+
+    if (p->is_wide_char)
+        return u16_indexof(string_ptr16(p), c, from, p->len);
+    if ((c & ~0xff) != 0 || from >= p->len)
+        return -1;
+    /* memchr is vectorized by the C library */
+    q = memchr(string_ptr8(p) + from, c, p->len - from);
+    if (!q)
+        return -1;
+    return q - string_ptr8(p);
+}
+
+/* return TRUE if p1[x1..x1+len) == p2[x2..x2+len) */
+static BOOL string_equal_at(JSString *p1, JSString *p2, int x1, int x2, int len)
+{
+    if (p1->is_wide_char == p2->is_wide_char) {
+        if (p1->is_wide_char)
+            return !memcmp(string_ptr16(p1) + x1, string_ptr16(p2) + x2, len * 2);
+        else
+            return !memcmp(string_ptr8(p1) + x1, string_ptr8(p2) + x2, len);
+    }
+    return !string_cmp(p1, p2, x1, x2, len);
+}
+
+#define STRING_HORSPOOL_MIN_LEN 16
+
+/* Boyer-Moore-Horspool search for long patterns. The shift table is
+   indexed by the low 8 bits of the characters, so collisions only
+   reduce the shifts. */
+static int string_indexof_horspool(JSString *p1, JSString *p2, int from)
+{
+    int i, len1 = p1->len, len2 = p2->len, c_last;
+    uint16_t shift[256];
+
+    for(i = 0; i < 256; i++)
+        shift[i] = min_int(len2, UINT16_MAX);
+    for(i = max_int(0, len2 - UINT16_MAX); i < len2 - 1; i++)
+        shift[string_get(p2, i) & 0xff] = len2 - 1 - i;
+    c_last = string_get(p2, len2 - 1);
+    if (p1->is_wide_char) {
+        const uint16_t *tab = string_ptr16(p1) + len2 - 1;
+        for(i = from; i + len2 <= len1; i += shift[tab[i] & 0xff]) {
+            if (tab[i] == c_last && string_equal_at(p1, p2, i, 0, len2 - 1))
                 return i;
         }
     } else {
-        if ((c & ~0xff) == 0) {
-            for (i = from; i < len; i++) {
-                if (p->u.str8[i] == (uint8_t)c)
-                    return i;
-            }
+        const uint8_t *tab = string_ptr8(p1) + len2 - 1;
+        for(i = from; i + len2 <= len1; i += shift[tab[i]]) {
+            if (tab[i] == c_last && string_equal_at(p1, p2, i, 0, len2 - 1))
+                return i;
         }
     }
     return -1;
@@ -44886,16 +49294,77 @@ static int string_indexof(JSString *p1, JSString *p2, int from)
     int c, i, j, len1 = p1->len, len2 = p2->len;
     if (len2 == 0)
         return from;
+    if (len2 > len1 - from)
+        return -1;
+    if (len2 >= STRING_HORSPOOL_MIN_LEN)
+        return string_indexof_horspool(p1, p2, from);
     for (i = from, c = string_get(p2, 0); i + len2 <= len1; i = j + 1) {
         j = string_indexof_char(p1, c, i);
         if (j < 0 || j + len2 > len1)
             break;
-        if (!string_cmp(p1, p2, j + 1, 1, len2 - 1))
+        if (string_equal_at(p1, p2, j + 1, 1, len2 - 1))
             return j;
     }
     return -1;
 }
 
+/* return TRUE if the characters of 'p2' are at the position 'pos' of
+   the string or rope 'val' */
+static BOOL string_rope_equal_at(JSRuntime *rt, JSValueConst val,
+                                 uint32_t pos, JSString *p2)
+{
+    JSString *p;
+    uint32_t i, l, start;
+
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
+        return string_equal_at(JS_VALUE_GET_STRING(val), p2, pos, 0, p2->len);
+    for(i = 0; i < p2->len; i += l) {
+        p = string_rope_find_leaf(rt, val, pos + i, &start);
+        l = min_uint32(p->len - (pos + i - start), p2->len - i);
+        if (!string_equal_at(p, p2, pos + i - start, i, l))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* same as string_indexof() for a string or a rope */
+static int string_rope_indexof(JSRuntime *rt, JSValueConst val, JSString *p2,
+                               int from)
+{
+    JSStringRopeIter it;
+    JSString *p;
+    int len, len2, start, pos, j, c;
+
+    if (JS_VALUE_GET_TAG(val) == JS_TAG_STRING)
+        return string_indexof(JS_VALUE_GET_STRING(val), p2, from);
+    len = string_rope_get_len(val);
+    len2 = p2->len;
+    if (len2 == 0)
+        return from;
+    if (len2 > len - from)
+        return -1;
+    c = string_get(p2, 0);
+    string_rope_iter_init(&it, val);
+    for(start = 0; (p = string_rope_iter_next(&it)) != NULL; start += p->len) {
+        if (start + p->len <= from)
+            continue;
+        pos = max_int(from - start, 0);
+        /* matches inside the leaf */
+        j = string_indexof(p, p2, pos);
+        if (j >= 0)
+            return start + j;
+        /* matches crossing the end of the leaf */
+        for(j = max_int(pos, p->len - len2 + 1); j < p->len; j++) {
+            if (start + j + len2 > len)
+                return -1;
+            if (string_get(p, j) == c &&
+                string_rope_equal_at(rt, val, start + j, p2))
+                return start + j;
+        }
+    }
+    return -1;
+}
+
 static int64_t string_advance_index(JSString *p, int64_t index, BOOL unicode)
 {
     if (!unicode || index >= p->len || !p->is_wide_char) {
@@ -44916,10 +49385,10 @@ static int js_string_find_invalid_codepoint(JSString *p)
     if (!p->is_wide_char)
         return -1;
     for(i = 0; i < p->len; i++) {
-        uint32_t c = p->u.str16[i];
+        uint32_t c = string_ptr16(p)[i];
         if (is_surrogate(c)) {
             if (is_hi_surrogate(c) && (i + 1) < p->len
-            &&  is_lo_surrogate(p->u.str16[i + 1])) {
+            &&  is_lo_surrogate(string_ptr16(p)[i + 1])) {
                 i++;
             } else {
                 return i;
@@ -44962,7 +49431,7 @@ static JSValue js_string_toWellFormed(JSContext *ctx, JSValueConst this_val,
     if (i < 0)
         return str;
 
-    ret = js_new_string16_len(ctx, p->u.str16, p->len);
+    ret = js_new_string16_len(ctx, string_ptr16(p), p->len);
     JS_FreeValue(ctx, str);
     if (JS_IsException(ret))
         return JS_EXCEPTION;
@@ -44986,21 +49455,26 @@ static JSValue js_string_indexOf(JSContext *ctx, JSValueConst this_val,
                                  int argc, JSValueConst *argv, int lastIndexOf)
 {
     JSValue str, v;
-    int i, len, v_len, pos, start, stop, ret, inc;
+    int i, len, v_len, pos, ret;
     JSString *p;
     JSString *p1;
 
-    str = JS_ToStringCheckObject(ctx, this_val);
+    /* the ropes are only linearized for lastIndexOf() */
+    if (lastIndexOf)
+        str = JS_ToStringCheckObject(ctx, this_val);
+    else
+        str = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(str))
         return str;
     v = JS_ToString(ctx, argv[0]);
     if (JS_IsException(v))
         goto fail;
-    p = JS_VALUE_GET_STRING(str);
     p1 = JS_VALUE_GET_STRING(v);
-    len = p->len;
+    len = string_rope_get_len(str);
     v_len = p1->len;
+    ret = -1;
     if (lastIndexOf) {
+        p = JS_VALUE_GET_STRING(str);
         pos = len - v_len;
         if (argc > 1) {
             double d;
@@ -45013,29 +49487,21 @@ static JSValue js_string_indexOf(JSContext *ctx, JSValueConst this_val,
                     pos = d;
             }
         }
-        start = pos;
-        stop = 0;
-        inc = -1;
+        if (len >= v_len) {
+            for (i = pos; i >= 0; i--) {
+                if (!string_cmp(p, p1, i, 0, v_len)) {
+                    ret = i;
+                    break;
+                }
+            }
+        }
     } else {
         pos = 0;
         if (argc > 1) {
             if (JS_ToInt32Clamp(ctx, &pos, argv[1], 0, len, 0))
                 goto fail;
         }
-        start = pos;
-        stop = len - v_len;
-        inc = 1;
-    }
-    ret = -1;
-    if (len >= v_len && inc * (stop - start) >= 0) {
-        for (i = start;; i += inc) {
-            if (!string_cmp(p, p1, i, 0, v_len)) {
-                ret = i;
-                break;
-            }
-            if (i == stop)
-                break;
-        }
+        ret = string_rope_indexof(ctx->rt, str, p1, pos);
     }
     JS_FreeValue(ctx, str);
     JS_FreeValue(ctx, v);
@@ -45054,11 +49520,10 @@ static JSValue js_string_includes(JSContext *ctx, JSValueConst this_val,
                                   int argc, JSValueConst *argv, int magic)
 {
     JSValue str, v = JS_UNDEFINED;
-    int i, len, v_len, pos, start, stop, ret;
-    JSString *p;
+    int len, v_len, pos, ret;
     JSString *p1;
 
-    str = JS_ToStringCheckObject(ctx, this_val);
+    str = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(str))
         return str;
     ret = js_is_regexp(ctx, argv[0]);
@@ -45070,40 +49535,23 @@ static JSValue js_string_includes(JSContext *ctx, JSValueConst this_val,
     v = JS_ToString(ctx, argv[0]);
     if (JS_IsException(v))
         goto fail;
-    p = JS_VALUE_GET_STRING(str);
     p1 = JS_VALUE_GET_STRING(v);
-    len = p->len;
+    len = string_rope_get_len(str);
     v_len = p1->len;
     pos = (magic == 2) ? len : 0;
     if (argc > 1 && !JS_IsUndefined(argv[1])) {
         if (JS_ToInt32Clamp(ctx, &pos, argv[1], 0, len, 0))
             goto fail;
     }
-    len -= v_len;
     ret = 0;
     if (magic == 0) {
-        start = pos;
-        stop = len;
+        ret = (string_rope_indexof(ctx->rt, str, p1, pos) >= 0);
     } else {
-        if (magic == 1) {
-            if (pos > len)
-                goto done;
-        } else {
+        if (magic == 2)
             pos -= v_len;
-        }
-        start = stop = pos;
+        if (pos >= 0 && pos <= len - v_len)
+            ret = string_rope_equal_at(ctx->rt, str, pos, p1);
     }
-    if (start >= 0 && start <= stop) {
-        for (i = start;; i++) {
-            if (!string_cmp(p, p1, i, 0, v_len)) {
-                ret = 1;
-                break;
-            }
-            if (i == stop)
-                break;
-        }
-    }
- done:
     JS_FreeValue(ctx, str);
     JS_FreeValue(ctx, v);
     return JS_NewBool(ctx, ret);
@@ -45272,8 +49720,8 @@ static int js_string_GetSubstitution(JSContext *ctx,
                 if (captures) {
                     int start, end;
                     if (captures[2 * k] && captures[2 * k + 1]) {
-                        start = (captures[2 * k] - sp->u.str8) >> shift;
-                        end = (captures[2 * k + 1] - sp->u.str8) >> shift;
+                        start = (captures[2 * k] - string_ptr8(sp)) >> shift;
+                        end = (captures[2 * k + 1] - string_ptr8(sp)) >> shift;
                         string_buffer_concat(b, sp, start, end);
                     }
                 } else {
@@ -45521,20 +49969,19 @@ static JSValue js_string_substring(JSContext *ctx, JSValueConst this_val,
                                    int argc, JSValueConst *argv)
 {
     JSValue str, ret;
-    int a, b, start, end;
-    JSString *p;
+    int a, b, start, end, len;
 
-    str = JS_ToStringCheckObject(ctx, this_val);
+    str = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(str))
         return str;
-    p = JS_VALUE_GET_STRING(str);
-    if (JS_ToInt32Clamp(ctx, &a, argv[0], 0, p->len, 0)) {
+    len = string_rope_get_len(str);
+    if (JS_ToInt32Clamp(ctx, &a, argv[0], 0, len, 0)) {
         JS_FreeValue(ctx, str);
         return JS_EXCEPTION;
     }
-    b = p->len;
+    b = len;
     if (!JS_IsUndefined(argv[1])) {
-        if (JS_ToInt32Clamp(ctx, &b, argv[1], 0, p->len, 0)) {
+        if (JS_ToInt32Clamp(ctx, &b, argv[1], 0, len, 0)) {
             JS_FreeValue(ctx, str);
             return JS_EXCEPTION;
         }
@@ -45546,7 +49993,7 @@ static JSValue js_string_substring(JSContext *ctx, JSValueConst this_val,
         start = b;
         end = a;
     }
-    ret = js_sub_string(ctx, p, start, end);
+    ret = js_sub_string_rope(ctx, str, start, end);
     JS_FreeValue(ctx, str);
     return ret;
 }
@@ -45556,13 +50003,11 @@ static JSValue js_string_substr(JSContext *ctx, JSValueConst this_val,
 {
     JSValue str, ret;
     int a, len, n;
-    JSString *p;
 
-    str = JS_ToStringCheckObject(ctx, this_val);
+    str = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(str))
         return str;
-    p = JS_VALUE_GET_STRING(str);
-    len = p->len;
+    len = string_rope_get_len(str);
     if (JS_ToInt32Clamp(ctx, &a, argv[0], 0, len, len)) {
         JS_FreeValue(ctx, str);
         return JS_EXCEPTION;
@@ -45574,7 +50019,7 @@ static JSValue js_string_substr(JSContext *ctx, JSValueConst this_val,
             return JS_EXCEPTION;
         }
     }
-    ret = js_sub_string(ctx, p, a, a + n);
+    ret = js_sub_string_rope(ctx, str, a, a + n);
     JS_FreeValue(ctx, str);
     return ret;
 }
@@ -45584,13 +50029,11 @@ static JSValue js_string_slice(JSContext *ctx, JSValueConst this_val,
 {
     JSValue str, ret;
     int len, start, end;
-    JSString *p;
 
-    str = JS_ToStringCheckObject(ctx, this_val);
+    str = js_to_string_or_rope_check_object(ctx, this_val);
     if (JS_IsException(str))
         return str;
-    p = JS_VALUE_GET_STRING(str);
-    len = p->len;
+    len = string_rope_get_len(str);
     if (JS_ToInt32Clamp(ctx, &start, argv[0], 0, len, len)) {
         JS_FreeValue(ctx, str);
         return JS_EXCEPTION;
@@ -45602,7 +50045,7 @@ static JSValue js_string_slice(JSContext *ctx, JSValueConst this_val,
             return JS_EXCEPTION;
         }
     }
-    ret = js_sub_string(ctx, p, start, max_int(end, start));
+    ret = js_sub_string_rope(ctx, str, start, max_int(end, start));
     JS_FreeValue(ctx, str);
     return ret;
 }
@@ -45759,16 +50202,16 @@ static int string_prevc(JSString *p, int *pidx)
         return 0;
     idx--;
     if (p->is_wide_char) {
-        c = p->u.str16[idx];
+        c = string_ptr16(p)[idx];
         if (is_lo_surrogate(c) && idx > 0) {
-            c1 = p->u.str16[idx - 1];
+            c1 = string_ptr16(p)[idx - 1];
             if (is_hi_surrogate(c1)) {
                 c = from_surrogate(c1, c);
                 idx--;
             }
         }
     } else {
-        c = p->u.str8[idx];
+        c = string_ptr8(p)[idx];
     }
     *pidx = idx;
     return c;
@@ -46076,7 +50519,7 @@ static JSValue js_string_iterator_next(JSContext *ctx, JSValueConst this_val,
     if (c <= 0xffff) {
         return js_new_string_char(ctx, c);
     } else {
-        return js_new_string16_len(ctx, p->u.str16 + start, 2);
+        return js_new_string16_len(ctx, string_ptr16(p) + start, 2);
     }
 }
 
@@ -46871,10 +51314,105 @@ static void js_regexp_finalizer(JSRuntime *rt, JSValue val)
         JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_STRING, re->pattern));
 }
 
+/* The compiled regexps are cached per runtime. The bytecode only
+   depends on the pattern and on the flags and it is immutable, so the
+   same string is shared by all the RegExp objects. */
+
+static uint32_t regexp_cache_hash(JSString *pattern, int re_flags)
+{
+    return js_string_hash(pattern) * 31 + re_flags;
+}
+
+static void regexp_cache_free_entry(JSRuntime *rt, JSRegExpCacheEntry *e)
+{
+    JSRegExpCacheEntry **pe;
+
+    for(pe = &rt->regexp_cache_hash[e->hash & (rt->regexp_cache_hash_size - 1)];
+        *pe != e; pe = &(*pe)->hash_next)
+        continue;
+    *pe = e->hash_next;
+    list_del(&e->link);
+    JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_STRING, e->pattern));
+    JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_STRING, e->bytecode));
+    js_free_rt(rt, e);
+    rt->regexp_cache_count--;
+}
+
+static void regexp_cache_clear(JSRuntime *rt)
+{
+    struct list_head *el, *el1;
+
+    list_for_each_safe(el, el1, &rt->regexp_cache_list) {
+        regexp_cache_free_entry(rt, list_entry(el, JSRegExpCacheEntry, link));
+    }
+    js_free_rt(rt, rt->regexp_cache_hash);
+    rt->regexp_cache_hash = NULL;
+    rt->regexp_cache_hash_size = 0;
+}
+
+/* return the cached bytecode or JS_UNDEFINED */
+static JSValue regexp_cache_find(JSRuntime *rt, JSString *pattern,
+                                 int re_flags)
+{
+    JSRegExpCacheEntry *e;
+    uint32_t h;
+
+    if (rt->regexp_cache_count == 0)
+        return JS_UNDEFINED;
+    h = regexp_cache_hash(pattern, re_flags);
+    for(e = rt->regexp_cache_hash[h & (rt->regexp_cache_hash_size - 1)];
+        e != NULL; e = e->hash_next) {
+        if (e->hash == h && e->re_flags == re_flags &&
+            js_string_eq(NULL, e->pattern, pattern)) {
+            list_del(&e->link);
+            list_add(&e->link, &rt->regexp_cache_list);
+            return JS_DupValueRT(rt, JS_MKPTR(JS_TAG_STRING, e->bytecode));
+        }
+    }
+    return JS_UNDEFINED;
+}
+
+/* the cache is not modified if there is not enough memory */
+static void regexp_cache_add(JSRuntime *rt, JSString *pattern, int re_flags,
+                             JSValueConst bc)
+{
+    JSRegExpCacheEntry *e;
+    int hash_size;
+
+    if (!rt->regexp_cache_hash) {
+        hash_size = 1;
+        while (hash_size < rt->regexp_cache_size)
+            hash_size *= 2;
+        rt->regexp_cache_hash = js_mallocz_rt(rt, sizeof(rt->regexp_cache_hash[0]) *
+                                              hash_size);
+        if (!rt->regexp_cache_hash)
+            return;
+        rt->regexp_cache_hash_size = hash_size;
+    }
+    if (rt->regexp_cache_count >= rt->regexp_cache_size) {
+        /* remove the least recently used entry */
+        regexp_cache_free_entry(rt, list_entry(rt->regexp_cache_list.prev,
+                                               JSRegExpCacheEntry, link));
+    }
+    e = js_malloc_rt(rt, sizeof(*e));
+    if (!e)
+        return;
+    e->hash = regexp_cache_hash(pattern, re_flags);
+    e->re_flags = re_flags;
+    e->pattern = JS_VALUE_GET_STRING(JS_DupValueRT(rt, JS_MKPTR(JS_TAG_STRING, pattern)));
+    e->bytecode = JS_VALUE_GET_STRING(JS_DupValueRT(rt, bc));
+    e->hash_next = rt->regexp_cache_hash[e->hash & (rt->regexp_cache_hash_size - 1)];
+    rt->regexp_cache_hash[e->hash & (rt->regexp_cache_hash_size - 1)] = e;
+    list_add(&e->link, &rt->regexp_cache_list);
+    rt->regexp_cache_count++;
+}
+
 /* create a string containing the RegExp bytecode */
 static JSValue js_compile_regexp(JSContext *ctx, JSValueConst pattern,
                                  JSValueConst flags)
 {
+    JSRuntime *rt = ctx->rt;
+    BOOL use_cache;
     const char *str;
     int re_flags, mask;
     uint8_t *re_bytecode_buf;
@@ -46933,7 +51471,18 @@ static JSValue js_compile_regexp(JSContext *ctx, JSValueConst pattern,
     bad_flags1:
         return JS_ThrowSyntaxError(ctx, "invalid regular expression flags");
     }
-    
+
+    use_cache = (rt->regexp_cache_size != 0 &&
+                 JS_VALUE_GET_TAG(pattern) == JS_TAG_STRING);
+    if (use_cache) {
+        ret = regexp_cache_find(rt, JS_VALUE_GET_STRING(pattern), re_flags);
+        if (!JS_IsUndefined(ret)) {
+            rt->regexp_cache_hits++;
+            return ret;
+        }
+        rt->regexp_cache_misses++;
+    }
+
     str = JS_ToCStringLen2(ctx, &len, pattern, !(re_flags & (LRE_FLAG_UNICODE | LRE_FLAG_UNICODE_SETS)));
     if (!str)
         return JS_EXCEPTION;
@@ -46947,6 +51496,8 @@ static JSValue js_compile_regexp(JSContext *ctx, JSValueConst pattern,
 
     ret = js_new_string8_len(ctx, (const char *)re_bytecode_buf, re_bytecode_len);
     js_free(ctx, re_bytecode_buf);
+    if (use_cache && !JS_IsException(ret))
+        regexp_cache_add(rt, JS_VALUE_GET_STRING(pattern), re_flags, ret);
     return ret;
 }
 
@@ -47421,7 +51972,8 @@ static JSValue js_regexp_exec(JSContext *ctx, JSValueConst this_val,
     JSValue t, ret, str_val, obj, groups;
     JSValue indices, indices_groups;
     uint8_t *re_bytecode;
-    uint8_t **capture, *str_buf;
+    uint8_t **capture;
+    const uint8_t *str_buf;
     int rc, capture_count, shift, i, re_flags, alloc_count;
     int64_t last_index;
     const char *group_name_ptr;
@@ -47460,7 +52012,7 @@ static JSValue js_regexp_exec(JSContext *ctx, JSValueConst this_val,
     }
     capture_count = lre_get_capture_count(re_bytecode);
     shift = str->is_wide_char;
-    str_buf = str->u.str8;
+    str_buf = string_ptr8(str);
     if (last_index > str->len) {
         rc = 2;
     } else {
@@ -47641,7 +52193,8 @@ static JSValue js_regexp_replace(JSContext *ctx, JSValueConst this_val, JSValueC
     JSValue str_val;
     uint8_t *re_bytecode;
     int ret;
-    uint8_t **capture, *str_buf;
+    uint8_t **capture;
+    const uint8_t *str_buf;
     int capture_count, alloc_count, shift, re_flags;
     int next_src_pos, start, end;
     int64_t last_index;
@@ -47685,7 +52238,7 @@ static JSValue js_regexp_replace(JSContext *ctx, JSValueConst this_val, JSValueC
     capture_count = lre_get_capture_count(re_bytecode);
     fullUnicode = ((re_flags & (LRE_FLAG_UNICODE | LRE_FLAG_UNICODE_SETS)) != 0);
     shift = str->is_wide_char;
-    str_buf = str->u.str8;
+    str_buf = string_ptr8(str);
     next_src_pos = 0;
     for (;;) {
         if (last_index > str->len) {
@@ -49217,8 +53770,11 @@ exception:
     return -1;
 }
 
-JSValue JS_JSONStringify(JSContext *ctx, JSValueConst obj,
-                         JSValueConst replacer, JSValueConst space0)
+/* if 'w' is not NULL, the result is output to it and JS_TRUE is
+   returned instead of the string */
+static JSValue js_json_stringify_internal(JSContext *ctx, JSValueConst obj,
+                                          JSValueConst replacer,
+                                          JSValueConst space0, UTF8Writer *w)
 {
     StringBuffer b_s;
     JSONStringifyContext jsc_s, *jsc = &jsc_s;
@@ -49235,7 +53791,12 @@ JSValue JS_JSONStringify(JSContext *ctx, JSValueConst obj,
     ret = JS_UNDEFINED;
     wrapper = JS_UNDEFINED;
 
-    string_buffer_init(ctx, jsc->b, 0);
+    if (w) {
+        string_buffer_init(ctx, jsc->b, UTF8_WRITER_BUF_SIZE);
+        jsc->b->writer = w;
+    } else {
+        string_buffer_init(ctx, jsc->b, 0);
+    }
     jsc->stack = JS_NewArray(ctx);
     if (JS_IsException(jsc->stack))
         goto exception;
@@ -49335,6 +53896,16 @@ JSValue JS_JSONStringify(JSContext *ctx, JSValueConst obj,
     if (js_json_to_str(ctx, jsc, wrapper, val, jsc->empty))
         goto exception;
 
+    if (w) {
+        /* the errors of the buffer functions are not always
+           propagated */
+        if (jsc->b->error_status)
+            goto exception;
+        string_buffer_flush(jsc->b);
+        utf8_writer_end(w);
+        ret = JS_TRUE;
+        goto done1;
+    }
     ret = string_buffer_end(jsc->b);
     goto done;
 
@@ -49351,6 +53922,26 @@ done:
     return ret;
 }
 
+JSValue JS_JSONStringify(JSContext *ctx, JSValueConst obj,
+                         JSValueConst replacer, JSValueConst space0)
+{
+    return js_json_stringify_internal(ctx, obj, replacer, space0, NULL);
+}
+
+int JS_JSONStringifyWrite(JSContext *ctx, JSPrintValueWrite *write_func,
+                          void *write_opaque, JSValueConst obj,
+                          JSValueConst replacer, JSValueConst space0)
+{
+    UTF8Writer w_s, *w = &w_s;
+    JSValue ret;
+
+    utf8_writer_init(w, write_func, write_opaque, FALSE);
+    ret = js_json_stringify_internal(ctx, obj, replacer, space0, w);
+    if (JS_IsException(ret))
+        return -1;
+    return JS_IsBool(ret);
+}
+
 static JSValue js_json_stringify(JSContext *ctx, JSValueConst this_val,
                                  int argc, JSValueConst *argv)
 {
@@ -50748,19 +55339,13 @@ static JSValue js_map_constructor(JSContext *ctx, JSValueConst new_target,
     s = js_mallocz(ctx, sizeof(*s));
     if (!s)
         goto fail;
-    init_list_head(&s->records);
+    init_list_head(&s->iterators);
     s->is_weak = is_weak;
     if (is_weak) {
         s->weakref_header.weakref_type = JS_WEAKREF_TYPE_MAP;
         list_add_tail(&s->weakref_header.link, &ctx->rt->weakref_list);
     }
     JS_SetOpaque(obj, s);
-    s->hash_bits = 1;
-    s->hash_size = 1U << s->hash_bits;
-    s->hash_table = js_mallocz(ctx, sizeof(s->hash_table[0]) * s->hash_size);
-    if (!s->hash_table)
-        goto fail;
-    s->record_count_threshold = 4;
 
     arr = JS_UNDEFINED;
     if (argc > 0)
@@ -50898,10 +55483,12 @@ static uint32_t map_hash_key(JSValueConst key, int hash_bits)
         h = map_hash32(JS_VALUE_GET_INT(key) ^ JS_TAG_BOOL, hash_bits);
         break;
     case JS_TAG_STRING:
-        h = map_hash32(hash_string(JS_VALUE_GET_STRING(key), 0) ^ JS_TAG_STRING, hash_bits);
+        h = map_hash32(js_string_hash(JS_VALUE_GET_STRING(key)) ^ JS_TAG_STRING, hash_bits);
         break;
     case JS_TAG_STRING_ROPE:
-        h = map_hash32(hash_string_rope(key, 0) ^ JS_TAG_STRING, hash_bits);
+        /* must be consistent with js_string_hash() */
+        h = hash_string_rope(key, JS_ATOM_TYPE_STRING) & JS_ATOM_HASH_MASK;
+        h = map_hash32(h ^ JS_TAG_STRING, hash_bits);
         break;
     case JS_TAG_OBJECT:
     case JS_TAG_SYMBOL:
@@ -50942,154 +55529,175 @@ static uint32_t map_hash_key(JSValueConst key, int hash_bits)
     return h;
 }
 
-static JSMapRecord *map_find_record(JSContext *ctx, JSMapState *s,
-                                    JSValueConst key)
+/* return the hash chain link pointing to the record of 'key' or NULL
+   if not found */
+static uint32_t *map_find_link(JSContext *ctx, JSMapState *s,
+                               JSValueConst key)
 {
     JSMapRecord *mr;
-    uint32_t h;
-    h = map_hash_key(key, s->hash_bits);
-    for(mr = s->hash_table[h]; mr != NULL; mr = mr->hash_next) {
-        if (mr->empty || (s->is_weak && !js_weakref_is_live(mr->key))) {
+    uint32_t *pidx;
+
+    if (!s->hash_table)
+        return NULL;
+    pidx = &s->hash_table[map_hash_key(key, s->hash_bits)];
+    while (*pidx != MAP_RECORD_NONE) {
+        mr = &s->records[*pidx];
+        if (s->is_weak && !js_weakref_is_live(mr->key)) {
             /* cannot match */
         } else {
             if (js_same_value_zero(ctx, mr->key, key))
-                return mr;
+                return pidx;
         }
+        pidx = &mr->hash_next;
     }
     return NULL;
 }
 
-static void map_hash_resize(JSContext *ctx, JSMapState *s)
+/* warning: the returned pointer is only valid until the next record
+   is added */
+static JSMapRecord *map_find_record(JSContext *ctx, JSMapState *s,
+                                    JSValueConst key)
+{
+    uint32_t *pidx;
+    pidx = map_find_link(ctx, s, key);
+    if (!pidx)
+        return NULL;
+    return &s->records[*pidx];
+}
+
+/* Reallocate the record array with 'new_size' entries, removing the
+   deleted records, and rebuild the hash table. The enumeration
+   positions are updated. Return -1 if memory allocation failed
+   (without raising an exception). */
+static int map_resize(JSRuntime *rt, JSMapState *s, uint32_t new_size)
 {
-    uint32_t new_hash_size, h;
+    JSMapRecord *new_records, *mr;
+    uint32_t i, j, h, *new_hash_table;
     int new_hash_bits;
     struct list_head *el;
-    JSMapRecord *mr, **new_hash_table;
-
-    /* XXX: no reporting of memory allocation failure */
-    new_hash_bits = min_int(s->hash_bits + 1, 31);
-    new_hash_size = 1U << new_hash_bits;
-    new_hash_table = js_realloc(ctx, s->hash_table,
-                                sizeof(new_hash_table[0]) * new_hash_size);
-    if (!new_hash_table)
-        return;
-
-    memset(new_hash_table, 0, sizeof(new_hash_table[0]) * new_hash_size);
+    JSMapIterPos *pos;
+
+    /* at most 2 records per hash bucket on average */
+    new_hash_bits = 1;
+    while ((1U << new_hash_bits) < new_size / 2)
+        new_hash_bits++;
+    new_records = js_malloc_rt(rt, sizeof(new_records[0]) * new_size);
+    if (!new_records)
+        return -1;
+    if (s->hash_table && new_hash_bits == s->hash_bits) {
+        new_hash_table = s->hash_table;
+    } else {
+        new_hash_table = js_malloc_rt(rt, sizeof(new_hash_table[0]) <<
+                                      new_hash_bits);
+        if (!new_hash_table) {
+            js_free_rt(rt, new_records);
+            return -1;
+        }
+    }
+    memset(new_hash_table, 0xff, sizeof(new_hash_table[0]) << new_hash_bits);
 
-    list_for_each(el, &s->records) {
-        mr = list_entry(el, JSMapRecord, link);
-        if (mr->empty || (s->is_weak && !js_weakref_is_live(mr->key))) {
-        } else {
+    j = 0;
+    for(i = 0; i < s->records_len; i++) {
+        mr = &s->records[i];
+        /* the old array is freed below: keep the new index of the
+           first live record at or after 'i' for the enumerations */
+        mr->hash_next = j;
+        if (!map_record_is_deleted(mr)) {
+            new_records[j] = *mr;
             h = map_hash_key(mr->key, new_hash_bits);
-            mr->hash_next = new_hash_table[h];
-            new_hash_table[h] = mr;
+            new_records[j].hash_next = new_hash_table[h];
+            new_hash_table[h] = j;
+            j++;
         }
     }
+    list_for_each(el, &s->iterators) {
+        pos = list_entry(el, JSMapIterPos, link);
+        if (pos->index < s->records_len)
+            pos->index = s->records[pos->index].hash_next;
+        else
+            pos->index = j;
+    }
+
+    js_free_rt(rt, s->records);
+    if (new_hash_table != s->hash_table)
+        js_free_rt(rt, s->hash_table);
+    s->records = new_records;
+    s->records_len = j;
+    s->records_size = new_size;
     s->hash_table = new_hash_table;
     s->hash_bits = new_hash_bits;
-    s->hash_size = new_hash_size;
-    s->record_count_threshold = new_hash_size * 2;
+    s->hash_size = 1U << new_hash_bits;
+    return 0;
 }
 
+/* the value of the new record is JS_UNDEFINED. Warning: the returned
+   pointer is only valid until the next record is added */
 static JSMapRecord *map_add_record(JSContext *ctx, JSMapState *s,
                                    JSValueConst key)
 {
-    uint32_t h;
+    uint32_t h, new_size;
     JSMapRecord *mr;
 
-    mr = js_malloc(ctx, sizeof(*mr));
-    if (!mr)
-        return NULL;
-    mr->ref_count = 1;
-    mr->empty = FALSE;
+    if (s->records_len >= s->records_size) {
+        if (s->records_size != 0 &&
+            s->record_count <= s->records_len / 2) {
+            /* enough deleted records: just compact the array */
+            new_size = s->records_size;
+        } else {
+            if (s->records_size > (MAP_RECORD_NONE - 1) / 2) {
+                JS_ThrowOutOfMemory(ctx);
+                return NULL;
+            }
+            new_size = max_uint32(4, s->records_size * 2);
+        }
+        if (map_resize(ctx->rt, s, new_size)) {
+            JS_ThrowOutOfMemory(ctx);
+            return NULL;
+        }
+    }
+    mr = &s->records[s->records_len];
     if (s->is_weak) {
         mr->key = js_weakref_new(ctx, key);
     } else {
         mr->key = JS_DupValue(ctx, key);
     }
+    mr->value = JS_UNDEFINED;
     h = map_hash_key(key, s->hash_bits);
     mr->hash_next = s->hash_table[h];
-    s->hash_table[h] = mr;
-    list_add_tail(&mr->link, &s->records);
+    s->hash_table[h] = s->records_len++;
     s->record_count++;
-    if (s->record_count >= s->record_count_threshold) {
-        map_hash_resize(ctx, s);
-    }
-    return mr;
-}
-
-static JSMapRecord *set_add_record(JSContext *ctx, JSMapState *s,
-                                   JSValueConst key)
-{
-    JSMapRecord *mr;
-    mr = map_add_record(ctx, s, key);
-    if (!mr)
-        return NULL;
-    mr->value = JS_UNDEFINED;
     return mr;
 }
 
 /* warning: the record must be removed from the hash table before */
 static void map_delete_record_internal(JSRuntime *rt, JSMapState *s, JSMapRecord *mr)
 {
-    if (mr->empty)
-        return;
-    
     if (s->is_weak) {
         js_weakref_free(rt, mr->key);
     } else {
         JS_FreeValueRT(rt, mr->key);
     }
     JS_FreeValueRT(rt, mr->value);
-    if (--mr->ref_count == 0) {
-        list_del(&mr->link);
-        js_free_rt(rt, mr);
-    } else {
-        /* keep a zombie record for iterators */
-        mr->empty = TRUE;
-        mr->key = JS_UNDEFINED;
-        mr->value = JS_UNDEFINED;
-    }
+    mr->key = JS_UNINITIALIZED;
+    mr->value = JS_UNDEFINED;
     s->record_count--;
 }
 
-static void map_decref_record(JSRuntime *rt, JSMapRecord *mr)
-{
-    if (--mr->ref_count == 0) {
-        /* the record can be safely removed */
-        assert(mr->empty);
-        list_del(&mr->link);
-        js_free_rt(rt, mr);
-    }
-}
-
 static void map_delete_weakrefs(JSRuntime *rt, JSWeakRefHeader *wh)
 {
     JSMapState *s = container_of(wh, JSMapState, weakref_header);
-    struct list_head *el, *el1;
-    JSMapRecord *mr1, **pmr;
-    uint32_t h;
-
-    list_for_each_safe(el, el1, &s->records) {
-        JSMapRecord *mr = list_entry(el, JSMapRecord, link);
-        if (!js_weakref_is_live(mr->key)) {
+    JSMapRecord *mr;
+    uint32_t i, *pidx;
 
+    for(i = 0; i < s->records_len; i++) {
+        mr = &s->records[i];
+        if (!map_record_is_deleted(mr) && !js_weakref_is_live(mr->key)) {
             /* even if key is not live it can be hashed as a pointer */
-            h = map_hash_key(mr->key, s->hash_bits);
-            pmr = &s->hash_table[h];
-            for(;;) {
-                mr1 = *pmr;
-                /* the entry may already be removed from the hash
-                   table if the map was resized */
-                if (mr1 == NULL)
-                    goto done; 
-                if (mr1 == mr)
-                    break;
-                pmr = &mr1->hash_next;
-            }
+            pidx = &s->hash_table[map_hash_key(mr->key, s->hash_bits)];
+            while (*pidx != i)
+                pidx = &s->records[*pidx].hash_next;
             /* remove from the hash table */
-            *pmr = mr1->hash_next;
-        done:
+            *pidx = mr->hash_next;
             map_delete_record_internal(rt, s, mr);
         }
     }
@@ -51143,30 +55751,22 @@ static JSValue js_map_get(JSContext *ctx, JSValueConst this_val,
 /* return JS_TRUE or JS_FALSE */
 static JSValue map_delete_record(JSContext *ctx, JSMapState *s, JSValueConst key)
 {
-    JSMapRecord *mr, **pmr;
-    uint32_t h;
+    JSMapRecord *mr;
+    uint32_t *pidx;
 
     key = map_normalize_key_const(ctx, key);
-    
-    h = map_hash_key(key, s->hash_bits);
-    pmr = &s->hash_table[h];
-    for(;;) {
-        mr = *pmr;
-        if (mr == NULL)
-            return JS_FALSE;
-        if (mr->empty || (s->is_weak && !js_weakref_is_live(mr->key))) {
-            /* not valid */
-        } else {
-            if (js_same_value_zero(ctx, mr->key, key))
-                break;
-        }
-        pmr = &mr->hash_next;
-    }
-
+    pidx = map_find_link(ctx, s, key);
+    if (!pidx)
+        return JS_FALSE;
+    mr = &s->records[*pidx];
     /* remove from the hash table */
-    *pmr = mr->hash_next;
-    
+    *pidx = mr->hash_next;
     map_delete_record_internal(ctx->rt, s, mr);
+
+    /* shrink the record array if it is mostly empty. The memory
+       allocation failure is not fatal. */
+    if (s->records_size > 8 && s->record_count < s->records_size / 8)
+        map_resize(ctx->rt, s, s->records_size / 2);
     return JS_TRUE;
 }
 
@@ -51234,18 +55834,27 @@ static JSValue js_map_clear(JSContext *ctx, JSValueConst this_val,
                             int argc, JSValueConst *argv, int magic)
 {
     JSMapState *s = JS_GetOpaque2(ctx, this_val, JS_CLASS_MAP + magic);
-    struct list_head *el, *el1;
+    struct list_head *el;
     JSMapRecord *mr;
+    uint32_t i;
 
     if (!s)
         return JS_EXCEPTION;
 
-    /* remove from the hash table */
-    memset(s->hash_table, 0, sizeof(s->hash_table[0]) * s->hash_size);
-    
-    list_for_each_safe(el, el1, &s->records) {
-        mr = list_entry(el, JSMapRecord, link);
-        map_delete_record_internal(ctx->rt, s, mr);
+    for(i = 0; i < s->records_len; i++) {
+        mr = &s->records[i];
+        if (!map_record_is_deleted(mr))
+            map_delete_record_internal(ctx->rt, s, mr);
+    }
+    js_free(ctx, s->records);
+    js_free(ctx, s->hash_table);
+    s->records = NULL;
+    s->records_len = 0;
+    s->records_size = 0;
+    s->hash_table = NULL;
+    /* the enumerations continue with the records added later */
+    list_for_each(el, &s->iterators) {
+        list_entry(el, JSMapIterPos, link)->index = 0;
     }
     return JS_UNDEFINED;
 }
@@ -51264,7 +55873,7 @@ static JSValue js_map_forEach(JSContext *ctx, JSValueConst this_val,
     JSMapState *s = JS_GetOpaque2(ctx, this_val, JS_CLASS_MAP + magic);
     JSValueConst func, this_arg;
     JSValue ret, args[3];
-    struct list_head *el;
+    JSMapIterPos pos;
     JSMapRecord *mr;
 
     if (!s)
@@ -51276,33 +55885,32 @@ static JSValue js_map_forEach(JSContext *ctx, JSValueConst this_val,
         this_arg = JS_UNDEFINED;
     if (check_function(ctx, func))
         return JS_EXCEPTION;
-    /* Note: the list can be modified while traversing it, but the
-       current element is locked */
-    el = s->records.next;
-    while (el != &s->records) {
-        mr = list_entry(el, JSMapRecord, link);
-        if (!mr->empty) {
-            mr->ref_count++;
-            /* must duplicate in case the record is deleted */
-            args[1] = JS_DupValue(ctx, mr->key);
-            if (magic)
-                args[0] = args[1];
-            else
-                args[0] = JS_DupValue(ctx, mr->value);
-            args[2] = (JSValue)this_val;
-            ret = JS_Call(ctx, func, this_arg, 3, (JSValueConst *)args);
-            JS_FreeValue(ctx, args[0]);
-            if (!magic)
-                JS_FreeValue(ctx, args[1]);
-            el = el->next;
-            map_decref_record(ctx->rt, mr);
-            if (JS_IsException(ret))
-                return ret;
-            JS_FreeValue(ctx, ret);
-        } else {
-            el = el->next;
+    /* Note: the map can be modified while traversing it. 'pos' is
+       updated if the records are moved. */
+    pos.index = 0;
+    list_add_tail(&pos.link, &s->iterators);
+    while (pos.index < s->records_len) {
+        mr = &s->records[pos.index++];
+        if (map_record_is_deleted(mr))
+            continue;
+        /* must duplicate in case the record is deleted */
+        args[1] = JS_DupValue(ctx, mr->key);
+        if (magic)
+            args[0] = args[1];
+        else
+            args[0] = JS_DupValue(ctx, mr->value);
+        args[2] = (JSValue)this_val;
+        ret = JS_Call(ctx, func, this_arg, 3, (JSValueConst *)args);
+        JS_FreeValue(ctx, args[0]);
+        if (!magic)
+            JS_FreeValue(ctx, args[1]);
+        if (JS_IsException(ret)) {
+            list_del(&pos.link);
+            return ret;
         }
+        JS_FreeValue(ctx, ret);
     }
+    list_del(&pos.link);
     return JS_UNDEFINED;
 }
 
@@ -51429,23 +56037,27 @@ static void js_map_finalizer(JSRuntime *rt, JSValue val)
     JSMapState *s;
     struct list_head *el, *el1;
     JSMapRecord *mr;
+    uint32_t i;
 
     p = JS_VALUE_GET_OBJ(val);
     s = p->u.map_state;
     if (s) {
-        /* if the object is deleted we are sure that no iterator is
-           using it */
-        list_for_each_safe(el, el1, &s->records) {
-            mr = list_entry(el, JSMapRecord, link);
-            if (!mr->empty) {
+        for(i = 0; i < s->records_len; i++) {
+            mr = &s->records[i];
+            if (!map_record_is_deleted(mr)) {
                 if (s->is_weak)
                     js_weakref_free(rt, mr->key);
                 else
                     JS_FreeValueRT(rt, mr->key);
                 JS_FreeValueRT(rt, mr->value);
             }
-            js_free_rt(rt, mr);
         }
+        /* During the GC sweep phase the Map finalizer may be called
+           before the Map iterator finalizers: detach them */
+        list_for_each_safe(el, el1, &s->iterators) {
+            init_list_head(el);
+        }
+        js_free_rt(rt, s->records);
         js_free_rt(rt, s->hash_table);
         if (s->is_weak) {
             list_del(&s->weakref_header.link);
@@ -51458,13 +56070,13 @@ static void js_map_mark(JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func)
 {
     JSObject *p = JS_VALUE_GET_OBJ(val);
     JSMapState *s;
-    struct list_head *el;
     JSMapRecord *mr;
+    uint32_t i;
 
     s = p->u.map_state;
     if (s) {
-        list_for_each(el, &s->records) {
-            mr = list_entry(el, JSMapRecord, link);
+        for(i = 0; i < s->records_len; i++) {
+            mr = &s->records[i];
             if (!s->is_weak)
                 JS_MarkValue(rt, mr->key, mark_func);
             JS_MarkValue(rt, mr->value, mark_func);
@@ -51477,7 +56089,7 @@ static void js_map_mark(JSRuntime *rt, JSValueConst val, JS_MarkFunc *mark_func)
 typedef struct JSMapIteratorData {
     JSValue obj;
     JSIteratorKindEnum kind;
-    JSMapRecord *cur_record;
+    JSMapIterPos pos; /* registered in the map if 'obj' is defined */
 } JSMapIteratorData;
 
 static void js_map_iterator_finalizer(JSRuntime *rt, JSValue val)
@@ -51488,11 +56100,9 @@ static void js_map_iterator_finalizer(JSRuntime *rt, JSValue val)
     p = JS_VALUE_GET_OBJ(val);
     it = p->u.map_iterator_data;
     if (it) {
-        /* During the GC sweep phase the Map finalizer may be
-           called before the Map iterator finalizer */
-        if (JS_IsLiveObject(rt, it->obj) && it->cur_record) {
-            map_decref_record(rt, it->cur_record);
-        }
+        /* the link is detached if the Map finalizer was called before */
+        if (!JS_IsUndefined(it->obj))
+            list_del(&it->pos.link);
         JS_FreeValueRT(rt, it->obj);
         js_free_rt(rt, it);
     }
@@ -51505,7 +56115,7 @@ static void js_map_iterator_mark(JSRuntime *rt, JSValueConst val,
     JSMapIteratorData *it;
     it = p->u.map_iterator_data;
     if (it) {
-        /* the record is already marked by the object */
+        /* the records are already marked by the object */
         JS_MarkValue(rt, it->obj, mark_func);
     }
 }
@@ -51533,7 +56143,8 @@ static JSValue js_create_map_iterator(JSContext *ctx, JSValueConst this_val,
     }
     it->obj = JS_DupValue(ctx, this_val);
     it->kind = kind;
-    it->cur_record = NULL;
+    it->pos.index = 0;
+    list_add_tail(&it->pos.link, &s->iterators);
     JS_SetOpaque(enum_obj, it);
     return enum_obj;
  fail:
@@ -51547,7 +56158,6 @@ static JSValue js_map_iterator_next(JSContext *ctx, JSValueConst this_val,
     JSMapIteratorData *it;
     JSMapState *s;
     JSMapRecord *mr;
-    struct list_head *el;
 
     it = JS_GetOpaque2(ctx, this_val, JS_CLASS_MAP_ITERATOR + magic);
     if (!it) {
@@ -51558,17 +56168,10 @@ static JSValue js_map_iterator_next(JSContext *ctx, JSValueConst this_val,
         goto done;
     s = JS_GetOpaque(it->obj, JS_CLASS_MAP + magic);
     assert(s != NULL);
-    if (!it->cur_record) {
-        el = s->records.next;
-    } else {
-        mr = it->cur_record;
-        el = mr->link.next;
-        map_decref_record(ctx->rt, mr); /* the record can be freed here */
-    }
     for(;;) {
-        if (el == &s->records) {
+        if (it->pos.index >= s->records_len) {
             /* no more record  */
-            it->cur_record = NULL;
+            list_del(&it->pos.link);
             JS_FreeValue(ctx, it->obj);
             it->obj = JS_UNDEFINED;
         done:
@@ -51576,16 +56179,10 @@ static JSValue js_map_iterator_next(JSContext *ctx, JSValueConst this_val,
             *pdone = TRUE;
             return JS_UNDEFINED;
         }
-        mr = list_entry(el, JSMapRecord, link);
-        if (!mr->empty)
+        mr = &s->records[it->pos.index++];
+        if (!map_record_is_deleted(mr))
             break;
-        /* get the next record */
-        el = mr->link.next;
     }
-
-    /* lock the record so that it won't be freed */
-    mr->ref_count++;
-    it->cur_record = mr;
     *pdone = FALSE;
 
     if (it->kind == JS_ITERATOR_KIND_KEY) {
@@ -51682,8 +56279,8 @@ static JSValue js_copy_set(JSContext *ctx, JSValueConst this_val)
 {
     JSValue newset;
     JSMapState *s, *t;
-    struct list_head *el;
     JSMapRecord *mr;
+    uint32_t i;
    
     s = JS_GetOpaque2(ctx, this_val, JS_CLASS_SET);
     if (!s)
@@ -51696,11 +56293,11 @@ static JSValue js_copy_set(JSContext *ctx, JSValueConst this_val)
 
     // can't clone this_val using js_map_constructor(),
     // test262 mandates we don't call the .add method
-    list_for_each(el, &s->records) {
-        mr = list_entry(el, JSMapRecord, link);
-        if (mr->empty)
+    for(i = 0; i < s->records_len; i++) {
+        mr = &s->records[i];
+        if (map_record_is_deleted(mr))
             continue;
-        if (!set_add_record(ctx, t, mr->key))
+        if (!map_add_record(ctx, t, mr->key))
             goto exception;
     }
     return newset;
@@ -51915,7 +56512,7 @@ static JSValue js_set_intersection(JSContext *ctx, JSValueConst this_val,
             } else if (map_find_record(ctx, t, item)) {
                 JS_FreeValue(ctx, item); // no duplicates
             } else {
-                mr = set_add_record(ctx, t, item);
+                mr = map_add_record(ctx, t, item);
                 JS_FreeValue(ctx, item);
                 if (!mr)
                     goto exception;
@@ -51942,7 +56539,7 @@ static JSValue js_set_intersection(JSContext *ctx, JSValueConst this_val,
                 if (map_find_record(ctx, t, item)) {
                     JS_FreeValue(ctx, item); // no duplicates
                 } else {
-                    mr = set_add_record(ctx, t, item);
+                    mr = map_add_record(ctx, t, item);
                     JS_FreeValue(ctx, item);
                     if (!mr)
                         goto exception;
@@ -52091,7 +56688,7 @@ static JSValue js_set_symmetricDifference(JSContext *ctx, JSValueConst this_val,
         } else if (mr) {
             JS_FreeValue(ctx, item);
         } else {
-            mr = set_add_record(ctx, t, item);
+            mr = map_add_record(ctx, t, item);
             JS_FreeValue(ctx, item);
             if (!mr)
                 goto exception;
@@ -57327,7 +61924,7 @@ static JSValue js_typed_array_join(JSContext *ctx, JSValueConst this_val,
             goto exception;
         s = JS_VALUE_GET_STRING(sep);
         if (s->len == 1 && !s->is_wide_char)
-            c = s->u.str8[0];
+            c = string_ptr8(s)[0];
         else
             c = -1;
         // ToString(sep) can detach or resize the arraybuffer as a side effect
@@ -59538,3 +64135,952 @@ int JS_AddIntrinsicWeakRef(JSContext *ctx)
     JS_FreeValue(ctx, obj);
     return 0;
 }
+
+/*******************************************************************/
+/* Context snapshots */
+
+/* JS_CloneContext() copies all the objects reachable from a template
+   context (intrinsics, global object, global variables, functions and
+   their closures). The atoms, strings and native functions are shared
+   with the template. The function bytecode is copied because it
+   references its realm. */
+
+typedef struct {
+    JSGCObjectHeader *src; /* NULL if free entry */
+    JSGCObjectHeader *dst;
+} JSCloneEntry;
+
+typedef struct {
+    JSContext *ctx; /* template context, also used to raise the exceptions */
+    JSContext *new_ctx;
+    /* shape of the objects which are allocated but not copied yet */
+    JSShape *empty_shape;
+    /* source GC object -> copy. A reference to each copy is kept. */
+    JSCloneEntry *hash_table;
+    int hash_bits;
+    uint32_t hash_count;
+    /* source objects whose copy is not filled yet */
+    JSObject **todo;
+    int todo_count;
+    int todo_size;
+} JSCloneState;
+
+static JSCloneEntry *clone_find(JSCloneState *s, void *src)
+{
+    uint32_t h, mask;
+    JSCloneEntry *e;
+
+    mask = (1 << s->hash_bits) - 1;
+    h = map_hash_pointer((uintptr_t)src, s->hash_bits);
+    for(;;) {
+        e = &s->hash_table[h];
+        if (e->src == src || !e->src)
+            return e;
+        h = (h + 1) & mask;
+    }
+}
+
+/* make room for one more entry */
+static int clone_hash_reserve(JSCloneState *s)
+{
+    JSCloneEntry *tab, *e;
+    uint32_t i, size;
+
+    size = 1 << s->hash_bits;
+    if (2 * (s->hash_count + 1) <= size)
+        return 0;
+    tab = s->hash_table;
+    s->hash_table = js_mallocz(s->ctx, sizeof(tab[0]) * size * 2);
+    if (!s->hash_table) {
+        s->hash_table = tab;
+        return -1;
+    }
+    s->hash_bits++;
+    for(i = 0; i < size; i++) {
+        if (tab[i].src) {
+            e = clone_find(s, tab[i].src);
+            *e = tab[i];
+        }
+    }
+    js_free(s->ctx, tab);
+    return 0;
+}
+
+static void clone_hash_add(JSCloneState *s, void *src, void *dst)
+{
+    JSCloneEntry *e;
+    e = clone_find(s, src);
+    e->src = src;
+    e->dst = dst;
+    s->hash_count++;
+}
+
+static JSContext *clone_realm(JSCloneState *s, JSContext *realm)
+{
+    if (realm == s->ctx)
+        realm = s->new_ctx;
+    return JS_DupContext(realm);
+}
+
+/* return a new reference to the copy of 'p'. Its contents are filled
+   later. */
+static JSObject *clone_object(JSCloneState *s, JSObject *p)
+{
+    JSCloneEntry *e;
+    JSObject *p1;
+
+    e = clone_find(s, p);
+    if (e->src) {
+        p1 = (JSObject *)e->dst;
+    } else {
+        if (clone_hash_reserve(s) ||
+            js_resize_array(s->ctx, (void **)&s->todo, sizeof(s->todo[0]),
+                            &s->todo_size, s->todo_count + 1))
+            return NULL;
+        p1 = js_mallocz(s->ctx, sizeof(JSObject));
+        if (!p1)
+            return NULL;
+        p1->header.ref_count = 1;
+        p1->class_id = JS_CLASS_OBJECT;
+        p1->shape = js_dup_shape(s->empty_shape);
+        add_gc_object(s->ctx->rt, &p1->header, JS_GC_OBJ_TYPE_JS_OBJECT);
+        clone_hash_add(s, p, p1);
+        s->todo[s->todo_count++] = p;
+    }
+    p1->header.ref_count++;
+    return p1;
+}
+
+static JSFunctionBytecode *clone_function_bytecode(JSCloneState *s,
+                                                   JSFunctionBytecode *b);
+
+static JSValue clone_value(JSCloneState *s, JSValueConst val)
+{
+    switch(JS_VALUE_GET_TAG(val)) {
+    case JS_TAG_OBJECT:
+        {
+            JSObject *p;
+            p = clone_object(s, JS_VALUE_GET_OBJ(val));
+            if (!p)
+                return JS_EXCEPTION;
+            return JS_MKPTR(JS_TAG_OBJECT, p);
+        }
+    case JS_TAG_FUNCTION_BYTECODE:
+        {
+            JSFunctionBytecode *b;
+            b = clone_function_bytecode(s, JS_VALUE_GET_PTR(val));
+            if (!b)
+                return JS_EXCEPTION;
+            return JS_MKPTR(JS_TAG_FUNCTION_BYTECODE, b);
+        }
+    case JS_TAG_MODULE:
+        return JS_ThrowTypeError(s->ctx, "cannot copy a module");
+    default:
+        return JS_DupValue(s->ctx, val);
+    }
+}
+
+static JSVarRef *clone_var_ref(JSCloneState *s, JSVarRef *var_ref)
+{
+    JSCloneEntry *e;
+    JSVarRef *var_ref1;
+    JSValue val;
+
+    e = clone_find(s, var_ref);
+    if (e->src) {
+        var_ref1 = (JSVarRef *)e->dst;
+    } else {
+        if (!var_ref->is_detached) {
+            JS_ThrowTypeError(s->ctx, "cannot copy a running function");
+            return NULL;
+        }
+        if (clone_hash_reserve(s))
+            return NULL;
+        var_ref1 = js_create_var_ref(s->ctx, FALSE);
+        if (!var_ref1)
+            return NULL;
+        var_ref1->is_lexical = var_ref->is_lexical;
+        var_ref1->is_const = var_ref->is_const;
+        clone_hash_add(s, var_ref, var_ref1);
+        val = clone_value(s, var_ref->value);
+        if (JS_IsException(val))
+            return NULL;
+        var_ref1->value = val;
+    }
+    var_ref1->header.ref_count++;
+    return var_ref1;
+}
+
+static void dup_bytecode_atoms(JSContext *ctx, const uint8_t *bc_buf,
+                               int bc_len)
+{
+    int pos, op;
+
+    pos = 0;
+    while (pos < bc_len) {
+        op = bc_buf[pos];
+        switch(short_opcode_info(op).fmt) {
+        case OP_FMT_atom:
+        case OP_FMT_atom_u8:
+        case OP_FMT_atom_u16:
+        case OP_FMT_atom_label_u8:
+        case OP_FMT_atom_label_u16:
+            JS_DupAtom(ctx, get_u32(bc_buf + pos + 1));
+            break;
+        default:
+            break;
+        }
+        pos += short_opcode_info(op).size;
+    }
+}
+
+static JSFunctionBytecode *clone_function_bytecode(JSCloneState *s,
+                                                   JSFunctionBytecode *b)
+{
+    JSContext *ctx = s->ctx;
+    JSCloneEntry *e;
+    JSFunctionBytecode *b1;
+    int function_size, cpool_offset, vardefs_offset, closure_var_offset;
+    int byte_code_offset, local_count, i;
+    JSValue val;
+
+    e = clone_find(s, b);
+    if (e->src) {
+        b1 = (JSFunctionBytecode *)e->dst;
+        b1->header.ref_count++;
+        return b1;
+    }
+    if (clone_hash_reserve(s))
+        return NULL;
+
+    /* same layout as JS_ReadFunctionTag() */
+    local_count = b->vardefs ? b->arg_count + b->var_count : 0;
+    if (b->has_debug) {
+        function_size = sizeof(*b);
+    } else {
+        function_size = offsetof(JSFunctionBytecode, debug);
+    }
+    cpool_offset = function_size;
+    function_size += b->cpool_count * sizeof(*b->cpool);
+    vardefs_offset = function_size;
+    function_size += local_count * sizeof(*b->vardefs);
+    closure_var_offset = function_size;
+    function_size += b->closure_var_count * sizeof(*b->closure_var);
+    byte_code_offset = function_size;
+    if (!b->read_only_bytecode)
+        function_size += b->byte_code_len;
+
+    b1 = js_mallocz(ctx, function_size);
+    if (!b1)
+        return NULL;
+    memcpy(b1, b, offsetof(JSFunctionBytecode, debug));
+    b1->header.ref_count = 1;
+    JS_DupAtom(ctx, b1->func_name);
+    if (local_count != 0) {
+        b1->vardefs = (void *)((uint8_t*)b1 + vardefs_offset);
+        memcpy(b1->vardefs, b->vardefs, local_count * sizeof(*b->vardefs));
+        for(i = 0; i < local_count; i++)
+            JS_DupAtom(ctx, b1->vardefs[i].var_name);
+    }
+    if (b->closure_var_count != 0) {
+        b1->closure_var = (void *)((uint8_t*)b1 + closure_var_offset);
+        memcpy(b1->closure_var, b->closure_var,
+               b->closure_var_count * sizeof(*b->closure_var));
+        for(i = 0; i < b->closure_var_count; i++)
+            JS_DupAtom(ctx, b1->closure_var[i].var_name);
+    }
+    if (b->cpool_count != 0) {
+        b1->cpool = (void *)((uint8_t*)b1 + cpool_offset);
+        for(i = 0; i < b->cpool_count; i++)
+            b1->cpool[i] = JS_UNDEFINED;
+    }
+    if (!b->read_only_bytecode) {
+        b1->byte_code_buf = (uint8_t*)b1 + byte_code_offset;
+        memcpy(b1->byte_code_buf, b->byte_code_buf, b->byte_code_len);
+    }
+    dup_bytecode_atoms(ctx, b1->byte_code_buf, b1->byte_code_len);
+    b1->ic = NULL;
+#ifdef CONFIG_JIT
+    b1->jit_counter = 0;
+    b1->jit_code = NULL;
+#endif
+    b1->realm = clone_realm(s, b->realm);
+    if (b->has_debug) {
+        b1->debug.filename = JS_DupAtom(ctx, b->debug.filename);
+        b1->debug.pc2line_len = 0;
+        b1->debug.source_len = 0;
+    }
+    add_gc_object(ctx->rt, &b1->header, JS_GC_OBJ_TYPE_FUNCTION_BYTECODE);
+    clone_hash_add(s, b, b1);
+
+    if (b->has_debug) {
+        if (b->debug.pc2line_len) {
+            b1->debug.pc2line_buf = js_malloc(ctx, b->debug.pc2line_len);
+            if (!b1->debug.pc2line_buf)
+                return NULL;
+            memcpy(b1->debug.pc2line_buf, b->debug.pc2line_buf,
+                   b->debug.pc2line_len);
+            b1->debug.pc2line_len = b->debug.pc2line_len;
+        }
+        if (b->debug.source) {
+            b1->debug.source = js_malloc(ctx, b->debug.source_len + 1);
+            if (!b1->debug.source)
+                return NULL;
+            memcpy(b1->debug.source, b->debug.source, b->debug.source_len);
+            b1->debug.source[b->debug.source_len] = '\0';
+            b1->debug.source_len = b->debug.source_len;
+        }
+    }
+    for(i = 0; i < b->cpool_count; i++) {
+        val = clone_value(s, b->cpool[i]);
+        if (JS_IsException(val))
+            return NULL;
+        b1->cpool[i] = val;
+    }
+    b1->header.ref_count++;
+    return b1;
+}
+
+/* the copy of a shape has the copy of its prototype */
+static JSShape *clone_shape(JSCloneState *s, JSShape *sh)
+{
+    JSRuntime *rt = s->ctx->rt;
+    JSCloneEntry *e;
+    JSShape *sh1;
+    JSShapeProperty *pr;
+    JSObject *proto;
+    uint32_t h;
+    int i;
+
+    e = clone_find(s, sh);
+    if (e->src)
+        return js_dup_shape((JSShape *)e->dst);
+    sh1 = js_clone_shape(s->ctx, sh);
+    if (!sh1)
+        return NULL;
+    if (sh->proto) {
+        proto = clone_object(s, sh->proto);
+        if (!proto) {
+            js_free_shape(rt, sh1);
+            return NULL;
+        }
+        JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_OBJECT, sh1->proto));
+        sh1->proto = proto;
+    }
+    if (clone_hash_reserve(s)) {
+        js_free_shape(rt, sh1);
+        return NULL;
+    }
+    if (sh->is_hashed) {
+        /* the hash depends on the prototype address */
+        h = shape_initial_hash(sh1->proto);
+        for(i = 0, pr = get_shape_prop(sh1); i < sh1->prop_count; i++, pr++)
+            h = shape_hash(shape_hash(h, pr->atom), pr->flags);
+        if (2 * (rt->shape_hash_count + 1) > rt->shape_hash_size)
+            resize_shape_hash(rt, rt->shape_hash_bits + 1);
+        sh1->hash = h;
+        sh1->is_hashed = TRUE;
+        js_shape_hash_link(rt, sh1);
+    }
+    clone_hash_add(s, sh, sh1);
+    return js_dup_shape(sh1);
+}
+
+static int clone_properties(JSCloneState *s, JSObject *p, JSObject *p1)
+{
+    JSShape *sh;
+    JSProperty *prop, *pr, *pr1;
+    JSShapeProperty *prs;
+    int i, n;
+
+    sh = clone_shape(s, p->shape);
+    if (!sh)
+        return -1;
+    prop = js_malloc(s->ctx, sizeof(prop[0]) * max_int(sh->prop_size, 1));
+    if (!prop) {
+        js_free_shape(s->ctx->rt, sh);
+        return -1;
+    }
+    prs = get_shape_prop(sh);
+    for(n = 0; n < sh->prop_count; n++, prs++) {
+        pr = &p->prop[n];
+        pr1 = &prop[n];
+        switch(prs->flags & JS_PROP_TMASK) {
+        case JS_PROP_GETSET:
+            pr1->u.getset.getter = NULL;
+            pr1->u.getset.setter = NULL;
+            if (pr->u.getset.getter &&
+                !(pr1->u.getset.getter = clone_object(s, pr->u.getset.getter)))
+                goto fail;
+            if (pr->u.getset.setter &&
+                !(pr1->u.getset.setter = clone_object(s, pr->u.getset.setter)))
+                goto fail;
+            break;
+        case JS_PROP_VARREF:
+            pr1->u.var_ref = clone_var_ref(s, pr->u.var_ref);
+            if (!pr1->u.var_ref)
+                goto fail;
+            break;
+        case JS_PROP_AUTOINIT:
+            pr1->u.init.realm_and_id = (uintptr_t)
+                clone_realm(s, js_autoinit_get_realm(pr)) |
+                js_autoinit_get_id(pr);
+            pr1->u.init.opaque = pr->u.init.opaque;
+            break;
+        default:
+            pr1->u.value = clone_value(s, pr->u.value);
+            if (JS_IsException(pr1->u.value))
+                goto fail;
+            break;
+        }
+    }
+    js_free_shape(s->ctx->rt, p1->shape);
+    p1->shape = sh;
+    p1->prop = prop;
+    return 0;
+ fail:
+    /* the failed property holds no reference except a getter */
+    if ((prs->flags & JS_PROP_TMASK) == JS_PROP_GETSET)
+        n++;
+    prs = get_shape_prop(sh);
+    for(i = 0; i < n; i++)
+        free_property(s->ctx->rt, &prop[i], prs[i].flags);
+    js_free(s->ctx, prop);
+    js_free_shape(s->ctx->rt, sh);
+    return -1;
+}
+
+static int clone_array_buffer(JSCloneState *s, JSObject *p, JSObject *p1)
+{
+    JSRuntime *rt = s->ctx->rt;
+    JSArrayBuffer *abuf = p->u.array_buffer, *abuf1;
+
+    abuf1 = js_mallocz(s->ctx, sizeof(*abuf1));
+    if (!abuf1)
+        return -1;
+    *abuf1 = *abuf;
+    init_list_head(&abuf1->array_list);
+    if (abuf->shared && rt->sab_funcs.sab_dup) {
+        /* the copy shares the memory */
+        rt->sab_funcs.sab_dup(rt->sab_funcs.sab_opaque, abuf->data);
+    } else if (!abuf->detached) {
+        abuf1->data = js_malloc(s->ctx, max_int(abuf->byte_length, 1));
+        if (!abuf1->data) {
+            js_free(s->ctx, abuf1);
+            return -1;
+        }
+        memcpy(abuf1->data, abuf->data, abuf->byte_length);
+        abuf1->opaque = NULL;
+        abuf1->free_func = js_array_buffer_free;
+    }
+    p1->class_id = p->class_id;
+    p1->u.array_buffer = abuf1;
+    return 0;
+}
+
+static int clone_fill_object(JSCloneState *s, JSObject *p, JSObject *p1);
+
+static int clone_typed_array(JSCloneState *s, JSObject *p, JSObject *p1)
+{
+    JSTypedArray *ta = p->u.typed_array, *ta1;
+    JSArrayBuffer *abuf;
+    JSObject *buffer;
+
+    buffer = clone_object(s, ta->buffer);
+    if (!buffer)
+        return -1;
+    /* the array buffer must be copied first */
+    if (buffer->shape == s->empty_shape &&
+        clone_fill_object(s, ta->buffer, buffer))
+        goto fail;
+    ta1 = js_malloc(s->ctx, sizeof(*ta1));
+    if (!ta1)
+        goto fail;
+    *ta1 = *ta;
+    ta1->obj = p1;
+    ta1->buffer = buffer;
+    abuf = buffer->u.array_buffer;
+    list_add_tail(&ta1->link, &abuf->array_list);
+    p1->class_id = p->class_id;
+    p1->u.typed_array = ta1;
+    p1->u.array.count = p->u.array.count;
+    if (p->u.array.u.ptr) {
+        p1->u.array.u.ptr = abuf->data +
+            (p->u.array.u.uint8_ptr - ta->buffer->u.array_buffer->data);
+    } else {
+        p1->u.array.u.ptr = NULL;
+    }
+    return 0;
+ fail:
+    JS_FreeValue(s->ctx, JS_MKPTR(JS_TAG_OBJECT, buffer));
+    return -1;
+}
+
+static int clone_map(JSCloneState *s, JSObject *p, JSObject *p1)
+{
+    JSContext *ctx = s->ctx;
+    JSMapState *ms = p->u.map_state, *ms1;
+    JSMapRecord *mr;
+    JSValue key, val;
+    uint32_t i, idx;
+
+    ms1 = js_mallocz(ctx, sizeof(*ms1));
+    if (!ms1)
+        return -1;
+    init_list_head(&ms1->iterators);
+    ms1->is_weak = ms->is_weak;
+    if (ms1->is_weak) {
+        ms1->weakref_header.weakref_type = JS_WEAKREF_TYPE_MAP;
+        list_add_tail(&ms1->weakref_header.link, &ctx->rt->weakref_list);
+    }
+    p1->class_id = p->class_id;
+    p1->u.map_state = ms1;
+
+    /* the record pointers are not kept across clone_value() */
+    for(i = 0; i < ms->records_len; i++) {
+        mr = &ms->records[i];
+        if (map_record_is_deleted(mr) ||
+            (ms->is_weak && !js_weakref_is_live(mr->key)))
+            continue;
+        key = clone_value(s, mr->key);
+        if (JS_IsException(key))
+            return -1;
+        idx = ms1->records_len;
+        mr = map_add_record(ctx, ms1, key);
+        JS_FreeValue(ctx, key);
+        if (!mr)
+            return -1;
+        val = clone_value(s, ms->records[i].value);
+        if (JS_IsException(val))
+            return -1;
+        ms1->records[idx].value = val;
+    }
+    return 0;
+}
+
+/* Copy the properties and the class data of 'p' to 'p1'. 'p1' stays a
+   valid object if an exception is raised. */
+static int clone_fill_object(JSCloneState *s, JSObject *p, JSObject *p1)
+{
+    JSContext *ctx = s->ctx;
+    JSValue val;
+    int i;
+
+    switch(p->class_id) {
+    case JS_CLASS_OBJECT:
+    case JS_CLASS_ARRAY:
+    case JS_CLASS_ERROR:
+    case JS_CLASS_NUMBER:
+    case JS_CLASS_STRING:
+    case JS_CLASS_BOOLEAN:
+    case JS_CLASS_SYMBOL:
+    case JS_CLASS_ARGUMENTS:
+    case JS_CLASS_MAPPED_ARGUMENTS:
+    case JS_CLASS_DATE:
+    case JS_CLASS_C_FUNCTION:
+    case JS_CLASS_BYTECODE_FUNCTION:
+    case JS_CLASS_BOUND_FUNCTION:
+    case JS_CLASS_C_FUNCTION_DATA:
+    case JS_CLASS_GENERATOR_FUNCTION:
+    case JS_CLASS_REGEXP:
+    case JS_CLASS_ARRAY_BUFFER:
+    case JS_CLASS_SHARED_ARRAY_BUFFER:
+    case JS_CLASS_UINT8C_ARRAY:
+    case JS_CLASS_INT8_ARRAY:
+    case JS_CLASS_UINT8_ARRAY:
+    case JS_CLASS_INT16_ARRAY:
+    case JS_CLASS_UINT16_ARRAY:
+    case JS_CLASS_INT32_ARRAY:
+    case JS_CLASS_UINT32_ARRAY:
+    case JS_CLASS_BIG_INT64_ARRAY:
+    case JS_CLASS_BIG_UINT64_ARRAY:
+    case JS_CLASS_FLOAT16_ARRAY:
+    case JS_CLASS_FLOAT32_ARRAY:
+    case JS_CLASS_FLOAT64_ARRAY:
+    case JS_CLASS_DATAVIEW:
+    case JS_CLASS_BIG_INT:
+    case JS_CLASS_MAP:
+    case JS_CLASS_SET:
+    case JS_CLASS_WEAKMAP:
+    case JS_CLASS_WEAKSET:
+    case JS_CLASS_GLOBAL_OBJECT:
+    case JS_CLASS_PROXY:
+    case JS_CLASS_ASYNC_FUNCTION:
+    case JS_CLASS_ASYNC_GENERATOR_FUNCTION:
+        break;
+    case JS_CLASS_PROMISE:
+        if (p->u.promise_data->promise_state != JS_PROMISE_PENDING)
+            break;
+        /* fall through */
+    default:
+        {
+            char buf[ATOM_GET_STR_BUF_SIZE];
+            JS_ThrowTypeError(ctx, "cannot copy %s objects",
+                              JS_AtomGetStr(ctx, buf, sizeof(buf),
+                                            ctx->rt->class_array[p->class_id].class_name));
+        }
+        return -1;
+    }
+
+    if (clone_properties(s, p, p1))
+        return -1;
+    p1->extensible = p->extensible;
+    p1->is_constructor = p->is_constructor;
+    p1->has_immutable_prototype = p->has_immutable_prototype;
+    p1->is_HTMLDDA = p->is_HTMLDDA;
+    p1->is_std_array_prototype = p->is_std_array_prototype;
+
+    /* the class is set once the class data is valid */
+    switch(p->class_id) {
+    case JS_CLASS_OBJECT:
+    case JS_CLASS_ERROR:
+        p1->class_id = p->class_id;
+        break;
+    case JS_CLASS_ARRAY:
+    case JS_CLASS_ARGUMENTS:
+        if (p->fast_array && p->u.array.count != 0) {
+            p1->u.array.u.values = js_malloc(ctx, sizeof(JSValue) *
+                                             p->u.array.count);
+            if (!p1->u.array.u.values)
+                return -1;
+        }
+        p1->u.array.u1.size = p->u.array.count;
+        p1->u.array.count = 0;
+        p1->class_id = p->class_id;
+        p1->fast_array = p->fast_array;
+        if (p->fast_array) {
+            for(i = 0; i < p->u.array.count; i++) {
+                val = clone_value(s, p->u.array.u.values[i]);
+                if (JS_IsException(val))
+                    return -1;
+                p1->u.array.u.values[i] = val;
+                p1->u.array.count++;
+            }
+        }
+        break;
+    case JS_CLASS_MAPPED_ARGUMENTS:
+        if (p->u.array.count != 0) {
+            p1->u.array.u.var_refs = js_mallocz(ctx, sizeof(JSVarRef *) *
+                                                p->u.array.count);
+            if (!p1->u.array.u.var_refs)
+                return -1;
+        }
+        p1->u.array.count = p->u.array.count;
+        p1->class_id = p->class_id;
+        p1->fast_array = p->fast_array;
+        for(i = 0; i < p->u.array.count; i++) {
+            p1->u.array.u.var_refs[i] = clone_var_ref(s, p->u.array.u.var_refs[i]);
+            if (!p1->u.array.u.var_refs[i])
+                return -1;
+        }
+        break;
+    case JS_CLASS_NUMBER:
+    case JS_CLASS_STRING:
+    case JS_CLASS_BOOLEAN:
+    case JS_CLASS_SYMBOL:
+    case JS_CLASS_DATE:
+    case JS_CLASS_BIG_INT:
+        p1->u.object_data = JS_UNDEFINED;
+        p1->class_id = p->class_id;
+        val = clone_value(s, p->u.object_data);
+        if (JS_IsException(val))
+            return -1;
+        p1->u.object_data = val;
+        break;
+    case JS_CLASS_GLOBAL_OBJECT:
+        p1->u.global_object.uninitialized_vars = JS_UNDEFINED;
+        p1->class_id = p->class_id;
+        val = clone_value(s, p->u.global_object.uninitialized_vars);
+        if (JS_IsException(val))
+            return -1;
+        p1->u.global_object.uninitialized_vars = val;
+        break;
+    case JS_CLASS_C_FUNCTION:
+        p1->u.cfunc = p->u.cfunc;
+        p1->u.cfunc.realm = clone_realm(s, p->u.cfunc.realm);
+        p1->class_id = p->class_id;
+        break;
+    case JS_CLASS_BYTECODE_FUNCTION:
+    case JS_CLASS_GENERATOR_FUNCTION:
+    case JS_CLASS_ASYNC_FUNCTION:
+    case JS_CLASS_ASYNC_GENERATOR_FUNCTION:
+        {
+            JSFunctionBytecode *b = p->u.func.function_bytecode, *b1;
+            JSVarRef **var_refs = NULL;
+            if (b->closure_var_count != 0) {
+                var_refs = js_mallocz(ctx, sizeof(var_refs[0]) *
+                                      b->closure_var_count);
+                if (!var_refs)
+                    return -1;
+            }
+            b1 = clone_function_bytecode(s, b);
+            if (!b1) {
+                js_free(ctx, var_refs);
+                return -1;
+            }
+            p1->u.func.function_bytecode = b1;
+            p1->u.func.var_refs = var_refs;
+            p1->u.func.home_object = NULL;
+            p1->class_id = p->class_id;
+            for(i = 0; i < b->closure_var_count; i++) {
+                if (p->u.func.var_refs[i]) {
+                    var_refs[i] = clone_var_ref(s, p->u.func.var_refs[i]);
+                    if (!var_refs[i])
+                        return -1;
+                }
+            }
+            if (p->u.func.home_object) {
+                p1->u.func.home_object = clone_object(s, p->u.func.home_object);
+                if (!p1->u.func.home_object)
+                    return -1;
+            }
+        }
+        break;
+    case JS_CLASS_BOUND_FUNCTION:
+        {
+            JSBoundFunction *bf = p->u.bound_function, *bf1;
+            bf1 = js_malloc(ctx, sizeof(*bf1) + bf->argc * sizeof(JSValue));
+            if (!bf1)
+                return -1;
+            bf1->func_obj = JS_UNDEFINED;
+            bf1->this_val = JS_UNDEFINED;
+            bf1->argc = bf->argc;
+            for(i = 0; i < bf->argc; i++)
+                bf1->argv[i] = JS_UNDEFINED;
+            p1->u.bound_function = bf1;
+            p1->class_id = p->class_id;
+            /* JS_EXCEPTION can be freed as any other value */
+            bf1->func_obj = clone_value(s, bf->func_obj);
+            if (JS_IsException(bf1->func_obj))
+                return -1;
+            bf1->this_val = clone_value(s, bf->this_val);
+            if (JS_IsException(bf1->this_val))
+                return -1;
+            for(i = 0; i < bf->argc; i++) {
+                bf1->argv[i] = clone_value(s, bf->argv[i]);
+                if (JS_IsException(bf1->argv[i]))
+                    return -1;
+            }
+        }
+        break;
+    case JS_CLASS_C_FUNCTION_DATA:
+        {
+            JSCFunctionDataRecord *fd = p->u.c_function_data_record, *fd1;
+            fd1 = js_malloc(ctx, sizeof(*fd1) + fd->data_len * sizeof(JSValue));
+            if (!fd1)
+                return -1;
+            *fd1 = *fd;
+            for(i = 0; i < fd->data_len; i++)
+                fd1->data[i] = JS_UNDEFINED;
+            p1->u.c_function_data_record = fd1;
+            p1->class_id = p->class_id;
+            for(i = 0; i < fd->data_len; i++) {
+                val = clone_value(s, fd->data[i]);
+                if (JS_IsException(val))
+                    return -1;
+                fd1->data[i] = val;
+            }
+        }
+        break;
+    case JS_CLASS_REGEXP:
+        p1->u.regexp.pattern = JS_VALUE_GET_STRING(JS_DupValue(ctx, JS_MKPTR(JS_TAG_STRING, p->u.regexp.pattern)));
+        p1->u.regexp.bytecode = JS_VALUE_GET_STRING(JS_DupValue(ctx, JS_MKPTR(JS_TAG_STRING, p->u.regexp.bytecode)));
+        p1->class_id = p->class_id;
+        break;
+    case JS_CLASS_PROXY:
+        {
+            JSProxyData *pd = p->u.proxy_data, *pd1;
+            pd1 = js_malloc(ctx, sizeof(*pd1));
+            if (!pd1)
+                return -1;
+            *pd1 = *pd;
+            pd1->target = JS_UNDEFINED;
+            pd1->handler = JS_UNDEFINED;
+            p1->u.proxy_data = pd1;
+            p1->class_id = p->class_id;
+            val = clone_value(s, pd->target);
+            if (JS_IsException(val))
+                return -1;
+            pd1->target = val;
+            val = clone_value(s, pd->handler);
+            if (JS_IsException(val))
+                return -1;
+            pd1->handler = val;
+        }
+        break;
+    case JS_CLASS_PROMISE:
+        {
+            JSPromiseData *pd = p->u.promise_data, *pd1;
+            pd1 = js_malloc(ctx, sizeof(*pd1));
+            if (!pd1)
+                return -1;
+            pd1->promise_state = pd->promise_state;
+            init_list_head(&pd1->promise_reactions[0]);
+            init_list_head(&pd1->promise_reactions[1]);
+            pd1->is_handled = pd->is_handled;
+            pd1->promise_result = JS_UNDEFINED;
+            p1->u.promise_data = pd1;
+            p1->class_id = p->class_id;
+            val = clone_value(s, pd->promise_result);
+            if (JS_IsException(val))
+                return -1;
+            pd1->promise_result = val;
+        }
+        break;
+    case JS_CLASS_ARRAY_BUFFER:
+    case JS_CLASS_SHARED_ARRAY_BUFFER:
+        if (clone_array_buffer(s, p, p1))
+            return -1;
+        break;
+    case JS_CLASS_MAP:
+    case JS_CLASS_SET:
+    case JS_CLASS_WEAKMAP:
+    case JS_CLASS_WEAKSET:
+        if (clone_map(s, p, p1))
+            return -1;
+        break;
+    default: /* typed arrays and DataView */
+        if (clone_typed_array(s, p, p1))
+            return -1;
+        p1->fast_array = p->fast_array;
+        break;
+    }
+    p1->is_exotic = p->is_exotic;
+    return 0;
+}
+
+static void clone_free(JSCloneState *s)
+{
+    JSRuntime *rt = s->ctx->rt;
+    JSCloneEntry *e;
+    uint32_t i;
+
+    if (!s->hash_table)
+        goto done;
+    for(i = 0; i < (1 << s->hash_bits); i++) {
+        e = &s->hash_table[i];
+        if (!e->src)
+            continue;
+        switch(e->dst->gc_obj_type) {
+        case JS_GC_OBJ_TYPE_JS_OBJECT:
+            JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_OBJECT, e->dst));
+            break;
+        case JS_GC_OBJ_TYPE_FUNCTION_BYTECODE:
+            JS_FreeValueRT(rt, JS_MKPTR(JS_TAG_FUNCTION_BYTECODE, e->dst));
+            break;
+        case JS_GC_OBJ_TYPE_VAR_REF:
+            free_var_ref(rt, (JSVarRef *)e->dst);
+            break;
+        case JS_GC_OBJ_TYPE_SHAPE:
+            js_free_shape(rt, (JSShape *)e->dst);
+            break;
+        default:
+            abort();
+        }
+    }
+    js_free_rt(rt, s->hash_table);
+ done:
+    js_free_rt(rt, s->todo);
+    if (s->empty_shape)
+        js_free_shape(rt, s->empty_shape);
+}
+
+static int clone_context_value(JSCloneState *s, JSValue *pval, JSValueConst val)
+{
+    *pval = clone_value(s, val);
+    if (JS_IsException(*pval)) {
+        *pval = JS_NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static int clone_context_shape(JSCloneState *s, JSShape **psh, JSShape *sh)
+{
+    if (!sh)
+        return 0;
+    *psh = clone_shape(s, sh);
+    return *psh ? 0 : -1;
+}
+
+/* Create a new context in the same runtime from the template context
+   'src'. The objects reachable from 'src' are copied: the intrinsic
+   objects, the global object and the global variables. Functions are
+   copied with their closure variables. Modules and pending jobs are
+   not copied. Return NULL with a pending exception if an object cannot
+   be copied (e.g. a generator or a pending promise). */
+JSContext *JS_CloneContext(JSContext *src)
+{
+    JSRuntime *rt = src->rt;
+    JSCloneState s_s, *s = &s_s;
+    JSContext *ctx;
+    JSObject *p, *p1;
+    int i;
+
+    ctx = JS_NewContext0(rt);
+    if (!ctx) {
+        JS_ThrowOutOfMemory(src);
+        return NULL;
+    }
+    memset(s, 0, sizeof(*s));
+    s->ctx = src;
+    s->new_ctx = ctx;
+    s->hash_bits = 8;
+    s->hash_table = js_mallocz(src, sizeof(s->hash_table[0]) << s->hash_bits);
+    if (!s->hash_table)
+        goto fail;
+    s->empty_shape = js_new_shape_nohash(src, NULL, JS_PROP_INITIAL_HASH_SIZE, 0);
+    if (!s->empty_shape)
+        goto fail;
+
+    for(i = 0; i < rt->class_count; i++) {
+        if (clone_context_value(s, &ctx->class_proto[i], src->class_proto[i]))
+            goto fail;
+    }
+    for(i = 0; i < JS_NATIVE_ERROR_COUNT; i++) {
+        if (clone_context_value(s, &ctx->native_error_proto[i],
+                                src->native_error_proto[i]))
+            goto fail;
+    }
+    if (clone_context_value(s, &ctx->function_proto, src->function_proto) ||
+        clone_context_value(s, &ctx->function_ctor, src->function_ctor) ||
+        clone_context_value(s, &ctx->array_ctor, src->array_ctor) ||
+        clone_context_value(s, &ctx->regexp_ctor, src->regexp_ctor) ||
+        clone_context_value(s, &ctx->promise_ctor, src->promise_ctor) ||
+        clone_context_value(s, &ctx->iterator_ctor, src->iterator_ctor) ||
+        clone_context_value(s, &ctx->async_iterator_proto, src->async_iterator_proto) ||
+        clone_context_value(s, &ctx->array_proto_values, src->array_proto_values) ||
+        clone_context_value(s, &ctx->throw_type_error, src->throw_type_error) ||
+        clone_context_value(s, &ctx->eval_obj, src->eval_obj) ||
+        clone_context_value(s, &ctx->global_obj, src->global_obj) ||
+        clone_context_value(s, &ctx->global_var_obj, src->global_var_obj))
+        goto fail;
+    if (clone_context_shape(s, &ctx->array_shape, src->array_shape) ||
+        clone_context_shape(s, &ctx->arguments_shape, src->arguments_shape) ||
+        clone_context_shape(s, &ctx->mapped_arguments_shape, src->mapped_arguments_shape) ||
+        clone_context_shape(s, &ctx->regexp_shape, src->regexp_shape) ||
+        clone_context_shape(s, &ctx->regexp_result_shape, src->regexp_result_shape))
+        goto fail;
+
+    while (s->todo_count > 0) {
+        p = s->todo[--s->todo_count];
+        p1 = (JSObject *)clone_find(s, p)->dst;
+        /* typed arrays fill their array buffer first */
+        if (p1->shape != s->empty_shape)
+            continue;
+        if (clone_fill_object(s, p, p1))
+            goto fail;
+    }
+
+    ctx->binary_object_count = src->binary_object_count;
+    ctx->binary_object_size = src->binary_object_size;
+    ctx->compile_regexp = src->compile_regexp;
+    ctx->eval_internal = src->eval_internal;
+    js_random_init(ctx);
+    clone_free(s);
+    return ctx;
+ fail:
+    clone_free(s);
+    JS_FreeContext(ctx);
+    return NULL;
+}
@@ -62,9 +62,16 @@ typedef uint32_t JSAtom;
 
 #ifndef JS_PTR64
 #define JS_NAN_BOXING
+#elif defined(JS_NAN_BOXING64)
+/* 64 bit JSValue on 64 bit hosts: the pointers are compressed into
+   48 bits and the tag is stored in the upper 16 bits */
+#define JS_NAN_BOXING
+#else
+#undef JS_NAN_BOXING64
 #endif
 
-#if defined(__SIZEOF_INT128__) && (INTPTR_MAX >= INT64_MAX)
+/* with NaN boxing, the short big ints must fit in 32 bits */
+#if defined(__SIZEOF_INT128__) && (INTPTR_MAX >= INT64_MAX) && !defined(JS_NAN_BOXING)
 #define JS_LIMB_BITS 64
 #else
 #define JS_LIMB_BITS 32
@@ -74,11 +81,20 @@ typedef uint32_t JSAtom;
 
 enum {
     /* all tags with a reference count are negative */
+#ifdef JS_NAN_BOXING64
+    /* no hole: only 15 tags fit in the NaN space with a 16 bit tag */
+    JS_TAG_FIRST       = -7, /* first negative tag */
+    JS_TAG_BIG_INT     = -7,
+    JS_TAG_SYMBOL      = -6,
+    JS_TAG_STRING      = -5,
+    JS_TAG_STRING_ROPE = -4,
+#else
     JS_TAG_FIRST       = -9, /* first negative tag */
     JS_TAG_BIG_INT     = -9,
     JS_TAG_SYMBOL      = -8,
     JS_TAG_STRING      = -7,
     JS_TAG_STRING_ROPE = -6,
+#endif
     JS_TAG_MODULE      = -3, /* used internally */
     JS_TAG_FUNCTION_BYTECODE = -2, /* used internally */
     JS_TAG_OBJECT      = -1,
@@ -141,6 +157,79 @@ static inline JSValue __JS_NewShortBigInt(JSContext *ctx, int32_t d)
     return JS_MKVAL(JS_TAG_SHORT_BIG_INT, d);
 }
 
+#elif defined(JS_NAN_BOXING64)
+
+typedef uint64_t JSValue;
+
+#define JSValueConst JSValue
+
+#define JS_VALUE_PTR_MASK (((uint64_t)1 << 48) - 1)
+
+#define JS_VALUE_GET_TAG(v) (int)((int64_t)(v) >> 48)
+#define JS_VALUE_GET_INT(v) (int)(v)
+#define JS_VALUE_GET_BOOL(v) (int)(v)
+#define JS_VALUE_GET_SHORT_BIG_INT(v) (int)(v)
+#define JS_VALUE_GET_PTR(v) (void *)(intptr_t)((v) & JS_VALUE_PTR_MASK)
+
+#define JS_MKVAL(tag, val) (((uint64_t)(tag) << 48) | (uint32_t)(val))
+/* 'ptr' must fit in 48 bits */
+#define JS_MKPTR(tag, ptr) (((uint64_t)(tag) << 48) | (uintptr_t)(ptr))
+
+/* the tags use the negative NaN space (0xfff1 to 0xffff) */
+#define JS_FLOAT64_TAG_ADDEND (0xfff0 - JS_TAG_FIRST + 1)
+
+static inline double JS_VALUE_GET_FLOAT64(JSValue v)
+{
+    union {
+        JSValue v;
+        double d;
+    } u;
+    u.v = v;
+    u.v += (uint64_t)JS_FLOAT64_TAG_ADDEND << 48;
+    return u.d;
+}
+
+#define JS_NAN (0x7ff8000000000000 - ((uint64_t)JS_FLOAT64_TAG_ADDEND << 48))
+
+static inline JSValue __JS_NewFloat64(JSContext *ctx, double d)
+{
+    union {
+        double d;
+        uint64_t u64;
+    } u;
+    JSValue v;
+    u.d = d;
+    /* normalize NaN */
+    if (js_unlikely((u.u64 & 0x7fffffffffffffff) > 0x7ff0000000000000))
+        v = JS_NAN;
+    else
+        v = u.u64 - ((uint64_t)JS_FLOAT64_TAG_ADDEND << 48);
+    return v;
+}
+
+#define JS_TAG_IS_FLOAT64(tag) ((unsigned)((tag) - JS_TAG_FIRST) >= (JS_TAG_FLOAT64 - JS_TAG_FIRST))
+
+/* same as JS_VALUE_GET_TAG, but return JS_TAG_FLOAT64 with NaN boxing */
+static inline int JS_VALUE_GET_NORM_TAG(JSValue v)
+{
+    int tag;
+    tag = JS_VALUE_GET_TAG(v);
+    if (JS_TAG_IS_FLOAT64(tag))
+        return JS_TAG_FLOAT64;
+    else
+        return tag;
+}
+
+static inline JS_BOOL JS_VALUE_IS_NAN(JSValue v)
+{
+    return v == JS_NAN;
+}
+
+static inline JSValue __JS_NewShortBigInt(JSContext *ctx, int32_t d)
+{
+    return JS_MKVAL(JS_TAG_SHORT_BIG_INT, d);
+}
+
 #elif defined(JS_NAN_BOXING)
 
 typedef uint64_t JSValue;
@@ -354,6 +443,10 @@ typedef struct JSMallocState {
     void *opaque; /* user opaque */
 } JSMallocState;
 
+/* With JS_NAN_BOXING64, an allocator which may return pointers wider
+   than 48 bits must implement js_malloc_usable_size: the reallocations
+   are then done with js_malloc and a copy, so that the old block is
+   kept if no suitable block is found. */
 typedef struct JSMallocFunctions {
     void *(*js_malloc)(JSMallocState *s, size_t size);
     void (*js_free)(JSMallocState *s, void *ptr);
@@ -368,12 +461,31 @@ JSRuntime *JS_NewRuntime(void);
 void JS_SetRuntimeInfo(JSRuntime *rt, const char *info);
 void JS_SetMemoryLimit(JSRuntime *rt, size_t limit);
 void JS_SetGCThreshold(JSRuntime *rt, size_t gc_threshold);
+
+typedef enum JSGCModeEnum {
+    JS_GC_MODE_FULL, /* the automatic GC scans all the objects (default) */
+    /* most automatic GCs only scan the objects allocated since the
+       previous GC. A full GC is done when the heap has grown enough. */
+    JS_GC_MODE_GENERATIONAL,
+} JSGCModeEnum;
+
+void JS_SetGCMode(JSRuntime *rt, JSGCModeEnum mode);
+
+#ifndef JS_DEFAULT_REGEXP_CACHE_SIZE
+#define JS_DEFAULT_REGEXP_CACHE_SIZE 64
+#endif
+/* maximum number of compiled regexps kept by the runtime. 0 disables
+   the cache. The cache is emptied. */
+void JS_SetRegExpCacheSize(JSRuntime *rt, int size);
 /* use 0 to disable maximum stack size check */
 void JS_SetMaxStackSize(JSRuntime *rt, size_t stack_size);
 /* should be called when changing thread to update the stack top value
    used to check stack overflow. */
 void JS_UpdateStackTop(JSRuntime *rt);
 JSRuntime *JS_NewRuntime2(const JSMallocFunctions *mf, void *opaque);
+/* same as JS_NewRuntime2() but the small blocks are allocated in
+   memory pools. 'mf' = NULL selects the default allocator. */
+JSRuntime *JS_NewRuntimeWithPools(const JSMallocFunctions *mf, void *opaque);
 void JS_FreeRuntime(JSRuntime *rt);
 void *JS_GetRuntimeOpaque(JSRuntime *rt);
 void JS_SetRuntimeOpaque(JSRuntime *rt, void *opaque);
@@ -385,6 +497,11 @@ JS_BOOL JS_IsLiveObject(JSRuntime *rt, JSValueConst obj);
 JSContext *JS_NewContext(JSRuntime *rt);
 void JS_FreeContext(JSContext *s);
 JSContext *JS_DupContext(JSContext *ctx);
+/* create a context in the same runtime whose objects are a copy of the
+   objects of the template context 'ctx' (intrinsics, globals and
+   functions). Return NULL with a pending exception if 'ctx' contains
+   objects which cannot be copied. */
+JSContext *JS_CloneContext(JSContext *ctx);
 void *JS_GetContextOpaque(JSContext *ctx);
 void JS_SetContextOpaque(JSContext *ctx, void *opaque);
 JSRuntime *JS_GetRuntime(JSContext *ctx);
@@ -439,6 +556,8 @@ typedef struct JSMemoryUsage {
     int64_t c_func_count, array_count;
     int64_t fast_array_count, fast_array_elements;
     int64_t binary_object_count, binary_object_size;
+    int64_t regexp_cache_count, regexp_cache_size;
+    int64_t regexp_cache_hits, regexp_cache_misses;
 } JSMemoryUsage;
 
 void JS_ComputeMemoryUsage(JSRuntime *rt, JSMemoryUsage *s);
@@ -737,6 +856,18 @@ static inline JSValue JS_NewString(JSContext *ctx, const char *str)
     return JS_NewStringLen(ctx, str, strlen(str));
 }
 JSValue JS_NewAtomString(JSContext *ctx, const char *str);
+typedef void JSFreeExternalStringFunc(JSRuntime *rt, void *opaque, void *ptr);
+/* create a string from host memory: 'len' Latin-1 characters if
+   'is_latin1' is true, otherwise 'len' bytes of UTF-8. The memory
+   must stay valid and unmodified until 'free_func' (if not NULL) is
+   called, which happens when the string is freed. It is called before
+   returning if the characters had to be copied (UTF-8 input with
+   non-ASCII characters) or in case of exception. A string value can
+   be shared by all the contexts of a runtime. */
+JSValue JS_NewExternalString(JSContext *ctx, const char *ptr, size_t len,
+                             JS_BOOL is_latin1,
+                             JSFreeExternalStringFunc *free_func,
+                             void *opaque);
 JSValue JS_ToString(JSContext *ctx, JSValueConst val);
 JSValue JS_ToPropertyKey(JSContext *ctx, JSValueConst val);
 const char *JS_ToCStringLen2(JSContext *ctx, size_t *plen, JSValueConst val1, JS_BOOL cesu8);
@@ -917,6 +1048,9 @@ typedef int JSInterruptHandler(JSRuntime *rt, void *opaque);
 void JS_SetInterruptHandler(JSRuntime *rt, JSInterruptHandler *cb, void *opaque);
 /* if can_block is TRUE, Atomics.wait() can be used */
 void JS_SetCanBlock(JSRuntime *rt, JS_BOOL can_block);
+/* if enable is TRUE (default), the calls in tail position of strict
+   mode functions reuse the stack frame of the caller */
+void JS_SetTailCalls(JSRuntime *rt, JS_BOOL enable);
 /* select which debug info is stripped from the compiled code */
 #define JS_STRIP_SOURCE (1 << 0) /* strip source code */
 #define JS_STRIP_DEBUG  (1 << 1) /* strip all debug info including source code */
@@ -1160,6 +1294,17 @@ void JS_PrintValueRT(JSRuntime *rt, JSPrintValueWrite *write_func, void *write_o
                      JSValueConst val, const JSPrintValueOptions *options);
 void JS_PrintValue(JSContext *ctx, JSPrintValueWrite *write_func, void *write_opaque,
                    JSValueConst val, const JSPrintValueOptions *options);
+/* output the UTF-8 encoding of 'val' converted to a string without
+   copying it. Return -1 if exception. */
+int JS_WriteStringUTF8(JSContext *ctx, JSPrintValueWrite *write_func,
+                       void *write_opaque, JSValueConst val);
+/* same as JS_JSONStringify() but the UTF-8 result is output in chunks
+   without building the string. Return -1 if exception (part of the
+   result may have been output), FALSE if the result is undefined
+   (nothing is output) and TRUE otherwise. */
+int JS_JSONStringifyWrite(JSContext *ctx, JSPrintValueWrite *write_func,
+                          void *write_opaque, JSValueConst obj,
+                          JSValueConst replacer, JSValueConst space0);
 
 #undef js_unlikely
 #undef js_force_inline
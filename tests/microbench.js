@@ -56,6 +56,7 @@ var ref_data;
 var log_data;
 
 var heads  = [ "TEST", "N", "TIME (ns)", "REF (ns)", "SCORE (1000)" ];
+var mem_heads = [ "MEMORY", "N", "BYTES" ];
 var widths = [    22,   10,          9,     9,       9 ];
 var precs  = [     0,   0,           2,     2,       0 ];
 var total  = [     0,   0,           0,     0,       0 ];
@@ -80,6 +81,19 @@ function log_line() {
     console.log(s);
 }
 
+/* the memory figures are not part of the totals, the score and the
+   reference data */
+function log_mem_line() {
+    var i, n, s;
+    s = "";
+    for (i = 0, n = arguments.length; i < n; i++) {
+        if (i > 0)
+            s += " ";
+        s += pad_left(arguments[i], widths[i]);
+    }
+    console.log(s);
+}
+
 var clocks_per_sec = 1000;
 var max_iterations = 100;
 var clock_threshold = 2;  /* favoring short measuring spans */
@@ -1114,6 +1128,53 @@ function string_build_large2(n)
     return n * len;
 }
 
+/* memory benchmarks: they report the number of bytes per element
+   instead of a time */
+
+function mem_used()
+{
+    std.gc();
+    return std.memoryUsage().memory_used_size;
+}
+
+function mem_float_array(n)
+{
+    var i, r = [];
+    for(i = 0; i < n; i++)
+        r.push(i + 0.5);
+    return r;
+}
+mem_float_array.memory = true;
+
+function mem_object_array(n)
+{
+    var i, r = [];
+    for(i = 0; i < n; i++)
+        r.push({ x: i, y: i + 0.5 });
+    return r;
+}
+mem_object_array.memory = true;
+
+function mem_closure(n)
+{
+    var i, r = [];
+    for(i = 0; i < n; i++) {
+        let a = i, b = i + 0.5;
+        r.push(function() { return a + b; });
+    }
+    return r;
+}
+mem_closure.memory = true;
+
+function mem_bench(f, text)
+{
+    var m0, n = 100000;
+    m0 = mem_used();
+    global_res = f(n);
+    log_mem_line(text, n, ((mem_used() - m0) / n).toFixed(2));
+    global_res = null;
+}
+
 /* sort bench */
 
 function sort_bench(text) {
@@ -1513,6 +1574,12 @@ function main(argc, argv, g)
         test_list.push(bigint256_arith);
     }
     test_list.push(sort_bench);
+    if (typeof std !== "undefined" && typeof std.memoryUsage === "function") {
+        /* JSValue memory footprint */
+        test_list.push(mem_float_array);
+        test_list.push(mem_object_array);
+        test_list.push(mem_closure);
+    }
 
     for (i = 1; i < argc;) {
         name = argv[i++];
@@ -1563,6 +1630,8 @@ function main(argc, argv, g)
 
     for(i = 0; i < tests.length; i++) {
         f = tests[i];
+        if (f.memory)
+            continue;
         bench(f, f.name, ref_data, log_data);
         if (ref_data && ref_data[f.name])
             n++;
@@ -1572,6 +1641,17 @@ function main(argc, argv, g)
     else
         log_line("total", "", total[2]);
 
+    for(i = 0, j = 0; i < tests.length; i++) {
+        f = tests[i];
+        if (!f.memory)
+            continue;
+        if (j++ == 0) {
+            console.log("");
+            log_mem_line.apply(null, mem_heads);
+        }
+        mem_bench(f, f.name);
+    }
+
     if (tests == test_list && new_ref_file)
         save_result(new_ref_file, log_data);
 }
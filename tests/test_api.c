@@ -0,0 +1,899 @@
+/*
+ * QuickJS: C API tests
+ *
+ * Each test creates its own runtime. The checks use assert() so that a
+ * failure aborts with the location of the check.
+ */
+#undef NDEBUG
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "quickjs.h"
+
+#define countof(x) (sizeof(x) / sizeof((x)[0]))
+
+static JSValue eval(JSContext *ctx, const char *code)
+{
+    JSValue val;
+    val = JS_Eval(ctx, code, strlen(code), "<test>", JS_EVAL_TYPE_GLOBAL);
+    if (JS_IsException(val)) {
+        JSValue exc = JS_GetException(ctx);
+        const char *str = JS_ToCString(ctx, exc);
+        fprintf(stderr, "%s\n", str ? str : "exception");
+        JS_FreeCString(ctx, str);
+        JS_FreeValue(ctx, exc);
+        abort();
+    }
+    return val;
+}
+
+/* return the exception raised by 'code' */
+static JSValue eval_exception(JSContext *ctx, const char *code)
+{
+    JSValue val;
+    val = JS_Eval(ctx, code, strlen(code), "<test>", JS_EVAL_TYPE_GLOBAL);
+    assert(JS_IsException(val));
+    return JS_GetException(ctx);
+}
+
+static void eval_void(JSContext *ctx, const char *code)
+{
+    JS_FreeValue(ctx, eval(ctx, code));
+}
+
+static int64_t eval_int(JSContext *ctx, const char *code)
+{
+    JSValue val;
+    int64_t res;
+    val = eval(ctx, code);
+    assert(JS_ToInt64(ctx, &res, val) == 0);
+    JS_FreeValue(ctx, val);
+    return res;
+}
+
+static int64_t obj_count(JSRuntime *rt)
+{
+    JSMemoryUsage stats;
+    JS_ComputeMemoryUsage(rt, &stats);
+    return stats.obj_count;
+}
+
+static void test_gc_generational(void)
+{
+    JSRuntime *rt;
+    JSContext *ctx;
+    int64_t count0, count1;
+
+    rt = JS_NewRuntime();
+    JS_SetGCMode(rt, JS_GC_MODE_GENERATIONAL);
+    ctx = JS_NewContext(rt);
+    /* some objects are created on the first use of the builtins */
+    eval_void(ctx, "[0].push([0].reduce(a => a))");
+    JS_RunGC(rt);
+    count0 = obj_count(rt);
+
+    /* the cycles of young objects are freed by the automatic GCs */
+    eval_void(ctx, "for (let i = 0; i < 200000; i++) {"
+              "  let a = { i }, b = { a }; a.b = b;"
+              "}");
+    count1 = obj_count(rt);
+    assert(count1 - count0 < 100000);
+    JS_RunGC(rt);
+    assert(obj_count(rt) == count0);
+
+    /* an old object only referenced by young cycles is freed with them */
+    eval_void(ctx, "var old = { name: 'old' }, old_cycle = {};"
+              "old_cycle.self = old_cycle;");
+    JS_RunGC(rt);
+    eval_void(ctx, "(function () {"
+              "  let o = old;"
+              "  old = undefined;"
+              "  for (let i = 0; i < 200000; i++) {"
+              "    let a = { o }, b = { a }; a.b = b;"
+              "  }"
+              "})();");
+    /* old-young cycle: only collected by a full GC */
+    eval_void(ctx, "(function () {"
+              "  let y = { old_cycle };"
+              "  old_cycle.y = y;"
+              "  old_cycle = undefined;"
+              "})();");
+    eval_void(ctx, "for (let i = 0; i < 200000; i++) {"
+              "  let a = [ i ]; a.push(a);"
+              "}");
+    JS_RunGC(rt);
+    assert(obj_count(rt) == count0);
+
+    /* the young objects referenced by old objects are kept */
+    eval_void(ctx, "var keep = [];"
+              "for (let i = 0; i < 100000; i++) {"
+              "  let a = { i }; a.self = a;"
+              "  if (i % 1000 == 0) keep.push(a);"
+              "}");
+    assert(eval_int(ctx, "keep.reduce((s, a) => s + (a.self === a ? a.i : -1e9), 0)") ==
+           99 * 100 / 2 * 1000);
+    eval_void(ctx, "keep = undefined");
+    JS_RunGC(rt);
+    assert(obj_count(rt) == count0);
+
+    JS_FreeContext(ctx);
+    JS_FreeRuntime(rt);
+}
+
+/* allocator counting the live blocks. The size is stored before the
+   block for the memory limit. */
+
+#define BLOCK_HEADER_SIZE 16
+
+static int64_t live_blocks;
+
+static void *count_malloc(JSMallocState *s, size_t size)
+{
+    uint8_t *ptr;
+    if (s->malloc_size + size > s->malloc_limit)
+        return NULL;
+    ptr = malloc(BLOCK_HEADER_SIZE + size);
+    if (!ptr)
+        return NULL;
+    *(size_t *)ptr = size;
+    live_blocks++;
+    s->malloc_count++;
+    s->malloc_size += size;
+    return ptr + BLOCK_HEADER_SIZE;
+}
+
+static void count_free(JSMallocState *s, void *ptr)
+{
+    uint8_t *p;
+    if (!ptr)
+        return;
+    p = (uint8_t *)ptr - BLOCK_HEADER_SIZE;
+    live_blocks--;
+    s->malloc_count--;
+    s->malloc_size -= *(size_t *)p;
+    free(p);
+}
+
+static void *count_realloc(JSMallocState *s, void *ptr, size_t size)
+{
+    uint8_t *p;
+    size_t old_size;
+    if (!ptr)
+        return size ? count_malloc(s, size) : NULL;
+    if (size == 0) {
+        count_free(s, ptr);
+        return NULL;
+    }
+    p = (uint8_t *)ptr - BLOCK_HEADER_SIZE;
+    old_size = *(size_t *)p;
+    if (s->malloc_size + size - old_size > s->malloc_limit)
+        return NULL;
+    p = realloc(p, BLOCK_HEADER_SIZE + size);
+    if (!p)
+        return NULL;
+    *(size_t *)p = size;
+    s->malloc_size += size - old_size;
+    return p + BLOCK_HEADER_SIZE;
+}
+
+static const JSMallocFunctions count_malloc_funcs = {
+    count_malloc,
+    count_free,
+    count_realloc,
+    NULL,
+};
+
+static void test_pools(void)
+{
+    static const size_t sizes[] = { 1, 15, 16, 17, 255, 256, 257, 4096 };
+    JSRuntime *rt;
+    JSContext *ctx;
+    uint8_t *tab[sizeof(sizes) / sizeof(sizes[0])], *p;
+    void **blocks;
+    int64_t live0;
+    JSMemoryUsage stats;
+    size_t i, j, n;
+
+    live_blocks = 0;
+    rt = JS_NewRuntimeWithPools(&count_malloc_funcs, NULL);
+    assert(rt);
+
+    /* the pooled blocks hold their size and keep their contents */
+    for(i = 0; i < countof(sizes); i++) {
+        tab[i] = js_malloc_rt(rt, sizes[i]);
+        assert(tab[i]);
+        memset(tab[i], i + 1, sizes[i]);
+        if (sizes[i] <= 256) {
+            assert(js_malloc_usable_size_rt(rt, tab[i]) >= sizes[i]);
+            assert(js_malloc_usable_size_rt(rt, tab[i]) < sizes[i] + 16);
+        }
+    }
+    for(i = 0; i < countof(sizes); i++) {
+        for(j = 0; j < sizes[i]; j++)
+            assert(tab[i][j] == i + 1);
+    }
+    /* reallocation between the size classes and the allocator */
+    p = tab[1];
+    p = js_realloc_rt(rt, p, 100);
+    memset(p + 15, 2, 85);
+    p = js_realloc_rt(rt, p, 1000);
+    memset(p + 100, 2, 900);
+    p = js_realloc_rt(rt, p, 40);
+    for(j = 0; j < 40; j++)
+        assert(p[j] == 2);
+    tab[1] = p;
+    assert(js_realloc_rt(rt, tab[0], 0) == NULL);
+    tab[0] = NULL;
+    for(i = 0; i < countof(sizes); i++)
+        js_free_rt(rt, tab[i]);
+
+    /* the empty chunks are released */
+    live0 = live_blocks;
+    n = 20000;
+    blocks = malloc(sizeof(blocks[0]) * n);
+    for(i = 0; i < n; i++) {
+        blocks[i] = js_malloc_rt(rt, 32 + (i % 4) * 16);
+        assert(blocks[i]);
+    }
+    assert(live_blocks > live0 + 10);
+    for(i = 0; i < n; i++) {
+        j = (i * 7919) % n;
+        js_free_rt(rt, blocks[j]);
+    }
+    free(blocks);
+    assert(live_blocks <= live0 + 4);
+
+    ctx = JS_NewContext(rt);
+    eval_void(ctx, "var a = [];"
+              "for (let i = 0; i < 100000; i++) a.push({ i, s: 'x' + i });"
+              "for (let i = 0; i < 100000; i++) if (a[i].s !== 'x' + i) throw Error('bad');");
+    /* out of memory in the pooled path */
+    JS_ComputeMemoryUsage(rt, &stats);
+    JS_SetMemoryLimit(rt, stats.malloc_size + 4 * 1024 * 1024);
+    assert(eval_int(ctx, "try {"
+                    "  var b = []; for (;;) b.push({ a: 1 }); 0;"
+                    "} catch (e) { b = undefined; 1; }") == 1);
+    assert(eval_int(ctx, "a.length + a[99999].i") == 199999);
+    JS_SetMemoryLimit(rt, -1);
+    JS_FreeContext(ctx);
+    JS_FreeRuntime(rt);
+    assert(live_blocks == 0);
+}
+
+static const char clone_template_src[] =
+    "class Point {"
+    "  #secret = 7;"
+    "  constructor(x, y) { this.x = x; this.y = y; }"
+    "  get norm1() { return Math.abs(this.x) + Math.abs(this.y); }"
+    "  secret() { return this.#secret; }"
+    "  static origin = new Point(0, 0);"
+    "}"
+    "function make_counter() { let n = 0; return () => ++n; }"
+    "var counter = make_counter();"
+    "counter();"
+    "var shared = { tag: 'shared' };"
+    "var obj = { a: 1, b: 'str', c: [1, 2, 3], d: shared, e: shared,"
+    "            p: new Point(3, -4), f: 1.5, big: 10n ** 30n };"
+    "obj.self = obj;"
+    "obj.c.push(obj.c);"
+    "var map = new Map([[1, 'one'], [shared, obj], ['k', [4, 5]]]);"
+    "var set = new Set([1, 'two', shared]);"
+    "var wm = new WeakMap([[shared, 42]]);"
+    "var ab = new ArrayBuffer(16);"
+    "var u8 = new Uint8Array(ab, 4, 8);"
+    "var f64 = new Float64Array([1.5, -2]);"
+    "u8.set([1, 2, 3]);"
+    "var dv = new DataView(ab);"
+    "var re = /a(b+)/g; re.lastIndex = 1;"
+    "var date = new Date(0);"
+    "var bound = function (a, b) { return this.v + a + b; }.bind({ v: 1 }, 2);"
+    "var proxy = new Proxy({}, { get: (t, k) => 'proxied ' + String(k) });"
+    "var sym = Symbol('s'); obj[sym] = 'symbol value';"
+    "let lex = 'lexical';"
+    "const resolved = Promise.resolve(5);"
+    "Array.prototype.sum = function () { return this.reduce((a, b) => a + b, 0); };";
+
+static void test_clone_context(void)
+{
+    JSRuntime *rt;
+    JSContext *tpl, *ctx, *ctx2;
+    JSValue val, exc;
+
+    rt = JS_NewRuntime();
+    tpl = JS_NewContext(rt);
+    eval_void(tpl, clone_template_src);
+
+    ctx = JS_CloneContext(tpl);
+    assert(ctx);
+
+    /* the copied objects still work */
+    assert(eval_int(ctx, "counter()") == 2);
+    assert(eval_int(ctx, "obj.p.norm1 + obj.p.secret()") == 14);
+    assert(eval_int(ctx, "obj.p instanceof Point && Point.origin.x === 0 &&"
+                    "new Point(1, 2).norm1 === 3") == 1);
+    assert(eval_int(ctx, "obj.a + obj.c.length") == 5);
+    assert(eval_int(ctx, "[1, 2, 3].sum()") == 6);
+    assert(eval_int(ctx, "obj.big === 10n ** 30n && obj.f === 1.5 && obj.b === 'str'") == 1);
+    assert(eval_int(ctx, "bound(3)") == 6);
+    assert(eval_int(ctx, "proxy.x === 'proxied x'") == 1);
+    assert(eval_int(ctx, "obj[sym] === 'symbol value' && lex === 'lexical'") == 1);
+    assert(eval_int(ctx, "re.lastIndex === 1 && re.exec('xabbab')[1] === 'bb' &&"
+                    "re.lastIndex === 4") == 1);
+    assert(eval_int(ctx, "date.getTime() === 0 && date instanceof Date") == 1);
+    assert(eval_int(ctx, "var r; resolved.then(v => r = v); 1") == 1);
+    while (JS_IsJobPending(rt)) {
+        JSContext *ctx1;
+        assert(JS_ExecutePendingJob(rt, &ctx1) >= 0);
+    }
+    assert(eval_int(ctx, "r") == 5);
+
+    /* cycles and shared references are preserved */
+    assert(eval_int(ctx, "obj.self === obj && obj.c[3] === obj.c &&"
+                    "obj.d === obj.e && obj.d === shared") == 1);
+    assert(eval_int(ctx, "map.get(shared) === obj && map.get('k')[1] === 5 &&"
+                    "map.size === 3 && [...map.keys()][1] === shared") == 1);
+    assert(eval_int(ctx, "set.has(shared) && set.has('two') && set.size === 3 &&"
+                    "wm.get(shared) === 42") == 1);
+    assert(eval_int(ctx, "u8.buffer === ab && dv.buffer === ab &&"
+                    "u8[0] + u8[2] === 4 && dv.getUint8(5) === 2 &&"
+                    "f64[1] === -2") == 1);
+
+    /* the intrinsics belong to the new context */
+    assert(eval_int(ctx, "Object.getPrototypeOf(obj.c) === Array.prototype &&"
+                    "obj.c instanceof Array && counter instanceof Function") == 1);
+
+    /* the copy is independent from the template in both directions */
+    eval_void(ctx, "obj.a = 100; obj.c[0] = 100; shared.tag = 'changed';"
+              "map.set('new', 1); set.delete(1); u8[0] = 100; f64[0] = 0;"
+              "Point.prototype.extra = 1; Array.prototype.sum = null;"
+              "Math.max = null; lex = 'changed'; globalThis.added = 1;"
+              "re.compile('z');");
+    assert(eval_int(tpl, "obj.a === 1 && obj.c[0] === 1 && shared.tag === 'shared'") == 1);
+    assert(eval_int(tpl, "map.size === 3 && set.has(1) && u8[0] === 1 && f64[0] === 1.5") == 1);
+    assert(eval_int(tpl, "new Point(1, 1).extra === undefined && [1].sum() === 1") == 1);
+    assert(eval_int(tpl, "Math.max(1, 2) === 2 && lex === 'lexical' &&"
+                    "typeof added === 'undefined' && re.source === 'a(b+)'") == 1);
+    assert(eval_int(tpl, "counter()") == 2);
+    assert(eval_int(tpl, "counter()") == 3);
+    assert(eval_int(ctx, "counter()") == 3);
+
+    /* a second copy starts from the state of the template */
+    ctx2 = JS_CloneContext(tpl);
+    assert(ctx2);
+    assert(eval_int(ctx2, "counter() + obj.a + map.size") == 4 + 1 + 3);
+    JS_FreeContext(ctx2);
+
+    /* the copy can be freed before or after the template */
+    JS_FreeContext(tpl);
+    assert(eval_int(ctx, "obj.p.norm1 + obj.c[1]") == 9);
+    JS_RunGC(rt);
+
+    /* objects which cannot be copied */
+    tpl = JS_NewContext(rt);
+    eval_void(tpl, "var gen = (function* () { yield 1; })();");
+    assert(JS_CloneContext(tpl) == NULL);
+    exc = JS_GetException(tpl);
+    val = JS_GetPropertyStr(tpl, exc, "name");
+    {
+        const char *str = JS_ToCString(tpl, val);
+        assert(str && !strcmp(str, "TypeError"));
+        JS_FreeCString(tpl, str);
+    }
+    JS_FreeValue(tpl, val);
+    JS_FreeValue(tpl, exc);
+    eval_void(tpl, "gen = undefined");
+    ctx2 = JS_CloneContext(tpl);
+    assert(ctx2);
+    JS_FreeContext(ctx2);
+    JS_FreeContext(tpl);
+
+    JS_FreeContext(ctx);
+    JS_FreeRuntime(rt);
+}
+
+static int interrupt_handler(JSRuntime *rt, void *opaque)
+{
+    int *pcount = opaque;
+    return ++*pcount >= 50;
+}
+
+/* the hot loops are compiled by the JIT (CONFIG_JIT), which must still
+   poll the interrupt handler */
+static void test_interrupt(void)
+{
+    static const char *loops[] = {
+        "for (;;) {}",
+        "var i = 0; while (true) i++;",
+        "(function () { var o = { x: 0 }; for (;;) o.x = o.x + 1; })()",
+        "(function f() { for (var i = 0; ; i++) { try { f.x = i; } finally { f.y = i; } } })()",
+        "var a = [1, 2, 3], s = 0; for (;;) s += a[s & 1];",
+    };
+    JSRuntime *rt;
+    JSContext *ctx;
+    JSValue val;
+    int count;
+    size_t i;
+
+    rt = JS_NewRuntime();
+    ctx = JS_NewContext(rt);
+    JS_SetInterruptHandler(rt, interrupt_handler, &count);
+    for(i = 0; i < countof(loops); i++) {
+        count = 0;
+        val = eval_exception(ctx, loops[i]);
+        assert(count >= 50);
+        JS_FreeValue(ctx, val);
+    }
+    /* the interrupt cannot be caught */
+    count = 0;
+    val = eval_exception(ctx, "var caught = 0;"
+                         "try { for (;;) {} } catch (e) { caught = 1; }");
+    JS_FreeValue(ctx, val);
+    assert(eval_int(ctx, "caught") == 0);
+    JS_SetInterruptHandler(rt, NULL, NULL);
+    assert(eval_int(ctx, "var s = 0; for (var i = 0; i < 10000; i++) s += i; s") ==
+           49995000);
+    JS_FreeContext(ctx);
+    JS_FreeRuntime(rt);
+}
+
+/* the functions are quickened when the script runs */
+static const char quicken_src[] =
+    "function f(a, n) {"
+    "  var s = 0;"
+    "  for (var i = 0; i < n; i++) {"
+    "    if (a[i] >= 2) s = s + a[i]; else s = s - 1;"
+    "  }"
+    "  return s;"
+    "}"
+    "var arr = [0, 1, 2, 3, 4], res = 0;"
+    "for (var k = 0; k < 100; k++) res += f(arr, arr.length);"
+    "res";
+
+static void test_quickened_bytecode(void)
+{
+    JSRuntime *rt;
+    JSContext *ctx;
+    JSValue obj, val;
+    uint8_t *buf1, *buf2, *rom;
+    size_t len1, len2;
+
+    rt = JS_NewRuntime();
+    ctx = JS_NewContext(rt);
+    obj = JS_Eval(ctx, quicken_src, strlen(quicken_src), "<test>",
+                  JS_EVAL_TYPE_GLOBAL | JS_EVAL_FLAG_COMPILE_ONLY);
+    assert(!JS_IsException(obj));
+    buf1 = JS_WriteObject(ctx, &len1, obj, JS_WRITE_OBJ_BYTECODE);
+    assert(buf1);
+
+    /* the quickened opcodes are not serialized */
+    val = JS_EvalFunction(ctx, JS_DupValue(ctx, obj));
+    assert(JS_VALUE_GET_INT(val) == 100 * 7);
+    buf2 = JS_WriteObject(ctx, &len2, obj, JS_WRITE_OBJ_BYTECODE);
+    assert(buf2);
+    assert(len1 == len2 && !memcmp(buf1, buf2, len1));
+    JS_FreeValue(ctx, obj);
+
+    /* the bytecode read back runs and is quickened again */
+    obj = JS_ReadObject(ctx, buf2, len2, JS_READ_OBJ_BYTECODE);
+    assert(!JS_IsException(obj));
+    val = JS_EvalFunction(ctx, obj);
+    assert(JS_VALUE_GET_INT(val) == 100 * 7);
+    assert(eval_int(ctx, "f([1.5, 2.5, 3], 3) === -1 + 2.5 + 3 &&"
+                    "f([2, 3], 2) === 5 && f('23', 2) === '023' &&"
+                    "f([5, 6], 2.5) === 10") == 1);
+
+    /* the read-only bytecode is never rewritten */
+    rom = malloc(len2);
+    memcpy(rom, buf2, len2);
+    obj = JS_ReadObject(ctx, rom, len2,
+                        JS_READ_OBJ_BYTECODE | JS_READ_OBJ_ROM_DATA);
+    assert(!JS_IsException(obj));
+    val = JS_EvalFunction(ctx, obj);
+    assert(JS_VALUE_GET_INT(val) == 100 * 7);
+    assert(!memcmp(rom, buf2, len2));
+
+    js_free(ctx, buf1);
+    js_free(ctx, buf2);
+    JS_FreeContext(ctx);
+    JS_FreeRuntime(rt);
+    free(rom);
+}
+
+/* output of JS_JSONStringifyWrite() */
+typedef struct {
+    char *buf;
+    size_t len;
+    int write_count;
+} OutputBuffer;
+
+static void output_write(void *opaque, const char *buf, size_t len)
+{
+    OutputBuffer *b = opaque;
+    b->buf = realloc(b->buf, b->len + len + 1);
+    assert(b->buf);
+    memcpy(b->buf + b->len, buf, len);
+    b->len += len;
+    b->write_count++;
+}
+
+/* 'expr' returns [ value, replacer, space ]. Return the number of
+   writes. */
+static int check_json_write(JSContext *ctx, const char *expr)
+{
+    JSValue args, obj, replacer, space, str;
+    OutputBuffer out = { NULL, 0, 0 };
+    const char *cstr;
+    size_t len;
+    int ret;
+
+    args = eval(ctx, expr);
+    obj = JS_GetPropertyUint32(ctx, args, 0);
+    replacer = JS_GetPropertyUint32(ctx, args, 1);
+    space = JS_GetPropertyUint32(ctx, args, 2);
+    str = JS_JSONStringify(ctx, obj, replacer, space);
+    assert(!JS_IsException(str));
+    ret = JS_JSONStringifyWrite(ctx, output_write, &out, obj, replacer, space);
+    if (JS_IsUndefined(str)) {
+        assert(ret == 0);
+        assert(out.len == 0);
+    } else {
+        assert(ret == 1);
+        cstr = JS_ToCStringLen(ctx, &len, str);
+        assert(cstr);
+        assert(out.len == len && !memcmp(out.buf, cstr, len));
+        JS_FreeCString(ctx, cstr);
+    }
+    JS_FreeValue(ctx, str);
+    JS_FreeValue(ctx, obj);
+    JS_FreeValue(ctx, replacer);
+    JS_FreeValue(ctx, space);
+    JS_FreeValue(ctx, args);
+    free(out.buf);
+    return out.write_count;
+}
+
+/* check that JS_JSONStringifyWrite() fails cleanly or gives the
+   complete result under all the memory limits */
+static void check_json_write_oom(JSContext *ctx, const char *expr)
+{
+    JSRuntime *rt = JS_GetRuntime(ctx);
+    JSValue args, obj, replacer, space;
+    JSMemoryUsage stats;
+    OutputBuffer out = { NULL, 0, 0 };
+    char *expected;
+    size_t expected_len, extra;
+    int ret, fail_count, ok_count;
+
+    args = eval(ctx, expr);
+    obj = JS_GetPropertyUint32(ctx, args, 0);
+    replacer = JS_GetPropertyUint32(ctx, args, 1);
+    space = JS_GetPropertyUint32(ctx, args, 2);
+    assert(JS_JSONStringifyWrite(ctx, output_write, &out, obj,
+                                 replacer, space) == 1);
+    expected = out.buf;
+    expected_len = out.len;
+    fail_count = ok_count = 0;
+    JS_RunGC(rt);
+    JS_ComputeMemoryUsage(rt, &stats);
+    for(extra = 0; extra < 16384; extra += 8) {
+        out = (OutputBuffer){ NULL, 0, 0 };
+        JS_SetMemoryLimit(rt, stats.malloc_size + extra);
+        ret = JS_JSONStringifyWrite(ctx, output_write, &out, obj,
+                                    replacer, space);
+        JS_SetMemoryLimit(rt, -1);
+        if (ret < 0) {
+            JS_FreeValue(ctx, JS_GetException(ctx));
+            fail_count++;
+        } else {
+            assert(ret == 1);
+            assert(out.len == expected_len &&
+                   !memcmp(out.buf, expected, expected_len));
+            ok_count++;
+        }
+        free(out.buf);
+    }
+    assert(fail_count > 0 && ok_count > 0);
+    free(expected);
+    JS_FreeValue(ctx, obj);
+    JS_FreeValue(ctx, replacer);
+    JS_FreeValue(ctx, space);
+    JS_FreeValue(ctx, args);
+}
+
+static void test_json_stringify_write(void)
+{
+    static const char *values[] = {
+        "[{ a: 1, b: [true, null, 'x'], c: { d: 1.5e300, e: -0, f: NaN } }]",
+        "['\\xe9\\u4e00\\ud83d\\ude00 \\ud800 \\udfff \"\\\\\\n\\t\\x01']",
+        "[{ a: 1, b: { c: [1, 2] }, d: 'x' },"
+        " (k, v) => typeof v === 'number' ? v * 2 : v, 2]",
+        "[{ a: 1, b: 2, c: [3, { a: 4 }] }, ['c', 'a'], '--']",
+        "[{ x: 1, toJSON() { return { y: '\\u4e00'.repeat(600) }; } }]",
+        "[[1n].map(String)]",
+        "[undefined]",
+        "[() => 1]",
+        "[Symbol()]",
+        "[{ toJSON() { return undefined; } }]",
+    };
+    JSRuntime *rt;
+    JSContext *ctx;
+    JSValue big, exc;
+    OutputBuffer out = { NULL, 0, 0 };
+    size_t i;
+    int ret;
+
+    rt = JS_NewRuntime();
+    ctx = JS_NewContext(rt);
+    for(i = 0; i < countof(values); i++)
+        check_json_write(ctx, values[i]);
+
+    /* the output is written in chunks, with Latin-1 and 16 bit
+       strings around the chunk boundaries */
+    assert(check_json_write(ctx,
+                            "[{ s: 'a'.repeat(5000), w: '\\u4e00'.repeat(3000),"
+                            "   l: '\\xe9'.repeat(2000), e: '\\ud83d\\ude00'.repeat(1000),"
+                            "   arr: Array.from({ length: 2000 }, (_, i) => ({ i, s: 'k' + i }))"
+                            "}, null, 1]") > 10);
+
+    /* exceptions: part of the result may have been output */
+    big = eval(ctx, "[1, { toJSON() { throw new RangeError('x'); } }]");
+    ret = JS_JSONStringifyWrite(ctx, output_write, &out, big,
+                                JS_UNDEFINED, JS_UNDEFINED);
+    assert(ret == -1);
+    exc = JS_GetException(ctx);
+    assert(JS_IsError(ctx, exc));
+    JS_FreeValue(ctx, exc);
+    JS_FreeValue(ctx, big);
+    free(out.buf);
+    out = (OutputBuffer){ NULL, 0, 0 };
+    big = eval(ctx, "var a = [1]; a.push({ a }); a");
+    assert(JS_JSONStringifyWrite(ctx, output_write, &out, big,
+                                 JS_UNDEFINED, JS_UNDEFINED) == -1);
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    JS_FreeValue(ctx, big);
+    free(out.buf);
+
+    /* out of memory at every point of the serialization */
+    check_json_write_oom(ctx,
+                         "[Array.from({ length: 50 }, (_, i) =>"
+                         "  ({ i, s: 'str' + i, w: '\\u4e00'.repeat(i * 10), a: [i, i / 3] }))]");
+    /* the buffer is widened by the indentation: the errors of the
+       following characters are not reported */
+    check_json_write_oom(ctx, "[[[], {}], null, '\\u4e00']");
+
+    JS_FreeContext(ctx);
+    JS_FreeRuntime(rt);
+}
+
+static int ext_free_count;
+
+/* the characters are in a malloc'ed block so that the accesses after
+   the finalizer are detected by the sanitizers */
+static void ext_free(JSRuntime *rt, void *opaque, void *ptr)
+{
+    assert(opaque == &ext_free_count);
+    ext_free_count++;
+    free(ptr);
+}
+
+static JSValue new_ext_string(JSContext *ctx, const char *str, int is_latin1)
+{
+    size_t len = strlen(str);
+    char *ptr = malloc(len);
+    assert(ptr);
+    memcpy(ptr, str, len);
+    return JS_NewExternalString(ctx, ptr, len, is_latin1, ext_free,
+                                &ext_free_count);
+}
+
+static void set_global(JSContext *ctx, const char *name, JSValue val)
+{
+    JSValue global = JS_GetGlobalObject(ctx);
+    assert(JS_SetPropertyStr(ctx, global, name, val) == 1);
+    JS_FreeValue(ctx, global);
+}
+
+/* check that JS_ToCStringLen2() gives 'expected' */
+static void check_cstring(JSContext *ctx, JSValueConst val, const char *expected,
+                          int cesu8)
+{
+    const char *str;
+    size_t len;
+    str = JS_ToCStringLen2(ctx, &len, val, cesu8);
+    assert(str);
+    assert(len == strlen(expected) && !memcmp(str, expected, len));
+    assert(str[len] == '\0');
+    JS_FreeCString(ctx, str);
+}
+
+static void test_external_string(void)
+{
+    JSRuntime *rt;
+    JSContext *ctx, *ctx2;
+    JSValue val, val2;
+    JSAtom atom;
+
+    ext_free_count = 0;
+    rt = JS_NewRuntime();
+    ctx = JS_NewContext(rt);
+
+    /* Latin-1 */
+    val = new_ext_string(ctx, "caf\xe9 cr\xe8me br\xfbl\xe9" "e", 1);
+    assert(JS_IsString(val));
+    check_cstring(ctx, val, "caf\xc3\xa9 cr\xc3\xa8me br\xc3\xbbl\xc3\xa9" "e", 0);
+    check_cstring(ctx, val, "caf\xc3\xa9 cr\xc3\xa8me br\xc3\xbbl\xc3\xa9" "e", 1);
+    set_global(ctx, "lat", val);
+    assert(eval_int(ctx, "lat === 'caf\\xe9 cr\\xe8me br\\xfbl\\xe9e' &&"
+                    "lat.length === 17 && lat.charCodeAt(3) === 0xe9") == 1);
+    assert(ext_free_count == 0);
+
+    /* ASCII given as UTF-8: not copied */
+    val = new_ext_string(ctx, "hello, external world", 0);
+    assert(ext_free_count == 0);
+    check_cstring(ctx, val, "hello, external world", 0);
+    set_global(ctx, "asc", JS_DupValue(ctx, val));
+
+    /* non-ASCII UTF-8: copied, the finalizer is called at once */
+    val2 = new_ext_string(ctx, "\xe4\xb8\x80\xf0\x9f\x98\x80", 0);
+    assert(ext_free_count == 1);
+    check_cstring(ctx, val2, "\xe4\xb8\x80\xf0\x9f\x98\x80", 0);
+    check_cstring(ctx, val2, "\xe4\xb8\x80\xed\xa0\xbd\xed\xb8\x80", 1);
+    set_global(ctx, "utf", val2);
+    assert(eval_int(ctx, "utf === '\\u4e00\\ud83d\\ude00'") == 1);
+
+    /* atoms */
+    atom = JS_ValueToAtom(ctx, val);
+    assert(atom != JS_ATOM_NULL);
+    val2 = JS_AtomToString(ctx, atom);
+    check_cstring(ctx, val2, "hello, external world", 0);
+    JS_FreeValue(ctx, val2);
+    JS_FreeAtom(ctx, atom);
+    assert(eval_int(ctx, "var o = {}; o[asc] = 1; o[lat] = 2;"
+                    "o['hello, external world'] === 1 &&"
+                    "o['caf\\xe9 cr\\xe8me br\\xfbl\\xe9e'] === 2 &&"
+                    "Object.keys(o).join() === asc + ',' + lat") == 1);
+    eval_void(ctx, "var sym = Symbol.for(lat), map = new Map([[asc, 3]])");
+    assert(eval_int(ctx, "Symbol.keyFor(sym) === lat &&"
+                    "map.get('hello, ' + 'external world') === 3") == 1);
+
+    /* concatenation */
+    eval_void(ctx, "var c1 = asc + '!', c2 = '<' + lat, c3 = asc + lat + asc,"
+              "  c4 = lat + utf;"
+              "for (var i = 0; i < 10; i++) c3 += lat;");
+    assert(eval_int(ctx, "c1 === 'hello, external world!' &&"
+                    "c2 === '<caf\\xe9 cr\\xe8me br\\xfbl\\xe9e' &&"
+                    "c3.length === 21 * 2 + 17 * 11 &&"
+                    "c3.startsWith(asc + lat) && c3.endsWith(lat + lat) &&"
+                    "c4.endsWith('\\u4e00\\ud83d\\ude00') &&"
+                    "c4.indexOf(lat) === 0") == 1);
+    val2 = eval(ctx, "c2");
+    check_cstring(ctx, val2, "<caf\xc3\xa9 cr\xc3\xa8me br\xc3\xbbl\xc3\xa9" "e", 0);
+    JS_FreeValue(ctx, val2);
+
+    /* slicing */
+    eval_void(ctx, "var s1 = asc.slice(7, 15), s2 = lat.substring(0, 4),"
+              "  s3 = lat.split(' '), s4 = asc.slice(-5);");
+    assert(eval_int(ctx, "s1 === 'external' && s2 === 'caf\\xe9' &&"
+                    "s3.join('|') === 'caf\\xe9|cr\\xe8me|br\\xfbl\\xe9e' &&"
+                    "s4 === 'world' && lat.indexOf('cr\\xe8me') === 5 &&"
+                    "asc.replace('world', 'string') === 'hello, external string'") == 1);
+    val2 = eval(ctx, "s3[2]");
+    check_cstring(ctx, val2, "br\xc3\xbbl\xc3\xa9" "e", 0);
+    JS_FreeValue(ctx, val2);
+    val2 = eval(ctx, "s1");
+    check_cstring(ctx, val2, "external", 0);
+    JS_FreeValue(ctx, val2);
+
+    /* the strings are shared by the contexts of the runtime */
+    ctx2 = JS_NewContext(rt);
+    set_global(ctx2, "asc2", JS_DupValue(ctx2, val));
+    assert(eval_int(ctx2, "asc2 === 'hello, external world'") == 1);
+    JS_FreeContext(ctx2);
+
+    /* the finalizers are called once, when the last reference (slices,
+       ropes and atoms included) is freed */
+    assert(ext_free_count == 1);
+    JS_FreeValue(ctx, val);
+    eval_void(ctx, "asc = lat = o = sym = map = undefined");
+    JS_RunGC(rt);
+    assert(eval_int(ctx, "c1 === 'hello, external world!' &&"
+                    "c3.slice(21, 38) === 'caf\\xe9 cr\\xe8me br\\xfbl\\xe9e' &&"
+                    "s1 === 'external' && s2 === 'caf\\xe9' && s4 === 'world'") == 1);
+    eval_void(ctx, "c1 = c2 = c3 = c4 = s1 = s2 = s3 = s4 = undefined");
+    JS_RunGC(rt);
+    assert(ext_free_count == 3);
+
+    /* exception: the finalizer is called */
+    JS_SetMemoryLimit(rt, 1);
+    val = new_ext_string(ctx, "out of memory", 1);
+    JS_SetMemoryLimit(rt, -1);
+    assert(JS_IsException(val));
+    JS_FreeValue(ctx, JS_GetException(ctx));
+
+    JS_FreeContext(ctx);
+    JS_FreeRuntime(rt);
+    assert(ext_free_count == 4);
+}
+
+static void check_regexp_cache(JSRuntime *rt, int64_t hits, int64_t misses,
+                               int64_t count)
+{
+    JSMemoryUsage stats;
+    JS_ComputeMemoryUsage(rt, &stats);
+    assert(stats.regexp_cache_hits == hits);
+    assert(stats.regexp_cache_misses == misses);
+    assert(stats.regexp_cache_count == count);
+    assert((stats.regexp_cache_size != 0) == (count != 0));
+}
+
+static void test_regexp_cache(void)
+{
+    JSRuntime *rt;
+    JSContext *ctx;
+
+    rt = JS_NewRuntime();
+    ctx = JS_NewContext(rt);
+    eval_void(ctx, "function m(src, flags, str) {"
+              "  var a = new RegExp(src, flags).exec(str);"
+              "  return a ? a.index * 100 + a[0].length : -1;"
+              "}");
+    check_regexp_cache(rt, 0, 0, 0);
+
+    /* disabled: nothing is looked up or added */
+    JS_SetRegExpCacheSize(rt, 0);
+    assert(eval_int(ctx, "m('a+', '', 'baa')") == 102);
+    assert(eval_int(ctx, "m('a+', '', 'baa')") == 102);
+    check_regexp_cache(rt, 0, 0, 0);
+
+    /* one entry: each new pattern evicts the previous one */
+    JS_SetRegExpCacheSize(rt, 1);
+    assert(eval_int(ctx, "m('a+', '', 'baa')") == 102);
+    check_regexp_cache(rt, 0, 1, 1);
+    assert(eval_int(ctx, "m('a+', '', 'caaa')") == 103);
+    check_regexp_cache(rt, 1, 1, 1);
+    assert(eval_int(ctx, "m('b+', '', 'abb')") == 102);
+    check_regexp_cache(rt, 1, 2, 1);
+    assert(eval_int(ctx, "m('a+', '', 'xa')") == 101);
+    check_regexp_cache(rt, 1, 3, 1);
+    /* the flags are part of the key */
+    assert(eval_int(ctx, "m('a+', 'i', 'xA')") == 101);
+    check_regexp_cache(rt, 1, 4, 1);
+    assert(eval_int(ctx, "m('a+', '', 'xA')") == -1);
+    check_regexp_cache(rt, 1, 5, 1);
+
+    /* two entries: the least recently used one is evicted */
+    JS_SetRegExpCacheSize(rt, 2);
+    check_regexp_cache(rt, 1, 5, 0);
+    assert(eval_int(ctx, "m('a', '', 'a') + m('b', '', 'b')") == 2);
+    check_regexp_cache(rt, 1, 7, 2);
+    assert(eval_int(ctx, "m('a', '', 'a') + m('c', '', 'c')") == 2);
+    check_regexp_cache(rt, 2, 8, 2);
+    assert(eval_int(ctx, "m('a', '', 'a')") == 1);
+    check_regexp_cache(rt, 3, 8, 2);
+    assert(eval_int(ctx, "m('b', '', 'b')") == 1);
+    check_regexp_cache(rt, 3, 9, 2);
+
+    /* a negative size disables the cache */
+    JS_SetRegExpCacheSize(rt, -1);
+    check_regexp_cache(rt, 3, 9, 0);
+    assert(eval_int(ctx, "m('b', '', 'b')") == 1);
+    check_regexp_cache(rt, 3, 9, 0);
+
+    JS_FreeContext(ctx);
+    JS_FreeRuntime(rt);
+}
+
+int main(int argc, char **argv)
+{
+    test_gc_generational();
+    test_pools();
+    test_clone_context();
+    test_interrupt();
+    test_quickened_bytecode();
+    test_json_stringify_write();
+    test_external_string();
+    test_regexp_cache();
+    printf("api tests passed\n");
+    return 0;
+}
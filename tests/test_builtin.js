@@ -341,6 +341,118 @@ function test_string()
     assert("abc".padStart(Infinity, ""), "abc");
 }
 
+/* indexOf and includes scan for the first character with vectors of 8,
+   16 or 32 characters and use a Horspool search for the patterns of 16
+   characters or more */
+function test_string_search()
+{
+    var lens, fill, pat, hay, i, j, k, n, s, p, w, ofs, res;
+
+    function naive_indexof(s, p, from) {
+        var i, j;
+        for(i = from; i + p.length <= s.length; i++) {
+            for(j = 0; j < p.length; j++) {
+                if (s.charCodeAt(i + j) != p.charCodeAt(j))
+                    break;
+            }
+            if (j == p.length)
+                return i;
+        }
+        return -1;
+    }
+
+    function make_pattern(len, base) {
+        var i, r = "";
+        for(i = 0; i < len; i++)
+            r += String.fromCharCode(base + (i * 7) % 23);
+        return r;
+    }
+
+    lens = [ 1, 2, 7, 8, 9, 15, 16, 17, 31, 32, 33 ];
+    /* Latin-1 and 16 bit haystacks and patterns: [ fill character,
+       first pattern character ]. The fill character never appears in
+       the pattern. 0x162 and 0x4e62 have the same low byte as 0x62 in
+       the Horspool shift table. */
+    w = [
+        [ "a", 0x62 ],
+        [ "\xe9", 0xc0 ],
+        [ "\u0162", 0x62 ],
+        [ "\u4e62", 0x162 ],
+        [ "\u4e00", 0x4e01 ],
+    ];
+    for(i = 0; i < lens.length; i++) {
+        n = lens[i];
+        for(j = 0; j < w.length; j++) {
+            fill = w[j][0];
+            pat = make_pattern(n, w[j][1]);
+            /* the match at every offset modulo the vector widths */
+            for(ofs = 0; ofs < 72; ofs++) {
+                hay = fill.repeat(ofs) + pat + fill.repeat(40);
+                assert(hay.indexOf(pat), ofs, "len=" + n + " ofs=" + ofs);
+                assert(hay.includes(pat), true);
+                assert(hay.indexOf(pat, ofs + 1), -1);
+                assert(hay.includes(pat, ofs + 1), false);
+                /* one character differs */
+                p = pat.slice(0, n - 1) + fill;
+                if (p != pat)
+                    assert(hay.indexOf(p), naive_indexof(hay, p, 0));
+                p = fill + pat.slice(1);
+                if (p != pat)
+                    assert(hay.indexOf(p), naive_indexof(hay, p, 0));
+            }
+            /* partial matches before the match */
+            s = pat.slice(0, n - 1) + fill + pat.slice(0, n >> 1) + pat;
+            assert(s.indexOf(pat), naive_indexof(s, pat, 0));
+            assert(s.lastIndexOf(pat), s.length - n);
+            /* the pattern at the end, truncated or with a 16 bit
+               character in the haystack */
+            hay = "Ā" + fill.repeat(50) + pat;
+            assert(hay.indexOf(pat), 51);
+            assert(hay.slice(0, -1).indexOf(pat), -1);
+            assert(hay.slice(0, -1).includes(pat), false);
+            /* unaligned haystacks */
+            for(k = 0; k < 9; k++) {
+                s = hay.substring(k);
+                assert(s.indexOf(pat), 51 - k);
+                assert(s.indexOf(pat, 50 - k), 51 - k);
+                assert(s.indexOf(pat, 52 - k), -1);
+            }
+        }
+    }
+
+    /* a 16 bit pattern is never found in a Latin-1 haystack */
+    hay = "a".repeat(100);
+    assert(hay.indexOf("š"), -1);
+    assert(hay.indexOf("š".repeat(20)), -1);
+    assert(hay.includes("aš"), false);
+    /* a Latin-1 pattern in a 16 bit haystack */
+    hay = "š".repeat(37) + "a".repeat(40);
+    assert(hay.indexOf("a"), 37);
+    assert(hay.indexOf("a".repeat(20)), 37);
+    assert(hay.indexOf("ša"), 36);
+    assert(hay.indexOf("š" + "a".repeat(19)), 36);
+    assert(hay.indexOf("a".repeat(41)), -1);
+
+    /* repetitive patterns */
+    s = "ab".repeat(100) + "abb" + "ab".repeat(100);
+    assert(s.indexOf("ab".repeat(10) + "b"), 182);
+    assert(s.indexOf("ab".repeat(20) + "b"), 162);
+    assert(s.indexOf("bb" + "ab".repeat(20)), 201);
+    assert(s.indexOf("ab".repeat(102)), -1);
+    s = "a".repeat(100) + "b";
+    assert(s.indexOf("a".repeat(16) + "b"), 84);
+    assert(s.indexOf("a".repeat(15) + "b"), 85);
+    assert(s.indexOf("a".repeat(101)), -1);
+
+    /* split and replaceAll use the same search */
+    pat = make_pattern(20, 0x4e00);
+    s = ["x", "yš", "", "z"].join(pat);
+    assert(s.split(pat), ["x", "yš", "", "z"]);
+    assert(s.replaceAll(pat, "-"), "x-yš--z");
+    res = "a".repeat(33).split("a".repeat(16));
+    assert(res, ["", "", "a"]);
+}
+
 function test_math()
 {
     var a;
@@ -807,6 +919,243 @@ function test_regexp()
     assert(a.indices[0][1], 2);
 }
 
+function test_regexp_prefix()
+{
+    var a, r, str, wstr, i, res;
+
+    /* candidates that fail after the literal prefix */
+    str = "ERR ERROR: x ERROR: 12 ERROR: 345 ERROR:";
+    r = /ERROR: (\d+)/g;
+    res = [];
+    while ((a = r.exec(str)) !== null)
+        res.push(a.index + ":" + a[1] + ":" + r.lastIndex);
+    assert(res.join(), "13:12:22,23:345:33");
+    assert(r.lastIndex, 0);
+
+    /* same search on a 16 bit string */
+    wstr = "\u4e00" + str;
+    res = [];
+    while ((a = r.exec(wstr)) !== null)
+        res.push(a.index + ":" + a[1] + ":" + r.lastIndex);
+    assert(res.join(), "14:12:23,24:345:34");
+
+    /* lastIndex past, inside and before a prefix occurrence */
+    r = /abc/g;
+    r.lastIndex = 1;
+    assert(r.exec("abcxabc").index, 4);
+    r.lastIndex = 5;
+    assert(r.exec("abcxabc"), null);
+    assert(r.lastIndex, 0);
+    r.lastIndex = 8;
+    assert(r.exec("abcxabc"), null);
+    r.lastIndex = 4;
+    assert(r.exec("abcxabc").index, 4);
+    assert(r.lastIndex, 7);
+
+    /* sticky regexps must not search */
+    r = /abc/y;
+    r.lastIndex = 1;
+    assert(r.exec("abcxabc"), null);
+    assert(r.lastIndex, 0);
+    r.lastIndex = 4;
+    assert(r.exec("abcxabc")[0], "abc");
+    assert(r.lastIndex, 7);
+    r = /abc/gy;
+    assert("abcabcxabc".replace(r, "-"), "--xabc");
+
+    /* prefix with a leading capture and a partial match at the end */
+    a = /(ab)c(d)?/.exec("xabxab" + "abcd".repeat(3));
+    assert(a, ["abcd", "ab", "d"]);
+    assert(a.index, 6);
+    assert(/abcd/.exec("abcabcab"), null);
+    assert("xaxa\u0100aa".search(/aa/), 5);
+    assert("\u0100".repeat(100).search(/\u0100\u0101/), -1);
+    assert(("\u0100".repeat(100) + "\u0100\u0101").search(/\u0100\u0101/), 100);
+
+    /* case insensitive and unicode patterns keep the normal search */
+    assert("xxABC".search(/abc/i), 2);
+    assert("x\u{1F431}y".search(/\u{1F431}/u), 1);
+    for(i = 0; i < 2; i++) {
+        str = (i ? "\u4e00" : "") + "a".repeat(1000) + "b";
+        assert(str.search(/ab/), 999 + i);
+        assert(str.replace(/aab/g, "-").length, str.length - 2);
+    }
+}
+
+/* the leading alternative makes the backtracking matcher exceed its
+   budget, so the match is redone by the linear time matcher */
+function test_regexp_linear()
+{
+    var pad = "\u0100".repeat(30);
+
+    function exec_linear(src, flags, str) {
+        var r, a;
+        r = new RegExp("(?:\u0100|\u0100)*#|" + src, flags);
+        a = r.exec(pad + str);
+        if (a !== null)
+            a.index -= pad.length;
+        return a;
+    }
+
+    function check(src, flags, str, expected, index) {
+        var a = exec_linear(src, flags, str);
+        assert(a, expected);
+        assert(a.index, index);
+        /* same result with the backtracking matcher alone */
+        a = new RegExp(src, flags).exec(str);
+        assert(a, expected);
+        assert(a.index, index);
+    }
+
+    check("(a|aa)*b", "", "aaaaaab", ["aaaaaab", "a"], 0);
+    check("(a|ab)(c|bcd)(d*)", "", "xabcd", ["abcd", "a", "bcd", ""], 1);
+    check("(x+x+)+y", "", "xxxxy", ["xxxxy", "xxxx"], 0);
+    check("(z)((a+)?(b+)?(c))*", "", "zaacbbbcac",
+          ["zaacbbbcac", "z", "ac", "a", undefined, "c"], 0);
+
+    /* captures are reset at each iteration */
+    check("((a)|b)*c", "", "ababc", ["ababc", "b", undefined], 0);
+    check("(?:(a)|b|())*c", "", "abc", ["abc", undefined, undefined], 0);
+    check("(?:a|())*x", "", "aax", ["aax", undefined], 0);
+
+    /* empty iterations */
+    check("(a*)*b", "", "aaab", ["aaab", "aaa"], 0);
+    check("(a?)+b", "", "aab", ["aab", "a"], 0);
+    check("(a|)+?b", "", "aab", ["aab", "a"], 0);
+    check("(a?){2,3}b", "", "aab", ["aab", "a"], 0);
+    check("(?:x|()){2}y", "", "xyz", ["xy", ""], 0);
+    check("(?:(a)|b()){1,2}?c", "", "abc", ["abc", undefined, ""], 0);
+
+    /* lazy quantifiers and priorities */
+    check("(a+?)(a*)b", "", "aaab", ["aaab", "a", "aa"], 0);
+    check("(a*?)(a*?)c", "", "aac", ["aac", "", "aa"], 0);
+    check("(a|b)*?(b)", "", "aabb", ["aab", "a", "b"], 0);
+    check("(\\w+)\\s(\\w+)?", "", "foo  bar", ["foo ", "foo", undefined], 0);
+
+    /* flags */
+    check("^(\\w+)$", "m", "12 ab\ncd\nef", ["cd", "cd"], 6);
+    check("(A)(b)?", "i", "xaB", ["aB", "a", "B"], 1);
+    check("(\ud83d\udc31)(.)", "u", "\u{1F431}\u{1F436}",
+          ["\u{1F431}\u{1F436}", "\u{1F431}", "\u{1F436}"], 0);
+    check("(a)|(b)", "", "\u4e00b", ["b", undefined, "b"], 1);
+
+    assert(exec_linear("(a|aa)*b", "", "aaaa"), null);
+
+    /* nested nullable loops must not take exponential time */
+    var t = Date.now();
+    assert(/(?:(?:a?)+)+c/.test("a".repeat(26)), false);
+    assert(/^(a?){25}(a){25}$/.test("a".repeat(25)), true);
+    assert(/^(?:a?){2,30}b/.test("a".repeat(28)), false);
+    assert(Date.now() - t < 1000);
+    assert((pad + "abcbc").replace(new RegExp("(?:\u0100|\u0100)*#|(b)|(c)", "g"),
+                                   "[$1|$2]"),
+           pad + "a[b|][|c][b|][|c]");
+}
+
+function test_regexp_cache()
+{
+    var i, r1, r2, a, src;
+
+    /* same source with different flags must not share the bytecode */
+    for(i = 0; i < 2; i++) {
+        assert(new RegExp("a.c").test("a\nc"), false);
+        assert(new RegExp("a.c", "s").test("a\nc"), true);
+        assert(new RegExp("abc").test("ABC"), false);
+        assert(new RegExp("abc", "i").test("ABC"), true);
+        assert(new RegExp("^b", "").test("a\nb"), false);
+        assert(new RegExp("^b", "m").test("a\nb"), true);
+        assert(new RegExp("\\u{3}").test("uuu"), true);
+        assert(new RegExp("\\u{3}", "u").test("\x03"), true);
+        assert(new RegExp("^.$").test("\u{1F431}"), false);
+        assert(new RegExp("^.$", "u").test("\u{1F431}"), true);
+        assert(new RegExp("(?<a>x)\\k<a>", "d").exec("xx").indices[1][0], 0);
+        assert("aXbx".match("x").index, 3);
+        assert("aXbx".search("x"), 3);
+        assert("aXbx".search(/x/i), 1);
+    }
+
+    /* each regexp keeps its own lastIndex */
+    r1 = new RegExp("b", "g");
+    r2 = new RegExp("b", "g");
+    assert(r1 !== r2);
+    assert(r1.exec("abab").index, 1);
+    assert(r2.lastIndex, 0);
+    assert(r2.exec("abab").index, 1);
+    assert(r1.exec("abab").index, 3);
+    r2 = new RegExp("b", "y");
+    assert(r2.exec("abab"), null);
+    assert(r2.flags, "y");
+    assert(r1.flags, "g");
+
+    /* compile() switches the flags of an existing object */
+    r1 = /a.c/;
+    r1.compile("a.c", "s");
+    assert(r1.test("a\nc"), true);
+    r1.compile("a.c");
+    assert(r1.test("a\nc"), false);
+    assert(r1.source, "a.c");
+
+    /* literals evaluated many times, and the same source as a string */
+    for(i = 0; i < 3; i++) {
+        a = /(\d+)-(\d+)/.exec("x12-345");
+        assert(a, ["12-345", "12", "345"]);
+        a = new RegExp("(\\d+)-(\\d+)", "g");
+        assert("1-2 3-4".replace(a, "$2-$1"), "2-1 4-3");
+    }
+
+    /* compile errors are reported every time */
+    for(i = 0; i < 2; i++) {
+        assert_throws(SyntaxError, () => new RegExp("a(", ""));
+        assert_throws(SyntaxError, () => new RegExp("\\u{110000}", "u"));
+        assert(new RegExp("\\u{110000}").test("u".repeat(110000)), true);
+    }
+
+    /* long sources */
+    src = "(x)" + "a".repeat(600);
+    assert(new RegExp(src).test("x" + "a".repeat(600)), true);
+    assert(new RegExp(src, "i").test("X" + "A".repeat(600)), true);
+    assert(new RegExp(src).test("X" + "A".repeat(600)), false);
+}
+
+function test_regexp_class_loop()
+{
+    var l = "ab".repeat(20), w = "\u4e00".repeat(20), a;
+
+    /* the loop cannot give characters back to what follows */
+    assert(/[a-z]*\d/i.exec("xABC" + l.toUpperCase() + "1")[0],
+           "xABC" + l.toUpperCase() + "1");
+    assert(/[^a-z]*x/.exec("12AX" + l + "x").index, 44);
+    assert(/[^"]*"/.exec(l + "\u0100\"rest")[0], l + "\u0100\"");
+    assert(/[^"]*"/.exec(l + "\u0100"), null);
+    assert(/\d+$/.exec("123a"), null);
+    assert(/\d+$/m.exec("12a\n345\n6")[0], "345");
+    assert(/[^\n]*$/m.exec("ab\ncd")[0], "ab");
+    assert(/[^b]+$/m.exec("aa\nab\n")[0], "aa");
+
+    /* case insensitive loops that overlap with what follows */
+    assert(/[a-z]+z/i.exec("abcZ")[0], "abcZ");
+    assert(/\w+k/i.exec("KKK")[0], "KKK");
+    assert(/[^a-z]+X/i.exec("12x")[0], "12x");
+    assert(/[^a-z]+X/i.exec("12_X")[0], "12_X");
+    assert(/[a-f]*?g/i.exec(l + "G")[0], l + "G");
+    assert(/[\u00e0-\u00ff]+\u00c0/i.exec("\u00e0\u00e1\u00c0\u00e0")[0],
+           "\u00e0\u00e1\u00c0\u00e0");
+    assert(/[^\u0100-\u01ff]*\u0101/i.exec(l + "\u0100x")[0], l + "\u0100");
+
+    /* case folding differs with and without the unicode flag */
+    assert(/\u017F+s/iu.exec("\u017F\u017Fs")[0], "\u017F\u017Fs");
+    assert(/[\u017F]+s/i.exec("\u017F\u017Fs")[0], "\u017F\u017Fs");
+    assert(/[\u017F]+s/i.exec("sss"), null);
+    assert(/[a-z]+\u212A/iu.exec("abk")[0], "abk");
+    assert(/[a-z]+\u212A/i.exec("abk"), null);
+    assert(/[^k]+K/iu.exec("abKk")[0], "abK");
+
+    /* captures around the loop and global matching on 16 bit strings */
+    a = /(\w*)(\d)/.exec("abc" + l + "12");
+    assert(a, ["abc" + l + "12", "abc" + l + "1", "2"]);
+    assert(("xAyaz" + w + "A").match(/[^a]+/gi), ["x", "y", "z" + w]);
+}
+
 function test_symbol()
 {
     var a, b, obj, c;
@@ -902,6 +1251,99 @@ function test_map()
     test_map1("bigint", n);
 }
 
+function test_map_iterator()
+{
+    var a, b, i, n, it, r, keys, e;
+    n = 1000;
+
+    /* deleting and re-adding while iterating */
+    a = new Map();
+    for(i = 0; i < 10; i++)
+        a.set(i, i);
+    keys = [];
+    for(e of a) {
+        keys.push(e[0]);
+        if (e[0] < 10) {
+            a.delete(e[0]);
+            a.set(e[0] + 10, e[1]);
+        }
+    }
+    assert(keys.join(), "0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19");
+    assert(a.size, 10);
+    assert([...a.keys()].join(), "10,11,12,13,14,15,16,17,18,19");
+
+    /* re-adding a deleted key moves it to the end */
+    a = new Map([[1, "a"], [2, "b"], [3, "c"]]);
+    keys = [];
+    a.forEach(function (v, k) {
+        keys.push(k);
+        if (k === 1 && v === "a") {
+            a.delete(2);
+            a.delete(1);
+            a.set(1, "d");
+        }
+    });
+    assert(keys.join(), "1,3,1");
+    assert([...a].join(), "3,c,1,d");
+
+    /* live iterators survive the compaction of deleted entries */
+    a = new Map();
+    for(i = 0; i < n; i++)
+        a.set(i, i * 2);
+    it = a.entries();
+    for(i = 0; i < 10; i++)
+        it.next();
+    for(i = 0; i < n - 20; i++)
+        a.delete(i);
+    assert(a.size, 20);
+    for(i = 0; i < n; i++)
+        a.set(n + i, i);
+    for(i = 0; i < n; i++)
+        a.delete(n + i);
+    assert(a.size, 20);
+    r = it.next();
+    assert(r.value[0], n - 20);
+    assert(r.value[1], (n - 20) * 2);
+    keys = [];
+    for(;;) {
+        r = it.next();
+        if (r.done)
+            break;
+        keys.push(r.value[0]);
+    }
+    assert(keys.length, 19);
+    assert(keys[18], n - 1);
+    assert(it.next().done);
+    a.set(-1, 0);
+    assert(it.next().done);
+
+    /* size and order after clear and compaction */
+    b = new Set();
+    for(i = 0; i < n; i++)
+        b.add("k" + i);
+    for(i = 0; i < n; i += 2)
+        b.delete("k" + i);
+    assert(b.size, n / 2);
+    assert(b.has("k1"));
+    assert(!b.has("k0"));
+    for(i = 0; i < n; i += 2)
+        b.add("k" + i);
+    assert(b.size, n);
+    keys = [...b];
+    assert(keys[0], "k1");
+    assert(keys[n / 2 - 1], "k" + (n - 1));
+    assert(keys[n / 2], "k0");
+    assert(keys[n - 1], "k" + (n - 2));
+    it = b.values();
+    it.next();
+    b.clear();
+    assert(b.size, 0);
+    assert(it.next().done);
+    b.add("x");
+    assert(b.size, 1);
+    assert([...b].join(), "x");
+}
+
 function test_weak_map()
 {
     var a, i, n, tab, o, v, n2;
@@ -1080,12 +1522,174 @@ function rope_concat(n, dir)
     }
 }
 
+/* build a rope from 'parts' with concatenations in both directions */
+function rope_build(parts)
+{
+    var i, s, mid = parts.length >> 1;
+    s = "";
+    for(i = mid; i < parts.length; i++)
+        s += parts[i];
+    for(i = mid - 1; i >= 0; i--)
+        s = parts[i] + s;
+    return s;
+}
+
+function rope_parts(n, wide)
+{
+    var parts = [], i, j, str;
+    for(i = 0; i < n; i++) {
+        str = "";
+        for(j = 0; j < 600 + i % 7; j++)
+            str += String.fromCharCode(97 + (i * 7 + j) % 26);
+        if (wide && i % 3 == 0)
+            str = "\u{1F600}" + str + "\ud83d"; /* pair split at the end */
+        else if (wide && i % 3 == 1)
+            str = "\ude00" + str;
+        parts.push(str);
+    }
+    return parts;
+}
+
+function test_rope_access()
+{
+    var parts, s, ref, i, pos, p1, p2;
+
+    for(var wide = 0; wide < 2; wide++) {
+        parts = rope_parts(41, wide);
+        s = rope_build(parts);
+        ref = parts.join("");
+        assert(s.length, ref.length);
+        for(i = 0; i < ref.length; i += 37) {
+            if (s.charCodeAt(i) !== ref.charCodeAt(i))
+                assert(s.charCodeAt(i), ref.charCodeAt(i));
+            if (s[i] !== ref[i] || s.charAt(i) !== ref.charAt(i))
+                assert(s[i], ref[i]);
+        }
+        /* sequential and backward accesses use the cached leaf */
+        for(i = ref.length - 1; i >= 0; i -= 5) {
+            if (s.codePointAt(i) !== ref.codePointAt(i))
+                assert(s.codePointAt(i), ref.codePointAt(i));
+        }
+        assert(s.at(-1), ref.at(-1));
+        assert(s.at(ref.length), undefined);
+        assert(s.charCodeAt(-1), NaN);
+        assert(s[ref.length], undefined);
+
+        /* searches crossing the leaf boundaries */
+        pos = 0;
+        for(i = 0; i < parts.length - 1; i++) {
+            pos += parts[i].length;
+            p1 = ref.substring(pos - 3, pos + 4);
+            assert(s.indexOf(p1), ref.indexOf(p1));
+            assert(s.indexOf(p1, pos - 2), ref.indexOf(p1, pos - 2));
+            assert(s.includes(p1), true);
+            assert(s.lastIndexOf(p1), ref.lastIndexOf(p1));
+            assert(s.startsWith(p1, pos - 3), true);
+            assert(s.endsWith(p1, pos + 4), true);
+        }
+        p2 = ref.substring(100, 2000);
+        assert(s.indexOf(p2), 100);
+        assert(s.includes(p2 + "#"), false);
+        assert(s.endsWith(ref.substring(ref.length - 700)), true);
+        assert(s.startsWith(ref.substring(0, 1500)), true);
+
+        /* conversions and flattening */
+        assert(encodeURIComponent(s), encodeURIComponent(ref));
+        assert(JSON.stringify(s), JSON.stringify(ref));
+        assert(s === ref, true);
+        assert(s + s, ref + ref);
+        assert((s + "x").length, ref.length + 1);
+        assert(s.split("").length, ref.length);
+        assert([...s].join(""), ref);
+        assert(/abc(def)/.exec(s)[1], "def");
+    }
+}
+
+function test_rope_slice()
+{
+    var parts, s, ref, i, seed, a, b, t, len;
+
+    seed = 1;
+    function rand(n) {
+        seed = (seed * 1103515245 + 12345) & 0x7fffffff;
+        return seed % n;
+    }
+    for(var wide = 0; wide < 2; wide++) {
+        parts = rope_parts(41, wide);
+        s = rope_build(parts);
+        ref = parts.join("");
+        len = ref.length;
+        for(i = 0; i < 300; i++) {
+            a = rand(len + 1);
+            b = a + rand(i < 150 ? 40 : len - a + 1);
+            t = s.slice(a, b);
+            if (t !== ref.slice(a, b))
+                assert(t, ref.slice(a, b));
+            /* slices of slices */
+            if (t.slice(3, -3) !== ref.slice(a, b).slice(3, -3))
+                assert(t.slice(3, -3), ref.slice(a, b).slice(3, -3));
+            if (t.length > 0 && t.charCodeAt(t.length - 1) !== ref.charCodeAt(b - 1))
+                assert(t.charCodeAt(t.length - 1), ref.charCodeAt(b - 1));
+        }
+        assert(s.slice(0), ref);
+        assert(s.slice(-1000), ref.slice(-1000));
+        assert(s.slice(len), "");
+        assert(s.substring(2000, 100), ref.substring(100, 2000));
+        assert(s.substr(-3000, 2500), ref.substr(-3000, 2500));
+        assert(s.slice(100, len - 100) + s.slice(len - 100) + "!",
+               ref.slice(100) + "!");
+        t = s.slice(1000, 20000);
+        assert(t.indexOf(ref.substring(5000, 5010)),
+               ref.slice(1000, 20000).indexOf(ref.substring(5000, 5010)));
+        assert(t.at(-1), ref.slice(1000, 20000).at(-1));
+    }
+}
+
 function test_rope()
 {
     rope_concat(100000, 1);
     rope_concat(100000, -1);
 }
 
+/* large substrings of flat strings reference their parent */
+function test_substring_view()
+{
+    var a, s, s1, w, w1, o, i;
+
+    a = [];
+    for(i = 0; i < 5000; i++)
+        a.push(String.fromCharCode(97 + i % 26));
+    s = a.join("");
+    s1 = s.slice(100, 4100);
+    assert(s1.length, 4000);
+    assert(s1[0], "w");
+    assert(s1.charCodeAt(3999), 97 + 4099 % 26);
+    assert(s1.substring(1000, 3000), s.substr(1100, 2000));
+    assert(s1.slice(1000, 3000).slice(10, 1000), s.slice(1110, 2100));
+    assert(s1.indexOf("abc", 10), 30);
+    assert(s1.lastIndexOf("z"), 3981);
+    assert((s1 + "!").length, 4001);
+    assert(JSON.parse(JSON.stringify(s1)), s1);
+    assert(/xyz(ab)c/.exec(s1)[1], "ab");
+    assert(s1.split("a").length, 155);
+    assert(s1.replace(/a/g, "A").indexOf("a"), -1);
+    assert(s1.toUpperCase().toLowerCase(), s1);
+    o = {};
+    o[s1] = 1;
+    assert(Object.keys(o)[0], s1);
+    assert(o[s.slice(100, 4100)], 1);
+
+    w = "\u0100" + s;
+    w1 = w.slice(1000, 5000);
+    assert(w1, s.slice(999, 4999));
+    w1 = w.slice(0, 3000);
+    assert(w1.charCodeAt(0), 0x100);
+    assert(w1.slice(1), s.slice(0, 2999));
+    assert(w1.substr(0, 1000) + w1.substr(1000), w1);
+    assert(w1.isWellFormed(), true);
+    assert(w1.toWellFormed(), w1);
+}
+
 function eval_error(eval_str, expected_error, level)
 {
     var err = false;
@@ -1175,6 +1779,7 @@ test_function();
 test_enum();
 test_array();
 test_string();
+test_string_search();
 test_math();
 test_number();
 test_eval();
@@ -1182,12 +1787,20 @@ test_typed_array();
 test_json();
 test_date();
 test_regexp();
+test_regexp_prefix();
+test_regexp_linear();
+test_regexp_cache();
+test_regexp_class_loop();
 test_symbol();
 test_map();
+test_map_iterator();
 test_weak_map();
 test_weak_map_cycles();
 test_weak_ref();
 test_finalization_registry();
 test_generator();
 test_rope();
+test_rope_access();
+test_rope_slice();
+test_substring_view();
 test_line_column_numbers();
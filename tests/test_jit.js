@@ -0,0 +1,359 @@
+function assert(actual, expected, message) {
+    if (arguments.length == 1)
+        expected = true;
+
+    if (Object.is(actual, expected))
+        return;
+
+    if (actual !== null && expected !== null
+    &&  typeof actual == 'object' && typeof expected == 'object'
+    &&  actual.toString() === expected.toString())
+        return;
+
+    throw Error("assertion failed: got |" + actual + "|" +
+                ", expected |" + expected + "|" +
+                (message ? " (" + message + ")" : ""));
+}
+
+function assert_throws(expected_error, func)
+{
+    var err = false;
+    try {
+        func();
+    } catch(e) {
+        err = true;
+        if (!(e instanceof expected_error)) {
+            throw Error("unexpected exception type");
+        }
+    }
+    if (!err) {
+        throw Error("expected exception");
+    }
+}
+
+/* These tests are run by every build. With CONFIG_JIT, a function is
+   compiled after JIT_THRESHOLD calls or backward branches, so each test
+   makes its function hot before changing the types or throwing. */
+var JIT_THRESHOLD = 1000;
+var N = 3 * JIT_THRESHOLD;
+
+/*----------------*/
+
+function test_int_arith()
+{
+    function f(a, b) {
+        return (a + b) * 2 - (a - b);
+    }
+    var i, s = 0;
+    for(i = 0; i < N; i++)
+        s += f(i, 1);
+    assert(s, N * (N - 1) / 2 + 3 * N);
+
+    /* int32 overflow in a compiled function */
+    assert(f(0x7fffffff, 0x7fffffff), 0x7fffffff * 4);
+    assert(f(-0x80000000, -1), (-0x80000001) * 2 + 0x7fffffff);
+    /* other types at the same sites */
+    assert(f(1.5, 0.25), 3.5 - 1.25);
+    assert(f("a", 1), NaN);
+    assert(f({ valueOf() { return 3; } }, 1), 6);
+    assert(Object.is(f(-0, 0), 0));
+    assert(f(2, 1), 5);
+
+    function add(a, b) {
+        return a + b;
+    }
+    for(i = 0; i < N; i++)
+        add(i, i);
+    assert(add(1n, 2n), 3n);
+    assert(add("a", 1), "a1");
+    assert(add(0.1, 0.2), 0.1 + 0.2);
+    assert(add(-0, -0), -0);
+    assert(add(1, 2), 3);
+}
+
+function test_loop_type_change()
+{
+    var i, s, x;
+    /* the loop variable changes type in the middle of a compiled loop */
+    s = 0;
+    x = 0;
+    for(i = 0; i < N; i++) {
+        if (i == 2 * JIT_THRESHOLD)
+            x = 0.5;
+        else if (i == 2 * JIT_THRESHOLD + 10)
+            x = "1";
+        s = s + x;
+        if (typeof s == "string")
+            s = s.length;
+    }
+    assert(s, 2);
+
+    /* int32 counter overflowing to float64 */
+    x = 0x7fffffff - 2 * JIT_THRESHOLD;
+    for(i = 0; i < N; i++)
+        x++;
+    assert(x, 0x7fffffff + JIT_THRESHOLD);
+}
+
+function test_compare()
+{
+    function lt(a, b) { return a < b; }
+    function cnt(a, b) {
+        var c = 0;
+        if (a < b) c |= 1;
+        if (a <= b) c |= 2;
+        if (a > b) c |= 4;
+        if (a >= b) c |= 8;
+        if (a == b) c |= 16;
+        if (a === b) c |= 32;
+        return c;
+    }
+    var i, c = 0;
+    for(i = 0; i < N; i++) {
+        if (lt(i, JIT_THRESHOLD))
+            c++;
+    }
+    assert(c, JIT_THRESHOLD);
+    for(i = 0; i < N; i++)
+        cnt(i, i & 1);
+    assert(cnt(1, 2), 3);
+    assert(cnt(2, 2), 2 | 8 | 16 | 32);
+    assert(cnt(NaN, 1), 0);
+    assert(cnt(1, NaN), 0);
+    assert(cnt(-0, 0), 2 | 8 | 16 | 32);
+    assert(cnt("10", "9"), 1 | 2);
+    assert(cnt("10", 9), 4 | 8);
+    assert(cnt(1n, 1), 2 | 8 | 16);
+    assert(cnt(undefined, null), 16);
+}
+
+function test_field_ic()
+{
+    function get_x(o) { return o.x; }
+    function set_x(o, v) { o.x = v; }
+    var i, o, s;
+    o = { x: 1, y: 2 };
+    s = 0;
+    for(i = 0; i < N; i++) {
+        set_x(o, i);
+        s += get_x(o);
+    }
+    assert(s, N * (N - 1) / 2);
+
+    /* other shapes at the same sites */
+    assert(get_x({ y: 1, x: 2 }), 2);
+    assert(get_x({}), undefined);
+    assert(get_x(Object.create({ x: 3 })), 3);
+    assert(get_x({ get x() { return 4; } }), 4);
+    assert(get_x("str"), undefined);
+    assert(get_x([1]), undefined);
+    o = { x: 1 };
+    delete o.x;
+    assert(get_x(o), undefined);
+    o = Object.freeze({ x: 1 });
+    set_x(o, 5);
+    assert(o.x, 1);
+    o = { set x(v) { this.y = v * 2; } };
+    set_x(o, 5);
+    assert(o.y, 10);
+    assert_throws(TypeError, () => get_x(null));
+    assert_throws(TypeError, () => set_x(undefined, 1));
+}
+
+function test_array_access()
+{
+    function sum(a) {
+        var i, s = 0;
+        for(i = 0; i < a.length; i++)
+            s += a[i];
+        return s;
+    }
+    function fill(a, n) {
+        for(var i = 0; i < n; i++)
+            a[i] = i;
+        return a;
+    }
+    var i, a = fill([], N);
+    assert(sum(a), N * (N - 1) / 2);
+
+    /* holes, out of bounds, non arrays and typed arrays */
+    a = [1, , 3];
+    assert(sum(a), NaN);
+    assert(sum([1.5, 2.5]), 4);
+    assert(sum("123"), "0123");
+    assert(sum({ length: 2, 0: 5, 1: 6 }), 11);
+    assert(sum(fill(new Int32Array(10), 10)), 45);
+    assert(sum(fill(new Float64Array(4), 4)), 6);
+    Array.prototype[1] = 100;
+    assert(sum([1, , 3]), 104);
+    delete Array.prototype[1];
+    a = fill([], 10);
+    Object.defineProperty(a, 5, { get() { return 1000; } });
+    assert(sum(a), 40 + 1000);
+    a = fill([], 10);
+    a.length = 5;
+    assert(sum(a), 10);
+    assert(a[7], undefined);
+    for(i = 0; i < N; i++)
+        a = fill([], 3);
+    assert(a.length, 3);
+}
+
+function test_global_var()
+{
+    function inc() { global_counter++; }
+    var i;
+    /* configurable global property */
+    globalThis.global_counter = 0;
+    for(i = 0; i < N; i++)
+        inc();
+    assert(global_counter, N);
+    /* the global variable becomes an accessor */
+    var v = 0;
+    Object.defineProperty(globalThis, "global_counter", {
+        get() { return v; },
+        set(x) { v = x * 2; },
+        configurable: true,
+    });
+    inc();
+    assert(v, 2);
+    delete globalThis.global_counter;
+    assert_throws(ReferenceError, () => { "use strict"; inc2(); });
+    function inc2() { global_counter_undefined++; }
+}
+
+function test_closure_var()
+{
+    function make() {
+        var n = 0;
+        return {
+            inc() { n++; },
+            get() { return n; },
+            set(v) { n = v; },
+        };
+    }
+    var c = make(), i;
+    for(i = 0; i < N; i++)
+        c.inc();
+    assert(c.get(), N);
+    c.set("a");
+    c.inc();
+    assert(c.get(), NaN);
+    c.set(1.5);
+    c.inc();
+    assert(c.get(), 2.5);
+}
+
+function test_exceptions()
+{
+    var i, c, caught;
+    function thrower(i) {
+        if (i == 2 * JIT_THRESHOLD)
+            throw new RangeError("at " + i);
+        return i;
+    }
+    function loop() {
+        var s = 0;
+        for(var i = 0; i < N; i++)
+            s += thrower(i);
+        return s;
+    }
+    try {
+        loop();
+        assert(false);
+    } catch(e) {
+        assert(e instanceof RangeError);
+        assert(e.message, "at " + 2 * JIT_THRESHOLD);
+        assert(e.stack.includes("thrower"));
+        assert(e.stack.includes("loop"));
+    }
+
+    /* try/catch/finally in a compiled loop */
+    c = 0;
+    caught = 0;
+    for(i = 0; i < N; i++) {
+        try {
+            if (i % 100 == 99)
+                null.x;
+            c++;
+        } catch(e) {
+            assert(e instanceof TypeError);
+            caught++;
+        } finally {
+            c++;
+        }
+    }
+    assert(caught, N / 100);
+    assert(c, 2 * N - N / 100);
+
+    /* exception from a getter and a valueOf called by compiled code */
+    function add1(o) { return o + 1; }
+    for(i = 0; i < N; i++)
+        add1(i);
+    assert_throws(SyntaxError, () => add1({ valueOf() { throw new SyntaxError(); } }));
+    assert(add1(1), 2);
+
+    /* break and continue out of a try block */
+    c = 0;
+    for(i = 0; i < N; i++) {
+        try {
+            if (i & 1)
+                continue;
+            if (i == N - 2)
+                break;
+            c++;
+        } finally {
+            c++;
+        }
+    }
+    assert(c, 3 * N / 2 - 2);
+}
+
+function test_stack_overflow()
+{
+    function rec(n) {
+        return rec(n + 1) + 1;
+    }
+    function sum_rec(n) {
+        return n == 0 ? 0 : n + sum_rec(n - 1);
+    }
+    var i;
+    for(i = 0; i < N; i++)
+        sum_rec(10);
+    assert_throws(InternalError, () => rec(0));
+    /* the compiled code still works after the overflow */
+    assert(sum_rec(50), 1275);
+    assert_throws(InternalError, () => rec(0));
+}
+
+function test_arguments_and_calls()
+{
+    function f(a, b, c) {
+        return arguments.length + (c === undefined ? 0 : c);
+    }
+    function g() {
+        var s = 0;
+        for(var i = 0; i < N; i++)
+            s += f(i, i) + f(1, 2, 3) + f();
+        return s;
+    }
+    assert(g(), N * (2 + 6 + 0));
+    var o = { m(x) { return this.k + x; }, k: 1 };
+    var s = 0;
+    for(var i = 0; i < N; i++)
+        s += o.m(1);
+    assert(s, 2 * N);
+    o.m = function (x) { return x; };
+    assert(o.m(5), 5);
+}
+
+test_int_arith();
+test_loop_type_change();
+test_compare();
+test_field_ic();
+test_array_access();
+test_global_var();
+test_closure_var();
+test_exceptions();
+test_stack_overflow();
+test_arguments_and_calls();
@@ -442,6 +442,90 @@ function test_spread()
     assert(Object.getOwnPropertyNames(x).toString(), "0,length");
 }
 
+function test_spread_call()
+{
+    var a, o, args, f, r, it_count, saved;
+
+    function g() { return Array.prototype.slice.call(arguments); }
+    function h(x = (a.length = 0), ...rest) { return rest; }
+
+    /* holes are read as undefined */
+    a = [1, , 3];
+    assert(g(...a).length, 3);
+    assert(g(...a)[1], undefined);
+    assert(1 in g(...a), true);
+    assert(g.apply(null, a)[1], undefined);
+    assert(Reflect.apply(g, null, a).length, 3);
+    a = [];
+    a[5] = 1;
+    assert(g(...a).length, 6);
+    assert(Math.max.apply(null, [1, , 3]), NaN);
+
+    /* holes are looked up in the prototype */
+    Array.prototype[1] = "p";
+    try {
+        assert(g(...[0, , 2]).join(), "0,p,2");
+        assert(g.apply(null, [0, , 2]).join(), "0,p,2");
+    } finally {
+        delete Array.prototype[1];
+    }
+
+    /* getters */
+    a = [1, 2, 3];
+    Object.defineProperty(a, 1, { get: function() { return "g"; } });
+    assert(g(...a).join(), "1,g,3");
+    assert(g.apply(null, a).join(), "1,g,3");
+
+    /* array-likes and iterables */
+    o = { length: 3, 0: "a", 2: "c" };
+    assert(g.apply(null, o).join(), "a,,c");
+    assert(Reflect.apply(g, null, o).length, 3);
+    assert(g(..."abc").join(), "a,b,c");
+    assert(g(...new Set([1, 2])).join(), "1,2");
+    assert(g(...new Uint8Array([4, 5])).join(), "4,5");
+    assert(g(1, ...[], 2, ...[3]).join(), "1,2,3");
+    assert_throws(TypeError, () => g(...{ length: 1 }));
+    assert_throws(TypeError, () => g.apply(null, 1));
+
+    /* a modified iterator is used */
+    a = [1, 2, 3];
+    it_count = 0;
+    saved = Array.prototype[Symbol.iterator];
+    Array.prototype[Symbol.iterator] = function *() {
+        it_count++;
+        yield "x";
+    };
+    try {
+        assert(g(...a).join(), "x");
+    } finally {
+        Array.prototype[Symbol.iterator] = saved;
+    }
+    assert(it_count, 1);
+    a[Symbol.iterator] = function *() { yield* [9, 8]; };
+    assert(g(...a).join(), "9,8");
+
+    /* the callee can modify the array holding its arguments */
+    a = [undefined, 5, 6];
+    assert(h.apply(null, a).join(), "5,6");
+    a = [undefined, 5, 6];
+    assert(Reflect.apply(h, null, a).join(), "5,6");
+    a = [undefined, 5, 6];
+    assert(h(...a).join(), "5,6");
+
+    /* spread in new and in method calls */
+    function C(x, y) { this.s = x + y; }
+    assert(new C(...[1, 2]).s, 3);
+    o = { v: 10, m(a, b) { return this.v + a + b; } };
+    assert(o.m(...[1, 2]), 13);
+    args = [];
+    for(r = 0; r < 1000; r++)
+        args.push(r);
+    assert(Math.max(...args), 999);
+    assert(Math.max.apply(null, args), 999);
+    f = function() { return arguments.length; };
+    assert(f(...args, ...args), 2000);
+}
+
 function test_function_length()
 {
     assert( ((a, b = 1, c) => {}).length, 1);
@@ -664,6 +748,414 @@ function test_global_var_opt()
     assert(gvar1, 5);
 }
 
+/* check that the property inline caches follow the shape changes */
+function test_inline_cache()
+{
+    var P, o, a, i, tab;
+    function get_x(o) { return o.x; }
+    function put_x(o, v) { o.x = v; }
+
+    P = { x: 10 };
+    o = Object.create(P);
+    for(i = 0; i < 3; i++)
+        assert(get_x(o), 10);
+    o.x = 5;
+    assert(get_x(o), 5);
+    delete o.x;
+    assert(get_x(o), 10);
+    P.x = 20;
+    assert(get_x(o), 20);
+    Object.defineProperty(P, "x", { get: function() { return 30; } });
+    assert(get_x(o), 30);
+    Object.setPrototypeOf(o, { x: 40 });
+    assert(get_x(o), 40);
+    Object.setPrototypeOf(o, new Proxy({}, { get: function() { return 50; } }));
+    assert(get_x(o), 50);
+
+    a = { x: 1 };
+    for(i = 0; i < 3; i++)
+        put_x(a, i);
+    assert(a.x, 2);
+    Object.freeze(a);
+    put_x(a, 3);
+    assert(a.x, 2);
+
+    /* polymorphic site */
+    tab = [ { x: 1 }, { y: 0, x: 2 }, { z: 0, x: 3 }, { w: 0, x: 4 },
+            { v: 0, x: 5 }, [] ];
+    tab[5].x = 6;
+    for(i = 0; i < 3 * tab.length; i++)
+        assert(get_x(tab[i % tab.length]), (i % tab.length) + 1);
+
+    /* deleting many properties compacts the shape */
+    o = {};
+    for(i = 0; i < 20; i++)
+        o["p" + i] = i;
+    for(i = 0; i < 3; i++)
+        assert(get_x(o), undefined);
+    o.x = 21;
+    assert(get_x(o), 21);
+    for(i = 0; i < 15; i++)
+        delete o["p" + i];
+    assert(get_x(o), 21);
+}
+
+/* the calls in tail position of strict mode functions reuse the stack
+   frame unless qjs is run with --no-tail-calls */
+function test_tail_calls()
+{
+    "use strict";
+    var n = 100000, tail_calls, o, r;
+
+    function sum(n, acc) {
+        if (n == 0)
+            return acc;
+        return sum(n - 1, acc + n);
+    }
+    function is_even(n) { return n == 0 ? true : is_odd(n - 1); }
+    function is_odd(n) { return n == 0 ? false : is_even(n - 1); }
+    function count(n, a, b, c) {
+        /* the callee has more arguments and locals than the caller */
+        if (n == 0)
+            return [a, b, c].join();
+        return count2(n - 1, a);
+    }
+    function count2(n, a) {
+        var x = a + 1, y = x * 2;
+        return count(n, x, y, arguments.length);
+    }
+
+    try {
+        sum(n, 0);
+        tail_calls = true;
+    } catch(e) {
+        /* stack overflow */
+        if (!(e instanceof InternalError))
+            throw e;
+        tail_calls = false;
+    }
+    assert(sum(100, 0), 5050);
+    assert(is_even(101), false);
+    assert(count(10, 0), "10,20,2");
+    if (tail_calls) {
+        assert(sum(n, 0), n * (n + 1) / 2);
+        assert(is_even(n), true);
+        assert(is_odd(n + 1), true);
+        assert(count(n, 0), [n, 2 * n, 2].join());
+    } else {
+        assert_throws(InternalError, () => is_even(n));
+    }
+
+    /* method calls keep their 'this' */
+    o = {
+        v: 3,
+        m(n) { return n == 0 ? this.v : this.m(n - 1); },
+    };
+    assert(o.m(tail_calls ? n : 100), 3);
+
+    /* calls to native, bound and generator functions */
+    function call_native(a) { return Math.max(a, 2); }
+    function call_bound(a) { return sum.bind(null, a)(0); }
+    function call_gen() { return (function *() { yield 1; })(); }
+    assert(call_native(1), 2);
+    assert(call_bound(4), 10);
+    assert(call_gen().next().value, 1);
+
+    /* exceptions go through the reused frames */
+    function thrower(n) {
+        if (n == 0)
+            throw new Error("tail");
+        return thrower(n - 1);
+    }
+    function catcher() {
+        try {
+            return thrower(10);
+        } catch(e) {
+            return e.message;
+        }
+    }
+    assert(catcher(), "tail");
+    assert_throws(TypeError, () => { class C {}; return C(); });
+
+    /* non strict functions keep a frame per call */
+    r = (new Function("var f = function(n) { return n == 0 ? 0 : f(n - 1); }; return f;"))();
+    assert(r(100), 0);
+}
+
+/* the variables of disjoint block scopes may share their slot (-s
+   option of qjs) */
+function test_block_scope_slots()
+{
+    var fs, r, g, i;
+
+    {
+        let a = 1, b = "b";
+        assert(a + b, "1b");
+    }
+    {
+        let c;
+        const d = 2;
+        assert(c, undefined);
+        assert(d, 2);
+    }
+    {
+        let e = { x: 1 };
+        assert(e.x, 1);
+    }
+    {
+        r = false;
+        try {
+            f = 3;
+        } catch(e) {
+            r = e instanceof ReferenceError;
+        }
+        assert(r, true);
+        r = false;
+        try {
+            g = h + 1;
+        } catch(e) {
+            r = e instanceof ReferenceError;
+        }
+        assert(r, true);
+        let f = 4, h = 5;
+        assert(f + h, 9);
+    }
+
+    /* closures capture their own variable */
+    fs = [];
+    {
+        let a = "a";
+        fs.push(() => a);
+    }
+    {
+        let t = "t";
+        let b = "b";
+        fs.push(() => b);
+        t += b;
+        assert(t, "tb");
+    }
+    {
+        let c = "c";
+        fs.push(function() { return c; });
+        c = "C";
+    }
+    assert(fs.map(f => f()).join(""), "abC");
+
+    fs = [];
+    for(i = 0; i < 3; i++) {
+        {
+            let x = i * 2;
+            assert(x, i * 2);
+        }
+        {
+            let y;
+            assert(y, undefined);
+            let z = i;
+            fs.push(() => z);
+        }
+    }
+    assert(fs.map(f => f()).join(), "0,1,2");
+
+    switch(1) {
+    case 0:
+        let k = 0;
+        break;
+    case 1:
+        r = false;
+        try {
+            k = 1;
+        } catch(e) {
+            r = e instanceof ReferenceError;
+        }
+        assert(r, true);
+        break;
+    }
+
+    function *gen() {
+        {
+            let a = 1;
+            yield a;
+        }
+        {
+            let b;
+            yield b;
+            b = 2;
+            yield b;
+        }
+    }
+    assert([...gen()].join(), "1,,2");
+
+    /* captured and non captured variables of disjoint scopes: the
+       captured ones keep their slot and the others are packed around
+       them */
+    function make() {
+        var fs = [];
+        {
+            let u1 = 1;
+            let a = "a";
+            let u2 = u1 + 1;
+            fs.push(() => a + u2);
+        }
+        {
+            let v1 = 10;
+            {
+                let b = "b";
+                let v2 = v1 * 2;
+                fs.push(() => b + v2);
+                b = "B";
+            }
+            {
+                let w = v1 + 1;
+                let c = "c" + w;
+                fs.push(() => c);
+            }
+        }
+        {
+            let x;
+            let d = "d";
+            /* captured by a nested closure */
+            fs.push(() => () => d + x);
+            x = 5;
+        }
+        {
+            let y = 7;
+            fs.push(() => y++);
+        }
+        return fs;
+    }
+    fs = make();
+    assert(fs[0](), "a2");
+    assert(fs[1](), "B20");
+    assert(fs[2](), "c11");
+    assert(fs[3]()(), "d5");
+    assert(fs[4](), 7);
+    assert(fs[4](), 8);
+    /* each call has its own variables */
+    g = make();
+    assert(g[4](), 7);
+    assert(fs[4](), 9);
+
+    /* closures capturing the variables of disjoint loop bodies */
+    fs = [];
+    for(let j = 0; j < 2; j++) {
+        let p = j;
+        fs.push(() => p);
+    }
+    for(let j = 10; j < 12; j++) {
+        let q = j, unused = j * 2;
+        assert(unused, 2 * q);
+        fs.push(() => q);
+    }
+    for(const s of ["s"]) {
+        fs.push(() => s);
+    }
+    assert(fs.map(f => f()).join(), "0,1,10,11,s");
+
+    /* function declarations in disjoint blocks */
+    fs = [];
+    {
+        let n = 1;
+        function fa() { return n; }
+        fs.push(fa);
+    }
+    {
+        let m = 2;
+        function fb() { return m * 10; }
+        fs.push(fb);
+    }
+    assert(fs[0]() + fs[1](), 21);
+
+    /* variables of disjoint catch clauses */
+    fs = [];
+    try {
+        throw 1;
+    } catch(e1) {
+        let t = e1 + 1;
+        fs.push(() => e1 + t);
+    }
+    try {
+        throw 10;
+    } catch(e2) {
+        let t = e2;
+        assert(t, 10);
+    }
+    assert(fs[0](), 3);
+}
+
+/* check the folding of the operators applied to literals */
+function test_const_fold()
+{
+    var a, f;
+
+    assert(typeof 1, "number");
+    assert(typeof "a", "string");
+    assert(typeof null, "object");
+    assert(typeof undefined, "undefined");
+    assert(typeof true, "boolean");
+    assert(typeof typeof 1, "string");
+    a = typeof 1.5;
+    assert(a, "number");
+
+    assert(-1, 0 - 1);
+    assert(Object.is(-0, 0 * -1), true);
+    assert(-"3", -3);
+    assert(-"x", NaN);
+    assert(+"12", 12);
+    assert(+"", 0);
+    assert(+"0x10", 16);
+    assert(+1.5, 1.5);
+    assert(!0, true);
+    assert(!"", true);
+    assert(!"a", false);
+    assert(!!1, true);
+    assert(~5, -6);
+    assert(~"7", -8);
+    assert(~1.5, -2);
+    assert(-(-2147483648), 2147483648);
+
+    assert(1 + 2, 3);
+    assert("a" + "b", "ab");
+    assert("a" + 1, "a1");
+    assert(1 + "a", "1a");
+    assert(0.1 + 0.2, 0.30000000000000004);
+    assert(2147483647 + 1, 2147483648);
+    assert(7 - "2", 5);
+    assert(6 * 7, 42);
+    assert(1 / 0, Infinity);
+    assert(Object.is(0 / -1, -0), true);
+    assert(-7 % 3, -1);
+    assert(2 ** 10, 1024);
+    assert(1 << 31, -2147483648);
+    assert(-8 >> 1, -4);
+    assert(-1 >>> 0, 4294967295);
+    assert(6 & 3, 2);
+    assert(6 | 3, 7);
+    assert(6 ^ 3, 5);
+    assert(1 < 2, true);
+    assert("b" <= "a", false);
+    assert("10" > "9", false);
+    assert(10 >= "9", true);
+    assert(1 == "1", true);
+    assert(null == undefined, true);
+    assert(1 != 1, false);
+    assert(1 === "1", false);
+    assert(NaN !== NaN, true);
+    assert("a" + "b" + 1 + 2, "ab12");
+    assert(1 + 2 + "a", "3a");
+
+    assert(`abc`, "abc");
+    assert(`a${1}b${"c"}d`, "a1bcd");
+    assert(`${1 + 2}`, "3");
+    assert(`${null}${undefined}${true}`, "nullundefinedtrue");
+    assert(`x${"y" + "z"}`, "xyz");
+    a = 2;
+    assert(`x${a}${1}`, "x21");
+
+    /* operators raising an exception are not folded */
+    f = function() { return 1n + 1; };
+    assert_throws(TypeError, f);
+}
+
 test_op1();
 test_cvt();
 test_eq();
@@ -682,6 +1174,7 @@ test_labels();
 test_labels2();
 test_destructuring();
 test_spread();
+test_spread_call();
 test_function_length();
 test_argument_scope();
 test_function_expr_name();
@@ -690,3 +1183,7 @@ test_optional_chaining();
 test_parse_arrow_function();
 test_unicode_ident();
 test_global_var_opt();
+test_inline_cache();
+test_const_fold();
+test_block_scope_slots();
+test_tail_calls();
@@ -0,0 +1,277 @@
+function assert(actual, expected, message) {
+    if (arguments.length == 1)
+        expected = true;
+
+    if (Object.is(actual, expected))
+        return;
+
+    if (actual !== null && expected !== null
+    &&  typeof actual == 'object' && typeof expected == 'object'
+    &&  actual.toString() === expected.toString())
+        return;
+
+    throw Error("assertion failed: got |" + actual + "|" +
+                ", expected |" + expected + "|" +
+                (message ? " (" + message + ")" : ""));
+}
+
+/* The interpreter rewrites add, sub, lt, lte, gt, gte and get_array_el
+   to an int32 variant after running them once with int32 operands. Each
+   test runs the same code with int32 operands first, then with other
+   types so that the quickened opcode reverts, then with int32 operands
+   again. */
+var N = 100;
+
+/*----------------*/
+
+function test_arith_type_flip()
+{
+    function add(a, b) { return a + b; }
+    function sub(a, b) { return a - b; }
+    var i, vals, j;
+    vals = [
+        [ 1, 2, 3, -1 ],
+        [ 0x7fffffff, 1, 0x80000000, 0x7ffffffe ],
+        [ -0x80000000, -1, -0x80000001, -0x7fffffff ],
+        [ 1.5, 1, 2.5, 0.5 ],
+        [ -0, 0, 0, -0 ],
+        [ -0, -0, -0, 0 ],
+        [ "a", 1, "a1", NaN ],
+        [ 1, "2", "12", -1 ],
+        [ 1n, 2n, 3n, -1n ],
+        [ true, 1, 2, 0 ],
+        [ null, 1, 1, -1 ],
+        [ undefined, 1, NaN, NaN ],
+        [ { valueOf() { return 5; } }, 1, 6, 4 ],
+        [ 3, 4, 7, -1 ],
+    ];
+    for(i = 0; i < N; i++) {
+        assert(add(i, 1), i + 1);
+        assert(sub(i, 1), i - 1);
+    }
+    for(j = 0; j < vals.length; j++) {
+        var v = vals[j];
+        assert(add(v[0], v[1]), v[2], "add " + j);
+        assert(sub(v[0], v[1]), v[3], "sub " + j);
+        /* back to int32 after each revert */
+        assert(add(j, 1), j + 1);
+        assert(sub(j, 1), j - 1);
+    }
+}
+
+function test_compare_type_flip()
+{
+    function cmp(a, b) {
+        return [a < b, a <= b, a > b, a >= b];
+    }
+    function ref(a, b) {
+        /* not quickened: the operands are never both int32 */
+        a = Number(a) + 0.5;
+        b = Number(b) + 0.5;
+        return [a < b, a <= b, a > b, a >= b];
+    }
+    var i, j, vals;
+    for(i = 0; i < N; i++)
+        assert(cmp(i, 50).toString(), ref(i, 50).toString());
+    vals = [
+        [ 1.5, 1 ], [ 1, 1.5 ], [ -0, 0 ], [ "10", "9" ], [ "10", 9 ],
+        [ 1n, 2 ], [ 2n, 2 ], [ null, 0 ], [ true, 1 ],
+        [ 0x7fffffff, -0x80000000 ],
+    ];
+    for(j = 0; j < vals.length; j++) {
+        var a = vals[j][0], b = vals[j][1];
+        var exp;
+        if (typeof a == "string" && typeof b == "string")
+            exp = [a < b, a <= b, a > b, a >= b];
+        else
+            exp = ref(Number(a), Number(b));
+        assert(cmp(a, b).toString(), exp.toString(), "cmp " + j);
+        assert(cmp(j, 5).toString(), ref(j, 5).toString());
+    }
+    /* NaN: all the comparisons are false */
+    assert(cmp(NaN, 1).toString(), "false,false,false,false");
+    assert(cmp(1, undefined).toString(), "false,false,false,false");
+    assert(cmp(1, 2).toString(), "true,true,false,false");
+}
+
+function test_compare_branch()
+{
+    var i, j, c, s, x;
+
+    /* comparison fused with a short if_false */
+    function count_lt(n, limit) {
+        var c = 0;
+        for(var i = 0; i < n; i++) {
+            if (i < limit)
+                c++;
+        }
+        return c;
+    }
+    assert(count_lt(N, 10), 10);
+    assert(count_lt(N, 10.5), 11);
+    assert(count_lt(N, "20"), 20);
+    assert(count_lt(N, NaN), 0);
+    assert(count_lt(10.5, 100), 11);
+    assert(count_lt(N, 30), 30);
+
+    /* comparison fused with a long if_false */
+    function long_branch(a, b) {
+        var r = 0;
+        if (a >= b) {
+            r += a; r *= 2; r -= b; r += a; r *= 2; r -= b;
+            r += a; r *= 2; r -= b; r += a; r *= 2; r -= b;
+            r += a; r *= 2; r -= b; r += a; r *= 2; r -= b;
+            r += a; r *= 2; r -= b; r += a; r *= 2; r -= b;
+            r += a; r *= 2; r -= b; r += a; r *= 2; r -= b;
+            r += a; r *= 2; r -= b; r += a; r *= 2; r -= b;
+        } else {
+            r = -1;
+        }
+        return r;
+    }
+    s = 0;
+    for(i = 0; i < N; i++)
+        s += long_branch(i, 50) < 0 ? 1 : 0;
+    assert(s, 50);
+    assert(long_branch(1, 1.5), -1);
+    assert(long_branch(1.5, 1) > 0);
+    assert(long_branch("b", "a") !== -1);
+    assert(long_branch(1, NaN), -1);
+    assert(long_branch(2, 1) > 0);
+
+    /* comparison not followed by a branch */
+    function gt(a, b) { var r = a > b; return r; }
+    for(i = 0; i < N; i++)
+        assert(gt(i, 50), i > 50);
+    assert(gt(1.5, 1), true);
+    assert(gt(1, 1), false);
+
+    /* the loop bound changes type during the loop */
+    c = 0;
+    x = 10;
+    for(i = 0; i < x; i++) {
+        c++;
+        if (i == 5)
+            x = 10.5;
+        else if (i == 8)
+            x = 12;
+    }
+    assert(c, 12);
+
+    /* the loop counter becomes a float64 */
+    c = 0;
+    for(i = 0x7fffffff - 5; i <= 0x7fffffff + 5; i++)
+        c++;
+    assert(c, 11);
+    c = 0;
+    for(i = -0x80000000 + 5; i >= -0x80000000 - 5; i--)
+        c++;
+    assert(c, 11);
+
+    /* nested loops and do/while */
+    c = 0;
+    for(i = 0; i < 10; i++) {
+        for(j = i; j > 0; j--)
+            c++;
+    }
+    assert(c, 45);
+    i = 0;
+    do {
+        i++;
+    } while (i < N);
+    assert(i, N);
+    i = 0;
+    while (!(i >= N))
+        i++;
+    assert(i, N);
+}
+
+function test_array_el_type_flip()
+{
+    function get(a, i) { return a[i]; }
+    function sum(a) {
+        var s = 0;
+        for(var i = 0; i < a.length; i++)
+            s += a[i];
+        return s;
+    }
+    var i, a, proto_val;
+    a = [];
+    for(i = 0; i < N; i++)
+        a.push(i);
+    for(i = 0; i < N; i++)
+        assert(get(a, i), i);
+    assert(sum(a), N * (N - 1) / 2);
+
+    /* out of bounds, negative and non int32 indexes */
+    assert(get(a, N), undefined);
+    assert(get(a, -1), undefined);
+    assert(get(a, 0x7fffffff), undefined);
+    assert(get(a, 1.5), undefined);
+    assert(get(a, "2"), 2);
+    assert(get(a, 2), 2);
+
+    /* holes: the prototype is looked up */
+    a = [0, , 2];
+    assert(get(a, 1), undefined);
+    Array.prototype[1] = 100;
+    assert(get(a, 1), 100);
+    assert(sum(a), 102);
+    delete Array.prototype[1];
+    assert(get(a, 1), undefined);
+
+    /* array converted to a slow array */
+    a = [0, 1, 2];
+    a[10] = 10;
+    assert(get(a, 10), 10);
+    assert(get(a, 5), undefined);
+    a = [0, 1, 2];
+    Object.defineProperty(a, 1, { get() { return 42; } });
+    assert(get(a, 1), 42);
+    assert(sum(a), 44);
+
+    /* typed arrays and other objects */
+    a = new Int32Array([1, 2, 3]);
+    assert(get(a, 1), 2);
+    assert(get(a, 3), undefined);
+    assert(sum(a), 6);
+    a = new Float64Array([0.5, 1.5]);
+    assert(sum(a), 2);
+    a = new Uint8Array(4);
+    a[3] = 255;
+    assert(get(a, 3), 255);
+    assert(get({ 1: "x" }, 1), "x");
+    assert(get("abc", 1), "b");
+    proto_val = Object.create([7, 8]);
+    assert(get(proto_val, 1), 8);
+    assert(get([5, 6], 1), 6);
+
+    /* the array length changes */
+    a = [1, 2, 3];
+    assert(get(a, 2), 3);
+    a.length = 2;
+    assert(get(a, 2), undefined);
+    a.push(9);
+    assert(get(a, 2), 9);
+}
+
+function test_closures_share_bytecode()
+{
+    /* the closures of a quickened function share its bytecode */
+    function make() {
+        return function (a, b) { return a + b; };
+    }
+    var f1 = make(), f2 = make(), i;
+    for(i = 0; i < N; i++)
+        f1(i, i);
+    assert(f2("a", "b"), "ab");
+    assert(f1(1, 2), 3);
+    assert(f2(1.5, 2), 3.5);
+    assert(f1(1, 2), 3);
+}
+
+test_arith_type_flip();
+test_compare_type_flip();
+test_compare_branch();
+test_array_el_type_flip();
+test_closures_share_bytecode();